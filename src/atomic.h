@@ -453,10 +453,13 @@ public:
 
 private:
     T *gimme() const {
-        if (value) {
-            static_cast<RCValue *>(value)->_rc_incref();
+        // Read value only once; HashTable::optimisticGet() copies values
+        // that may be replaced concurrently (but not freed).
+        T *rv = value;
+        if (rv) {
+            static_cast<RCValue *>(rv)->_rc_incref();
         }
-        return value;
+        return rv;
     }
 
     void swap(T *newValue) {
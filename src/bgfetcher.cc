@@ -32,7 +32,8 @@ void BgFetcher::start() {
     pendingFetch.compare_exchange_strong(inverse, true);
     ExecutorPool* iom = ExecutorPool::get();
     ExTask task = new BgFetcherTask(&(store->getEPEngine()), this,
-                                      Priority::BgFetcherPriority, false);
+                                      Priority::BgFetcherPriority,
+                                      shard->getId(), false);
     this->setTaskId(task->getId());
     iom->schedule(task, READER_TASK_IDX);
     cb_assert(taskId > 0);
@@ -54,7 +55,7 @@ void BgFetcher::notifyBGEvent(void) {
     }
 }
 
-size_t BgFetcher::doFetch(uint16_t vbId) {
+size_t BgFetcher::doFetch(uint16_t vbId, RCPtr<VBucket> &vb) {
     hrtime_t startTime(gethrtime());
     LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, vBucket = %d "
         "numDocs = %d, startTime = %lld\n", vbId, items2fetch.size(),
@@ -62,10 +63,28 @@ size_t BgFetcher::doFetch(uint16_t vbId) {
 
     shard->getROUnderlying()->getMulti(vbId, items2fetch);
 
-    size_t totalfetches = 0;
-    std::vector<bgfetched_item_t> fetchedItems;
+    // Fetches of the same keys made while the reads were in flight joined
+    // them, and complete with the values just read
+    size_t joined = 0;
     vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
     for (; itr != items2fetch.end(); ++itr) {
+        std::list<VBucketBGFetchItem *> &requestedItems = (*itr).second;
+        std::list<VBucketBGFetchItem *> waiters;
+        vb->takeBGFetchWaiters((*itr).first,
+                               VBucketBGFetchItem::metaOnly(requestedItems),
+                               waiters);
+        std::list<VBucketBGFetchItem *>::iterator w = waiters.begin();
+        for (; w != waiters.end(); ++w) {
+            (*w)->value = requestedItems.front()->value;
+        }
+        joined += waiters.size();
+        requestedItems.splice(requestedItems.end(), waiters);
+    }
+    stats.bgFetchJoined.fetch_add(joined);
+
+    size_t totalfetches = 0;
+    std::vector<bgfetched_item_t> fetchedItems;
+    for (itr = items2fetch.begin(); itr != items2fetch.end(); ++itr) {
         std::list<VBucketBGFetchItem *> &requestedItems = (*itr).second;
         std::list<VBucketBGFetchItem *>::iterator itm = requestedItems.begin();
         for(; itm != requestedItems.end(); ++itm) {
@@ -82,7 +101,8 @@ size_t BgFetcher::doFetch(uint16_t vbId) {
 
     // failed requests will get requeued for retry within clearItems()
     clearItems(vbId);
-    return totalfetches;
+    // Joined fetches were never counted as remaining jobs
+    return totalfetches - joined;
 }
 
 void BgFetcher::clearItems(uint16_t vbId) {
@@ -131,7 +151,7 @@ bool BgFetcher::run(GlobalTask *task) {
         }
         RCPtr<VBucket> vb = shard->getBucket(vbId);
         if (vb && vb->getBGFetchItems(items2fetch)) {
-            num_fetched_items += doFetch(vbId);
+            num_fetched_items += doFetch(vbId, vb);
             items2fetch.clear();
         }
     }
@@ -40,6 +40,20 @@ public:
         value.setValue(NULL);
     }
 
+    /**
+     * A key's fetches are served by a metadata only read if none of them
+     * needs the value.
+     */
+    static bool metaOnly(const std::list<VBucketBGFetchItem *> &fetches) {
+        std::list<VBucketBGFetchItem *>::const_iterator it = fetches.begin();
+        for (; it != fetches.end(); ++it) {
+            if (!(*it)->metaDataOnly) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     GetValue value;
     const void * cookie;
     hrtime_t initTime;
@@ -53,6 +67,7 @@ typedef std::pair<std::string, VBucketBGFetchItem *> bgfetched_item_t;
 class EventuallyPersistentStore;
 class KVShard;
 class GlobalTask;
+class VBucket;
 
 /**
  * Dispatcher job responsible for batching data reads and push to
@@ -91,7 +106,7 @@ public:
     }
 
 private:
-    size_t doFetch(uint16_t vbId);
+    size_t doFetch(uint16_t vbId, RCPtr<VBucket> &vb);
     void clearItems(uint16_t vbId);
 
     EventuallyPersistentStore *store;
@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -62,11 +63,22 @@ private:
     CheckpointConfig &config;
 };
 
+size_t CheckpointCursor::getOffset() const {
+    int64_t os = baseOffset + static_cast<int64_t>(currentPos.index());
+    return os > 0 ? static_cast<size_t>(os) : 0;
+}
+
+void CheckpointCursor::setOffset(size_t os) {
+    baseOffset = static_cast<int64_t>(os) -
+                 static_cast<int64_t>(currentPos.index());
+}
+
 void CheckpointCursor::decrOffset(size_t decr) {
-    if (offset >= decr) {
-        offset.fetch_sub(decr);
+    size_t os = getOffset();
+    if (os >= decr) {
+        setOffset(os - decr);
     } else {
-        offset = 0;
+        setOffset(0);
         LOG(EXTENSION_LOG_INFO, "%s cursor offset is negative. Reset it to 0.",
             name.c_str());
     }
@@ -74,7 +86,172 @@ void CheckpointCursor::decrOffset(size_t decr) {
 
 void CheckpointCursor::decrPos() {
     if (currentPos != (*currentCheckpoint)->begin()) {
+        size_t os = getOffset();
         --currentPos;
+        setOffset(os);
+    }
+}
+
+void CheckpointCursor::settle() {
+    if (currentPos != (*currentCheckpoint)->end() && !*currentPos) {
+        --currentPos;
+    }
+}
+
+const size_t CheckpointQueue::chunkSize;
+
+CheckpointQueue::~CheckpointQueue() {
+    std::vector<queued_item*>::iterator it = chunks.begin();
+    for (; it != chunks.end(); ++it) {
+        delete [] *it;
+    }
+}
+
+size_t CheckpointQueue::push_back(const queued_item &qi) {
+    if (numSlots == chunks.size() * chunkSize) {
+        addChunk();
+    }
+    slot(numSlots) = qi;
+    ++numLive;
+    return numSlots++;
+}
+
+void CheckpointQueue::supersede(size_t pos) {
+    cb_assert(pos < numSlots && slot(pos));
+    slot(pos).reset();
+    --numLive;
+    countSuperseded(pos, true);
+}
+
+void CheckpointQueue::pop_back() {
+    cb_assert(numLive > 0);
+    iterator last = end();
+    --last;
+    slot(last.position()).reset();
+    --numLive;
+    numSlots = last.position();
+    while (numSlots > 0 && !slot(numSlots - 1)) {
+        countSuperseded(--numSlots, false);
+    }
+    freeUnusedChunks();
+}
+
+void CheckpointQueue::insert(size_t pos, const std::vector<queued_item> &items,
+                             std::vector<iterator*> &positions) {
+    size_t count = items.size();
+    if (count == 0) {
+        return;
+    }
+    cb_assert(pos <= numSlots);
+
+    while (chunks.size() * chunkSize < numSlots + count) {
+        addChunk();
+    }
+    for (size_t i = numSlots; i > pos; --i) {
+        slot(i - 1 + count) = slot(i - 1);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        slot(pos + i) = items[i];
+    }
+    numSlots += count;
+    numLive += count;
+    recountSuperseded();
+
+    std::vector<iterator*>::iterator it = positions.begin();
+    for (; it != positions.end(); ++it) {
+        size_t curr = (*it)->position();
+        if (curr >= pos) {
+            **it = iterator(this, curr + count);
+        }
+    }
+}
+
+static bool comparePositions(const CheckpointQueue::iterator *a,
+                             const CheckpointQueue::iterator *b) {
+    return a->position() < b->position();
+}
+
+void CheckpointQueue::compact(std::vector<iterator*> &positions) {
+    std::sort(positions.begin(), positions.end(), comparePositions);
+    std::vector<iterator*>::iterator next = positions.begin();
+    size_t live = 0;
+    for (size_t i = 0; i < numSlots; ++i) {
+        bool superseded = !slot(i);
+        for (; next != positions.end() && (*next)->position() == i; ++next) {
+            // A position on a superseded slot falls back onto the item
+            // before it, as if the slot had been erased.
+            **next = iterator(this, (superseded && live > 0) ? live - 1 : live);
+        }
+        if (!superseded) {
+            if (live != i) {
+                slot(live) = slot(i);
+                slot(i).reset();
+            }
+            ++live;
+        }
+    }
+    cb_assert(live == numLive);
+    numSlots = live;
+    freeUnusedChunks();
+    supersededTree.assign(chunks.size(), 0);
+}
+
+size_t CheckpointQueue::indexOf(size_t pos) const {
+    if (pos >= numSlots) {
+        return numLive > 0 ? numLive - 1 : 0;
+    }
+    size_t chunk = pos / chunkSize;
+    size_t superseded = supersededInChunks(chunk);
+    for (size_t i = chunk * chunkSize; i <= pos; ++i) {
+        if (!slot(i)) {
+            ++superseded;
+        }
+    }
+    return pos >= superseded ? pos - superseded : 0;
+}
+
+void CheckpointQueue::addChunk() {
+    chunks.push_back(new queued_item[chunkSize]);
+    // The new tree node covers the last (n & -n) chunks, of which only the
+    // new one has no superseded slots yet.
+    size_t n = chunks.size();
+    supersededTree.push_back(supersededInChunks(n - 1) -
+                             supersededInChunks(n - (n & (~n + 1))));
+}
+
+void CheckpointQueue::freeUnusedChunks() {
+    while (chunks.size() * chunkSize >= numSlots + chunkSize) {
+        delete [] chunks.back();
+        chunks.pop_back();
+    }
+    supersededTree.resize(chunks.size());
+}
+
+void CheckpointQueue::countSuperseded(size_t pos, bool superseded) {
+    size_t n = supersededTree.size();
+    for (size_t i = pos / chunkSize + 1; i <= n; i += i & (~i + 1)) {
+        if (superseded) {
+            ++supersededTree[i - 1];
+        } else {
+            --supersededTree[i - 1];
+        }
+    }
+}
+
+size_t CheckpointQueue::supersededInChunks(size_t n) const {
+    size_t superseded = 0;
+    for (size_t i = n; i > 0; i -= i & (~i + 1)) {
+        superseded += supersededTree[i - 1];
+    }
+    return superseded;
+}
+
+void CheckpointQueue::recountSuperseded() {
+    supersededTree.assign(chunks.size(), 0);
+    for (size_t i = 0; i < numSlots; ++i) {
+        if (!slot(i)) {
+            countSuperseded(i, true);
+        }
     }
 }
 
@@ -84,6 +261,7 @@ Checkpoint::~Checkpoint() {
         checkpointId, vbucketId);
     stats.memOverhead.fetch_sub(memorySize());
     cb_assert(stats.memOverhead.load() < GIGANTOR);
+    stats.checkpointMemory.fetch_sub(itemsMemory);
 }
 
 void Checkpoint::setState(checkpoint_state state) {
@@ -93,13 +271,15 @@ void Checkpoint::setState(checkpoint_state state) {
 void Checkpoint::popBackCheckpointEndItem() {
     if (!toWrite.empty() &&
         toWrite.back()->getOperation() == queue_op_checkpoint_end) {
-        keyIndex.erase(toWrite.back()->getKey());
+        keyIndex.erase(checkpoint_index_key(toWrite.back()->getKey()));
+        removeItemsMemory(toWrite.back()->size());
         toWrite.pop_back();
+        accountQueueMemory();
     }
 }
 
 bool Checkpoint::keyExists(const std::string &key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return keyIndex.find(checkpoint_index_key(key)) != keyIndex.end();
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
@@ -107,117 +287,223 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
     assert (checkpointState == CHECKPOINT_OPEN);
     queue_dirty_t rv;
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    checkpoint_index::iterator it =
+        keyIndex.find(checkpoint_index_key(qi->getKey()));
     // Check if this checkpoint already had an item for the same key.
     if (it != keyIndex.end()) {
         rv = EXISTING_ITEM;
-        std::list<queued_item>::iterator currPos = it->second.position;
-        uint64_t currMutationId = it->second.mutation_id;
-
-        cursor_index::iterator map_it = checkpointManager->tapCursors.begin();
-        for (; map_it != checkpointManager->tapCursors.end(); ++map_it) {
-
-            if (*(map_it->second.currentCheckpoint) == this) {
-                queued_item &tqi = *(map_it->second.currentPos);
-                const std::string &key = tqi->getKey();
-                checkpoint_index::iterator ita = keyIndex.find(key);
-                if (ita != keyIndex.end()) {
-                    uint64_t mutationId = ita->second.mutation_id;
-                    if (currMutationId <= mutationId &&
-                        tqi->getOperation() != queue_op_checkpoint_start) {
-                        map_it->second.decrOffset(1);
-                        if (map_it->second.name.compare(CheckpointManager::pCursorName) == 0) {
-                            rv = PERSIST_AGAIN;
-                        }
-                    }
-                }
-                // If an TAP cursor points to the existing item for the same
-                // key, shift it left by 1
-                if (map_it->second.currentPos == currPos) {
-                    map_it->second.decrPos();
-                }
-            }
+        size_t currPos = it->second.position;
+
+        // Cursors that already walked past the existing item don't need to
+        // be visited: their offsets drop by one as its slot is superseded,
+        // and a cursor left on that slot settles onto the item before it
+        // when it is next used. Only the persistence cursor decides the
+        // result.
+        CheckpointCursor *pCursor = checkpointManager->pCursor;
+        if (pCursor && *(pCursor->currentCheckpoint) == this &&
+            pCursor->currentPos.position() >= currPos) {
+            rv = PERSIST_AGAIN;
         }
 
-        toWrite.push_back(qi);
-        // Remove the existing item for the same key from the list.
-        toWrite.erase(currPos);
+        // Set the index of the key to the new item that is pushed back into
+        // the queue, before the existing item (whose key the index refers
+        // to) is released.
+        it->first.key = &qi->getKey();
+        it->second.position = toWrite.push_back(qi);
+        it->second.mutation_id = qi->getBySeqno();
+        removeItemsMemory(toWrite.at(currPos)->size());
+        addItemsMemory(qi->size());
+        toWrite.supersede(currPos);
+
+        if (toWrite.getNumSuperseded() > CheckpointQueue::chunkSize &&
+            toWrite.getNumSuperseded() > toWrite.size()) {
+            compact(checkpointManager);
+        }
     } else {
         if (qi->getOperation() == queue_op_set ||
             qi->getOperation() == queue_op_del) {
             ++numItems;
         }
         rv = NEW_ITEM;
-        // Push the new item into the list
-        toWrite.push_back(qi);
+        // Push the new item into the queue
+        size_t pos = toWrite.push_back(qi);
+        addItemsMemory(qi->size());
+        if (qi->getNKey() > 0) {
+            index_entry entry = {pos, qi->getBySeqno()};
+            keyIndex.insert(std::make_pair(checkpoint_index_key(qi->getKey()),
+                                           entry));
+            addMemOverhead(sizeof(checkpoint_index::value_type));
+        }
     }
 
-    if (qi->getNKey() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
-        // --last is okay as the list is not empty now.
-        index_entry entry = {--last, qi->getBySeqno()};
-        // Set the index of the key to the new item that is pushed back into
-        // the list.
-        keyIndex[qi->getKey()] = entry;
-        if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getNKey() + sizeof(index_entry) +
-                                  sizeof(queued_item);
-            memOverhead += newEntrySize;
-            stats.memOverhead.fetch_add(newEntrySize);
-            cb_assert(stats.memOverhead.load() < GIGANTOR);
+    accountQueueMemory();
+    return rv;
+}
+
+void Checkpoint::getCursors(CheckpointManager *checkpointManager,
+                            std::vector<CheckpointCursor*> &cursors) {
+    cursor_index::iterator map_it = checkpointManager->tapCursors.begin();
+    for (; map_it != checkpointManager->tapCursors.end(); ++map_it) {
+        if (*(map_it->second.currentCheckpoint) == this) {
+            cursors.push_back(&(map_it->second));
         }
     }
-    return rv;
 }
 
-size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
-    size_t numNewItems = 0;
-    size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
+void Checkpoint::compact(CheckpointManager *checkpointManager) {
+    std::vector<CheckpointCursor*> cursors;
+    getCursors(checkpointManager, cursors);
+    std::vector<CheckpointQueue::iterator*> positions;
+    std::vector<CheckpointCursor*>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        positions.push_back(&((*cit)->currentPos));
+    }
+    // Compaction keeps the index of every position, and so the offsets.
+    toWrite.compact(positions);
+
+    // Point the index at the slots the items were moved to.
+    CheckpointQueue::iterator pos = toWrite.begin();
+    for (; pos != toWrite.end(); ++pos) {
+        if ((*pos)->getNKey() > 0) {
+            checkpoint_index::iterator it =
+                keyIndex.find(checkpoint_index_key((*pos)->getKey()));
+            if (it != keyIndex.end()) {
+                it->second.position = pos.position();
+            }
+        }
+    }
+}
 
+void Checkpoint::accountQueueMemory() {
+    size_t current = toWrite.memorySize();
+    if (current > queueMemory) {
+        addMemOverhead(current - queueMemory);
+    } else if (current < queueMemory) {
+        removeMemOverhead(queueMemory - current);
+    }
+    queueMemory = current;
+}
+
+size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                                       CheckpointManager *checkpointManager) {
     LOG(EXTENSION_LOG_INFO,
         "Collapse the checkpoint %llu into the checkpoint %llu for vbucket %d",
         pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    std::list<queued_item>::iterator itr = toWrite.begin();
-    uint64_t seqno = pPrevCheckpoint->getMutationIdForKey("dummy_key");
-    keyIndex["dummy_key"].mutation_id = seqno;
+    const std::string dummyKey("dummy_key");
+    const std::string startKey("checkpoint_start");
+
+    CheckpointQueue::iterator itr = toWrite.begin();
+    uint64_t seqno = pPrevCheckpoint->getMutationIdForKey(dummyKey);
+    keyIndex.find(checkpoint_index_key(dummyKey))->second.mutation_id = seqno;
     (*itr)->setBySeqno(seqno);
 
-    seqno = pPrevCheckpoint->getMutationIdForKey("checkpoint_start");
-    keyIndex["checkpoint_start"].mutation_id = seqno;
+    seqno = pPrevCheckpoint->getMutationIdForKey(startKey);
+    keyIndex.find(checkpoint_index_key(startKey))->second.mutation_id = seqno;
     ++itr;
     (*itr)->setBySeqno(seqno);
 
-    for (; rit != pPrevCheckpoint->rend(); ++rit) {
-        const std::string &key = (*rit)->getKey();
-        if ((*rit)->getOperation() != queue_op_del &&
-            (*rit)->getOperation() != queue_op_set) {
+    // The items from the previous checkpoint go right after the first two
+    // meta items, in the order they had there.
+    std::vector<queued_item> newItems;
+    CheckpointQueue::iterator pit = pPrevCheckpoint->begin();
+    for (; pit != pPrevCheckpoint->end(); ++pit) {
+        if ((*pit)->getOperation() != queue_op_del &&
+            (*pit)->getOperation() != queue_op_set) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
-            // Skip the first two meta items
-            ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, static_cast<int64_t>(pPrevCheckpoint->
-                                                    getMutationIdForKey(key))};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
-            ++numItems;
-            ++numNewItems;
+        if (!keyExists((*pit)->getKey())) {
+            newItems.push_back(*pit);
+            addItemsMemory((*pit)->size());
         }
     }
-    memOverhead += newEntryMemOverhead;
-    stats.memOverhead.fetch_add(newEntryMemOverhead);
-    cb_assert(stats.memOverhead.load() < GIGANTOR);
+    expelled = expelled || pPrevCheckpoint->hasExpelledItems();
+
+    size_t pos = itr.position() + 1;
+    size_t numNewItems = newItems.size();
+    // The items inserted in front of a cursor don't count as walked past, so
+    // keep the offsets the cursors had.
+    std::vector<CheckpointCursor*> cursors;
+    getCursors(checkpointManager, cursors);
+    std::vector<CheckpointQueue::iterator*> positions;
+    std::vector<size_t> offsets;
+    std::vector<CheckpointCursor*>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        positions.push_back(&((*cit)->currentPos));
+        offsets.push_back((*cit)->getOffset());
+    }
+    toWrite.insert(pos, newItems, positions);
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        cursors[i]->setOffset(offsets[i]);
+    }
+
+    checkpoint_index::iterator it = keyIndex.begin();
+    for (; it != keyIndex.end(); ++it) {
+        if (it->second.position >= pos) {
+            it->second.position += numNewItems;
+        }
+    }
+
+    for (size_t i = 0; i < numNewItems; ++i) {
+        const std::string &key = newItems[i]->getKey();
+        index_entry entry = {pos + i, static_cast<int64_t>(pPrevCheckpoint->
+                                                getMutationIdForKey(key))};
+        keyIndex.insert(std::make_pair(checkpoint_index_key(key), entry));
+    }
+    numItems += numNewItems;
+    addMemOverhead(numNewItems * sizeof(checkpoint_index::value_type));
+    accountQueueMemory();
     return numNewItems;
 }
 
+size_t Checkpoint::expelItems(size_t lastPos, uint64_t persistedSeqno,
+                              CheckpointManager *checkpointManager) {
+    size_t numExpelled = 0;
+    int64_t lastExpelledSeqno = 0;
+    CheckpointQueue::iterator it = toWrite.begin();
+    while (it != toWrite.end() && it.position() <= lastPos) {
+        const queued_item &qi = *it;
+        if (qi->getOperation() != queue_op_set &&
+            qi->getOperation() != queue_op_del) {
+            ++it;
+            continue;
+        }
+        if (static_cast<uint64_t>(qi->getBySeqno()) > persistedSeqno) {
+            break;
+        }
+
+        // Every cursor has walked past the item and it is on disk, so it
+        // can be dropped. A later mutation on its key is then a new item.
+        lastExpelledSeqno = qi->getBySeqno();
+        keyIndex.erase(checkpoint_index_key(qi->getKey()));
+        removeMemOverhead(sizeof(checkpoint_index::value_type));
+        removeItemsMemory(qi->size());
+        size_t pos = it.position();
+        ++it;
+        toWrite.supersede(pos);
+        --numItems;
+        ++numExpelled;
+    }
+
+    if (numExpelled > 0) {
+        // The checkpoint now starts after the expelled items, so that a
+        // cursor registered by seqno before them backfills them from disk.
+        CheckpointQueue::iterator start = toWrite.begin();
+        ++start;
+        (*start)->setBySeqno(lastExpelledSeqno + 1);
+        const std::string startKey("checkpoint_start");
+        keyIndex.find(checkpoint_index_key(startKey))->second.mutation_id =
+            lastExpelledSeqno + 1;
+        expelled = true;
+        compact(checkpointManager);
+        accountQueueMemory();
+    }
+    return numExpelled;
+}
+
 uint64_t Checkpoint::getMutationIdForKey(const std::string &key) {
     uint64_t mid = 0;
-    checkpoint_index::iterator it = keyIndex.find(key);
+    checkpoint_index::iterator it = keyIndex.find(checkpoint_index_key(key));
     if (it != keyIndex.end()) {
         mid = it->second.mutation_id;
     }
@@ -263,8 +549,8 @@ uint64_t CheckpointManager::getLastClosedCheckpointId() {
 void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
     if (!checkpointList.empty()) {
         // Update the checkpoint_start item with the new Id.
-        std::list<queued_item>::iterator it =
-            ++(checkpointList.back()->begin());
+        CheckpointQueue::iterator it = checkpointList.back()->begin();
+        ++it;
         (*it)->setRevSeqno(id);
         if (checkpointList.back()->getId() == 0) {
             (*it)->setBySeqno(lastBySeqno + 1);
@@ -329,7 +615,6 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id,
             cursor.currentPos != (*(cursor.currentCheckpoint))->end() &&
             (*(cursor.currentPos))->getOperation() == queue_op_checkpoint_end) {
             // checkpoint_end meta item is only used by replication cursors
-            ++(cursor.offset);
             ++(cursor.currentPos); // cursor now reaches to the checkpoint end
         }
 
@@ -394,6 +679,7 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name
     removeCursor_UNLOCKED(name);
 
     size_t skipped = 0;
+    bool expelledItemsSkipped = false;
     CursorRegResult result;
     result.first = std::numeric_limits<uint64_t>::max();
     result.second = false;
@@ -408,9 +694,11 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name
                                                 skipped, false);
             (*itr)->registerCursorName(name);
             result.first = (*itr)->getLowSeqno();
+            // The items expelled from the checkpoint have to be backfilled.
+            expelledItemsSkipped = (*itr)->hasExpelledItems();
             break;
         } else if (startBySeqno <= en) {
-            std::list<queued_item>::iterator iitr = (*itr)->begin();
+            CheckpointQueue::iterator iitr = (*itr)->begin();
             while (++iitr != (*itr)->end() &&
                     startBySeqno >= static_cast<uint64_t>((*iitr)->getBySeqno())) {
                 skipped++;
@@ -433,7 +721,8 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name
         }
     }
 
-    result.second = (result.first == checkpointList.front()->getLowSeqno()) ? true : false;
+    result.second = (result.first == checkpointList.front()->getLowSeqno() ||
+                     expelledItemsSkipped) ? true : false;
 
     if (result.first == std::numeric_limits<uint64_t>::max()) {
         /*
@@ -444,6 +733,8 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name
         LOG(EXTENSION_LOG_WARNING, "Cursor not registered into vb %d "
             " for stream '%s' because seqno %llu is too high",
             vbucketId, name.c_str(), startBySeqno);
+    } else if (name.compare(pCursorName) == 0) {
+        pCursor = &tapCursors[name];
     }
     return result;
 }
@@ -471,9 +762,17 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
         "Register the tap cursor with the name \"%s\" for vbucket %d",
         name.c_str(), vbucketId);
 
+    // The items expelled from the checkpoint can only be read from disk,
+    // unless the cursor simply resumes from where it is in the checkpoint.
+    cursor_index::iterator map_it = tapCursors.find(name);
+    if (found && (*it)->hasExpelledItems() &&
+        (alwaysFromBeginning || map_it == tapCursors.end() ||
+         *(map_it->second.currentCheckpoint) != *it)) {
+        found = false;
+    }
+
     // If the tap cursor exists, remove its name from the checkpoint that is
     // currently referenced by the tap cursor.
-    cursor_index::iterator map_it = tapCursors.find(name);
     if (map_it != tapCursors.end()) {
         (*(map_it->second.currentCheckpoint))->removeCursorName(name);
     }
@@ -504,7 +803,7 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
         (*it)->registerCursorName(name);
     } else {
         size_t offset = 0;
-        std::list<queued_item>::iterator curr;
+        CheckpointQueue::iterator curr;
 
         LOG(EXTENSION_LOG_DEBUG,
             "Checkpoint %llu for vbucket %d exists in memory. "
@@ -518,7 +817,7 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
             // simply start from
             // its current position.
             curr = map_it->second.currentPos;
-            offset = map_it->second.offset;
+            offset = map_it->second.getOffset();
         } else {
             // Set the cursor's position to the begining of the checkpoint to
             // start with
@@ -536,6 +835,9 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
         (*it)->registerCursorName(name);
     }
 
+    if (name.compare(pCursorName) == 0) {
+        pCursor = &tapCursors[name];
+    }
     return found;
 }
 
@@ -567,6 +869,9 @@ bool CheckpointManager::removeCursor_UNLOCKED(const std::string &name) {
         (*cit)->removeCursorName(name);
     }
 
+    if (&(it->second) == pCursor) {
+        pCursor = NULL;
+    }
     tapCursors.erase(it);
     return true;
 }
@@ -718,6 +1023,73 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
     return numUnrefItems;
 }
 
+size_t CheckpointManager::expelUnreferencedItems(uint64_t persistedSeqno) {
+    LockHolder lh(queueLock);
+    if (tapCursors.empty()) {
+        return 0;
+    }
+
+    // Find the earliest cursor position. The items before it have been
+    // walked past by every cursor.
+    cursor_index::iterator map_it = tapCursors.begin();
+    std::list<Checkpoint*>::iterator oldest = map_it->second.currentCheckpoint;
+    size_t lastPos = map_it->second.currentPos.position();
+    for (++map_it; map_it != tapCursors.end(); ++map_it) {
+        uint64_t id = (*(map_it->second.currentCheckpoint))->getId();
+        size_t pos = map_it->second.currentPos.position();
+        if (id < (*oldest)->getId() ||
+            (id == (*oldest)->getId() && pos < lastPos)) {
+            oldest = map_it->second.currentCheckpoint;
+            lastPos = pos;
+        }
+    }
+
+    size_t numExpelled = (*oldest)->expelItems(lastPos, persistedSeqno, this);
+    if (numExpelled > 0) {
+        numItems.fetch_sub(numExpelled);
+        // The offsets of the cursors in the checkpoint dropped along with
+        // the items; those of the cursors beyond it have to follow.
+        for (map_it = tapCursors.begin(); map_it != tapCursors.end();
+             ++map_it) {
+            if (map_it->second.currentCheckpoint != oldest) {
+                map_it->second.decrOffset(numExpelled);
+            }
+        }
+        stats.itemsExpelledFromCheckpoints.fetch_add(numExpelled);
+    }
+    return numExpelled;
+}
+
+std::list<std::string> CheckpointManager::getCursorsBehindPersistence() {
+    LockHolder lh(queueLock);
+    std::list<std::string> cursorNames;
+    if (!pCursor) {
+        return cursorNames;
+    }
+
+    typedef std::pair<std::pair<uint64_t, size_t>, std::string> cursor_pos;
+    std::pair<uint64_t, size_t> persisted(
+                                (*(pCursor->currentCheckpoint))->getId(),
+                                pCursor->currentPos.position());
+    std::vector<cursor_pos> behind;
+    cursor_index::iterator map_it = tapCursors.begin();
+    for (; map_it != tapCursors.end(); ++map_it) {
+        std::pair<uint64_t, size_t> pos(
+                            (*(map_it->second.currentCheckpoint))->getId(),
+                            map_it->second.currentPos.position());
+        if (pos < persisted) {
+            behind.push_back(std::make_pair(pos, map_it->first));
+        }
+    }
+
+    std::sort(behind.begin(), behind.end());
+    std::vector<cursor_pos>::iterator it = behind.begin();
+    for (; it != behind.end(); ++it) {
+        cursorNames.push_back(it->second);
+    }
+    return cursorNames;
+}
+
 void CheckpointManager::removeInvalidCursorsOnCheckpoint(
                                                      Checkpoint *pCheckpoint) {
     std::list<std::string> invalidCursorNames;
@@ -759,6 +1131,7 @@ void CheckpointManager::collapseClosedCheckpoints(
             if (cc == tapCursors.end()) {
                 continue;
             }
+            cc->second.settle();
             enum queue_operation qop = (*(cc->second.currentPos))->getOperation();
             if (qop ==  queue_op_empty || qop == queue_op_checkpoint_start) {
                 return;
@@ -771,7 +1144,8 @@ void CheckpointManager::collapseClosedCheckpoints(
         ++rit; ++rit; //Move to the second last closed checkpoint.
         size_t numDuplicatedItems = 0, numMetaItems = 0;
         for (; rit != checkpointList.rend(); ++rit) {
-            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit);
+            size_t numAddedItems =
+                (*lastClosedChk)->mergePrevCheckpoint(*rit, this);
             numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
             numMetaItems += 2; // checkpoint start and end meta items
 
@@ -779,6 +1153,7 @@ void CheckpointManager::collapseClosedCheckpoints(
                 (*rit)->getCursorNameList().begin();
             for (; nameItr != (*rit)->getCursorNameList().end(); ++nameItr) {
                 cursor_index::iterator cc = tapCursors.find(*nameItr);
+                cc->second.settle();
                 const std::string& key = (*(cc->second.currentPos))->getKey();
                 bool cursor_on_chk_start = false;
                 if ((*(cc->second.currentPos))->getOperation() ==
@@ -860,6 +1235,15 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
 snapshot_range_t CheckpointManager::getAllItemsForCursor(
                                              const std::string& name,
                                              std::vector<queued_item> &items) {
+    return getItemsForCursor(name, items, std::numeric_limits<size_t>::max(),
+                             std::numeric_limits<size_t>::max());
+}
+
+snapshot_range_t CheckpointManager::getItemsForCursor(
+                                             const std::string& name,
+                                             std::vector<queued_item> &items,
+                                             size_t maxItems,
+                                             size_t maxBytes) {
     LockHolder lh(queueLock);
     snapshot_range_t range;
     cursor_index::iterator it = tapCursors.find(name);
@@ -869,12 +1253,23 @@ snapshot_range_t CheckpointManager::getAllItemsForCursor(
         return range;
     }
 
-    bool moreItems;
+    // Every item ahead of the cursor, meta items included, is counted in
+    // numItems, so the batch never outgrows this.
+    size_t offset = it->second.getOffset();
+    size_t ahead = numItems > offset ? numItems - offset : 0;
+    items.reserve(items.size() + std::min(ahead, maxItems));
+
+    bool moreItems = true;
+    size_t numBatched = 0;
+    size_t bytesBatched = 0;
     range.start = (*it->second.currentCheckpoint)->getSnapshotStartSeqno();
     range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
-    while ((moreItems = incrCursor(it->second))) {
+    while (numBatched < maxItems && bytesBatched < maxBytes &&
+           (moreItems = incrCursor(it->second))) {
         queued_item& qi = *(it->second.currentPos);
         items.push_back(qi);
+        ++numBatched;
+        bytesBatched += qi->size();
 
         if (qi->getOperation() == queue_op_checkpoint_end) {
             range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
@@ -885,7 +1280,10 @@ snapshot_range_t CheckpointManager::getAllItemsForCursor(
         }
     }
 
-    if (!moreItems) {
+    // A batch cut short by its budget ends in the checkpoint the cursor is
+    // in, unless it was cut right at the end of a checkpoint.
+    if (!moreItems || (numBatched > 0 && items.back()->getOperation() !=
+                                         queue_op_checkpoint_end)) {
         range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
     }
 
@@ -928,7 +1326,6 @@ queued_item CheckpointManager::nextItem(const std::string &name,
 
 bool CheckpointManager::incrCursor(CheckpointCursor &cursor) {
     if (++(cursor.currentPos) != (*(cursor.currentCheckpoint))->end()) {
-        ++(cursor.offset);
         return true;
     } else if (!moveCursorToNextCheckpoint(cursor)) {
         --(cursor.currentPos);
@@ -968,7 +1365,7 @@ void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
         }
         cit->second.currentCheckpoint = checkpointList.begin();
         cit->second.currentPos = checkpointList.front()->begin();
-        cit->second.offset = 0;
+        cit->second.setOffset(0);
         checkpointList.front()->registerCursorName(cit->second.name);
     }
 }
@@ -996,8 +1393,10 @@ bool CheckpointManager::moveCursorToNextCheckpoint(CheckpointCursor &cursor) {
     // Remove the cursor's name from its current checkpoint.
     (*(cursor.currentCheckpoint))->removeCursorName(cursor.name);
     // Move the cursor to the next checkpoint.
+    size_t offset = cursor.getOffset();
     ++(cursor.currentCheckpoint);
     cursor.currentPos = (*(cursor.currentCheckpoint))->begin();
+    cursor.setOffset(offset);
     // Register the cursor's name to its new current checkpoint.
     (*(cursor.currentCheckpoint))->registerCursorName(cursor.name);
     return true;
@@ -1045,7 +1444,8 @@ size_t CheckpointManager::getNumItemsForCursor_UNLOCKED(const std::string &name)
     size_t remains = 0;
     cursor_index::iterator it = tapCursors.find(name);
     if (it != tapCursors.end()) {
-        size_t offset = it->second.offset + getNumOfMetaItemsFromCursor(it->second);
+        size_t offset = it->second.getOffset() +
+                        getNumOfMetaItemsFromCursor(it->second);
         remains = (numItems > offset) ? numItems - offset : 0;
     }
     return remains;
@@ -1057,7 +1457,7 @@ size_t CheckpointManager::getNumOfMetaItemsFromCursor(CheckpointCursor &cursor)
     std::list<Checkpoint*>::iterator curr_chk = cursor.currentCheckpoint;
     for (; curr_chk != checkpointList.end(); ++curr_chk) {
         if (curr_chk == cursor.currentCheckpoint) {
-            std::list<queued_item>::iterator curr_pos = cursor.currentPos;
+            CheckpointQueue::iterator curr_pos = cursor.currentPos;
             ++curr_pos;
             if (curr_pos == (*curr_chk)->end()) {
                 continue;
@@ -1087,8 +1487,11 @@ size_t CheckpointManager::getNumOfMetaItemsFromCursor(CheckpointCursor &cursor)
 void CheckpointManager::decrCursorFromCheckpointEnd(const std::string &name) {
     LockHolder lh(queueLock);
     cursor_index::iterator it = tapCursors.find(name);
-    if (it != tapCursors.end() &&
-        (*(it->second.currentPos))->getOperation() ==
+    if (it == tapCursors.end()) {
+        return;
+    }
+    it->second.settle();
+    if ((*(it->second.currentPos))->getOperation() ==
         queue_op_checkpoint_end) {
         it->second.decrPos();
     }
@@ -1096,7 +1499,7 @@ void CheckpointManager::decrCursorFromCheckpointEnd(const std::string &name) {
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(
                                                    CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
+    CheckpointQueue::iterator it = cursor.currentPos;
     ++it;
     if (it == (*(cursor.currentCheckpoint))->end() ||
         (*it)->getOperation() == queue_op_checkpoint_end) {
@@ -1198,7 +1601,9 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
                     continue;
                 } else { // TAP cursors
                     cursor_index::iterator mit = tapCursors.find(*cit);
+                    size_t offset = mit->second.getOffset();
                     mit->second.currentPos = checkpointList.back()->begin();
+                    mit->second.setOffset(offset);
                 }
             }
         } else {
@@ -1227,6 +1632,7 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
     cursor_index::iterator itr;
     for (itr = tapCursors.begin(); itr != tapCursors.end(); itr++) {
         Checkpoint* chk = *(itr->second.currentCheckpoint);
+        itr->second.settle();
         const std::string& key = (*(itr->second.currentPos))->getKey();
         bool cursor_on_chk_start = false;
         if ((*(itr->second.currentPos))->getOperation() == queue_op_checkpoint_start) {
@@ -1244,7 +1650,7 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
     // Collapse all checkpoints.
     for (; rit != checkpointList.rend(); ++rit) {
         size_t numAddedItems = checkpointList.back()->
-                               mergePrevCheckpoint(*rit);
+                               mergePrevCheckpoint(*rit, this);
         numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
         numMetaItems += 2; // checkpoint start and end meta items
         delete *rit;
@@ -1269,8 +1675,8 @@ putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &curs
                          std::list<Checkpoint*>::iterator chkItr) {
     size_t i;
     Checkpoint *chk = *chkItr;
-    std::list<queued_item>::iterator cit = chk->begin();
-    std::list<queued_item>::iterator last = chk->begin();
+    CheckpointQueue::iterator cit = chk->begin();
+    CheckpointQueue::iterator last = chk->begin();
     for (i = 0; cit != chk->end(); ++i, ++cit) {
         uint64_t id = chk->getMutationIdForKey((*cit)->getKey());
         std::map<std::string, std::pair<uint64_t, bool> >::iterator mit = cursors.begin();
@@ -1287,7 +1693,7 @@ putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &curs
                 }
                 cc->second.currentCheckpoint = chkItr;
                 cc->second.currentPos = last;
-                cc->second.offset = (i > 0) ? i - 1 : 0;
+                cc->second.setOffset((i > 0) ? i - 1 : 0);
                 chk->registerCursorName(cc->second.name);
                 cursors.erase(mit++);
             } else {
@@ -1310,10 +1716,10 @@ putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &curs
         cc->second.currentCheckpoint = chkItr;
         if (cc->second.fromBeginningOnChkCollapse) {
             cc->second.currentPos = chk->begin();
-            cc->second.offset = 0;
+            cc->second.setOffset(0);
         } else {
             cc->second.currentPos = last;
-            cc->second.offset = (i > 0) ? i - 1 : 0;
+            cc->second.setOffset((i > 0) ? i - 1 : 0);
         }
         chk->registerCursorName(cc->second.name);
     }
@@ -1327,7 +1733,7 @@ bool CheckpointManager::hasNext(const std::string &name) {
     }
 
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
+    CheckpointQueue::iterator curr = it->second.currentPos;
     ++curr;
     if (curr == (*(it->second.currentCheckpoint))->end() &&
         (*(it->second.currentCheckpoint)) == checkpointList.back()) {
@@ -1503,6 +1909,7 @@ void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
                         add_stat, cookie);
         snprintf(buf, sizeof(buf), "vb_%d:%s:cursor_seqno", vbucketId,
                  tap_it->first.c_str());
+        tap_it->second.settle();
         add_casted_stat(buf, (*(tap_it->second.currentPos))->getBySeqno(),
                         add_stat, cookie);
     }
@@ -30,6 +30,7 @@
 #include "common.h"
 #include "item.h"
 #include "locks.h"
+#include "murmurhash3.h"
 #include "stats.h"
 
 #define MIN_CHECKPOINT_ITEMS 10
@@ -51,11 +52,251 @@ typedef enum {
     CHECKPOINT_CLOSED  //!< The checkpoint is not open.
 } checkpoint_state;
 
+/**
+ * The queue of items in a checkpoint. Items are appended to fixed size chunks
+ * rather than to a list, so queueing an item doesn't allocate a node of its
+ * own. An item deduplicated by a newer one for the same key isn't erased; its
+ * slot is left empty (superseded) and skipped by iterators until compact()
+ * reclaims it. The superseded slots are counted per chunk in a Fenwick tree,
+ * so the index of a position among the remaining items is found without
+ * walking the queue.
+ */
+class CheckpointQueue {
+public:
+    // Number of item slots in each chunk
+    static const size_t chunkSize = 128;
+
+    /**
+     * A position in the queue as a (chunk, offset) pair. Iterators only stop
+     * on items that haven't been superseded. Appending to the queue doesn't
+     * invalidate them; insert() and compact() move the ones they are given.
+     */
+    class iterator {
+        friend class CheckpointQueue;
+    public:
+        iterator() : queue(NULL), chunk(0), offset(0) { }
+
+        queued_item &operator*() const {
+            return queue->chunks[chunk][offset];
+        }
+
+        iterator &operator++() {
+            do {
+                if (++offset == chunkSize) {
+                    ++chunk;
+                    offset = 0;
+                }
+            } while (position() < queue->numSlots &&
+                     !queue->chunks[chunk][offset]);
+            return *this;
+        }
+
+        iterator &operator--() {
+            do {
+                if (offset == 0) {
+                    --chunk;
+                    offset = chunkSize;
+                }
+                --offset;
+            } while (!queue->chunks[chunk][offset]);
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const {
+            return queue == other.queue && chunk == other.chunk &&
+                   offset == other.offset;
+        }
+
+        bool operator!=(const iterator &other) const {
+            return !(*this == other);
+        }
+
+        /**
+         * Return the slot number of this position in the queue.
+         */
+        size_t position() const {
+            return chunk * chunkSize + offset;
+        }
+
+        /**
+         * Return the index of this position among the items that haven't
+         * been superseded. A superseded slot has the index of the item
+         * before it, and end() that of the last item.
+         */
+        size_t index() const {
+            return queue->indexOf(position());
+        }
+
+    private:
+        iterator(CheckpointQueue *q, size_t pos)
+            : queue(q), chunk(pos / chunkSize), offset(pos % chunkSize) { }
+
+        CheckpointQueue *queue;
+        size_t           chunk;
+        size_t           offset;
+    };
+
+    CheckpointQueue() : numSlots(0), numLive(0) { }
+
+    ~CheckpointQueue();
+
+    iterator begin() {
+        iterator it(this, 0);
+        if (numSlots > 0 && !slot(0)) {
+            ++it;
+        }
+        return it;
+    }
+
+    iterator end() {
+        return iterator(this, numSlots);
+    }
+
+    /**
+     * Return the item in the given slot.
+     */
+    queued_item &at(size_t pos) {
+        return slot(pos);
+    }
+
+    /**
+     * Return the last item that hasn't been superseded.
+     */
+    queued_item &back() {
+        iterator it = end();
+        return *(--it);
+    }
+
+    bool empty() const {
+        return numLive == 0;
+    }
+
+    /**
+     * Return the number of items that haven't been superseded.
+     */
+    size_t size() const {
+        return numLive;
+    }
+
+    /**
+     * Return the number of superseded slots not yet reclaimed.
+     */
+    size_t getNumSuperseded() const {
+        return numSlots - numLive;
+    }
+
+    /**
+     * Append an item to the queue.
+     * @return the slot number of the item.
+     */
+    size_t push_back(const queued_item &qi);
+
+    /**
+     * Release the item in the given slot and leave the slot empty.
+     */
+    void supersede(size_t pos);
+
+    /**
+     * Remove the last item, along with any superseded slots before it.
+     */
+    void pop_back();
+
+    /**
+     * Insert items in front of the given slot, shifting the slots behind it.
+     * @param pos the slot to insert the items at
+     * @param items the items to be inserted, in order
+     * @param positions iterators into this queue to be kept on their items
+     */
+    void insert(size_t pos, const std::vector<queued_item> &items,
+                std::vector<iterator*> &positions);
+
+    /**
+     * Move the items down over the superseded slots and free the chunks
+     * left unused.
+     * @param positions iterators into this queue to be kept on their items
+     */
+    void compact(std::vector<iterator*> &positions);
+
+    /**
+     * Return the memory held by the chunks of this queue.
+     */
+    size_t memorySize() const {
+        return chunks.capacity() * sizeof(queued_item*) +
+               chunks.size() * chunkSize * sizeof(queued_item) +
+               supersededTree.capacity() * sizeof(size_t);
+    }
+
+private:
+    queued_item &slot(size_t pos) {
+        return chunks[pos / chunkSize][pos % chunkSize];
+    }
+
+    const queued_item &slot(size_t pos) const {
+        return chunks[pos / chunkSize][pos % chunkSize];
+    }
+
+    size_t indexOf(size_t pos) const;
+
+    void addChunk();
+
+    void freeUnusedChunks();
+
+    /**
+     * Add (or remove) a superseded slot to the count of its chunk.
+     */
+    void countSuperseded(size_t pos, bool superseded);
+
+    /**
+     * Return the number of superseded slots in the first n chunks.
+     */
+    size_t supersededInChunks(size_t n) const;
+
+    /**
+     * Recount the superseded slots of every chunk.
+     */
+    void recountSuperseded();
+
+    std::vector<queued_item*> chunks;
+    // Fenwick tree of the number of superseded slots per chunk
+    std::vector<size_t>       supersededTree;
+    // Number of slots used, superseded ones included
+    size_t                    numSlots;
+    // Number of slots holding an item
+    size_t                    numLive;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointQueue);
+};
+
+/**
+ * A checkpoint index key. It refers to the key of the queued item instead of
+ * holding a copy of it. When a newer item for the same key supersedes the
+ * queued one, the reference is moved to the newer item's key, which is equal
+ * and so leaves the key's hash unchanged.
+ */
+struct checkpoint_index_key {
+    explicit checkpoint_index_key(const std::string &k) : key(&k) { }
+
+    bool operator==(const checkpoint_index_key &other) const {
+        return *key == *other.key;
+    }
+
+    mutable const std::string *key;
+};
+
+struct checkpoint_index_hash {
+    size_t operator()(const checkpoint_index_key &k) const {
+        uint32_t h;
+        MurmurHash3_x86_32(k.key->data(), static_cast<int>(k.key->size()), 0,
+                           &h);
+        return h;
+    }
+};
+
 /**
  * A checkpoint index entry.
  */
 struct index_entry {
-    std::list<queued_item>::iterator position;
+    size_t position; // Slot of the item in the checkpoint queue
     int64_t mutation_id;
 };
 
@@ -72,7 +313,8 @@ typedef struct {
 /**
  * The checkpoint index maps a key to a checkpoint index_entry.
  */
-typedef unordered_map<std::string, index_entry> checkpoint_index;
+typedef unordered_map<checkpoint_index_key, index_entry,
+                      checkpoint_index_hash> checkpoint_index;
 
 class Checkpoint;
 class CheckpointManager;
@@ -87,48 +329,53 @@ class CheckpointCursor {
     friend class Checkpoint;
 public:
 
-    CheckpointCursor() { }
+    CheckpointCursor() : baseOffset(0), fromBeginningOnChkCollapse(false) { }
 
     CheckpointCursor(const std::string &n)
         : name(n),
           currentCheckpoint(),
           currentPos(),
-          offset(0),
+          baseOffset(0),
           fromBeginningOnChkCollapse(false) { }
 
     CheckpointCursor(const std::string &n,
                      std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
+                     CheckpointQueue::iterator pos,
                      size_t os,
                      bool beginningOnChkCollapse) :
         name(n), currentCheckpoint(checkpoint), currentPos(pos),
-        offset(os), fromBeginningOnChkCollapse(beginningOnChkCollapse) { }
+        baseOffset(0), fromBeginningOnChkCollapse(beginningOnChkCollapse) {
+        setOffset(os);
+    }
 
-    // We need to define the copy construct explicitly due to the fact
-    // that std::atomic implicitly deleted the assignment operator
-    CheckpointCursor(const CheckpointCursor &other) :
-        name(other.name), currentCheckpoint(other.currentCheckpoint),
-        currentPos(other.currentPos), offset(other.offset.load()),
-        fromBeginningOnChkCollapse(other.fromBeginningOnChkCollapse) { }
+    /**
+     * Return the number of items the cursor has walked past.
+     */
+    size_t getOffset() const;
 
-    CheckpointCursor &operator=(const CheckpointCursor &other) {
-        name.assign(other.name);
-        currentCheckpoint = other.currentCheckpoint;
-        currentPos = other.currentPos;
-        offset.store(other.offset.load());
-        fromBeginningOnChkCollapse = other.fromBeginningOnChkCollapse;
-        return *this;
-    }
+    void setOffset(size_t os);
 
     void decrOffset(size_t decr);
 
+    /**
+     * Move the cursor back by one item, keeping its offset.
+     */
     void decrPos();
 
+    /**
+     * Move the cursor off a slot superseded since it got there onto the item
+     * before it, before the cursor's current item is read.
+     */
+    void settle();
+
 private:
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
-    AtomicValue<size_t>              offset;
+    CheckpointQueue::iterator        currentPos;
+    // The offset less the index of currentPos. The offset is derived from
+    // the index, so it drops by itself as items behind the cursor are
+    // superseded, and deduplication doesn't have to visit the cursor.
+    int64_t                          baseOffset;
     bool                             fromBeginningOnChkCollapse;
 };
 
@@ -171,7 +418,8 @@ public:
                uint16_t vbid) :
         stats(st), checkpointId(id), snapStartSeqno(snapStart),
         snapEndSeqno(snapEnd), vbucketId(vbid), creationTime(ep_real_time()),
-        checkpointState(CHECKPOINT_OPEN), numItems(0), memOverhead(0) {
+        checkpointState(CHECKPOINT_OPEN), numItems(0), memOverhead(0),
+        queueMemory(0), itemsMemory(0), expelled(false) {
         stats.memOverhead.fetch_add(memorySize());
         cb_assert(stats.memOverhead.load() < GIGANTOR);
     }
@@ -268,14 +516,13 @@ public:
                              CheckpointManager *checkpointManager);
 
     uint64_t getLowSeqno() {
-        std::list<queued_item>::iterator pos = toWrite.begin();
-        pos++;
+        CheckpointQueue::iterator pos = toWrite.begin();
+        ++pos;
         return (*pos)->getBySeqno();
     }
 
     uint64_t getHighSeqno() {
-        std::list<queued_item>::reverse_iterator pos = toWrite.rbegin();
-        return (*pos)->getBySeqno();
+        return toWrite.back()->getBySeqno();
     }
 
     uint64_t getSnapshotStartSeqno() {
@@ -294,22 +541,14 @@ public:
         snapEndSeqno = seqno;
     }
 
-    std::list<queued_item>::iterator begin() {
+    CheckpointQueue::iterator begin() {
         return toWrite.begin();
     }
 
-    std::list<queued_item>::iterator end() {
+    CheckpointQueue::iterator end() {
         return toWrite.end();
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
-        return toWrite.rbegin();
-    }
-
-    std::list<queued_item>::reverse_iterator rend() {
-        return toWrite.rend();
-    }
-
     bool keyExists(const std::string &key);
 
     /**
@@ -326,9 +565,11 @@ public:
      * Merge the previous checkpoint into the this checkpoint by adding the items from
      * the previous checkpoint, which don't exist in this checkpoint.
      * @param pPrevCheckpoint pointer to the previous checkpoint.
+     * @param checkpointManager the checkpoint manager to which this checkpoint belongs
      * @return the number of items added from the previous checkpoint.
      */
-    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint);
+    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                               CheckpointManager *checkpointManager);
 
     /**
      * Get the mutation id for a given key in this checkpoint
@@ -337,7 +578,64 @@ public:
      */
     uint64_t getMutationIdForKey(const std::string &key);
 
+    /**
+     * Release the set and delete items up to a given slot that are persisted,
+     * and move the start of this checkpoint past them.
+     * @param lastPos the last slot whose item can be expelled
+     * @param persistedSeqno the highest seqno persisted for the vbucket
+     * @param checkpointManager the manager of the cursors in this checkpoint
+     * @return the number of items expelled
+     */
+    size_t expelItems(size_t lastPos, uint64_t persistedSeqno,
+                      CheckpointManager *checkpointManager);
+
+    /**
+     * Return true if items were expelled from this checkpoint, so that a
+     * cursor starting from its beginning misses them.
+     */
+    bool hasExpelledItems() const {
+        return expelled;
+    }
+
 private:
+    /**
+     * Collect the cursors currently in this checkpoint.
+     */
+    void getCursors(CheckpointManager *checkpointManager,
+                    std::vector<CheckpointCursor*> &cursors);
+
+    /**
+     * Reclaim the superseded slots of the queue.
+     */
+    void compact(CheckpointManager *checkpointManager);
+
+    /**
+     * Account the memory held by the queue's chunks in memOverhead.
+     */
+    void accountQueueMemory();
+
+    void addMemOverhead(size_t size) {
+        memOverhead += size;
+        stats.memOverhead.fetch_add(size);
+        cb_assert(stats.memOverhead.load() < GIGANTOR);
+    }
+
+    void removeMemOverhead(size_t size) {
+        memOverhead -= size;
+        stats.memOverhead.fetch_sub(size);
+        cb_assert(stats.memOverhead.load() < GIGANTOR);
+    }
+
+    void addItemsMemory(size_t size) {
+        itemsMemory += size;
+        stats.checkpointMemory.fetch_add(size);
+    }
+
+    void removeItemsMemory(size_t size) {
+        itemsMemory -= size;
+        stats.checkpointMemory.fetch_sub(size);
+    }
+
     EPStats                       &stats;
     uint64_t                       checkpointId;
     uint64_t                       snapStartSeqno;
@@ -347,10 +645,15 @@ private:
     checkpoint_state               checkpointState;
     size_t                         numItems;
     std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
+    // Deduplication supersedes slots in place, so appending never shifts.
+    CheckpointQueue                toWrite;
     checkpoint_index               keyIndex;
     size_t                         memOverhead;
+    // Chunk memory of toWrite already included in memOverhead
+    size_t                         queueMemory;
+    // Size of the items in toWrite, accounted in ep_checkpoint_memory
+    size_t                         itemsMemory;
+    bool                           expelled;
 };
 
 typedef std::pair<uint64_t, bool> CursorRegResult;
@@ -372,7 +675,7 @@ public:
         stats(st), checkpointConfig(config), vbucketId(vbucket), numItems(0),
         lastBySeqno(lastSeqno), lastClosedChkBySeqno(lastSeqno),
         isCollapsedCheckpoint(false),
-        pCursorPreCheckpointId(0) {
+        pCursorPreCheckpointId(0), pCursor(NULL) {
         LockHolder lh(queueLock);
         addNewCheckpoint_UNLOCKED(checkpointId, lastSnapStart, lastSnapEnd);
         registerCursor_UNLOCKED("persistence", checkpointId);
@@ -403,6 +706,21 @@ public:
     size_t removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbucket,
                                         bool &newOpenCheckpointCreated);
 
+    /**
+     * Expel the persisted items that every cursor has already walked past
+     * from the oldest checkpoint a cursor is in, to release their memory
+     * while the checkpoint itself is still referenced.
+     * @param persistedSeqno the highest seqno persisted for the vbucket
+     * @return the number of items expelled
+     */
+    size_t expelUnreferencedItems(uint64_t persistedSeqno);
+
+    /**
+     * Return the names of the cursors that are behind the persistence
+     * cursor, the slowest first.
+     */
+    std::list<std::string> getCursorsBehindPersistence();
+
     /**
      * Register the cursor for getting items whose bySeqno values are between
      * startBySeqno and endBySeqno, and close the open checkpoint if endBySeqno
@@ -466,6 +784,21 @@ public:
     snapshot_range_t getAllItemsForCursor(const std::string& name,
                                           std::vector<queued_item> &items);
 
+    /**
+     * Move a cursor past a batch of items in a single lock acquisition and
+     * append them to the given vector, which is grown once for the batch.
+     * A cursor other than the persistence cursor stops at the end of a
+     * checkpoint.
+     * @param name the name of the cursor
+     * @param items the vector the items are appended to
+     * @param maxItems the number of items to stop the batch at
+     * @param maxBytes the size of the items to stop the batch at
+     * @return the snapshot range of the items returned
+     */
+    snapshot_range_t getItemsForCursor(const std::string& name,
+                                       std::vector<queued_item> &items,
+                                       size_t maxItems, size_t maxBytes);
+
     /**
      * Return the total number of items that belong to this checkpoint manager.
      */
@@ -649,6 +982,8 @@ private:
     uint64_t                 lastClosedCheckpointId;
     uint64_t                 pCursorPreCheckpointId;
     cursor_index             tapCursors;
+    // The persistence cursor in tapCursors, looked up by queueDirty
+    CheckpointCursor        *pCursor;
 };
 
 /**
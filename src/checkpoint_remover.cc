@@ -24,7 +24,8 @@
 #include "connmap.h"
 
 /**
- * Remove all the closed unreferenced checkpoints for each vbucket.
+ * Remove all the closed unreferenced checkpoints for each vbucket, and expel
+ * items from the referenced ones while checkpoint memory is too high.
  */
 class CheckpointVisitor : public VBucketVisitor {
 public:
@@ -33,7 +34,7 @@ public:
      * Construct a CheckpointVisitor.
      */
     CheckpointVisitor(EventuallyPersistentStore *s, EPStats &st, bool *sfin)
-        : store(s), stats(st), removed(0),
+        : store(s), stats(st), removed(0), expelled(0),
           wasHighMemoryUsage(s->isMemoryUsageTooHigh()), stateFinalizer(sfin) {}
 
     bool visitBucket(RCPtr<VBucket> &vb) {
@@ -41,6 +42,9 @@ public:
         bool newCheckpointCreated = false;
         removed = vb->checkpointManager.removeClosedUnrefCheckpoints(vb,
                                                          newCheckpointCreated);
+        if (store->isCheckpointMemoryTooHigh()) {
+            reduceCheckpointMemory(vb, newCheckpointCreated);
+        }
         // If the new checkpoint is created, notify this event to the
         // corresponding paused TAP & DCP connections.
         if (newCheckpointCreated) {
@@ -61,7 +65,41 @@ public:
                 "Removed %ld closed unreferenced checkpoints from VBucket %d",
                 removed, currentBucket->getId());
         }
+        if (expelled > 0) {
+            LOG(EXTENSION_LOG_INFO,
+                "Expelled %ld items from checkpoints of VBucket %d",
+                expelled, currentBucket->getId());
+        }
         removed = 0;
+        expelled = 0;
+    }
+
+    /**
+     * Expel the persisted items every cursor has walked past, then drop the
+     * DCP cursors lagging behind persistence, the slowest first, until the
+     * checkpoint memory is back under its threshold.
+     */
+    void reduceCheckpointMemory(RCPtr<VBucket> &vb,
+                                bool &newCheckpointCreated) {
+        CheckpointManager &manager = vb->checkpointManager;
+        uint64_t persistedSeqno = store->getLastPersistedSeqno(vb->getId());
+        expelled += manager.expelUnreferencedItems(persistedSeqno);
+
+        std::list<std::string> cursors = manager.getCursorsBehindPersistence();
+        std::list<std::string>::iterator it = cursors.begin();
+        for (; it != cursors.end() && store->isCheckpointMemoryTooHigh();
+             ++it) {
+            if (!store->getEPEngine().getDcpConnMap().handleSlowStream(
+                                                        vb->getId(), *it)) {
+                continue;
+            }
+            stats.cursorsDropped++;
+
+            bool created = false;
+            removed += manager.removeClosedUnrefCheckpoints(vb, created);
+            newCheckpointCreated = newCheckpointCreated || created;
+            expelled += manager.expelUnreferencedItems(persistedSeqno);
+        }
     }
 
     void complete() {
@@ -80,6 +118,7 @@ private:
     EventuallyPersistentStore *store;
     EPStats                   &stats;
     size_t                     removed;
+    size_t                     expelled;
     bool                       wasHighMemoryUsage;
     bool                      *stateFinalizer;
 };
@@ -30,6 +30,7 @@
 #cmakedefine HAVE_MACH_ABSOLUTE_TIME ${HAVE_MACH_ABSOLUTE_TIME}
 #cmakedefine HAVE_GETTIMEOFDAY ${GETTIMEOFDAY}
 #cmakedefine HAVE_GETOPT_LONG ${HAVE_GETOPT_LONG}
+#cmakedefine HAVE_LIBURING ${HAVE_LIBURING}
 
 /* various */
 #define VERSION "${EP_ENGINE_VERSION}"
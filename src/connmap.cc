@@ -28,6 +28,7 @@
 #include "executorthread.h"
 #include "tapconnection.h"
 #include "connmap.h"
+#include "dcp-backfill.h"
 #include "dcp-backfill-manager.h"
 #include "dcp-consumer.h"
 #include "dcp-producer.h"
@@ -929,7 +930,7 @@ void TAPSessionStats::clearStats(const std::string &name) {
 }
 
 DcpConnMap::DcpConnMap(EventuallyPersistentEngine &e)
-    : ConnMap(e) {
+    : ConnMap(e), numSharedBackfills(0) {
 
 }
 
@@ -1154,6 +1155,22 @@ void DcpConnMap::notifyVBConnections(uint16_t vbid, uint64_t bySeqno)
     }
 }
 
+bool DcpConnMap::handleSlowStream(uint16_t vbid, const std::string &name)
+{
+    size_t lock_num = vbid % vbConnLockNum;
+    SpinLockHolder lh(&vbConnLocks[lock_num]);
+
+    std::list<connection_t> &conns = vbConns[vbid];
+    std::list<connection_t>::iterator it = conns.begin();
+    for (; it != conns.end(); ++it) {
+        DcpProducer *conn = static_cast<DcpProducer*>((*it).get());
+        if (conn->getName() == name) {
+            return conn->handleSlowStream(vbid);
+        }
+    }
+    return false;
+}
+
 void DcpConnMap::notifyBackfillManagerTasks() {
     LockHolder lh(connsLock);
     std::map<const void*, connection_t>::iterator itr = map_.begin();
@@ -1164,3 +1181,40 @@ void DcpConnMap::notifyBackfillManagerTasks() {
         }
     }
 }
+
+void DcpConnMap::addSharedBackfill(uint16_t vbid,
+                                   shared_ptr<SharedBackfillScan> &scan) {
+    LockHolder lh(sharedBackfillsLock);
+    sharedBackfills[vbid] = scan;
+}
+
+void DcpConnMap::removeSharedBackfill(uint16_t vbid,
+                                      shared_ptr<SharedBackfillScan> &scan) {
+    LockHolder lh(sharedBackfillsLock);
+    std::map<uint16_t, shared_ptr<SharedBackfillScan> >::iterator itr =
+        sharedBackfills.find(vbid);
+    if (itr != sharedBackfills.end() && itr->second == scan) {
+        sharedBackfills.erase(itr);
+    }
+}
+
+bool DcpConnMap::subscribeSharedBackfill(uint16_t vbid,
+                                         shared_ptr<BackfillSubscription> &sub,
+                                         uint64_t endSeqno) {
+    shared_ptr<SharedBackfillScan> scan;
+    {
+        LockHolder lh(sharedBackfillsLock);
+        std::map<uint16_t, shared_ptr<SharedBackfillScan> >::iterator itr =
+            sharedBackfills.find(vbid);
+        if (itr == sharedBackfills.end()) {
+            return false;
+        }
+        scan = itr->second;
+    }
+
+    if (!scan->subscribe(sub, endSeqno)) {
+        return false;
+    }
+    numSharedBackfills++;
+    return true;
+}
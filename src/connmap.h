@@ -38,6 +38,8 @@ class TapConsumer;
 class TapProducer;
 class DcpConsumer;
 class DcpProducer;
+class BackfillSubscription;
+class SharedBackfillScan;
 class Item;
 class EventuallyPersistentEngine;
 
@@ -445,8 +447,37 @@ public:
 
     void notifyVBConnections(uint16_t vbid, uint64_t bySeqno);
 
+    /**
+     * Drop the checkpoint cursor of the given producer's stream for a
+     * vbucket, as it is too far behind persistence.
+     * @return true if the cursor was dropped
+     */
+    bool handleSlowStream(uint16_t vbid, const std::string &name);
+
     void notifyBackfillManagerTasks();
 
+    /**
+     * Publish the scan of a vbucket backfill so that the backfills of other
+     * streams of the vbucket can share it.
+     */
+    void addSharedBackfill(uint16_t vbid,
+                           shared_ptr<SharedBackfillScan> &scan);
+
+    void removeSharedBackfill(uint16_t vbid,
+                              shared_ptr<SharedBackfillScan> &scan);
+
+    /**
+     * Subscribe a backfill to the scan published for the vbucket.
+     * @return false if there is no scan the backfill can share
+     */
+    bool subscribeSharedBackfill(uint16_t vbid,
+                                 shared_ptr<BackfillSubscription> &sub,
+                                 uint64_t endSeqno);
+
+    size_t getNumSharedBackfills() {
+        return numSharedBackfills;
+    }
+
     void removeVBConnections(connection_t &conn);
 
     void vbucketStateChanged(uint16_t vbucket, vbucket_state_t state);
@@ -464,6 +495,11 @@ private:
     void closeAllStreams_UNLOCKED();
 
     std::list<connection_t> deadConnections;
+
+    Mutex sharedBackfillsLock;
+    std::map<uint16_t, shared_ptr<SharedBackfillScan> > sharedBackfills;
+    //! The backfills that shared the scan of another stream
+    AtomicValue<size_t> numSharedBackfills;
 };
 
 
@@ -17,9 +17,15 @@
 
 #include "config.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+
 #include "common.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "histo.h"
+#include "locks.h"
 
 extern "C" {
 static couch_file_handle cfs_construct(couchstore_error_info_t*, void* cookie);
@@ -39,7 +45,7 @@ static couchstore_error_t cfs_advise(couchstore_error_info_t*,
 static void cfs_destroy(couchstore_error_info_t*,couch_file_handle);
 }
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
+couch_file_ops getCouchstoreStatsOps(CouchFileOpsContext* ctx) {
     couch_file_ops ops = {
         5,
         cfs_construct,
@@ -51,7 +57,7 @@ couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
         cfs_sync,
         cfs_advise,
         cfs_destroy,
-        stats
+        ctx
     };
     return ops;
 }
@@ -61,20 +67,139 @@ struct StatFile {
     couch_file_handle orig_handle;
     CouchstoreStats* stats;
     cs_off_t last_offs;
+    couchstore_error_t (*drain)(couchstore_error_info_t*, couch_file_handle);
+    CouchSyncGroup* group;
+    bool sync_pending;
+    CouchReadPlan* read_plan;
+    CouchReadAhead* read_ahead;
 };
 
+const std::pair<cs_off_t, size_t> *CouchReadPlan::find(cs_off_t offset,
+                                                       size_t length) const {
+    // The first range starting after offset follows the candidate
+    std::vector<std::pair<cs_off_t, size_t> >::const_iterator it;
+    it = std::upper_bound(ranges.begin(), ranges.end(),
+                          std::make_pair(offset,
+                                         std::numeric_limits<size_t>::max()));
+    if (it == ranges.begin()) {
+        return NULL;
+    }
+    --it;
+    if (offset + static_cast<cs_off_t>(length) >
+        it->first + static_cast<cs_off_t>(it->second)) {
+        return NULL;
+    }
+    return &*it;
+}
+
+bool CouchReadPlan::serve(void *buf, size_t length, cs_off_t offset) {
+    if (window.empty() || offset < windowOffset ||
+        offset + static_cast<cs_off_t>(length) >
+        windowOffset + static_cast<cs_off_t>(window.size())) {
+        return false;
+    }
+    memcpy(buf, &window[offset - windowOffset], length);
+    return true;
+}
+
+static couchstore_error_t adviseFile(void *file, cs_off_t offset,
+                                     cs_off_t length,
+                                     couchstore_file_advice_t advice) {
+    if (!file) {
+        return COUCHSTORE_SUCCESS;
+    }
+    StatFile *sf = static_cast<StatFile*>(file);
+    couchstore_error_info_t errinfo;
+    return sf->orig_ops->advise(&errinfo, sf->orig_handle, offset, length,
+                                advice);
+}
+
+couchstore_error_t CouchReadAhead::willNeed(cs_off_t offset, size_t length) {
+    couchstore_error_t rv = adviseFile(file, offset, length,
+                                       COUCHSTORE_FILE_ADVICE_WILLNEED);
+    if (rv == COUCHSTORE_SUCCESS) {
+        advisedBytes += length;
+        ++advisedRanges;
+    }
+    return rv;
+}
+
+couchstore_error_t CouchReadAhead::sequential() {
+    return adviseFile(file, 0, 0, COUCHSTORE_FILE_ADVICE_SEQUENTIAL);
+}
+
+bool CouchSyncGroup::defer(const couch_file_ops *ops,
+                           couch_file_handle handle) {
+    LockHolder lh(mutex);
+    if (!active.load()) {
+        return false;
+    }
+    files.push_back(std::make_pair(ops, handle));
+    return true;
+}
+
+couchstore_error_t CouchSyncGroup::end() {
+    std::vector<std::pair<const couch_file_ops*, couch_file_handle> > pending;
+    {
+        LockHolder lh(mutex);
+        active.store(false);
+        pending.swap(files);
+    }
+
+    // Sync through the handles couchstore wrote with: a writeback error is
+    // only reported to the descriptors that were open when it happened.
+    couchstore_error_t rv = COUCHSTORE_SUCCESS;
+    std::vector<std::pair<const couch_file_ops*,
+                          couch_file_handle> >::iterator it = pending.begin();
+    for (; it != pending.end(); ++it) {
+        const couch_file_ops *ops = it->first;
+        couchstore_error_info_t errinfo;
+        couchstore_error_t err;
+        {
+            BlockTimer bt(&stats->syncTimeHisto);
+            err = ops->sync(&errinfo, it->second);
+        }
+        ops->close(&errinfo, it->second);
+        ops->destructor(&errinfo, it->second);
+
+        if (err != COUCHSTORE_SUCCESS && rv == COUCHSTORE_SUCCESS) {
+            rv = err;
+        }
+    }
+    return rv;
+}
+
 extern "C" {
     static couch_file_handle cfs_construct(couchstore_error_info_t *errinfo,
                                            void* cookie) {
+        CouchFileOpsContext* ctx = static_cast<CouchFileOpsContext*>(cookie);
         StatFile* sf = new StatFile;
-        sf->stats = static_cast<CouchstoreStats*>(cookie);
-        sf->orig_ops = couchstore_get_default_file_ops();
+        sf->stats = ctx->stats;
+        sf->orig_ops = ctx->base;
         sf->orig_handle = sf->orig_ops->constructor(errinfo,
                                                     sf->orig_ops->cookie);
         sf->last_offs = 0;
+        sf->drain = ctx->drain;
+        sf->group = ctx->group;
+        sf->sync_pending = false;
+        sf->read_plan = ctx->readPlan;
+        sf->read_ahead = ctx->readAhead;
+        if (sf->read_ahead) {
+            sf->read_ahead->file = sf;
+        }
         return reinterpret_cast<couch_file_handle>(sf);
     }
 
+    static couchstore_error_t cfs_flush_pending(couchstore_error_info_t *errinfo,
+                                                StatFile* sf) {
+        if (!sf->sync_pending) {
+            return COUCHSTORE_SUCCESS;
+        }
+        sf->sync_pending = false;
+        BlockTimer bt(&sf->stats->syncTimeHisto);
+        return sf->orig_ops->sync(errinfo, sf->orig_handle);
+    }
+
     static couchstore_error_t cfs_open(couchstore_error_info_t *errinfo,
                                        couch_file_handle* h,
                                        const char* path,
@@ -86,15 +211,23 @@ extern "C" {
     static void cfs_close(couchstore_error_info_t *errinfo,
                           couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->sync_pending &&
+            sf->group->defer(sf->orig_ops, sf->orig_handle)) {
+            // The group syncs and closes the file through this handle
+            sf->sync_pending = false;
+            sf->orig_handle = sf->orig_ops->constructor(errinfo,
+                                                        sf->orig_ops->cookie);
+            return;
+        }
+        cfs_flush_pending(errinfo, sf);
         sf->orig_ops->close(errinfo, sf->orig_handle);
     }
 
-    static ssize_t cfs_pread(couchstore_error_info_t *errinfo,
-                             couch_file_handle h,
-                             void* buf,
-                             size_t sz,
-                             cs_off_t off) {
-        StatFile* sf = reinterpret_cast<StatFile*>(h);
+    static ssize_t cfs_pread_file(couchstore_error_info_t *errinfo,
+                                  StatFile* sf,
+                                  void* buf,
+                                  size_t sz,
+                                  cs_off_t off) {
         sf->stats->readSizeHisto.add(sz);
         if(sf->last_offs) {
             sf->stats->readSeekHisto.add(abs(off - sf->last_offs));
@@ -104,12 +237,50 @@ extern "C" {
         return sf->orig_ops->pread(errinfo, sf->orig_handle, buf, sz, off);
     }
 
+    static ssize_t cfs_pread(couchstore_error_info_t *errinfo,
+                             couch_file_handle h,
+                             void* buf,
+                             size_t sz,
+                             cs_off_t off) {
+        StatFile* sf = reinterpret_cast<StatFile*>(h);
+        CouchReadPlan* plan = sf->read_plan;
+        if (plan) {
+            if (plan->serve(buf, sz, off)) {
+                ++plan->coalescedReads;
+                return sz;
+            }
+            const std::pair<cs_off_t, size_t> *range = plan->find(off, sz);
+            if (range) {
+                plan->window.resize(range->second);
+                ssize_t rv = cfs_pread_file(errinfo, sf, &plan->window[0],
+                                            range->second, range->first);
+                if (rv < 0) {
+                    plan->window.clear();
+                    return rv;
+                }
+                plan->window.resize(rv);
+                plan->windowOffset = range->first;
+                ++plan->runs;
+                if (plan->serve(buf, sz, off)) {
+                    return sz;
+                }
+                // Cut short by the end of the file; read it on its own
+            }
+        }
+        return cfs_pread_file(errinfo, sf, buf, sz, off);
+    }
+
     static ssize_t cfs_pwrite(couchstore_error_info_t *errinfo,
                               couch_file_handle h,
                               const void* buf,
                               size_t sz,
                               cs_off_t off) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        // A deferred sync must still land before anything written after it
+        couchstore_error_t err = cfs_flush_pending(errinfo, sf);
+        if (err != COUCHSTORE_SUCCESS) {
+            return err;
+        }
         sf->stats->writeSizeHisto.add(sz);
         BlockTimer bt(&sf->stats->writeTimeHisto);
         return sf->orig_ops->pwrite(errinfo, sf->orig_handle, buf, sz, off);
@@ -124,6 +295,19 @@ extern "C" {
     static couchstore_error_t cfs_sync(couchstore_error_info_t *errinfo,
                                        couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->group && sf->group->isActive()) {
+            // Only the sync itself waits for the group; queued writes
+            // still have to land, and report their errors, now
+            if (sf->drain) {
+                BlockTimer bt(&sf->stats->syncTimeHisto);
+                couchstore_error_t err = sf->drain(errinfo, sf->orig_handle);
+                if (err != COUCHSTORE_SUCCESS) {
+                    return err;
+                }
+            }
+            sf->sync_pending = true;
+            return COUCHSTORE_SUCCESS;
+        }
         BlockTimer bt(&sf->stats->syncTimeHisto);
         return sf->orig_ops->sync(errinfo, sf->orig_handle);
     }
@@ -140,6 +324,9 @@ extern "C" {
     static void cfs_destroy(couchstore_error_info_t *errinfo,
                             couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->read_ahead && sf->read_ahead->file == sf) {
+            sf->read_ahead->file = NULL;
+        }
         sf->orig_ops->destructor(errinfo, sf->orig_handle);
         delete sf;
     }
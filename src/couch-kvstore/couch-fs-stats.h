@@ -22,7 +22,13 @@
 
 #include <libcouchstore/couch_db.h>
 
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "atomic.h"
 #include "histo.h"
+#include "mutex.h"
 
 struct CouchstoreStats {
 public:
@@ -54,6 +60,157 @@ public:
     }
 };
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats);
+/**
+ * Defers the syncs of the files written through its file ops while it is
+ * active, so that the commits of several vbucket files can be made
+ * durable together.
+ *
+ * A deferred sync is still issued before any further write to the same
+ * file, so couchstore's ordering of data before headers is kept; only the
+ * last sync of each commit ends up waiting for end().
+ */
+class CouchSyncGroup {
+public:
+    CouchSyncGroup(CouchstoreStats *s) : stats(s), active(false) { }
+
+    /**
+     * Start deferring syncs.
+     */
+    void begin() {
+        active.store(true);
+    }
+
+    /**
+     * Sync and close every file whose sync was deferred and stop deferring.
+     *
+     * @return the first error hit, in which case the commits made since
+     *         begin() may not be durable
+     */
+    couchstore_error_t end();
+
+    bool isActive() const {
+        return active.load();
+    }
+
+    /**
+     * Take over a handle closed with a sync still outstanding, to be
+     * synced and closed by end().
+     *
+     * @return false if the group isn't active; the handle is left to the
+     *         caller
+     */
+    bool defer(const couch_file_ops *ops, couch_file_handle handle);
+
+    CouchstoreStats *stats;
+
+private:
+    AtomicValue<bool> active;
+    Mutex mutex;
+    std::vector<std::pair<const couch_file_ops*, couch_file_handle> > files;
+};
+
+/**
+ * Ranges of a file to be read as a whole the first time couchstore reads
+ * within them, so that a batch of reads of nearby data costs one read.
+ * The last such read is kept to serve couchstore's reads that follow.
+ */
+class CouchReadPlan {
+public:
+    CouchReadPlan() : windowOffset(0), coalescedReads(0), runs(0) { }
+
+    /**
+     * Add a range to read in one go; ranges must be added in increasing
+     * offset order and must not overlap.
+     */
+    void addRange(cs_off_t offset, size_t length) {
+        ranges.push_back(std::make_pair(offset, length));
+    }
+
+    bool empty() const {
+        return ranges.empty();
+    }
+
+    /**
+     * @return the planned range holding [offset, offset + length), or
+     *         NULL if there is none
+     */
+    const std::pair<cs_off_t, size_t> *find(cs_off_t offset,
+                                            size_t length) const;
+
+    /**
+     * Copy [offset, offset + length) from the last range read, if it holds
+     * all of it.
+     *
+     * @return false if it doesn't
+     */
+    bool serve(void *buf, size_t length, cs_off_t offset);
+
+    cs_off_t windowOffset;
+    std::vector<char> window;
+
+    //! Reads served from a range read as a whole
+    size_t coalescedReads;
+    //! Ranges read as a whole
+    size_t runs;
+
+private:
+    std::vector<std::pair<cs_off_t, size_t> > ranges;
+};
+
+/**
+ * Advice to the OS about the file of a scan, given through the handle its
+ * file ops opened, so that reads the scan is about to issue are started
+ * ahead of it.
+ */
+class CouchReadAhead {
+public:
+    CouchReadAhead() : file(NULL), advisedBytes(0), advisedRanges(0) { }
+
+    /**
+     * Ask the OS to start reading [offset, offset + length) into the page
+     * cache without waiting for it.
+     */
+    couchstore_error_t willNeed(cs_off_t offset, size_t length);
+
+    /**
+     * Tell the OS the file is about to be read mostly in order, so that it
+     * reads further ahead of each read.
+     */
+    couchstore_error_t sequential();
+
+    //! The stats collecting handle, set when the file ops construct it
+    void *file;
+
+    //! Bytes the OS was asked to read ahead
+    size_t advisedBytes;
+    //! Ranges the OS was asked to read ahead
+    size_t advisedRanges;
+};
+
+/**
+ * What a set of stats collecting file ops works with. It must outlive
+ * every handle opened through them.
+ */
+struct CouchFileOpsContext {
+    CouchFileOpsContext(CouchstoreStats *s) :
+        stats(s), base(couchstore_get_default_file_ops()), drain(NULL),
+        group(NULL), readPlan(NULL), readAhead(NULL) { }
+
+    CouchstoreStats *stats;
+    //! The file ops doing the actual I/O
+    const couch_file_ops *base;
+    //! If base may return from pwrite before the write is done, waits for
+    //! a handle's writes and returns their first error
+    couchstore_error_t (*drain)(couchstore_error_info_t*, couch_file_handle);
+    //! Group holding back syncs while it is active, if any
+    CouchSyncGroup *group;
+    //! Reads to coalesce, if any; only for ops used by a single thread
+    CouchReadPlan *readPlan;
+    //! Read-ahead to hand the handle to, if any; only for ops opening a
+    //! single handle
+    CouchReadAhead *readAhead;
+};
+
+couch_file_ops getCouchstoreStatsOps(CouchFileOpsContext* ctx);
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_FS_STATS_H_
@@ -0,0 +1,551 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-fs-uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "locks.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+struct UringFile;
+
+struct UringWrite {
+    UringWrite(UringFile *f, const void *b, size_t sz, cs_off_t off) :
+        file(f), buf(new char[sz]), size(sz), offset(off) {
+        memcpy(buf, b, sz);
+    }
+
+    ~UringWrite() {
+        delete []buf;
+    }
+
+    UringFile *file;
+    char *buf;
+    size_t size;
+    cs_off_t offset;
+};
+
+/**
+ * The ring shared by every file of a CouchKVStore. The flusher and
+ * compaction may write different files at once, so the mutex covers the
+ * ring and the queued writes of all files using it.
+ */
+struct CouchstoreUring {
+    CouchstoreUring(size_t d) : depth(d), ready(false), unsubmitted(0),
+                                inflight(0) { }
+
+    Mutex mutex;
+    size_t depth;
+    struct io_uring ring;
+    bool ready;
+    //! Writes queued on the ring but not yet submitted
+    size_t unsubmitted;
+    //! Writes queued and not yet completed
+    size_t inflight;
+    //! Queued writes in the order they were queued, so that the newest
+    //! `unsubmitted' of them are the ones not yet submitted
+    std::vector<UringWrite*> queued;
+};
+
+struct UringFile {
+    UringFile(CouchstoreUring *r) : fd(-1), uring(r), writable(false),
+                                    error(COUCHSTORE_SUCCESS), errnum(0) { }
+
+    int fd;
+    CouchstoreUring *uring;
+    //! Read only handles never queue anything
+    bool writable;
+    //! This file's writes queued and not yet completed
+    std::vector<UringWrite*> inflight;
+    //! First write error since the last drain, and its errno
+    couchstore_error_t error;
+    int errnum;
+};
+
+extern "C" {
+static couch_file_handle ufs_construct(couchstore_error_info_t*, void* cookie);
+static couchstore_error_t ufs_open(couchstore_error_info_t*,
+                                   couch_file_handle*, const char*, int);
+static void ufs_close(couchstore_error_info_t*, couch_file_handle);
+static ssize_t ufs_pread(couchstore_error_info_t*, couch_file_handle,
+                         void *, size_t, cs_off_t);
+static ssize_t ufs_pwrite(couchstore_error_info_t*, couch_file_handle,
+                          const void *, size_t, cs_off_t);
+static cs_off_t ufs_goto_eof(couchstore_error_info_t*, couch_file_handle);
+static couchstore_error_t ufs_sync(couchstore_error_info_t*, couch_file_handle);
+static couchstore_error_t ufs_advise(couchstore_error_info_t*,
+                                     couch_file_handle,
+                                     cs_off_t, cs_off_t,
+                                     couchstore_file_advice_t);
+static void ufs_destroy(couchstore_error_info_t*,couch_file_handle);
+}
+
+CouchstoreUring *createCouchstoreUring(size_t depth) {
+    CouchstoreUring *uring = new CouchstoreUring(depth);
+    int rv = io_uring_queue_init(depth, &uring->ring, 0);
+    if (rv < 0) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: io_uring setup failed: %s", strerror(-rv));
+        delete uring;
+        return NULL;
+    }
+    uring->ready = true;
+    return uring;
+}
+
+void destroyCouchstoreUring(CouchstoreUring *uring) {
+    if (uring) {
+        cb_assert(uring->inflight == 0);
+        if (uring->ready) {
+            io_uring_queue_exit(&uring->ring);
+        }
+        delete uring;
+    }
+}
+
+couch_file_ops getCouchstoreUringOps(CouchstoreUring *uring) {
+    couch_file_ops ops = {
+        5,
+        ufs_construct,
+        ufs_open,
+        ufs_close,
+        ufs_pread,
+        ufs_pwrite,
+        ufs_goto_eof,
+        ufs_sync,
+        ufs_advise,
+        ufs_destroy,
+        uring
+    };
+    return ops;
+}
+
+static void latch_error(UringFile *uf, couchstore_error_t err, int errnum) {
+    if (uf->error == COUCHSTORE_SUCCESS) {
+        uf->error = err;
+        uf->errnum = errnum;
+    }
+}
+
+static void forget_write(CouchstoreUring *uring, UringWrite *w) {
+    UringFile *uf = w->file;
+    std::vector<UringWrite*>::iterator it;
+    it = std::find(uf->inflight.begin(), uf->inflight.end(), w);
+    cb_assert(it != uf->inflight.end());
+    uf->inflight.erase(it);
+    it = std::find(uring->queued.begin(), uring->queued.end(), w);
+    cb_assert(it != uring->queued.end());
+    uring->queued.erase(it);
+    --uring->inflight;
+    delete w;
+}
+
+static void complete_write(CouchstoreUring *uring, UringWrite *w, int res) {
+    UringFile *uf = w->file;
+    if (res < 0) {
+        latch_error(uf, COUCHSTORE_ERROR_WRITE, -res);
+    } else {
+        // Finish a short write synchronously
+        size_t done = static_cast<size_t>(res);
+        while (done < w->size) {
+            ssize_t rv = ::pwrite(uf->fd, w->buf + done, w->size - done,
+                                  w->offset + done);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv <= 0) {
+                latch_error(uf, COUCHSTORE_ERROR_WRITE, rv < 0 ? errno : EIO);
+                break;
+            }
+            done += rv;
+        }
+    }
+    forget_write(uring, w);
+}
+
+/**
+ * Reap completed writes of any file, waiting for them until `uf' has no
+ * more than `target' writes left in flight. Pass a NULL `uf' to wait for
+ * `target' completions of any file instead.
+ */
+static void reap_completions(CouchstoreUring *uring, UringFile *uf,
+                             size_t target) {
+    size_t reaped = 0;
+    while (uring->ready && uring->inflight > uring->unsubmitted) {
+        bool wait = uf ? uf->inflight.size() > target : reaped < target;
+        struct io_uring_cqe *cqe = NULL;
+        int rv;
+        if (wait) {
+            rv = io_uring_wait_cqe(&uring->ring, &cqe);
+        } else {
+            rv = io_uring_peek_cqe(&uring->ring, &cqe);
+        }
+        if (rv == -EINTR) {
+            continue;
+        } else if (rv < 0 || !cqe) {
+            break;
+        }
+        UringWrite *w = static_cast<UringWrite*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(&uring->ring, cqe);
+        complete_write(uring, w, res);
+        ++reaped;
+    }
+}
+
+static void fail_ring(CouchstoreUring *uring, int errnum) {
+    LOG(EXTENSION_LOG_WARNING,
+        "Warning: io_uring submission failed: %s", strerror(errnum));
+
+    // Writes already submitted may still be using their buffers, so wait
+    // for them before tearing down the ring. The unsubmitted ones are the
+    // newest and never reach the kernel once the ring is gone.
+    reap_completions(uring, NULL, uring->inflight - uring->unsubmitted);
+    size_t stuck = uring->inflight - uring->unsubmitted;
+    if (stuck > 0) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: leaking %" PRIu64 " io_uring writes which could not "
+            "be reaped", static_cast<uint64_t>(stuck));
+    }
+
+    io_uring_queue_exit(&uring->ring);
+    uring->ready = false;
+    while (uring->queued.size() > stuck) {
+        UringWrite *w = uring->queued.back();
+        latch_error(w->file, COUCHSTORE_ERROR_WRITE, errnum);
+        forget_write(uring, w);
+    }
+    for (size_t i = 0; i < stuck; ++i) {
+        UringWrite *w = uring->queued[i];
+        latch_error(w->file, COUCHSTORE_ERROR_WRITE, errnum);
+        w->file->inflight.clear();
+    }
+    uring->queued.clear();
+    uring->unsubmitted = 0;
+    uring->inflight = 0;
+}
+
+static void submit(CouchstoreUring *uring) {
+    while (uring->ready && uring->unsubmitted > 0) {
+        int rv = io_uring_submit(&uring->ring);
+        if (rv > 0) {
+            uring->unsubmitted -= std::min(static_cast<size_t>(rv),
+                                           uring->unsubmitted);
+        } else if (rv == -EINTR) {
+            continue;
+        } else if ((rv == 0 || rv == -EAGAIN || rv == -EBUSY) &&
+                   uring->inflight > uring->unsubmitted) {
+            // Out of kernel resources; let some writes finish first
+            reap_completions(uring, NULL, 1);
+        } else {
+            fail_ring(uring, rv < 0 ? -rv : EIO);
+        }
+    }
+}
+
+/**
+ * Wait until `uf' has no writes left in flight. The ring's mutex must be
+ * held.
+ */
+static couchstore_error_t drain(couchstore_error_info_t *errinfo,
+                                UringFile *uf) {
+    if (!uf->inflight.empty()) {
+        submit(uf->uring);
+        reap_completions(uf->uring, uf, 0);
+    }
+    couchstore_error_t err = uf->error;
+    if (err != COUCHSTORE_SUCCESS) {
+        errinfo->error = uf->errnum;
+        uf->error = COUCHSTORE_SUCCESS;
+        uf->errnum = 0;
+    }
+    return err;
+}
+
+static couchstore_error_t locked_drain(couchstore_error_info_t *errinfo,
+                                       UringFile *uf) {
+    LockHolder lh(uf->uring->mutex);
+    return drain(errinfo, uf);
+}
+
+couchstore_error_t couchstoreUringDrain(couchstore_error_info_t *errinfo,
+                                        couch_file_handle handle) {
+    return locked_drain(errinfo, reinterpret_cast<UringFile*>(handle));
+}
+
+static bool overlaps_inflight(UringFile *uf, cs_off_t off, size_t sz) {
+    std::vector<UringWrite*>::iterator it = uf->inflight.begin();
+    for (; it != uf->inflight.end(); ++it) {
+        if (off < (*it)->offset + static_cast<cs_off_t>((*it)->size) &&
+            (*it)->offset < off + static_cast<cs_off_t>(sz)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static ssize_t sync_pwrite(couchstore_error_info_t *errinfo, UringFile *uf,
+                           const void* buf, size_t sz, cs_off_t off) {
+    ssize_t rv;
+    do {
+        rv = ::pwrite(uf->fd, buf, sz, off);
+    } while (rv == -1 && errno == EINTR);
+    if (rv < 0) {
+        errinfo->error = errno;
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return rv;
+}
+
+extern "C" {
+    static couch_file_handle ufs_construct(couchstore_error_info_t *errinfo,
+                                           void* cookie) {
+        (void)errinfo;
+        CouchstoreUring *uring = static_cast<CouchstoreUring*>(cookie);
+        return reinterpret_cast<couch_file_handle>(new UringFile(uring));
+    }
+
+    static couchstore_error_t ufs_open(couchstore_error_info_t *errinfo,
+                                       couch_file_handle* h,
+                                       const char* path,
+                                       int flags) {
+        UringFile* uf = reinterpret_cast<UringFile*>(*h);
+        int fd;
+        do {
+            fd = ::open(path, flags | O_LARGEFILE, 0666);
+        } while (fd == -1 && errno == EINTR);
+
+        if (fd < 0) {
+            errinfo->error = errno;
+            if (errno == ENOENT) {
+                return COUCHSTORE_ERROR_NO_SUCH_FILE;
+            }
+            return COUCHSTORE_ERROR_OPEN_FILE;
+        }
+        uf->fd = fd;
+        uf->writable = (flags & O_ACCMODE) != O_RDONLY;
+        return COUCHSTORE_SUCCESS;
+    }
+
+    static void ufs_close(couchstore_error_info_t *errinfo,
+                          couch_file_handle h) {
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        if (locked_drain(errinfo, uf) != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: queued write failed before close: %s",
+                strerror(errinfo->error));
+        }
+        if (uf->fd != -1) {
+            int rv;
+            do {
+                rv = ::close(uf->fd);
+            } while (rv == -1 && errno == EINTR);
+            uf->fd = -1;
+        }
+    }
+
+    static ssize_t ufs_pread(couchstore_error_info_t *errinfo,
+                             couch_file_handle h,
+                             void* buf,
+                             size_t sz,
+                             cs_off_t off) {
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        if (uf->writable) {
+            LockHolder lh(uf->uring->mutex);
+            if (overlaps_inflight(uf, off, sz)) {
+                couchstore_error_t err = drain(errinfo, uf);
+                if (err != COUCHSTORE_SUCCESS) {
+                    return err;
+                }
+            }
+        }
+
+        ssize_t rv;
+        do {
+            rv = ::pread(uf->fd, buf, sz, off);
+        } while (rv == -1 && errno == EINTR);
+
+        if (rv < 0) {
+            errinfo->error = errno;
+            return COUCHSTORE_ERROR_READ;
+        }
+        return rv;
+    }
+
+    static ssize_t ufs_pwrite(couchstore_error_info_t *errinfo,
+                              couch_file_handle h,
+                              const void* buf,
+                              size_t sz,
+                              cs_off_t off) {
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        CouchstoreUring *uring = uf->uring;
+        LockHolder lh(uring->mutex);
+        if (uf->error != COUCHSTORE_SUCCESS) {
+            return drain(errinfo, uf);
+        }
+
+        // Make room, also picking up whatever has completed meanwhile
+        if (uring->ready && uring->inflight >= uring->depth) {
+            submit(uring);
+            reap_completions(uring, NULL, 1);
+        } else if (uring->ready) {
+            reap_completions(uring, NULL, 0);
+        }
+
+        struct io_uring_sqe *sqe = NULL;
+        if (uring->ready && !(sqe = io_uring_get_sqe(&uring->ring))) {
+            submit(uring);
+            if (uring->ready) {
+                sqe = io_uring_get_sqe(&uring->ring);
+            }
+        }
+        if (!sqe) {
+            return sync_pwrite(errinfo, uf, buf, sz, off);
+        }
+
+        UringWrite *w = new UringWrite(uf, buf, sz, off);
+        io_uring_prep_write(sqe, uf->fd, w->buf, sz, off);
+        io_uring_sqe_set_data(sqe, w);
+        uf->inflight.push_back(w);
+        uring->queued.push_back(w);
+        ++uring->inflight;
+
+        // Submit in batches of a quarter of the ring
+        if (++uring->unsubmitted >= std::max(uring->depth / 4, size_t(1))) {
+            submit(uring);
+        }
+        return sz;
+    }
+
+    static cs_off_t ufs_goto_eof(couchstore_error_info_t *errinfo,
+                                 couch_file_handle h) {
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        couchstore_error_t err = locked_drain(errinfo, uf);
+        if (err != COUCHSTORE_SUCCESS) {
+            return err;
+        }
+        cs_off_t rv = ::lseek(uf->fd, 0, SEEK_END);
+        if (rv < 0) {
+            errinfo->error = errno;
+            return COUCHSTORE_ERROR_READ;
+        }
+        return rv;
+    }
+
+    static couchstore_error_t ufs_sync(couchstore_error_info_t *errinfo,
+                                       couch_file_handle h) {
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        couchstore_error_t err = locked_drain(errinfo, uf);
+        if (err != COUCHSTORE_SUCCESS) {
+            return err;
+        }
+        int rv;
+        do {
+#ifdef __linux__
+            rv = fdatasync(uf->fd);
+#else
+            rv = fsync(uf->fd);
+#endif
+        } while (rv == -1 && errno == EINTR);
+
+        if (rv == -1) {
+            errinfo->error = errno;
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+
+    static couchstore_error_t ufs_advise(couchstore_error_info_t *errinfo,
+                                         couch_file_handle h,
+                                         cs_off_t offs,
+                                         cs_off_t len,
+                                         couchstore_file_advice_t adv) {
+#ifdef POSIX_FADV_NORMAL
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        int advice = POSIX_FADV_NORMAL;
+        switch (adv) {
+        case COUCHSTORE_FILE_ADVICE_RANDOM:
+            advice = POSIX_FADV_RANDOM;
+            break;
+        case COUCHSTORE_FILE_ADVICE_SEQUENTIAL:
+            advice = POSIX_FADV_SEQUENTIAL;
+            break;
+        case COUCHSTORE_FILE_ADVICE_WILLNEED:
+            advice = POSIX_FADV_WILLNEED;
+            break;
+        case COUCHSTORE_FILE_ADVICE_DONTNEED:
+            advice = POSIX_FADV_DONTNEED;
+            break;
+        default:
+            break;
+        }
+        int rv = posix_fadvise(uf->fd, offs, len, advice);
+        if (rv != 0) {
+            errinfo->error = rv;
+            return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+        }
+#else
+        (void)errinfo; (void)h; (void)offs; (void)len; (void)adv;
+#endif
+        return COUCHSTORE_SUCCESS;
+    }
+
+    static void ufs_destroy(couchstore_error_info_t *errinfo,
+                            couch_file_handle h) {
+        (void)errinfo;
+        UringFile* uf = reinterpret_cast<UringFile*>(h);
+        cb_assert(uf->inflight.empty());
+        delete uf;
+    }
+}
+
+#else
+
+CouchstoreUring *createCouchstoreUring(size_t) {
+    return NULL;
+}
+
+void destroyCouchstoreUring(CouchstoreUring *) {
+}
+
+couch_file_ops getCouchstoreUringOps(CouchstoreUring *) {
+    return *couchstore_get_default_file_ops();
+}
+
+couchstore_error_t couchstoreUringDrain(couchstore_error_info_t *,
+                                        couch_file_handle) {
+    return COUCHSTORE_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COUCH_KVSTORE_COUCH_FS_URING_H_
+#define SRC_COUCH_KVSTORE_COUCH_FS_URING_H_ 1
+
+#include "config.h"
+
+#include <libcouchstore/couch_db.h>
+
+/**
+ * An io_uring shared by every file written through the couch_file_ops of
+ * getCouchstoreUringOps, so that opening a file doesn't set up a ring of
+ * its own. Meant to be created once per read-write CouchKVStore.
+ */
+struct CouchstoreUring;
+
+/**
+ * Set up a ring.
+ *
+ * @param depth number of writes the ring may keep in flight, across all
+ *              the files using it
+ * @return NULL if built without liburing or if the running kernel has no
+ *         io_uring support
+ */
+CouchstoreUring *createCouchstoreUring(size_t depth);
+
+/**
+ * Tear down a ring. Every file using it must have been closed.
+ */
+void destroyCouchstoreUring(CouchstoreUring *uring);
+
+/**
+ * couch_file_ops doing their writes through an io_uring.
+ *
+ * pwrite copies the data, queues it on the ring and returns straight
+ * away; the queued writes are submitted in batches and are only waited
+ * for by sync, goto_eof, close or a pread of a range still being written.
+ * A failed write is reported by the next call on its file that can return
+ * an error, at the latest by sync, so a commit never completes over a
+ * lost write. Reads stay synchronous, as couchstore waits on each of them.
+ *
+ * @param uring the ring to write through, from createCouchstoreUring
+ */
+couch_file_ops getCouchstoreUringOps(CouchstoreUring *uring);
+
+/**
+ * Wait for every write queued on a handle of getCouchstoreUringOps.
+ *
+ * @return the first write error since the last wait
+ */
+couchstore_error_t couchstoreUringDrain(couchstore_error_info_t *errinfo,
+                                        couch_file_handle handle);
+
+#endif  // SRC_COUCH_KVSTORE_COUCH_FS_URING_H_
@@ -43,6 +43,7 @@
 #include <cJSON.h>
 
 #include "common.h"
+#include "couch-kvstore/couch-fs-uring.h"
 #include "couch-kvstore/couch-kvstore.h"
 #define STATWRITER_NAMESPACE couchstore_engine
 #include "statwriter.h"
@@ -196,6 +197,42 @@ static std::string couchkvstore_strerrno(Db *db, couchstore_error_t err) {
             err == COUCHSTORE_ERROR_WRITE) ? getStrError(db) : "none";
 }
 
+/**
+ * A DocInfo kept past the couchstore callback it was handed to.
+ */
+struct DocInfoCopy {
+    DocInfoCopy(const DocInfo *d) :
+        id(d->id.buf, d->id.size), meta(d->rev_meta.buf, d->rev_meta.size),
+        info(*d) { }
+
+    DocInfo *getDocInfo() {
+        info.id.buf = const_cast<char *>(id.data());
+        info.rev_meta.buf = const_cast<char *>(meta.data());
+        return &info;
+    }
+
+    std::string id;
+    std::string meta;
+    DocInfo info;
+};
+
+/**
+ * A BG fetch whose body is read once the docinfos of the whole batch are
+ * known, so that the reads can be made in file order and merged.
+ */
+struct DeferredBGFetch : public DocInfoCopy {
+    DeferredBGFetch(const DocInfo *d,
+                    std::list<VBucketBGFetchItem *> *f) :
+        DocInfoCopy(d), fetches(f) { }
+
+    std::list<VBucketBGFetchItem *> *fetches;
+};
+
+static bool compareByBodyOffset(const DocInfoCopy *a,
+                                const DocInfoCopy *b) {
+    return a->info.bp < b->info.bp;
+}
+
 struct GetMultiCbCtx {
     GetMultiCbCtx(CouchKVStore &c, uint16_t v, vb_bgfetch_queue_t &f) :
         cks(c), vbId(v), fetches(f) {}
@@ -203,8 +240,127 @@ struct GetMultiCbCtx {
     CouchKVStore &cks;
     uint16_t vbId;
     vb_bgfetch_queue_t &fetches;
+    std::list<DeferredBGFetch> deferred;
+};
+
+//! Most unrequested bytes read between two bodies to merge their reads
+static const size_t BG_FETCH_COALESCE_GAP = 4096;
+//! Largest merged read
+static const size_t BG_FETCH_COALESCE_MAX = 256 * 1024;
+
+/**
+ * Upper bound of the bytes couchstore reads for a body stored with the
+ * given size: its 8 byte chunk header, plus a marker byte for every 4k
+ * block boundary it crosses.
+ */
+static size_t bodyDiskSpan(size_t size) {
+    size_t len = size + 8;
+    return len + len / 4095 + 2;
+}
+
+/**
+ * Plan a read for each run of nearby bodies in a batch sorted by offset.
+ */
+static void planBGFetchReads(std::vector<DeferredBGFetch *> &sorted,
+                             CouchReadPlan &plan) {
+    std::vector<DeferredBGFetch *>::iterator it = sorted.begin();
+    while (it != sorted.end()) {
+        uint64_t start = (*it)->info.bp;
+        uint64_t end = start + bodyDiskSpan((*it)->info.size);
+        size_t bodies = 1;
+        for (++it; it != sorted.end(); ++it) {
+            uint64_t bp = (*it)->info.bp;
+            uint64_t bpEnd = bp + bodyDiskSpan((*it)->info.size);
+            if (bp > end + BG_FETCH_COALESCE_GAP ||
+                std::max(end, bpEnd) - start > BG_FETCH_COALESCE_MAX) {
+                break;
+            }
+            end = std::max(end, bpEnd);
+            ++bodies;
+        }
+        if (bodies > 1) {
+            plan.addRange(start, end - start);
+        }
+    }
+}
+
+/**
+ * The file a scan reads, opened through private file ops so that the scan
+ * can give the OS read-ahead advice for it.
+ */
+struct CouchScan {
+    CouchScan(const CouchFileOpsContext &base) : db(NULL), opsContext(base) {
+        opsContext.readAhead = &readAhead;
+        ops = getCouchstoreStatsOps(&opsContext);
+    }
+
+    Db *db;
+    CouchReadAhead readAhead;
+    CouchFileOpsContext opsContext;
+    couch_file_ops ops;
+};
+
+struct ScanBatchCtx {
+    ScanBatchCtx(size_t max) : maxDocs(max), full(false) {
+        docs.reserve(max);
+    }
+
+    size_t maxDocs;
+    bool full;
+    std::vector<DocInfoCopy> docs;
 };
 
+extern "C" {
+    static int collectDocInfoC(Db *, DocInfo *docinfo, void *ctx)
+    {
+        ScanBatchCtx *batch = static_cast<ScanBatchCtx *>(ctx);
+        batch->docs.push_back(DocInfoCopy(docinfo));
+        if (batch->docs.size() >= batch->maxDocs) {
+            batch->full = true;
+            return COUCHSTORE_ERROR_CANCEL;
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+}
+
+//! Most bytes between two bodies for a scan to read them ahead as one range
+static const size_t SCAN_READ_AHEAD_GAP = 64 * 1024;
+//! Largest range read ahead at once
+static const size_t SCAN_READ_AHEAD_MAX = 1024 * 1024;
+
+/**
+ * Ask the OS to read ahead the bodies of a batch of documents, merging
+ * nearby bodies into one range.
+ */
+static void readAheadBodies(std::vector<DocInfoCopy> &docs,
+                            CouchReadAhead &readAhead) {
+    std::vector<DocInfoCopy *> sorted;
+    sorted.reserve(docs.size());
+    std::vector<DocInfoCopy>::iterator dit = docs.begin();
+    for (; dit != docs.end(); ++dit) {
+        if (!dit->info.deleted && dit->info.size > 0) {
+            sorted.push_back(&*dit);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), compareByBodyOffset);
+
+    std::vector<DocInfoCopy *>::iterator it = sorted.begin();
+    while (it != sorted.end()) {
+        uint64_t start = (*it)->info.bp;
+        uint64_t end = start + bodyDiskSpan((*it)->info.size);
+        for (++it; it != sorted.end(); ++it) {
+            uint64_t bp = (*it)->info.bp;
+            uint64_t bpEnd = bp + bodyDiskSpan((*it)->info.size);
+            if (bp > end + SCAN_READ_AHEAD_GAP ||
+                std::max(end, bpEnd) - start > SCAN_READ_AHEAD_MAX) {
+                break;
+            }
+            end = std::max(end, bpEnd);
+        }
+        readAhead.willNeed(start, end - start);
+    }
+}
+
 struct StatResponseCtx {
 public:
     StatResponseCtx(std::map<std::pair<uint16_t, uint16_t>, vbucket_state> &sm,
@@ -294,10 +450,12 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev,
 
 CouchKVStore::CouchKVStore(Configuration &config, bool read_only) :
     KVStore(read_only), configuration(config),
-    dbname(configuration.getDbname()), intransaction(false)
+    dbname(configuration.getDbname()), intransaction(false),
+    uring(NULL), fileOpsContext(&st.fsStats), syncGroup(&st.fsStats),
+    groupFileOpsContext(&st.fsStats)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    initFileOps();
 
     // init db file map with default revision number, 1
     numDbFiles = static_cast<uint16_t>(configuration.getMaxVbuckets());
@@ -316,10 +474,35 @@ CouchKVStore::CouchKVStore(Configuration &config, bool read_only) :
 CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     KVStore(copyFrom), configuration(copyFrom.configuration),
     dbname(copyFrom.dbname), dbFileRevMap(copyFrom.dbFileRevMap),
-    numDbFiles(copyFrom.numDbFiles), intransaction(false)
+    numDbFiles(copyFrom.numDbFiles), intransaction(false),
+    uring(NULL), fileOpsContext(&st.fsStats), syncGroup(&st.fsStats),
+    groupFileOpsContext(&st.fsStats)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    initFileOps();
+}
+
+void CouchKVStore::initFileOps() {
+    // Only writes are queued on the ring, so readers gain nothing from it
+    if (!isReadOnly() && configuration.isCouchstoreIoUringEnabled()) {
+        // One ring for all the files of this store, as opening a file
+        // is too frequent to set up a ring each time
+        uring = createCouchstoreUring(
+                                   configuration.getCouchstoreIoUringDepth());
+        if (uring) {
+            uringFileOps = getCouchstoreUringOps(uring);
+            fileOpsContext.base = &uringFileOps;
+            fileOpsContext.drain = couchstoreUringDrain;
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "io_uring is not available, "
+                "couchstore files will be written synchronously");
+        }
+    }
+    statCollectingFileOps = getCouchstoreStatsOps(&fileOpsContext);
+
+    groupFileOpsContext = fileOpsContext;
+    groupFileOpsContext.group = &syncGroup;
+    groupSyncFileOps = getCouchstoreStatsOps(&groupFileOpsContext);
 }
 
 void CouchKVStore::initialize() {
@@ -356,6 +539,7 @@ void CouchKVStore::initialize() {
 
 CouchKVStore::~CouchKVStore() {
     close();
+    destroyCouchstoreUring(uring);
 
     for (std::vector<vbucket_state *>::iterator it = cachedVBStates.begin();
          it != cachedVBStates.end(); it++) {
@@ -485,9 +669,16 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
     int numItems = itms.size();
     uint64_t fileRev = dbFileRevMap[vb];
 
+    // Private file ops, as the read plan is only for this thread's reads
+    CouchReadPlan plan;
+    CouchFileOpsContext readContext(fileOpsContext);
+    readContext.readPlan = &plan;
+    couch_file_ops readOps = getCouchstoreStatsOps(&readContext);
+
     Db *db = NULL;
     couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+                                        COUCHSTORE_OPEN_FLAG_RDONLY, NULL,
+                                        &readOps);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Warning: failed to open database for data fetch, "
@@ -518,7 +709,24 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
 
     errCode = couchstore_docinfos_by_id(db, ids, itms.size(),
                                         0, getMultiCbC, &ctx);
-    if (errCode != COUCHSTORE_SUCCESS) {
+    if (errCode == COUCHSTORE_SUCCESS && !ctx.deferred.empty()) {
+        std::vector<DeferredBGFetch *> sorted;
+        sorted.reserve(ctx.deferred.size());
+        std::list<DeferredBGFetch>::iterator it = ctx.deferred.begin();
+        for (; it != ctx.deferred.end(); ++it) {
+            sorted.push_back(&*it);
+        }
+        std::sort(sorted.begin(), sorted.end(), compareByBodyOffset);
+        planBGFetchReads(sorted, plan);
+
+        std::vector<DeferredBGFetch *>::iterator sit = sorted.begin();
+        for (; sit != sorted.end(); ++sit) {
+            getMultiItem(db, (*sit)->getDocInfo(), vb, *(*sit)->fetches,
+                         false);
+        }
+        st.bgFetchCoalescedReads.fetch_add(plan.coalescedReads);
+        st.bgFetchCoalescedRuns.fetch_add(plan.runs);
+    } else if (errCode != COUCHSTORE_SUCCESS) {
         st.numGetFailure.fetch_add(numItems);
         for (itr = itms.begin(); itr != itms.end(); ++itr) {
             LOG(EXTENSION_LOG_WARNING, "Warning: failed to read database by"
@@ -1085,6 +1293,18 @@ bool CouchKVStore::commit(Callback<kvstats_ctx> *cb, uint64_t snapStartSeqno,
     return !intransaction;
 }
 
+bool CouchKVStore::endSyncGroup() {
+    cb_assert(!isReadOnly());
+    couchstore_error_t errCode = syncGroup.end();
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to sync the files of a group commit, error=%s",
+            couchstore_strerror(errCode));
+        return false;
+    }
+    return true;
+}
+
 uint64_t CouchKVStore::getLastPersistedSeqno(uint16_t vbid) {
     vbucket_state *state = cachedVBStates[vbid];
     if (state) {
@@ -1121,6 +1341,14 @@ void CouchKVStore::addStats(const std::string &prefix,
     addStat(prefix_str, "io_num_write", st.io_num_write, add_stat, c);
     addStat(prefix_str, "io_read_bytes", st.io_read_bytes, add_stat, c);
     addStat(prefix_str, "io_write_bytes", st.io_write_bytes, add_stat, c);
+    addStat(prefix_str, "bg_fetch_coalesced_reads", st.bgFetchCoalescedReads,
+            add_stat, c);
+    addStat(prefix_str, "bg_fetch_coalesced_runs", st.bgFetchCoalescedRuns,
+            add_stat, c);
+    addStat(prefix_str, "scan_read_ahead_bytes", st.scanReadAheadBytes,
+            add_stat, c);
+    addStat(prefix_str, "scan_read_ahead_ranges", st.scanReadAheadRanges,
+            add_stat, c);
 
 }
 
@@ -1195,16 +1423,19 @@ ScanContext* CouchKVStore::initScanContext(shared_ptr<Callback<GetValue> > cb,
                                            uint16_t vbid, uint64_t startSeqno,
                                            bool keysOnly, bool noDeletes,
                                            bool deletesOnly) {
-    Db *db = NULL;
+    CouchScan *scan = new CouchScan(fileOpsContext);
     uint64_t rev = dbFileRevMap[vbid];
-    couchstore_error_t errorCode = openDB(vbid, rev, &db,
-                                          COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errorCode = openDB(vbid, rev, &scan->db,
+                                          COUCHSTORE_OPEN_FLAG_RDONLY, NULL,
+                                          &scan->ops);
     if (errorCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING, "Failed to open database, "
             "name=%s/%d.couch.%lu", dbname.c_str(), vbid, rev);
         remVBucketFromDbFileMap(vbid);
+        delete scan;
         return NULL;
     }
+    Db *db = scan->db;
 
     DbInfo info;
     errorCode = couchstore_db_info(db, &info);
@@ -1214,10 +1445,14 @@ ScanContext* CouchKVStore::initScanContext(shared_ptr<Callback<GetValue> > cb,
         abort();
     }
 
+    if (!keysOnly && configuration.getCouchstoreScanReadAhead() > 0) {
+        scan->readAhead.sequential();
+    }
+
     size_t backfillId = backfillCounter++;
 
     LockHolder lh(backfillLock);
-    backfills[backfillId] = db;
+    backfills[backfillId] = scan;
 
     return new ScanContext(cb, cl, vbid, backfillId, startSeqno,
                            info.last_sequence, keysOnly, noDeletes,
@@ -1234,12 +1469,13 @@ scan_error_t CouchKVStore::scan(ScanContext* ctx) {
     }
 
     LockHolder lh(backfillLock);
-    std::map<size_t, Db*>::iterator itr = backfills.find(ctx->scanId);
+    std::map<size_t, CouchScan*>::iterator itr = backfills.find(ctx->scanId);
     if (itr == backfills.end()) {
         return scan_failed;
     }
 
-    Db* db = itr->second;
+    CouchScan* scan = itr->second;
+    Db* db = scan->db;
     lh.unlock();
 
     couchstore_docinfos_options options;
@@ -1257,8 +1493,13 @@ scan_error_t CouchKVStore::scan(ScanContext* ctx) {
     }
 
     couchstore_error_t errorCode;
-    errorCode = couchstore_changes_since(db, start, options, recordDbDumpC,
-                                         static_cast<void*>(ctx));
+    size_t readAheadDocs = configuration.getCouchstoreScanReadAhead();
+    if (readAheadDocs > 0 && !ctx->onlyKeys) {
+        errorCode = scanReadingAhead(scan, ctx, start, options, readAheadDocs);
+    } else {
+        errorCode = couchstore_changes_since(db, start, options, recordDbDumpC,
+                                             static_cast<void*>(ctx));
+    }
     if (errorCode != COUCHSTORE_SUCCESS) {
         if (errorCode == COUCHSTORE_ERROR_CANCEL) {
             return scan_again;
@@ -1280,14 +1521,56 @@ void CouchKVStore::destroyScanContext(ScanContext* ctx) {
     }
 
     LockHolder lh(backfillLock);
-    std::map<size_t, Db*>::iterator itr = backfills.find(ctx->scanId);
+    std::map<size_t, CouchScan*>::iterator itr = backfills.find(ctx->scanId);
     if (itr != backfills.end()) {
-        closeDatabaseHandle(itr->second);
+        closeDatabaseHandle(itr->second->db);
+        delete itr->second;
         backfills.erase(itr);
     }
     delete ctx;
 }
 
+couchstore_error_t CouchKVStore::scanReadingAhead(CouchScan *scan,
+                                                  ScanContext *ctx,
+                                                  uint64_t start,
+                                                  couchstore_docinfos_options options,
+                                                  size_t batchSize) {
+    ScanBatchCtx batch(batchSize);
+    do {
+        batch.docs.clear();
+        batch.full = false;
+        couchstore_error_t errorCode;
+        errorCode = couchstore_changes_since(scan->db, start, options,
+                                             collectDocInfoC,
+                                             static_cast<void*>(&batch));
+        if (errorCode != COUCHSTORE_SUCCESS &&
+            !(errorCode == COUCHSTORE_ERROR_CANCEL && batch.full)) {
+            return errorCode;
+        }
+
+        readAheadBodies(batch.docs, scan->readAhead);
+        st.scanReadAheadBytes.fetch_add(scan->readAhead.advisedBytes);
+        st.scanReadAheadRanges.fetch_add(scan->readAhead.advisedRanges);
+        scan->readAhead.advisedBytes = 0;
+        scan->readAhead.advisedRanges = 0;
+
+        std::vector<DocInfoCopy>::iterator it = batch.docs.begin();
+        for (; it != batch.docs.end(); ++it) {
+            int rv = recordDbDump(scan->db, it->getDocInfo(),
+                                  static_cast<void*>(ctx));
+            if (rv != COUCHSTORE_SUCCESS) {
+                return static_cast<couchstore_error_t>(rv);
+            }
+        }
+
+        if (!batch.docs.empty()) {
+            start = batch.docs.back().info.db_seq + 1;
+        }
+    } while (batch.full);
+
+    return COUCHSTORE_SUCCESS;
+}
+
 void CouchKVStore::open() {
     // TODO intransaction, is it needed?
     intransaction = false;
@@ -1362,9 +1645,12 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
                                         uint64_t fileRev,
                                         Db **db,
                                         uint64_t options,
-                                        uint64_t *newFileRev) {
+                                        uint64_t *newFileRev,
+                                        couch_file_ops *ops) {
     std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
-    couch_file_ops* ops = &statCollectingFileOps;
+    if (!ops) {
+        ops = &statCollectingFileOps;
+    }
 
     uint64_t newRevNum = fileRev;
     couchstore_error_t errorCode = COUCHSTORE_SUCCESS;
@@ -1786,7 +2072,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
 
     Db *db = NULL;
     uint64_t newFileRev;
-    errCode = openDB(vbid, fileRev, &db, 0, &newFileRev);
+    errCode = openDB(vbid, fileRev, &db, 0, &newFileRev, &groupSyncFileOps);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
                 "Warning: failed to open database, vbucketId = %d "
@@ -2088,8 +2374,6 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx) {
     std::string keyStr(docinfo->id.buf, docinfo->id.size);
     cb_assert(ctx);
     GetMultiCbCtx *cbCtx = static_cast<GetMultiCbCtx *>(ctx);
-    CouchKVStoreStats &st = cbCtx->cks.getCKVStoreStat();
-
 
     vb_bgfetch_queue_t::iterator qitr = cbCtx->fetches.find(keyStr);
     if (qitr == cbCtx->fetches.end()) {
@@ -2112,20 +2396,34 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx) {
         }
     }
 
+    if (meta_only) {
+        cbCtx->cks.getMultiItem(db, docinfo, cbCtx->vbId, fetches, true);
+    } else {
+        // Read once the batch can be read in file order
+        cbCtx->deferred.push_back(DeferredBGFetch(docinfo, &fetches));
+    }
+    return 0;
+}
+
+void CouchKVStore::getMultiItem(Db *db, DocInfo *docinfo, uint16_t vbId,
+                                std::list<VBucketBGFetchItem *> &fetches,
+                                bool metaOnly) {
     GetValue returnVal;
 
-    couchstore_error_t errCode = cbCtx->cks.fetchDoc(db, docinfo, returnVal,
-                                                     cbCtx->vbId, meta_only);
-    if (errCode != COUCHSTORE_SUCCESS && !meta_only) {
+    couchstore_error_t errCode = fetchDoc(db, docinfo, returnVal, vbId,
+                                          metaOnly);
+    if (errCode != COUCHSTORE_SUCCESS && !metaOnly) {
         LOG(EXTENSION_LOG_WARNING, "Warning: failed to fetch data from database, "
-            "vBucket=%d key=%s error=%s [%s]", cbCtx->vbId,
-            keyStr.c_str(), couchstore_strerror(errCode),
+            "vBucket=%d key=%.*s error=%s [%s]", vbId,
+            (int)docinfo->id.size, docinfo->id.buf,
+            couchstore_strerror(errCode),
             couchkvstore_strerrno(db, errCode).c_str());
         st.numGetFailure++;
     }
 
-    returnVal.setStatus(cbCtx->cks.couchErr2EngineErr(errCode));
-    for (itr = fetches.begin(); itr != fetches.end(); ++itr) {
+    returnVal.setStatus(couchErr2EngineErr(errCode));
+    std::list<VBucketBGFetchItem *>::iterator itr = fetches.begin();
+    for (; itr != fetches.end(); ++itr) {
         // populate return value for remaining fetch items with the
         // same seqid
         (*itr)->value = returnVal;
@@ -2135,7 +2433,6 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx) {
                                  returnVal.getValue()->getNBytes());
         }
     }
-    return 0;
 }
 
 
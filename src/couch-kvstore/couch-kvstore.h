@@ -49,6 +49,8 @@ public:
       numLoadedVb(0), numGetFailure(0), numSetFailure(0),
       numDelFailure(0), numOpenFailure(0), numVbSetFailure(0),
       io_num_read(0), io_num_write(0), io_read_bytes(0), io_write_bytes(0),
+      bgFetchCoalescedReads(0), bgFetchCoalescedRuns(0),
+      scanReadAheadBytes(0), scanReadAheadRanges(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
       writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
     }
@@ -63,6 +65,10 @@ public:
         numDelFailure.store(0);
         numOpenFailure.store(0);
         numVbSetFailure.store(0);
+        bgFetchCoalescedReads.store(0);
+        bgFetchCoalescedRuns.store(0);
+        scanReadAheadBytes.store(0);
+        scanReadAheadRanges.store(0);
 
         readTimeHisto.reset();
         readSizeHisto.reset();
@@ -100,6 +106,14 @@ public:
     AtomicValue<size_t> io_read_bytes;
     //! Number of bytes written
     AtomicValue<size_t> io_write_bytes;
+    //! Number of file reads saved by merging nearby BG fetch reads
+    AtomicValue<size_t> bgFetchCoalescedReads;
+    //! Number of merged BG fetch reads issued
+    AtomicValue<size_t> bgFetchCoalescedRuns;
+    //! Number of bytes scans asked the OS to read ahead
+    AtomicValue<size_t> scanReadAheadBytes;
+    //! Number of ranges scans asked the OS to read ahead
+    AtomicValue<size_t> scanReadAheadRanges;
 
     /* for flush and vb delete, no error handling in CouchKVStore, such
      * failure should be tracked in MC-engine  */
@@ -128,6 +142,8 @@ public:
 };
 
 class EventuallyPersistentEngine;
+struct CouchScan;
+struct CouchstoreUring;
 
 typedef union {
     Callback <mutation_result> *setCb;
@@ -330,6 +346,13 @@ public:
         }
     }
 
+    void beginSyncGroup(void) {
+        cb_assert(!isReadOnly());
+        syncGroup.begin();
+    }
+
+    bool endSyncGroup(void);
+
     /**
      * Query the properties of the underlying storage.
      *
@@ -523,6 +546,9 @@ public:
     static int recordDbDump(Db *db, DocInfo *docinfo, void *ctx);
     static int recordDbStat(Db *db, DocInfo *docinfo, void *ctx);
     static int getMultiCb(Db *db, DocInfo *docinfo, void *ctx);
+    void getMultiItem(Db *db, DocInfo *docinfo, uint16_t vbId,
+                      std::list<VBucketBGFetchItem *> &fetches,
+                      bool metaOnly);
     void readVBState(Db *db, uint16_t vbId);
 
     couchstore_error_t fetchDoc(Db *db, DocInfo *docinfo,
@@ -567,6 +593,7 @@ private:
 
     void open();
     void close();
+    void initFileOps();
     bool commit2couchstore(Callback<kvstats_ctx> *cb, uint64_t snapStartSeqno,
                            uint64_t snapEndSeqno, uint64_t maxCas,
                            uint64_t driftCounter);
@@ -577,10 +604,21 @@ private:
     void remVBucketFromDbFileMap(uint16_t vbucketId);
     void updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev);
     couchstore_error_t openDB(uint16_t vbucketId, uint64_t fileRev, Db **db,
-                              uint64_t options, uint64_t *newFileRev = NULL);
+                              uint64_t options, uint64_t *newFileRev = NULL,
+                              couch_file_ops *ops = NULL);
     couchstore_error_t openDB_retry(std::string &dbfile, uint64_t options,
                                     const couch_file_ops *ops,
                                     Db **db, uint64_t *newFileRev);
+
+    /**
+     * Scan the changes in batches: read the by-seqno index entries of the
+     * next batchSize documents, ask the OS to read their bodies ahead, then
+     * hand the documents to the scan in seqno order.
+     */
+    couchstore_error_t scanReadingAhead(CouchScan *scan, ScanContext *ctx,
+                                        uint64_t start,
+                                        couchstore_docinfos_options options,
+                                        size_t batchSize);
     couchstore_error_t saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
                                 DocInfo **docinfos, size_t docCount,
                                 kvstats_ctx &kvctx,
@@ -622,7 +660,15 @@ private:
 
     /* all stats */
     CouchKVStoreStats   st;
+    /* file ops doing the I/O under the stats collecting ones */
+    CouchstoreUring *uring;
+    couch_file_ops uringFileOps;
+    CouchFileOpsContext fileOpsContext;
     couch_file_ops statCollectingFileOps;
+    /* syncs held back by a group commit */
+    CouchSyncGroup syncGroup;
+    CouchFileOpsContext groupFileOpsContext;
+    couch_file_ops groupSyncFileOps;
     /* vbucket state cache*/
     std::vector<vbucket_state *> cachedVBStates;
     /* deleted docs in each file*/
@@ -633,7 +679,7 @@ private:
     AtomicQueue<std::string> pendingFileDeletions;
 
     AtomicValue<size_t> backfillCounter;
-    std::map<size_t, Db*> backfills;
+    std::map<size_t, CouchScan*> backfills;
     Mutex backfillLock;
 };
 
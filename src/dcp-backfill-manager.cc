@@ -75,6 +75,10 @@ BackfillManager::BackfillManager(EventuallyPersistentEngine* e, connection_t c)
     scanBuffer.maxBytes = config.getDcpScanByteLimit();
     scanBuffer.maxItems = config.getDcpScanItemLimit();
 
+    scanStats.runs.store(0);
+    scanStats.bytes.store(0);
+    scanStats.time.store(0);
+
     buffer.bytesRead = 0;
     buffer.maxBytes = config.getDcpBackfillByteLimit();
     buffer.nextReadSize = 0;
@@ -104,7 +108,7 @@ BackfillManager::~BackfillManager() {
 
 void BackfillManager::schedule(stream_t stream, uint64_t start, uint64_t end) {
     LockHolder lh(lock);
-    activeBackfills.push(new DCPBackfill(engine, stream, start, end));
+    activeBackfills.push(new DCPBackfill(engine, conn, stream, start, end));
 
     if (managerTask) {
         managerTask->snooze(0);
@@ -143,6 +147,18 @@ bool BackfillManager::bytesRead(uint32_t bytes) {
     return true;
 }
 
+bool BackfillManager::sharedBytesRead(uint32_t bytes) {
+    LockHolder lh(lock);
+    if (buffer.bytesRead == 0 || buffer.bytesRead + bytes <= buffer.maxBytes) {
+        buffer.bytesRead += bytes;
+        return true;
+    }
+
+    buffer.full = true;
+    buffer.nextReadSize = bytes;
+    return false;
+}
+
 void BackfillManager::bytesSent(uint32_t bytes) {
     LockHolder lh(lock);
     cb_assert(buffer.bytesRead >= bytes);
@@ -200,14 +216,23 @@ backfill_status_t BackfillManager::backfill() {
     DCPBackfill* backfill = activeBackfills.front();
 
     lh.unlock();
+    hrtime_t start = gethrtime();
     backfill_status_t status = backfill->run();
+    hrtime_t spent = gethrtime() - start;
     lh.lock();
 
+    scanStats.time.fetch_add(spent);
+
     if (status == backfill_success && buffer.full) {
         // Snooze while the buffer is full
         return backfill_snooze;
     }
 
+    if (scanBuffer.itemsRead > 0) {
+        scanStats.runs++;
+        scanStats.bytes.fetch_add(scanBuffer.bytesRead);
+    }
+
     scanBuffer.bytesRead = 0;
     scanBuffer.itemsRead = 0;
 
@@ -220,13 +245,20 @@ backfill_status_t BackfillManager::backfill() {
     } else if (status == backfill_snooze) {
         uint16_t vbid = backfill->getVBucketId();
         RCPtr<VBucket> vb = engine->getVBucket(vbid);
-        if (vb) {
+        if (vb && backfill->isWakePending()) {
+            // The shared scan woke it up while it was running
+            activeBackfills.push(backfill);
+        } else if (vb) {
             snoozingBackfills.push_back(
                                 std::make_pair(ep_current_time(), backfill));
-            shared_ptr<Callback<uint64_t> >
-                                cb(new BackfillCallback(backfill->getEndSeqno(),
-                                                        vbid, conn));
-            vb->addPersistenceNotification(cb);
+            // A backfill sharing the scan of another stream is woken up by
+            // that scan rather than by persistence
+            if (!backfill->isSharing()) {
+                shared_ptr<Callback<uint64_t> >
+                            cb(new BackfillCallback(backfill->getEndSeqno(),
+                                                    vbid, conn));
+                vb->addPersistenceNotification(cb);
+            }
         } else {
             lh.unlock();
             LOG(EXTENSION_LOG_WARNING, "Deleting the backfill, as vbucket %d "
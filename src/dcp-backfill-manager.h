@@ -37,6 +37,10 @@ public:
 
     bool bytesRead(uint32_t bytes);
 
+    //! Account for an item that the shared scan of another connection read
+    //! for a stream of this connection.
+    bool sharedBytesRead(uint32_t bytes);
+
     void bytesSent(uint32_t bytes);
 
     backfill_status_t backfill();
@@ -44,6 +48,19 @@ public:
     void wakeUpTask();
     void wakeUpSnoozingBackfills(uint16_t vbid);
 
+    size_t getScanRuns() {
+        return scanStats.runs;
+    }
+
+    uint64_t getScanBytes() {
+        return scanStats.bytes;
+    }
+
+    //! Time spent in the scan runs, in microseconds
+    uint64_t getScanTime() {
+        return scanStats.time / 1000;
+    }
+
 private:
 
     bool addIfLessThanMax(AtomicValue<uint32_t>& val, uint32_t incr,
@@ -64,6 +81,15 @@ private:
         uint32_t maxItems;
     } scanBuffer;
 
+    //! The scan runs that read items; each reads up to the scan buffer.
+    //! The time covers every run of the backfills, including the ones
+    //! that end up snoozing.
+    struct {
+        AtomicValue<size_t> runs;
+        AtomicValue<uint64_t> bytes;
+        AtomicValue<uint64_t> time;
+    } scanStats;
+
     //! The buffer is the total bytes used by all backfills for this connection
     struct {
         uint32_t bytesRead;
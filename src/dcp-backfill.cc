@@ -17,9 +17,11 @@
 
 #include "config.h"
 
+#include "ep_engine.h"
 #include "dcp-backfill.h"
+#include "dcp-backfill-manager.h"
+#include "dcp-producer.h"
 #include "dcp-stream.h"
-#include "ep_engine.h"
 
 static const char* backfillStateToString(backfill_state_t state) {
     switch (state) {
@@ -27,6 +29,8 @@ static const char* backfillStateToString(backfill_state_t state) {
             return "initalizing";
         case backfill_state_scanning:
             return "scanning";
+        case backfill_state_sharing:
+            return "sharing";
         case backfill_state_completing:
             return "completing";
         case backfill_state_done:
@@ -36,9 +40,124 @@ static const char* backfillStateToString(backfill_state_t state) {
     }
 }
 
-CacheCallback::CacheCallback(EventuallyPersistentEngine* e, stream_t &s)
-    : engine_(e), stream_(s) {
-    cb_assert(stream_.get() && stream_.get()->getType() == STREAM_ACTIVE);
+bool SharedBackfillScan::subscribe(subscription_t sub, uint64_t end_seqno) {
+    LockHolder lh(lock);
+    if (!open || sub->startSeqno < startSeqno || sub->startSeqno <= readSeqno ||
+        end_seqno > endSeqno) {
+        return false;
+    }
+
+    // Mark the snapshot before the scan can hand the stream any item
+    sub->snapEndSeqno = endSeqno;
+    ActiveStream* as = static_cast<ActiveStream*>(sub->stream.get());
+    as->markDiskSnapshot(sub->startSeqno, endSeqno);
+    subscribers.push_back(sub);
+    return true;
+}
+
+bool SharedBackfillScan::itemRead(Item* itm, backfill_source_t source) {
+    uint64_t seqno = itm->getBySeqno();
+
+    LockHolder lh(lock);
+    if (seqno > endSeqno) {
+        // Read past the snapshot sent to the stream
+        delete itm;
+        return true;
+    }
+
+    // The owning stream may compress or send the item as soon as it is
+    // queued, so the subscribers get a copy taken before.
+    Item* copy = NULL;
+    if (!subscribers.empty()) {
+        copy = new Item(*itm);
+    }
+
+    ActiveStream* as = static_cast<ActiveStream*>(stream.get());
+    if (!as->backfillReceived(itm, source)) {
+        delete copy;
+        return false;
+    }
+
+    readSeqno = seqno;
+    std::list<subscription_t>::iterator it = subscribers.begin();
+    while (it != subscribers.end()) {
+        if ((*it)->state != subscription_following) {
+            it = subscribers.erase(it);
+            continue;
+        }
+        if (seqno >= (*it)->startSeqno) {
+            receivers.push_back(*it);
+        }
+        ++it;
+    }
+    lh.unlock();
+
+    if (copy) {
+        fanOut(copy, source);
+    }
+    return true;
+}
+
+void SharedBackfillScan::fanOut(Item* itm, backfill_source_t source) {
+    uint64_t seqno = itm->getBySeqno();
+
+    std::vector<subscription_t>::iterator it = receivers.begin();
+    for (; it != receivers.end(); ++it) {
+        subscription_t &sub = *it;
+        if (seqno <= sub->lastSeqno) {
+            continue;
+        }
+
+        // The last receiver takes the copy made for the subscribers
+        Item* copy = itm;
+        if (it + 1 != receivers.end()) {
+            copy = new Item(*itm);
+        } else {
+            itm = NULL;
+        }
+
+        ActiveStream* as = static_cast<ActiveStream*>(sub->stream.get());
+        if (as->backfillReceived(copy, source, true)) {
+            sub->lastSeqno = seqno;
+        } else {
+            sub->state = subscription_detached;
+            wakeUp(sub);
+        }
+    }
+
+    delete itm;
+    receivers.clear();
+}
+
+void SharedBackfillScan::finish(bool completed) {
+    std::list<subscription_t> subs;
+    {
+        LockHolder lh(lock);
+        open = false;
+        subs.swap(subscribers);
+    }
+
+    std::list<subscription_t>::iterator it = subs.begin();
+    for (; it != subs.end(); ++it) {
+        if ((*it)->state == subscription_following) {
+            (*it)->state = completed ? subscription_finished :
+                                       subscription_detached;
+            wakeUp(*it);
+        }
+    }
+}
+
+void SharedBackfillScan::wakeUp(subscription_t &sub) {
+    // The backfill may not be snoozing yet; it checks the flag when it is
+    sub->wakePending = true;
+    DcpProducer* producer = static_cast<DcpProducer*>(sub->conn.get());
+    producer->getBackfillManager()->wakeUpSnoozingBackfills(
+                                                sub->stream->getVBucket());
+}
+
+CacheCallback::CacheCallback(EventuallyPersistentEngine* e, shared_scan_t &s)
+    : engine_(e), scan_(s) {
+    cb_assert(scan_.get());
 }
 
 void CacheCallback::callback(CacheLookup &lookup) {
@@ -54,8 +173,7 @@ void CacheCallback::callback(CacheLookup &lookup) {
     if (v && v->isResident() && v->getBySeqno() == lookup.getBySeqno()) {
         Item* it = v->toItem(false, lookup.getVBucketId());
         lh.unlock();
-        ActiveStream* as = static_cast<ActiveStream*>(stream_.get());
-        if (!as->backfillReceived(it, BACKFILL_FROM_MEMORY)) {
+        if (!scan_->itemRead(it, BACKFILL_FROM_MEMORY)) {
             setStatus(ENGINE_ENOMEM); // Pause the backfill
         } else {
             setStatus(ENGINE_KEY_EEXISTS);
@@ -65,26 +183,25 @@ void CacheCallback::callback(CacheLookup &lookup) {
     }
 }
 
-DiskCallback::DiskCallback(stream_t &s)
-    : stream_(s) {
-    cb_assert(stream_.get() && stream_.get()->getType() == STREAM_ACTIVE);
+DiskCallback::DiskCallback(shared_scan_t &s)
+    : scan_(s) {
+    cb_assert(scan_.get());
 }
 
 void DiskCallback::callback(GetValue &val) {
     cb_assert(val.getValue());
 
-    ActiveStream* as = static_cast<ActiveStream*>(stream_.get());
-    if (!as->backfillReceived(val.getValue(), BACKFILL_FROM_DISK)) {
+    if (!scan_->itemRead(val.getValue(), BACKFILL_FROM_DISK)) {
         setStatus(ENGINE_ENOMEM); // Pause the backfill
     } else {
         setStatus(ENGINE_SUCCESS);
     }
 }
 
-DCPBackfill::DCPBackfill(EventuallyPersistentEngine* e, stream_t s,
-                         uint64_t start_seqno, uint64_t end_seqno)
-    : engine(e), stream(s),startSeqno(start_seqno), endSeqno(end_seqno),
-      scanCtx(NULL), state(backfill_state_init) {
+DCPBackfill::DCPBackfill(EventuallyPersistentEngine* e, connection_t c,
+                         stream_t s, uint64_t start_seqno, uint64_t end_seqno)
+    : engine(e), conn(c), stream(s),startSeqno(start_seqno),
+      endSeqno(end_seqno), scanCtx(NULL), state(backfill_state_init) {
     cb_assert(stream->getType() == STREAM_ACTIVE);
 }
 
@@ -95,6 +212,8 @@ backfill_status_t DCPBackfill::run() {
             return create();
         case backfill_state_scanning:
             return scan();
+        case backfill_state_sharing:
+            return share();
         case backfill_state_completing:
             return complete(false);
         case backfill_state_done:
@@ -113,6 +232,16 @@ uint64_t DCPBackfill::getEndSeqno() {
     return endSeqno;
 }
 
+bool DCPBackfill::isSharing() {
+    LockHolder lh(lock);
+    return state == backfill_state_sharing;
+}
+
+bool DCPBackfill::isWakePending() {
+    LockHolder lh(lock);
+    return subscription && subscription->wakePending;
+}
+
 void DCPBackfill::cancel() {
     LockHolder lh(lock);
     complete(true);
@@ -138,12 +267,16 @@ backfill_status_t DCPBackfill::create() {
 
     as->incrBackfillRemaining(numItems);
 
-    shared_ptr<Callback<GetValue> > cb(new DiskCallback(stream));
-    shared_ptr<Callback<CacheLookup> > cl(new CacheCallback(engine, stream));
-    scanCtx = kvstore->initScanContext(cb, cl, vbid, startSeqno, false, false,
-                                       false);
-    if (scanCtx) {
+    if (subscribe()) {
+        transitionState(backfill_state_sharing);
+        return backfill_success;
+    }
+
+    if (openScan(startSeqno, std::numeric_limits<uint64_t>::max())) {
         as->markDiskSnapshot(startSeqno, scanCtx->maxSeqno);
+        if (engine->getConfiguration().isDcpEnableSharedBackfill()) {
+            engine->getDcpConnMap().addSharedBackfill(vbid, sharedScan);
+        }
         transitionState(backfill_state_scanning);
     } else {
         transitionState(backfill_state_done);
@@ -152,6 +285,42 @@ backfill_status_t DCPBackfill::create() {
     return backfill_success;
 }
 
+bool DCPBackfill::openScan(uint64_t start, uint64_t end) {
+    uint16_t vbid = stream->getVBucket();
+    KVStore* kvstore = engine->getEpStore()->getROUnderlying(vbid);
+    sharedScan.reset(new SharedBackfillScan(stream, start));
+    shared_ptr<Callback<GetValue> > cb(new DiskCallback(sharedScan));
+    shared_ptr<Callback<CacheLookup> > cl(new CacheCallback(engine,
+                                                            sharedScan));
+    scanCtx = kvstore->initScanContext(cb, cl, vbid, start, false, false,
+                                       false);
+    if (!scanCtx) {
+        sharedScan.reset();
+        return false;
+    }
+
+    sharedScan->setEndSeqno(std::min(end, scanCtx->maxSeqno));
+    return true;
+}
+
+bool DCPBackfill::subscribe() {
+    if (!engine->getConfiguration().isDcpEnableSharedBackfill()) {
+        return false;
+    }
+
+    uint16_t vbid = stream->getVBucket();
+    subscription_t sub(new BackfillSubscription(conn, stream, startSeqno));
+    if (!engine->getDcpConnMap().subscribeSharedBackfill(vbid, sub,
+                                                         endSeqno)) {
+        return false;
+    }
+
+    LOG(EXTENSION_LOG_WARNING, "Backfill task (%llu to %llu) for vb %d "
+        "shares the scan of another stream", startSeqno, endSeqno, vbid);
+    subscription = sub;
+    return true;
+}
+
 backfill_status_t DCPBackfill::scan() {
     uint16_t vbid = stream->getVBucket();
     KVStore* kvstore = engine->getEpStore()->getROUnderlying(vbid);
@@ -166,10 +335,56 @@ backfill_status_t DCPBackfill::scan() {
     return backfill_success;
 }
 
+backfill_status_t DCPBackfill::share() {
+    // Any wakeup sent from here on is for a state read below
+    subscription->wakePending = false;
+    switch (subscription->state.load()) {
+        case subscription_following:
+            return backfill_snooze;
+        case subscription_finished:
+            subscription.reset();
+            transitionState(backfill_state_completing);
+            return backfill_success;
+        case subscription_detached:
+            break;
+    }
+
+    // The stream fell behind the shared scan, or the scan was cancelled.
+    // Finish the snapshot it was sent with a scan of our own.
+    uint64_t resumeSeqno = subscription->lastSeqno + 1;
+    uint64_t snapEndSeqno = subscription->snapEndSeqno;
+    subscription.reset();
+    if (resumeSeqno > snapEndSeqno) {
+        transitionState(backfill_state_completing);
+        return backfill_success;
+    }
+
+    if (openScan(resumeSeqno, snapEndSeqno)) {
+        transitionState(backfill_state_scanning);
+    } else {
+        transitionState(backfill_state_completing);
+    }
+
+    return backfill_success;
+}
+
 backfill_status_t DCPBackfill::complete(bool cancelled) {
     uint16_t vbid = stream->getVBucket();
     KVStore* kvstore = engine->getEpStore()->getROUnderlying(vbid);
     kvstore->destroyScanContext(scanCtx);
+    scanCtx = NULL;
+
+    if (sharedScan) {
+        engine->getDcpConnMap().removeSharedBackfill(vbid, sharedScan);
+        sharedScan->finish(!cancelled);
+        sharedScan.reset();
+    }
+
+    if (subscription) {
+        // Leave the shared scan
+        subscription->state = subscription_finished;
+        subscription.reset();
+    }
 
     ActiveStream* as = static_cast<ActiveStream*>(stream.get());
     as->completeBackfill();
@@ -190,14 +405,20 @@ void DCPBackfill::transitionState(backfill_state_t newState) {
 
     switch (newState) {
         case backfill_state_scanning:
+            cb_assert(state == backfill_state_init ||
+                      state == backfill_state_sharing);
+            break;
+        case backfill_state_sharing:
             cb_assert(state == backfill_state_init);
             break;
         case backfill_state_completing:
-            cb_assert(state == backfill_state_scanning);
+            cb_assert(state == backfill_state_scanning ||
+                      state == backfill_state_sharing);
             break;
         case backfill_state_done:
             cb_assert(state == backfill_state_init ||
                       state == backfill_state_scanning ||
+                      state == backfill_state_sharing ||
                       state == backfill_state_completing);
             break;
         default:
@@ -20,15 +20,22 @@
 
 #include "config.h"
 
+#include "atomic.h"
 #include "callbacks.h"
+#include "connmap.h"
 #include "dcp-stream.h"
 
+#include <limits>
+#include <list>
+#include <vector>
+
 class EventuallyPersistentEngine;
 class ScanContext;
 
 typedef enum {
     backfill_state_init,
     backfill_state_scanning,
+    backfill_state_sharing,
     backfill_state_completing,
     backfill_state_done
 } backfill_state_t;
@@ -39,30 +46,132 @@ typedef enum {
     backfill_snooze
 } backfill_status_t;
 
+typedef enum {
+    subscription_following,
+    subscription_finished,
+    subscription_detached
+} subscription_state_t;
+
+/**
+ * A backfill that takes its items from the scan of another backfill of the
+ * same vbucket instead of scanning the vbucket itself.
+ */
+class BackfillSubscription {
+public:
+    BackfillSubscription(connection_t c, stream_t s, uint64_t start_seqno)
+        : conn(c), stream(s), startSeqno(start_seqno),
+          snapEndSeqno(0), lastSeqno(start_seqno - 1),
+          state(subscription_following), wakePending(false) {}
+
+    const connection_t conn;
+    const stream_t stream;
+    const uint64_t startSeqno;
+    //! The end of the disk snapshot sent to the subscriber's stream
+    uint64_t snapEndSeqno;
+    //! The last seqno the scan handed to the subscriber
+    AtomicValue<uint64_t> lastSeqno;
+    AtomicValue<subscription_state_t> state;
+    //! Set when the scan wakes the subscriber up, until its backfill runs
+    AtomicValue<bool> wakePending;
+};
+
+typedef shared_ptr<BackfillSubscription> subscription_t;
+
+/**
+ * The items read by the scan of a backfill, up to the end of the snapshot
+ * its stream was sent. Backfills of other streams of the vbucket that start
+ * ahead of the scan subscribe to it, and every item is fanned out to each
+ * of them once the stream that owns the scan accepted it.
+ *
+ * A subscriber whose connection buffer is full leaves the scan, so the
+ * slowest connection does not hold back the others, and finishes the
+ * snapshot with a scan of its own.
+ */
+class SharedBackfillScan {
+public:
+    SharedBackfillScan(stream_t s, uint64_t start_seqno)
+        : stream(s), startSeqno(start_seqno),
+          endSeqno(std::numeric_limits<uint64_t>::max()),
+          readSeqno(start_seqno - 1), open(true) {}
+
+    //! Limit the scan to the snapshot sent to the owning stream
+    void setEndSeqno(uint64_t seqno) {
+        LockHolder lh(lock);
+        endSeqno = seqno;
+    }
+
+    uint64_t getEndSeqno() {
+        LockHolder lh(lock);
+        return endSeqno;
+    }
+
+    /**
+     * Subscribe a backfill that wants the items from the subscription's
+     * start seqno up to the given end seqno, and send its stream the disk
+     * snapshot the scan reads.
+     * @return false if the scan already read past the start seqno or
+     *         does not read up to the end seqno
+     */
+    bool subscribe(subscription_t sub, uint64_t end_seqno);
+
+    /**
+     * Hand an item read by the scan to the owning stream and the
+     * subscribers.
+     * @return false if the owning stream has no room for the item, in
+     *         which case the scan has to pause and read it again
+     */
+    bool itemRead(Item* itm, backfill_source_t source);
+
+    /**
+     * Close the scan. The subscribers are finished if the scan read every
+     * item, otherwise they carry on with scans of their own.
+     */
+    void finish(bool completed);
+
+private:
+
+    void fanOut(Item* itm, backfill_source_t source);
+
+    static void wakeUp(subscription_t &sub);
+
+    Mutex lock;
+    const stream_t stream;
+    const uint64_t startSeqno;
+    uint64_t endSeqno;
+    //! The last seqno handed to the owning stream
+    uint64_t readSeqno;
+    bool open;
+    std::list<subscription_t> subscribers;
+    //! The subscribers an item is fanned out to, only used by the scan
+    std::vector<subscription_t> receivers;
+};
+
+typedef shared_ptr<SharedBackfillScan> shared_scan_t;
+
 class CacheCallback : public Callback<CacheLookup> {
 public:
-    CacheCallback(EventuallyPersistentEngine* e, stream_t &s);
+    CacheCallback(EventuallyPersistentEngine* e, shared_scan_t &s);
 
     void callback(CacheLookup &lookup);
 
 private:
     EventuallyPersistentEngine* engine_;
-    stream_t stream_;
+    shared_scan_t scan_;
 };
 
 class DiskCallback : public Callback<GetValue> {
 public:
-    DiskCallback(stream_t &s);
+    DiskCallback(shared_scan_t &s);
 
     void callback(GetValue &val);
 
 private:
-    stream_t stream_;
+    shared_scan_t scan_;
 };
 
 class DCPBackfill {
 public:
-    DCPBackfill(EventuallyPersistentEngine* e, stream_t s,
+    DCPBackfill(EventuallyPersistentEngine* e, connection_t c, stream_t s,
                 uint64_t start_seqno, uint64_t end_seqno);
 
     backfill_status_t run();
@@ -71,23 +180,44 @@ public:
 
     uint64_t getEndSeqno();
 
+    //! Whether the backfill waits on the scan of another backfill
+    bool isSharing();
+
+    //! Whether the scan it shares woke it up since it last ran
+    bool isWakePending();
+
     void cancel();
 
 private:
 
     backfill_status_t create();
 
+    bool subscribe();
+
+    /**
+     * Open a scan of the vbucket from the start seqno that hands the
+     * stream the items up to the end seqno, or up to the last seqno on
+     * disk if that comes first.
+     * @return false if the vbucket could not be opened
+     */
+    bool openScan(uint64_t start, uint64_t end);
+
     backfill_status_t scan();
 
+    backfill_status_t share();
+
     backfill_status_t complete(bool cancelled);
 
     void transitionState(backfill_state_t newState);
 
     EventuallyPersistentEngine *engine;
+    connection_t                conn;
     stream_t                    stream;
     uint64_t                    startSeqno;
     uint64_t                    endSeqno;
     ScanContext*                scanCtx;
+    shared_scan_t               sharedScan;
+    subscription_t              subscription;
     backfill_state_t            state;
     Mutex                       lock;
 };
@@ -82,12 +82,19 @@ DcpConsumer::DcpConsumer(EventuallyPersistentEngine &engine, const void *cookie,
     flowControl.bufferSize = config.getDcpConnBufferSize();
     flowControl.maxUnackedBytes = config.getDcpMaxUnackedBytes();
 
+    processBatchMax = config.getDcpConsumerProcessBatchMax();
+    processTimeLimit = config.getDcpConsumerProcessTimeLimit() * 1000;
+    processNextVb = 0;
+
     noopInterval = config.getDcpNoopInterval();
     enableNoop = config.isDcpEnableNoop();
     sendNoopInterval = config.isDcpEnableNoop();
 
     setPriority = true;
     enableExtMetaData = true;
+    enableValueCompression = config.isDcpEnableValueCompression();
+    inflateValues = enableValueCompression &&
+                    config.isDcpConsumerInflateValues();
 
     ExTask task = new Processer(&engine, this, Priority::PendingOpsPriority, 1);
     processTaskId = ExecutorPool::get()->schedule(task, NONIO_TASK_IDX);
@@ -418,6 +425,13 @@ ENGINE_ERROR_CODE DcpConsumer::step(struct dcp_message_producers* producers) {
         return ret;
     }
 
+    if ((ret = handleValueCompression(producers)) != ENGINE_FAILED) {
+        if (ret == ENGINE_SUCCESS) {
+            ret = ENGINE_WANT_MORE;
+        }
+        return ret;
+    }
+
     DcpResponse *resp = getNextItem();
     if (resp == NULL) {
         return ENGINE_SUCCESS;
@@ -583,6 +597,7 @@ void DcpConsumer::addStats(ADD_STAT add_stat, const void *c) {
     }
 
     addStat("total_backoffs", backoffs, add_stat, c);
+    addStat("process_batch_limit", getProcessBatchLimit(), add_stat, c);
     if (flowControl.enabled) {
         addStat("total_acked_bytes", flowControl.ackedBytes, add_stat, c);
     }
@@ -592,12 +607,35 @@ void DcpConsumer::aggregateQueueStats(ConnCounter* aggregator) {
     aggregator->conn_queueBackoff += backoffs;
 }
 
+size_t DcpConsumer::getProcessBatchLimit() {
+    EPStats &stats = engine_.getEpStats();
+    double memUsed = static_cast<double>(stats.getTotalMemoryUsed());
+    double lowWat = static_cast<double>(stats.mem_low_wat);
+    double highWat = static_cast<double>(stats.mem_high_wat);
+
+    if (memUsed <= lowWat) {
+        return processBatchMax;
+    } else if (memUsed >= highWat) {
+        return PassiveStream::minBatchSize;
+    }
+
+    double headroom = (highWat - memUsed) / (highWat - lowWat);
+    size_t limit = static_cast<size_t>(processBatchMax * headroom);
+    return std::max(limit, PassiveStream::minBatchSize);
+}
+
 process_items_error_t DcpConsumer::processBufferedItems() {
     itemsToProcess.store(false);
     process_items_error_t process_ret = all_processed;
 
+    hrtime_t deadline = gethrtime() + processTimeLimit;
+    size_t batchLimit = getProcessBatchLimit();
+
+    // Pick up from the vbucket the previous run ran out of time on, so that
+    // the streams of the later vbuckets aren't starved by the earlier ones
     int max_vbuckets = engine_.getConfiguration().getMaxVbuckets();
-    for (int vbucket = 0; vbucket < max_vbuckets; vbucket++) {
+    for (int i = 0; i < max_vbuckets; i++) {
+        int vbucket = (processNextVb + i) % max_vbuckets;
 
         passive_stream_t stream = streams[vbucket];
         if (!stream) {
@@ -609,12 +647,20 @@ process_items_error_t DcpConsumer::processBufferedItems() {
         do {
             if (!engine_.getTapThrottle().shouldProcess()) {
                 backoffs++;
+                processNextVb = vbucket;
                 return cannot_process;
             }
 
             bytes_processed = 0;
-            process_ret = stream->processBufferedMessages(bytes_processed);
+            process_ret = stream->processBufferedMessages(bytes_processed,
+                                                          batchLimit);
             flowControl.freedBytes.fetch_add(bytes_processed);
+
+            if (bytes_processed > 0 && process_ret != cannot_process &&
+                gethrtime() >= deadline) {
+                processNextVb = vbucket;
+                return more_to_process;
+            }
         } while (bytes_processed > 0 && process_ret != cannot_process);
     }
 
@@ -831,3 +877,18 @@ ENGINE_ERROR_CODE DcpConsumer::handleExtMetaData(struct dcp_message_producers* p
 
     return ENGINE_FAILED;
 }
+
+ENGINE_ERROR_CODE DcpConsumer::handleValueCompression(struct dcp_message_producers* producers) {
+    if (enableValueCompression) {
+        ENGINE_ERROR_CODE ret;
+        uint32_t opaque = ++opaqueCounter;
+        EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
+        ret = producers->control(getCookie(), opaque,
+                                 "enable_value_compression", 24, "true", 4);
+        ObjectRegistry::onSwitchThread(epe);
+        enableValueCompression = false;
+        return ret;
+    }
+
+    return ENGINE_FAILED;
+}
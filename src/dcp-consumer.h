@@ -90,10 +90,26 @@ public:
 
     process_items_error_t processBufferedItems();
 
+    /**
+     * Whether the values the producer compressed for this consumer are
+     * inflated before being stored.
+     */
+    bool isValueInflationEnabled() {
+        return inflateValues;
+    }
+
 private:
 
     DcpResponse* getNextItem();
 
+    /**
+     * The most buffered messages a stream may apply in one batch. This is
+     * dcp_consumer_process_batch_max while memory usage is below the low
+     * watermark and shrinks towards PassiveStream::minBatchSize as memory
+     * usage approaches the high watermark.
+     */
+    size_t getProcessBatchLimit();
+
     /**
      * Check if the provided opaque id is one of the
      * current open "session" id's
@@ -115,6 +131,8 @@ private:
 
     ENGINE_ERROR_CODE handleExtMetaData(struct dcp_message_producers* producers);
 
+    ENGINE_ERROR_CODE handleValueCompression(struct dcp_message_producers* producers);
+
     uint64_t opaqueCounter;
     size_t processTaskId;
     AtomicValue<bool> itemsToProcess;
@@ -124,11 +142,16 @@ private:
     opaque_map opaqueMap_;
     rel_time_t lastNoopTime;
     uint32_t backoffs;
+    size_t processBatchMax;
+    hrtime_t processTimeLimit;
+    uint16_t processNextVb;
     uint32_t noopInterval;
     bool enableNoop;
     bool sendNoopInterval;
     bool setPriority;
     bool enableExtMetaData;
+    bool enableValueCompression;
+    bool inflateValues;
 
     struct FlowControl {
         FlowControl() : enabled(true), pendingControl(true), bufferSize(0),
@@ -26,6 +26,50 @@
 #include "dcp-stream.h"
 
 const uint32_t DcpProducer::defaultNoopInerval = 20;
+const size_t DcpProducer::processorBatchSize = 16;
+
+class ActiveStreamCheckpointProcessorTask : public GlobalTask {
+public:
+    ActiveStreamCheckpointProcessorTask(EventuallyPersistentEngine* e,
+                                        connection_t c, const Priority &p,
+                                        double sleeptime = 1,
+                                        bool shutdown = false)
+        : GlobalTask(e, p, sleeptime, shutdown), conn(c) {}
+
+    bool run();
+
+    std::string getDescription();
+
+private:
+    connection_t conn;
+};
+
+bool ActiveStreamCheckpointProcessorTask::run() {
+    DcpProducer* producer = static_cast<DcpProducer*>(conn.get());
+    if (producer->doDisconnect() || engine->getEpStats().isShutdown) {
+        return false;
+    }
+
+    if (producer->processCheckpoints()) {
+        snooze(0);
+        return true;
+    }
+
+    // Sleep until scheduleCheckpointProcessing() or setDisconnect() wakes
+    // this task. A wakeup that came in while the task was still running is
+    // overridden by the snooze, so check again for what it was sent for.
+    snooze(INT_MAX);
+    if (producer->hasCheckpointsToProcess() || producer->doDisconnect()) {
+        snooze(0);
+    }
+    return true;
+}
+
+std::string ActiveStreamCheckpointProcessorTask::getDescription() {
+    std::stringstream ss;
+    ss << "Processing checkpoint items for " << conn->getName();
+    return ss.str();
+}
 
 void BufferLog::insert(DcpResponse* response) {
     cb_assert(!isFull());
@@ -44,7 +88,7 @@ DcpProducer::DcpProducer(EventuallyPersistentEngine &e, const void *cookie,
                          const std::string &name, bool isNotifier)
     : Producer(e, cookie, name), rejectResp(NULL),
       notifyOnly(isNotifier), lastSendTime(ep_current_time()), log(NULL),
-      itemsSent(0), totalBytesSent(0), ackedBytes(0) {
+      itemsSent(0), totalBytesSent(0), ackedBytes(0), nextProcessorTask(0) {
     setSupportAck(true);
     setReserved(true);
 
@@ -76,7 +120,15 @@ DcpProducer::DcpProducer(EventuallyPersistentEngine &e, const void *cookie,
 
     enableExtMetaData = false;
 
+    enableValueCompression.store(false);
+    compressionBytesIn.store(0);
+    compressionBytesOut.store(0);
+    compressionTime.store(0);
+
     backfillMgr = new BackfillManager(&engine_, this);
+
+    numProcessorTasks = notifyOnly ? 0 :
+        e.getConfiguration().getDcpProducerProcessorTasks();
 }
 
 DcpProducer::~DcpProducer() {
@@ -264,7 +316,7 @@ ENGINE_ERROR_CODE DcpProducer::step(struct dcp_message_producers* producers) {
         }
         case DCP_MUTATION:
         {
-            MutationResponse *m = dynamic_cast<MutationResponse*> (resp);
+            MutationResponse *m = static_cast<MutationResponse*>(resp);
             ExtendedMetaData *emd = NULL;
 
             if (enableExtMetaData) {
@@ -429,6 +481,13 @@ ENGINE_ERROR_CODE DcpProducer::control(uint32_t opaque, const void* key,
             enableExtMetaData = false;
         }
         return ENGINE_SUCCESS;
+    } else if (strncmp(param, "enable_value_compression", nkey) == 0) {
+        if (valueStr.compare("true") == 0) {
+            enableValueCompression.store(true);
+        } else {
+            enableValueCompression.store(false);
+        }
+        return ENGINE_SUCCESS;
     } else if (strncmp(param, "set_noop_interval", nkey) == 0) {
         if (parseUint32(valueStr.c_str(), &noopCtx.noopInterval)) {
             return ENGINE_SUCCESS;
@@ -554,8 +613,21 @@ void DcpProducer::addStats(ADD_STAT add_stat, const void *c) {
     addStat("noop_enabled", noopCtx.enabled, add_stat, c);
     addStat("noop_wait", noopCtx.pendingRecv, add_stat, c);
     addStat("priority", priority.c_str(), add_stat, c);
+    addStat("backfill_scan_runs", backfillMgr->getScanRuns(), add_stat, c);
+    addStat("backfill_scan_bytes", backfillMgr->getScanBytes(), add_stat, c);
+    addStat("backfill_scan_time", backfillMgr->getScanTime(), add_stat, c);
+    {
+        LockHolder plh(processorLock);
+        addStat("processor_tasks", processorTaskIds.size(), add_stat, c);
+        addStat("processor_queue", processorQueue.size(), add_stat, c);
+    }
     addStat("enable_ext_metadata", enableExtMetaData ? "enabled" : "disabled",
             add_stat, c);
+    addStat("enable_value_compression",
+            enableValueCompression ? "enabled" : "disabled", add_stat, c);
+    addStat("compression_bytes_in", compressionBytesIn, add_stat, c);
+    addStat("compression_bytes_out", compressionBytesOut, add_stat, c);
+    addStat("compression_time", compressionTime / 1000, add_stat, c);
 
     if (log) {
         addStat("max_buffer_bytes", log->getBufferSize(), add_stat, c);
@@ -610,6 +682,17 @@ void DcpProducer::notifySeqnoAvailable(uint16_t vbucket, uint64_t seqno) {
     }
 }
 
+bool DcpProducer::handleSlowStream(uint16_t vbucket) {
+    LockHolder lh(queueLock);
+    std::map<uint16_t, stream_t>::iterator itr = streams.find(vbucket);
+    if (itr != streams.end() && itr->second->isActive()) {
+        stream_t stream = itr->second;
+        lh.unlock();
+        return stream->handleSlowStream();
+    }
+    return false;
+}
+
 void DcpProducer::vbucketStateChanged(uint16_t vbucket, vbucket_state_t state) {
     LockHolder lh(queueLock);
     std::map<uint16_t, stream_t>::iterator itr = streams.find(vbucket);
@@ -711,6 +794,8 @@ void DcpProducer::setDisconnect(bool disconnect) {
         for (; itr != streams.end(); ++itr) {
             itr->second->setDead(END_STREAM_DISCONNECTED);
         }
+        lh.unlock();
+        clearCheckpointProcessing();
     }
 }
 
@@ -731,6 +816,93 @@ void DcpProducer::notifyStreamReady(uint16_t vbucket, bool schedule) {
     }
 }
 
+bool DcpProducer::scheduleCheckpointProcessing(stream_t stream) {
+    // Compressing values is too costly for step(), so a compressing
+    // connection always gets at least one processor task.
+    if (numProcessorTasks == 0 && !enableValueCompression) {
+        return false;
+    }
+
+    LockHolder lh(processorLock);
+    if (processorTaskIds.empty()) {
+        size_t numTasks = std::max(numProcessorTasks, static_cast<size_t>(1));
+        for (size_t i = 0; i < numTasks; ++i) {
+            ExTask task = new ActiveStreamCheckpointProcessorTask(&engine_,
+                            this, Priority::ActiveStreamChkptProcessorPriority);
+            processorTaskIds.push_back(
+                ExecutorPool::get()->schedule(task, NONIO_TASK_IDX));
+        }
+    }
+
+    processorQueue.push_back(stream);
+    wakeCheckpointProcessor_UNLOCKED();
+    return true;
+}
+
+bool DcpProducer::processCheckpoints() {
+    std::vector<stream_t> batch;
+    LockHolder lh(processorLock);
+    while (!processorQueue.empty() && batch.size() < processorBatchSize) {
+        batch.push_back(processorQueue.front());
+        processorQueue.pop_front();
+    }
+    // Let another task take the rest while this one works on its batch.
+    if (!processorQueue.empty()) {
+        wakeCheckpointProcessor_UNLOCKED();
+    }
+    lh.unlock();
+
+    std::vector<stream_t>::iterator it = batch.begin();
+    for (; it != batch.end(); ++it) {
+        static_cast<ActiveStream*>(it->get())->processCheckpoint();
+    }
+
+    lh.lock();
+    return !processorQueue.empty();
+}
+
+bool DcpProducer::hasCheckpointsToProcess() {
+    LockHolder lh(processorLock);
+    return !processorQueue.empty();
+}
+
+queued_item DcpProducer::compressItem(const queued_item &qi) {
+    if (!enableValueCompression || qi->getOperation() != queue_op_set) {
+        return qi;
+    }
+
+    queued_item copy(new Item(*qi));
+    return compressValue(*copy) ? copy : qi;
+}
+
+bool DcpProducer::compressValue(Item &itm) {
+    size_t before = itm.getNBytes();
+    hrtime_t start = gethrtime();
+    bool compressed = itm.compressValue();
+    compressionTime.fetch_add(gethrtime() - start);
+
+    if (compressed) {
+        compressionBytesIn.fetch_add(before);
+        compressionBytesOut.fetch_add(itm.getNBytes());
+    }
+    return compressed;
+}
+
+void DcpProducer::wakeCheckpointProcessor_UNLOCKED() {
+    size_t taskId = processorTaskIds[nextProcessorTask];
+    nextProcessorTask = (nextProcessorTask + 1) % processorTaskIds.size();
+    ExecutorPool::get()->wake(taskId);
+}
+
+void DcpProducer::clearCheckpointProcessing() {
+    LockHolder lh(processorLock);
+    processorQueue.clear();
+    std::vector<size_t>::iterator it = processorTaskIds.begin();
+    for (; it != processorTaskIds.end(); ++it) {
+        ExecutorPool::get()->wake(*it);
+    }
+}
+
 ENGINE_ERROR_CODE DcpProducer::maybeSendNoop(struct dcp_message_producers* producers) {
     if (noopCtx.enabled) {
         size_t sinceTime = ep_current_time() - noopCtx.sendTime;
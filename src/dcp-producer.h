@@ -96,6 +96,13 @@ public:
 
     void notifySeqnoAvailable(uint16_t vbucket, uint64_t seqno);
 
+    /**
+     * Drop the checkpoint cursor of the stream for the given vbucket so that
+     * it backfills from disk instead of holding checkpoint memory.
+     * @return true if the cursor was dropped
+     */
+    bool handleSlowStream(uint16_t vbucket);
+
     void vbucketStateChanged(uint16_t vbucket, vbucket_state_t state);
 
     void closeAllStreams();
@@ -133,6 +140,44 @@ public:
 
     void notifyStreamReady(uint16_t vbucket, bool schedule);
 
+    /**
+     * Queue an active stream to have its next checkpoint items read and its
+     * snapshot built by a processor task, off the connection's step().
+     * @return false if this producer has no processor tasks
+     */
+    bool scheduleCheckpointProcessing(stream_t stream);
+
+    /**
+     * Prepare the checkpoint snapshots of a batch of the queued streams.
+     * Run by the processor tasks, each taking whichever streams are queued
+     * next.
+     * @return true if streams are still queued
+     */
+    bool processCheckpoints();
+
+    /**
+     * @return true if streams are queued for the processor tasks
+     */
+    bool hasCheckpointsToProcess();
+
+    bool isValueCompressionEnabled() {
+        return enableValueCompression.load();
+    }
+
+    /**
+     * Return the item a stream should send for the given checkpoint item:
+     * a copy with a compressed value if value compression is enabled on
+     * this connection and shrinks the value, or the checkpoint item itself.
+     */
+    queued_item compressItem(const queued_item &qi);
+
+    /**
+     * Compress the value of an item the stream owns, e.g. a backfilled one,
+     * and account for it in the compression stats.
+     * @return true if the value was compressed
+     */
+    bool compressValue(Item &itm);
+
     BackfillManager* getBackfillManager() {
         return backfillMgr;
     }
@@ -145,6 +190,10 @@ private:
 
     ENGINE_ERROR_CODE maybeSendNoop(struct dcp_message_producers* producers);
 
+    void wakeCheckpointProcessor_UNLOCKED();
+
+    void clearCheckpointProcessing();
+
     struct {
         rel_time_t sendTime;
         uint32_t opaque;
@@ -168,7 +217,21 @@ private:
     AtomicValue<size_t> totalBytesSent;
     AtomicValue<size_t> ackedBytes;
 
+    //! Values are Snappy compressed by the streams before being queued
+    AtomicValue<bool> enableValueCompression;
+    AtomicValue<uint64_t> compressionBytesIn;
+    AtomicValue<uint64_t> compressionBytesOut;
+    AtomicValue<uint64_t> compressionTime;
+
+    //! Streams waiting for a processor task to prepare their snapshots
+    Mutex processorLock;
+    std::list<stream_t> processorQueue;
+    std::vector<size_t> processorTaskIds;
+    size_t numProcessorTasks;
+    size_t nextProcessorTask;
+
     static const uint32_t defaultNoopInerval;
+    static const size_t processorBatchSize;
 };
 
 #endif  // SRC_DCP_PRODUCER_H_
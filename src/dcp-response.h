@@ -289,6 +289,12 @@ public:
         return item_;
     }
 
+    /**
+     * Return a copy of the item for the network layer to send and release.
+     * The copy shares the value's Blob with the queued item, and so with the
+     * hash table: the value isn't copied, and the Blob stays pinned until
+     * the copy is released once it has been written out.
+     */
     Item* getItemCopy() {
         return new Item(*item_);
     }
@@ -35,7 +35,7 @@ static const char* snapshotTypeToString(snapshot_type_t type) {
 }
 
 const uint64_t Stream::dcpMaxSeqno = std::numeric_limits<uint64_t>::max();
-const size_t PassiveStream::batchSize = 10;
+const size_t PassiveStream::minBatchSize = 10;
 
 Stream::Stream(const std::string &name, uint32_t flags, uint32_t opaque,
                uint16_t vb, uint64_t start_seqno, uint64_t end_seqno,
@@ -96,7 +96,10 @@ ActiveStream::ActiveStream(EventuallyPersistentEngine* e, DcpProducer* p,
        lastReadSeqno(st_seqno), lastSentSeqno(st_seqno), curChkSeqno(st_seqno),
        takeoverState(vbucket_state_pending), backfillRemaining(0),
        itemsFromMemoryPhase(0), firstMarkerSent(false), waitForSnapshot(0),
-       engine(e), producer(p), isBackfillTaskRunning(false) {
+       engine(e), producer(p), isBackfillTaskRunning(false),
+       pendingBackfill(false), chkptProcessingScheduled(false),
+       chkItemLimit(e->getConfiguration().getDcpCheckpointItemLimit()),
+       chkByteLimit(e->getConfiguration().getDcpCheckpointByteLimit()) {
 
     const char* type = "";
     if (flags_ & DCP_ADD_STREAM_FLAG_TAKEOVER) {
@@ -205,10 +208,20 @@ void ActiveStream::markDiskSnapshot(uint64_t startSeqno, uint64_t endSeqno) {
     }
 }
 
-bool ActiveStream::backfillReceived(Item* itm, backfill_source_t backfill_source) {
+bool ActiveStream::backfillReceived(Item* itm, backfill_source_t backfill_source,
+                                    bool shared) {
+    // Compress outside the stream lock, on the backfill's thread
+    if (producer->isValueCompressionEnabled() &&
+        itm->getOperation() == queue_op_set) {
+        producer->compressValue(*itm);
+    }
+
     LockHolder lh(streamMutex);
     if (state_ == STREAM_BACKFILLING) {
-        if (!producer->getBackfillManager()->bytesRead(itm->size())) {
+        BackfillManager* backfillMgr = producer->getBackfillManager();
+        bool room = shared ? backfillMgr->sharedBytesRead(itm->size()) :
+                             backfillMgr->bytesRead(itm->size());
+        if (!room) {
             delete itm;
             return false;
         }
@@ -334,8 +347,25 @@ DcpResponse* ActiveStream::inMemoryPhase() {
         return nextQueuedItem();
     }
 
+    if (pendingBackfill) {
+        // The cursor was dropped, so the items it skipped are read from disk
+        // (if they are no longer in memory) before streaming from memory.
+        pendingBackfill = false;
+        transitionState(STREAM_BACKFILLING);
+        if (state_ != STREAM_IN_MEMORY) {
+            return NULL;
+        }
+    }
+
     if (lastSentSeqno >= end_seqno_) {
         endStream(END_STREAM_OK);
+    } else if (chkptProcessingScheduled) {
+        return NULL;
+    } else if (producer->scheduleCheckpointProcessing(this)) {
+        // A processor task reads the checkpoint and notifies the producer
+        // once the snapshot is queued.
+        chkptProcessingScheduled = true;
+        return NULL;
     } else {
         nextCheckpointItem();
     }
@@ -343,6 +373,21 @@ DcpResponse* ActiveStream::inMemoryPhase() {
     return nextQueuedItem();
 }
 
+void ActiveStream::processCheckpoint() {
+    LockHolder lh(streamMutex);
+    chkptProcessingScheduled = false;
+    if (state_ != STREAM_IN_MEMORY || !readyQ.empty()) {
+        return;
+    }
+
+    nextCheckpointItem();
+    if (!readyQ.empty() && !itemsReady) {
+        itemsReady = true;
+        lh.unlock();
+        producer->notifyStreamReady(vb_, true);
+    }
+}
+
 DcpResponse* ActiveStream::takeoverSendPhase() {
     if (!readyQ.empty()) {
         return nextQueuedItem();
@@ -462,7 +507,8 @@ void ActiveStream::nextCheckpointItem() {
     bool mark = false;
     std::vector<queued_item> items;
     std::list<MutationResponse*> mutations;
-    vbucket->checkpointManager.getAllItemsForCursor(name_, items);
+    vbucket->checkpointManager.getItemsForCursor(name_, items, chkItemLimit,
+                                                 chkByteLimit);
     if (vbucket->checkpointManager.getNumCheckpoints() > 1) {
         engine->getEpStore()->wakeUpCheckpointRemover();
     }
@@ -481,7 +527,8 @@ void ActiveStream::nextCheckpointItem() {
             curChkSeqno = qi->getBySeqno();
             lastReadSeqno = qi->getBySeqno();
 
-            mutations.push_back(new MutationResponse(qi, opaque_));
+            mutations.push_back(new MutationResponse(producer->compressItem(qi),
+                                                     opaque_));
         } else if (qi->getOperation() == queue_op_checkpoint_start) {
             cb_assert(mutations.empty());
             mark = true;
@@ -543,6 +590,29 @@ void ActiveStream::notifySeqnoAvailable(uint64_t seqno) {
     }
 }
 
+bool ActiveStream::handleSlowStream() {
+    LockHolder lh(streamMutex);
+    if (state_ != STREAM_IN_MEMORY || pendingBackfill) {
+        return false;
+    }
+
+    RCPtr<VBucket> vb = engine->getVBucket(vb_);
+    if (!vb || !vb->checkpointManager.removeCursor(name_)) {
+        return false;
+    }
+
+    LOG(EXTENSION_LOG_WARNING, "%s (vb %d) Dropping the checkpoint cursor of "
+        "a slow stream at seqno %llu, the stream will backfill from disk",
+        producer->logHeader(), vb_, lastReadSeqno);
+    pendingBackfill = true;
+    if (!itemsReady) {
+        itemsReady = true;
+        lh.unlock();
+        producer->notifyStreamReady(vb_, true);
+    }
+    return true;
+}
+
 void ActiveStream::endStream(end_stream_status_t reason) {
     if (state_ != STREAM_DEAD) {
         if (reason != END_STREAM_DISCONNECTED) {
@@ -775,7 +845,8 @@ PassiveStream::PassiveStream(EventuallyPersistentEngine* e, DcpConsumer* c,
     : Stream(name, flags, opaque, vb, st_seqno, en_seqno, vb_uuid,
              snap_start_seqno, snap_end_seqno),
       engine(e), consumer(c), last_seqno(st_seqno), cur_snapshot_start(0),
-      cur_snapshot_end(0), cur_snapshot_type(none), cur_snapshot_ack(false) {
+      cur_snapshot_end(0), cur_snapshot_type(none), cur_snapshot_ack(false),
+      batchSize(minBatchSize) {
     LockHolder lh(streamMutex);
     readyQ.push(new StreamRequest(vb, opaque, flags, st_seqno, en_seqno,
                                   vb_uuid, snap_start_seqno, snap_end_seqno));
@@ -883,7 +954,8 @@ ENGINE_ERROR_CODE PassiveStream::messageReceived(DcpResponse* resp) {
     return ENGINE_SUCCESS;
 }
 
-process_items_error_t PassiveStream::processBufferedMessages(uint32_t& processed_bytes) {
+process_items_error_t PassiveStream::processBufferedMessages(uint32_t& processed_bytes,
+                                                             size_t maxBatchSize) {
     LockHolder lh(buffer.bufMutex);
     uint32_t count = 0;
     uint32_t message_bytes = 0;
@@ -894,18 +966,24 @@ process_items_error_t PassiveStream::processBufferedMessages(uint32_t& processed
         return all_processed;
     }
 
-    while (count < PassiveStream::batchSize && !buffer.messages.empty()) {
+    // Look the vbucket up once for the whole batch rather than per message
+    RCPtr<VBucket> vb = engine->getVBucket(vb_);
+    size_t limit = std::min(batchSize, std::max(maxBatchSize, minBatchSize));
+
+    while (count < limit && !buffer.messages.empty()) {
         ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
         DcpResponse *response = buffer.messages.front();
         message_bytes = response->getMessageSize();
 
         switch (response->getEvent()) {
             case DCP_MUTATION:
-                ret = processMutation(static_cast<MutationResponse*>(response));
+                ret = processMutation(vb,
+                                      static_cast<MutationResponse*>(response));
                 break;
             case DCP_DELETION:
             case DCP_EXPIRATION:
-                ret = processDeletion(static_cast<MutationResponse*>(response));
+                ret = processDeletion(vb,
+                                      static_cast<MutationResponse*>(response));
                 break;
             case DCP_SNAPSHOT_MARKER:
                 processMarker(static_cast<SnapshotMarker*>(response));
@@ -931,31 +1009,59 @@ process_items_error_t PassiveStream::processBufferedMessages(uint32_t& processed
         buffer.bytes -= message_bytes;
         count++;
         total_bytes_processed += message_bytes;
+
+        // Only hold the buffer lock for a small batch at a time so that new
+        // messages can still be received while a large batch is applied
+        if (count % minBatchSize == 0) {
+            lh.unlock();
+            lh.lock();
+        }
     }
 
     processed_bytes = total_bytes_processed;
 
     if (failed) {
+        batchSize = minBatchSize;
         return cannot_process;
     }
 
+    if (count == limit) {
+        batchSize = std::min(limit * 2, std::max(maxBatchSize, minBatchSize));
+    }
+
     return all_processed;
 }
 
-ENGINE_ERROR_CODE PassiveStream::processMutation(MutationResponse* mutation) {
-    RCPtr<VBucket> vb = engine->getVBucket(vb_);
+ENGINE_ERROR_CODE PassiveStream::processMutation(RCPtr<VBucket> &vb,
+                                                 MutationResponse* mutation) {
     if (!vb) {
         return ENGINE_NOT_MY_VBUCKET;
     }
 
+    // Inflate a copy, so that the buffered message keeps the size the
+    // producer accounted for if it has to be retried.
+    queued_item item = mutation->getItem();
+    uint8_t datatype = item->getDataType();
+    if (consumer->isValueInflationEnabled() &&
+        (datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED ||
+         datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON)) {
+        item.reset(new Item(*item));
+        if (!item->decompressValue()) {
+            LOG(EXTENSION_LOG_WARNING, "%s (vb %d) Failed to inflate the value "
+                "of seqno %llu, storing it compressed", consumer->logHeader(),
+                vb_, mutation->getBySeqno());
+            item = mutation->getItem();
+        }
+    }
+
     ENGINE_ERROR_CODE ret;
     if (vb->isBackfillPhase()) {
-        ret = engine->getEpStore()->addTAPBackfillItem(*mutation->getItem(),
+        ret = engine->getEpStore()->addTAPBackfillItem(*item,
                                                     INITIAL_NRU_VALUE,
                                                     false,
                                                     mutation->getExtMetaData());
     } else {
-        ret = engine->getEpStore()->setWithMeta(*mutation->getItem(), 0, NULL,
+        ret = engine->getEpStore()->setWithMeta(*item, 0, NULL,
                                                 consumer->getCookie(), true,
                                                 true, INITIAL_NRU_VALUE, false,
                                                 mutation->getExtMetaData());
@@ -978,8 +1084,8 @@ ENGINE_ERROR_CODE PassiveStream::processMutation(MutationResponse* mutation) {
     return ret;
 }
 
-ENGINE_ERROR_CODE PassiveStream::processDeletion(MutationResponse* deletion) {
-    RCPtr<VBucket> vb = engine->getVBucket(vb_);
+ENGINE_ERROR_CODE PassiveStream::processDeletion(RCPtr<VBucket> &vb,
+                                                 MutationResponse* deletion) {
     if (!vb) {
         return ENGINE_NOT_MY_VBUCKET;
     }
@@ -1086,6 +1192,8 @@ void PassiveStream::addStats(ADD_STAT add_stat, const void *c) {
     add_casted_stat(buf, buffer.items, add_stat, c);
     snprintf(buf, bsize, "%s:stream_%d_buffer_bytes", name_.c_str(), vb_);
     add_casted_stat(buf, buffer.bytes, add_stat, c);
+    snprintf(buf, bsize, "%s:stream_%d_batch_size", name_.c_str(), vb_);
+    add_casted_stat(buf, batchSize, add_stat, c);
     snprintf(buf, bsize, "%s:stream_%d_items_ready", name_.c_str(), vb_);
     add_casted_stat(buf, itemsReady ? "true" : "false", add_stat, c);
     snprintf(buf, bsize, "%s:stream_%d_last_received_seqno", name_.c_str(), vb_);
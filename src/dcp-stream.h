@@ -114,6 +114,13 @@ public:
 
     virtual void notifySeqnoAvailable(uint64_t seqno) {}
 
+    /**
+     * Drop the checkpoint cursor of this stream because it holds back too
+     * much checkpoint memory.
+     * @return true if the cursor was dropped
+     */
+    virtual bool handleSlowStream() { return false; }
+
     bool isActive() {
         return state_ != STREAM_DEAD;
     }
@@ -171,6 +178,14 @@ public:
 
     void notifySeqnoAvailable(uint64_t seqno);
 
+    bool handleSlowStream();
+
+    /**
+     * Read the next checkpoint items and queue their snapshot, on behalf of
+     * a checkpoint processor task of the producer.
+     */
+    void processCheckpoint();
+
     void snapshotMarkerAckReceived();
 
     void setVBucketStateAckRecieved();
@@ -181,7 +196,15 @@ public:
 
     void markDiskSnapshot(uint64_t startSeqno, uint64_t endSeqno);
 
-    bool backfillReceived(Item* itm, backfill_source_t backfill_source);
+    /**
+     * Queue an item read by the backfill of this stream.
+     * @param shared whether the item was read by the scan of another
+     *        stream, in which case it only counts against the backfill
+     *        buffer of the connection and not against its scan buffer
+     * @return false if there is no room for the item
+     */
+    bool backfillReceived(Item* itm, backfill_source_t backfill_source,
+                          bool shared = false);
 
     void completeBackfill();
 
@@ -241,6 +264,14 @@ private:
     EventuallyPersistentEngine* engine;
     DcpProducer* producer;
     bool isBackfillTaskRunning;
+    //! Whether the cursor was dropped and the stream has to backfill again
+    bool pendingBackfill;
+    //! Whether the stream is queued for a checkpoint processor task
+    bool chkptProcessingScheduled;
+
+    //! Budget of each batch of items taken from the checkpoint cursor
+    size_t chkItemLimit;
+    size_t chkByteLimit;
 
     struct {
         AtomicValue<uint32_t> bytes;
@@ -285,7 +316,16 @@ public:
 
     ~PassiveStream();
 
-    process_items_error_t processBufferedMessages(uint32_t &processed_bytes);
+    /**
+     * Apply a batch of the buffered messages to the vbucket. The batch
+     * doubles after each full batch applied, up to maxBatchSize, and drops
+     * back to minBatchSize when the vbucket can't take any more mutations.
+     *
+     * @param processed_bytes set to the bytes of the messages applied
+     * @param maxBatchSize the most messages to apply in this batch
+     */
+    process_items_error_t processBufferedMessages(uint32_t &processed_bytes,
+                                                  size_t maxBatchSize);
 
     DcpResponse* next();
 
@@ -300,13 +340,15 @@ public:
 
     void addStats(ADD_STAT add_stat, const void *c);
 
-    static const size_t batchSize;
+    static const size_t minBatchSize;
 
 private:
 
-    ENGINE_ERROR_CODE processMutation(MutationResponse* mutation);
+    ENGINE_ERROR_CODE processMutation(RCPtr<VBucket> &vb,
+                                      MutationResponse* mutation);
 
-    ENGINE_ERROR_CODE processDeletion(MutationResponse* deletion);
+    ENGINE_ERROR_CODE processDeletion(RCPtr<VBucket> &vb,
+                                      MutationResponse* deletion);
 
     void handleSnapshotEnd(RCPtr<VBucket>& vb, uint64_t byseqno);
 
@@ -327,6 +369,9 @@ private:
     snapshot_type_t cur_snapshot_type;
     bool cur_snapshot_ack;
 
+    /* Messages applied per batch, guarded by the buffer mutex */
+    size_t batchSize;
+
     struct Buffer {
         Buffer() : bytes(0), items(0) {}
         size_t bytes;
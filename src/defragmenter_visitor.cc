@@ -92,8 +92,9 @@ bool DefragmentVisitor::visit(StoredValue& v) {
     // value must be at least non-zero (also covers Items with null Blobs)
     // and no larger than the biggest size class the allocator
     // supports, so it can be successfully reallocated to a run with other
-    // objects of the same size.
-    if (value_len > 0 && value_len <= max_size_class) {
+    // objects of the same size. Values held inline have no Blob to move.
+    if (value_len > 0 && value_len <= max_size_class &&
+        !v.hasInlineValue()) {
         // If sufficiently old reallocate, otherwise increment it's age.
         if (v.getValue()->getAge() >= age_threshold) {
             v.reallocate();
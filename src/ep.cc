@@ -108,6 +108,9 @@ public:
         } else if (key.compare("backfill_mem_threshold") == 0) {
             double backfill_threshold = static_cast<double>(value) / 100;
             store.setBackfillMemoryThreshold(backfill_threshold);
+        } else if (key.compare("chk_mem_threshold") == 0) {
+            double chk_threshold = static_cast<double>(value) / 100;
+            store.setCheckpointMemoryThreshold(chk_threshold);
         } else if (key.compare("tap_throttle_queue_cap") == 0) {
             store.getEPEngine().getTapThrottle().setQueueCap(value);
         } else if (key.compare("tap_throttle_cap_pcnt") == 0) {
@@ -199,7 +202,7 @@ EventuallyPersistentStore::EventuallyPersistentStore(
     defragmenterTask(NULL),
     bgFetchQueue(0),
     diskFlushAll(false), bgFetchDelay(0),
-    backfillMemoryThreshold(0.95),
+    backfillMemoryThreshold(0.95), checkpointMemoryThreshold(0.5),
     statsSnapshotTaskId(0), lastTransTimePerItem(0)
 {
     cachedResidentRatio.activeRatio.store(0);
@@ -231,8 +234,10 @@ EventuallyPersistentStore::EventuallyPersistentStore(
     size_t num_vbs = config.getMaxVbuckets();
     vb_mutexes = new Mutex[num_vbs];
     schedule_vbstate_persist = new AtomicValue<bool>[num_vbs];
+    vb_flush_generation = new uint64_t[num_vbs];
     for (size_t i = 0; i < num_vbs; ++i) {
         schedule_vbstate_persist[i] = false;
+        vb_flush_generation[i] = 0;
     }
 
     stats.memOverhead = sizeof(EventuallyPersistentStore);
@@ -290,6 +295,12 @@ EventuallyPersistentStore::EventuallyPersistentStore(
     config.addValueChangedListener("backfill_mem_threshold",
                                    new EPStoreValueChangeListener(*this));
 
+    double chk_threshold = static_cast<double>
+                                      (config.getChkMemThreshold()) / 100;
+    setCheckpointMemoryThreshold(chk_threshold);
+    config.addValueChangedListener("chk_mem_threshold",
+                                   new EPStoreValueChangeListener(*this));
+
     config.addValueChangedListener("bfilter_enabled",
                                    new EPStoreValueChangeListener(*this));
 
@@ -382,6 +393,7 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
 
     delete [] vb_mutexes;
     delete [] schedule_vbstate_persist;
+    delete [] vb_flush_generation;
     delete [] stats.schedulingHisto;
     delete [] stats.taskRuntimeHisto;
     delete conflictResolver;
@@ -1543,6 +1555,7 @@ void EventuallyPersistentStore::updateBGStats(const hrtime_t init,
 
 void EventuallyPersistentStore::completeBGFetch(const std::string &key,
                                                 uint16_t vbucket,
+                                                const RCPtr<VBucket> &fetchVb,
                                                 const void *cookie,
                                                 hrtime_t init,
                                                 bool isMeta) {
@@ -1626,6 +1639,13 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
         status = ENGINE_NOT_MY_VBUCKET;
     }
 
+    // Fetches of the key made during the read joined it on the vbucket it
+    // was started on, even if that vbucket was deleted or recreated since
+    std::list<VBucketBGFetchItem *> waiters;
+    if (fetchVb) {
+        fetchVb->takeBGFetchWaiters(key, isMeta, waiters);
+    }
+
     lh.unlock();
 
     hrtime_t stop = gethrtime();
@@ -1634,6 +1654,19 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
 
     delete gcb.val.getValue();
     engine.notifyIOComplete(cookie, status);
+
+    std::list<VBucketBGFetchItem *>::iterator itr = waiters.begin();
+    for (; itr != waiters.end(); ++itr) {
+        if (isMeta) {
+            ++stats.bg_meta_fetched;
+        } else {
+            ++stats.bg_fetched;
+        }
+        updateBGStats((*itr)->initTime, start, stop);
+        engine.notifyIOComplete((*itr)->cookie, status);
+        delete *itr;
+    }
+    stats.bgFetchJoined.fetch_add(waiters.size());
 }
 
 void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
@@ -1741,26 +1774,34 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
                                         bool isMeta) {
     std::stringstream ss;
 
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    VBucketBGFetchItem * fetchThis = new VBucketBGFetchItem(cookie, isMeta);
+    // Without a batching bgfetcher, the first fetch of a key reads it for
+    // every fetch of that key that comes in meanwhile
+    if (vb && vb->joinBGFetch(key, fetchThis, !multiBGFetchEnabled())) {
+        LOG(EXTENSION_LOG_DEBUG, "Joined the background fetch of a key "
+            "already being read");
+        return;
+    }
+
     if (multiBGFetchEnabled()) {
-        RCPtr<VBucket> vb = getVBucket(vbucket);
         cb_assert(vb);
         KVShard *myShard = vbMap.getShard(vbucket);
 
         // schedule to the current batch of background fetch of the given
         // vbucket
-        VBucketBGFetchItem * fetchThis = new VBucketBGFetchItem(cookie,
-                                                                isMeta);
         vb->queueBGFetchItem(key, fetchThis, myShard->getBgFetcher());
         myShard->getBgFetcher()->notifyBGEvent();
         ss << "Queued a background fetch, now at "
            << vb->numPendingBGFetchItems() << std::endl;
         LOG(EXTENSION_LOG_DEBUG, "%s", ss.str().c_str());
     } else {
+        delete fetchThis;
         bgFetchQueue++;
         stats.maxRemainingBgJobs = std::max(stats.maxRemainingBgJobs,
                                             bgFetchQueue.load());
         ExecutorPool* iom = ExecutorPool::get();
-        ExTask task = new BGFetchTask(&engine, key, vbucket, cookie,
+        ExTask task = new BGFetchTask(&engine, key, vbucket, vb, cookie,
                                       isMeta,
                                       Priority::BgFetcherGetMetaPriority,
                                       bgFetchDelay, false);
@@ -1797,6 +1838,13 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         }
     }
 
+    // Resident items can usually be copied out without the bucket lock.
+    Item *itm = vb->ht.optimisticGet(key, vbucket, trackReference);
+    if (itm) {
+        return GetValue(itm, ENGINE_SUCCESS, itm->getBySeqno(), false,
+                        itm->getNRUValue());
+    }
+
     int bucket_num(0);
     LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
     StoredValue *v = fetchValidValue(vb, key, bucket_num, true,
@@ -2430,7 +2478,7 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
         if (diskItem.getFlags() != v->getFlags()) {
             return "flags_mismatch";
         } else if (v->isResident() && memcmp(diskItem.getData(),
-                                             v->getValue()->getData(),
+                                             v->getValueData(),
                                              diskItem.getNBytes())) {
             return "data_mismatch";
         } else {
@@ -2701,6 +2749,7 @@ void EventuallyPersistentStore::reset() {
         RCPtr<VBucket> vb = getVBucket(*it);
         if (vb) {
             LockHolder lh(vb_mutexes[vb->getId()]);
+            ++vb_flush_generation[vb->getId()];
             vb->ht.clear();
             vb->checkpointManager.clear(vb->getState());
             vb->resetStats();
@@ -2922,7 +2971,9 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     setFlushAllComplete();
 }
 
-int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+int EventuallyPersistentStore::flushVBucket(uint16_t vbid,
+                                            FlushBatch *prefetched,
+                                            std::vector<FlushCompletion> *deferred) {
     KVShard *shard = vbMap.getShard(vbid);
     if (diskFlushAll && !flushAllTaskCtx.delayFlushAll) {
         if (shard->getId() == EP_PRIMARY_SHARD) {
@@ -2938,131 +2989,282 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
     }
 
     int items_flushed = 0;
-    rel_time_t flush_start = ep_current_time();
 
     RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+    FlushBatch batch;
+    if (prefetched) {
+        batch.swap(*prefetched);
+    }
     if (vb) {
         LockHolder lh(vb_mutexes[vbid], true /*tryLock*/);
         if (!lh.islocked()) { // Try another bucket if this one is locked
+            if (prefetched) {
+                prefetched->swap(batch);
+            }
             return RETRY_FLUSH_VBUCKET; // to avoid blocking flusher
         }
 
-        KVStatsCallback cb(this);
-        std::vector<queued_item> items;
+        if (batch.numQueued == 0 || batch.vb.get() != vb.get() ||
+            batch.generation != vb_flush_generation[vbid]) {
+            // Nothing prefetched, or it was collected from a vbucket that
+            // has since been deleted, reset or rolled back.
+            FlushBatch().swap(batch);
+            collectFlushBatch_UNLOCKED(vb, batch);
+        }
+
         KVStore *rwUnderlying = getRWUnderlying(vbid);
+        FlushCompletion done;
+        done.vb = vb;
+        if (batch.numQueued > 0) {
+            items_flushed = persistFlushBatch_UNLOCKED(batch);
+            done.persistedSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
+        }
+        done.persisted = vb->rejectQueue.empty();
 
-        while (!vb->rejectQueue.empty()) {
-            items.push_back(vb->rejectQueue.front());
-            vb->rejectQueue.pop();
+        BlockTimer timer(&stats.flushCompleteHisto, "flush_complete",
+                         stats.timingLog);
+        rwUnderlying->pendingTasks();
+
+        if (vb->checkpointManager.getNumCheckpoints() > 1) {
+            wakeUpCheckpointRemover();
         }
 
-        const std::string cursor(CheckpointManager::pCursorName);
-        vb->getBackfillItems(items);
+        if (deferred) {
+            done.items.swap(batch.items);
+            deferred->push_back(done);
+        } else {
+            completeFlush(done);
+        }
+    }
 
-        snapshot_range_t range;
-        range = vb->checkpointManager.getAllItemsForCursor(cursor, items);
+    return items_flushed;
+}
 
-        if (!items.empty()) {
-            while (!rwUnderlying->begin()) {
-                ++stats.beginFailed;
-                LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
-                    "Retry in 1 sec ...");
-                sleep(1);
-            }
-            rwUnderlying->optimizeWrites(items);
-
-            Item *prev = NULL;
-            uint64_t maxSeqno = 0;
-            uint64_t maxCas = 0;
-            std::list<PersistenceCallback*> pcbs;
-            std::vector<queued_item>::iterator it = items.begin();
-            for(; it != items.end(); ++it) {
-                if ((*it)->getOperation() != queue_op_set &&
-                    (*it)->getOperation() != queue_op_del) {
-                    continue;
-                } else if (!prev || prev->getKey() != (*it)->getKey()) {
-                    prev = (*it).get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
-                    }
+void EventuallyPersistentStore::completeFlush(FlushCompletion &done) {
+    if (!done.persisted) {
+        return;
+    }
 
-                    maxSeqno = std::max(maxSeqno, (uint64_t)(*it)->getBySeqno());
-                    maxCas = std::max(maxCas, (uint64_t)(*it)->getCas());
-                    ++stats.flusher_todo;
-                } else {
-                    stats.decrDiskQueueSize(1);
-                    vb->doStatsForFlushing(*(*it), (*it)->size());
-                }
-            }
+    RCPtr<VBucket> &vb = done.vb;
+    uint16_t vbid = vb->getId();
+    if (done.persistedSeqno > 0 &&
+        done.persistedSeqno != vbMap.getPersistenceSeqno(vbid)) {
+        vbMap.setPersistenceSeqno(vbid, done.persistedSeqno);
+        vb->notifySeqnoPersisted(done.persistedSeqno);
+    }
 
-            BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
-                             stats.timingLog);
-            hrtime_t start = gethrtime();
+    vb->checkpointManager.itemsPersisted();
+    uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
+    uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
+    vb->notifyCheckpointPersisted(engine, seqno, true);
+    vb->notifyCheckpointPersisted(engine, chkid, false);
+    if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
+        vbMap.setPersistenceCheckpointId(vbid, chkid);
+    }
+}
 
-            if (vb->getState() == vbucket_state_active) {
-                range.start = maxSeqno;
-                range.end = maxSeqno;
-            }
+void EventuallyPersistentStore::beginFlushGroup(uint16_t shardId) {
+    vbMap.shards[shardId]->getRWUnderlying()->beginSyncGroup();
+}
 
-            vb->setPersistedSnapshot(range.start, range.end);
-            while (!rwUnderlying->commit(&cb, range.start, range.end, maxCas,
-                                         vb->getDriftCounter())) {
-                ++stats.commitFailed;
-                LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
-                    "1 sec...\n");
-                sleep(1);
+void EventuallyPersistentStore::endFlushGroup(uint16_t shardId,
+                                         std::vector<FlushCompletion> &deferred) {
+    KVStore *rwUnderlying = vbMap.shards[shardId]->getRWUnderlying();
+    bool synced;
+    {
+        BlockTimer timer(&stats.flushGroupSyncHisto, "flush_group_sync",
+                         stats.timingLog);
+        synced = rwUnderlying->endSyncGroup();
+    }
 
-            }
+    // Syncing again through other descriptors could miss the error, so
+    // the commits of a failed group are made again from scratch.
+    if (!synced) {
+        ++stats.commitFailed;
+        LOG(EXTENSION_LOG_WARNING, "Group commit sync failed!!! Requeueing "
+            "the items of %d vbuckets", (int)deferred.size());
+    } else if (!deferred.empty()) {
+        ++stats.flusherGroupCommits;
+        stats.flusherGroupCommitVBuckets.fetch_add(deferred.size());
+    }
 
-            if (vb->rejectQueue.empty()) {
-                uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
-                if (highSeqno > 0 &&
-                    highSeqno != vbMap.getPersistenceSeqno(vbid)) {
-                    vbMap.setPersistenceSeqno(vbid, highSeqno);
-                    vb->notifySeqnoPersisted(highSeqno);
-                }
-            }
+    std::vector<FlushCompletion>::iterator it = deferred.begin();
+    for (; it != deferred.end(); ++it) {
+        if (synced) {
+            completeFlush(*it);
+        } else {
+            requeueFlush(*it);
+        }
+    }
+    deferred.clear();
+}
 
-            while (!pcbs.empty()) {
-                delete pcbs.front();
-                pcbs.pop_front();
-            }
+void EventuallyPersistentStore::requeueFlush(FlushCompletion &done) {
+    RCPtr<VBucket> &vb = done.vb;
+    uint16_t vbid = vb->getId();
+    if (vbMap.getBucket(vbid).get() != vb.get() ||
+        vbMap.isBucketDeletion(vbid)) {
+        return;
+    }
 
-            ++stats.flusherCommits;
-            hrtime_t end = gethrtime();
-            uint64_t commit_time = (end - start) / 1000000;
-            uint64_t trans_time = (end - flush_start) / 1000000;
+    LockHolder lh(vb_mutexes[vbid]);
+    // Items the commit rejected are already queued again
+    std::set<Item*> rejected;
+    for (size_t i = vb->rejectQueue.size(); i > 0; --i) {
+        queued_item qi = vb->rejectQueue.front();
+        vb->rejectQueue.pop();
+        rejected.insert(qi.get());
+        vb->rejectQueue.push(qi);
+    }
 
-            lastTransTimePerItem = (items_flushed == 0) ? 0 :
-                static_cast<double>(trans_time) /
-                static_cast<double>(items_flushed);
-            stats.commit_time.store(commit_time);
-            stats.cumulativeCommitTime.fetch_add(commit_time);
-            stats.cumulativeFlushTime.fetch_add(ep_current_time()
-                                                - flush_start);
-            stats.flusher_todo.store(0);
+    std::vector<queued_item>::iterator it = done.items.begin();
+    for (; it != done.items.end(); ++it) {
+        if (rejected.count(it->get())) {
+            continue;
         }
+        ++stats.flushFailed;
+        ++stats.diskQueueSize;
+        vb->doStatsForQueueing(**it, (*it)->size());
+        invokeOnLockedStoredValue((*it)->getKey(), vbid,
+                                  &StoredValue::reDirty);
+        vb->rejectQueue.push(*it);
+    }
+}
 
-        rwUnderlying->pendingTasks();
+bool EventuallyPersistentStore::collectFlushBatch(uint16_t vbid,
+                                                  FlushBatch &batch) {
+    if (diskFlushAll || vbMap.isBucketCreation(vbid)) {
+        return false;
+    }
 
-        if (vb->checkpointManager.getNumCheckpoints() > 1) {
-            wakeUpCheckpointRemover();
+    RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+    if (!vb) {
+        return false;
+    }
+
+    LockHolder lh(vb_mutexes[vbid], true /*tryLock*/);
+    if (!lh.islocked()) {
+        return false;
+    }
+    collectFlushBatch_UNLOCKED(vb, batch);
+    return true;
+}
+
+void EventuallyPersistentStore::collectFlushBatch_UNLOCKED(RCPtr<VBucket> &vb,
+                                                           FlushBatch &batch) {
+    BlockTimer timer(&stats.flushCollectHisto, "flush_collect",
+                     stats.timingLog);
+    std::vector<queued_item> items;
+
+    batch.vbid = vb->getId();
+    batch.vb = vb;
+    batch.generation = vb_flush_generation[batch.vbid];
+    batch.flushStart = ep_current_time();
+
+    while (!vb->rejectQueue.empty()) {
+        items.push_back(vb->rejectQueue.front());
+        vb->rejectQueue.pop();
+    }
+
+    const std::string cursor(CheckpointManager::pCursorName);
+    vb->getBackfillItems(items);
+
+    batch.range = vb->checkpointManager.getAllItemsForCursor(cursor, items);
+    batch.numQueued = items.size();
+    if (items.empty()) {
+        return;
+    }
+
+    getRWUnderlying(batch.vbid)->optimizeWrites(items);
+
+    Item *prev = NULL;
+    batch.items.reserve(items.size());
+    std::vector<queued_item>::iterator it = items.begin();
+    for(; it != items.end(); ++it) {
+        if ((*it)->getOperation() != queue_op_set &&
+            (*it)->getOperation() != queue_op_del) {
+            continue;
+        } else if (!prev || prev->getKey() != (*it)->getKey()) {
+            prev = (*it).get();
+            batch.items.push_back(*it);
+            batch.maxSeqno = std::max(batch.maxSeqno,
+                                      (uint64_t)(*it)->getBySeqno());
+            batch.maxCas = std::max(batch.maxCas, (uint64_t)(*it)->getCas());
+        } else {
+            stats.decrDiskQueueSize(1);
+            vb->doStatsForFlushing(*(*it), (*it)->size());
         }
+    }
+}
+
+int EventuallyPersistentStore::persistFlushBatch_UNLOCKED(FlushBatch &batch) {
+    RCPtr<VBucket> &vb = batch.vb;
+    uint16_t vbid = batch.vbid;
+    KVStatsCallback cb(this);
+    KVStore *rwUnderlying = getRWUnderlying(vbid);
+    int items_flushed = 0;
+
+    while (!rwUnderlying->begin()) {
+        ++stats.beginFailed;
+        LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
+            "Retry in 1 sec ...");
+        sleep(1);
+    }
 
-        if (vb->rejectQueue.empty()) {
-            vb->checkpointManager.itemsPersisted();
-            uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
-            uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
-            vb->notifyCheckpointPersisted(engine, seqno, true);
-            vb->notifyCheckpointPersisted(engine, chkid, false);
-            if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
-                vbMap.setPersistenceCheckpointId(vbid, chkid);
+    std::list<PersistenceCallback*> pcbs;
+    {
+        BlockTimer timer(&stats.flushWriteHisto, "flush_write",
+                         stats.timingLog);
+        std::vector<queued_item>::iterator it = batch.items.begin();
+        for(; it != batch.items.end(); ++it) {
+            ++items_flushed;
+            PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
+            if (cb) {
+                pcbs.push_back(cb);
             }
+            ++stats.flusher_todo;
         }
     }
 
+    BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
+                     stats.timingLog);
+    hrtime_t start = gethrtime();
+
+    snapshot_range_t range = batch.range;
+    if (vb->getState() == vbucket_state_active) {
+        range.start = batch.maxSeqno;
+        range.end = batch.maxSeqno;
+    }
+
+    vb->setPersistedSnapshot(range.start, range.end);
+    while (!rwUnderlying->commit(&cb, range.start, range.end, batch.maxCas,
+                                 vb->getDriftCounter())) {
+        ++stats.commitFailed;
+        LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
+            "1 sec...\n");
+        sleep(1);
+
+    }
+
+    while (!pcbs.empty()) {
+        delete pcbs.front();
+        pcbs.pop_front();
+    }
+
+    ++stats.flusherCommits;
+    hrtime_t end = gethrtime();
+    uint64_t commit_time = (end - start) / 1000000;
+    uint64_t trans_time = (end - batch.flushStart) / 1000000;
+
+    lastTransTimePerItem = (items_flushed == 0) ? 0 :
+        static_cast<double>(trans_time) /
+        static_cast<double>(items_flushed);
+    stats.commit_time.store(commit_time);
+    stats.cumulativeCommitTime.fetch_add(commit_time);
+    stats.cumulativeFlushTime.fetch_add(ep_current_time()
+                                        - batch.flushStart);
+    stats.flusher_todo.store(0);
+
     return items_flushed;
 }
 
@@ -3262,6 +3464,17 @@ void EventuallyPersistentStore::setBackfillMemoryThreshold(
     backfillMemoryThreshold = threshold;
 }
 
+bool EventuallyPersistentStore::isCheckpointMemoryTooHigh() {
+    double chkMemory = static_cast<double>(stats.checkpointMemory.load());
+    double maxSize = static_cast<double>(stats.getMaxDataSize());
+    return chkMemory > (maxSize * checkpointMemoryThreshold);
+}
+
+void EventuallyPersistentStore::setCheckpointMemoryThreshold(
+                                                double threshold) {
+    checkpointMemoryThreshold = threshold;
+}
+
 void EventuallyPersistentStore::setExpiryPagerSleeptime(size_t val) {
     LockHolder lh(expiryPager.mutex);
 
@@ -3576,6 +3789,8 @@ EventuallyPersistentStore::rollback(uint16_t vbid,
     if (!lh.islocked()) {
         return ENGINE_TMPFAIL; // Reschedule a vbucket rollback task.
     }
+    // Mutations the flusher collected ahead of time are about to be undone
+    ++vb_flush_generation[vbid];
 
     if (rollbackSeqno != 0) {
         shared_ptr<RollbackCB> cb(new RollbackCB(engine));
@@ -176,6 +176,55 @@ class KVShard;
 
 typedef std::pair<uint16_t, ExTask> CompTaskEntry;
 
+/**
+ * The deduplicated set of mutations collected from a vbucket's
+ * persistence cursor, ready to be written out by the flusher.
+ */
+struct FlushBatch {
+    FlushBatch() : vbid(0), numQueued(0), generation(0), maxSeqno(0),
+                   maxCas(0), flushStart(0) { }
+
+    void swap(FlushBatch &other) {
+        std::swap(vbid, other.vbid);
+        std::swap(vb, other.vb);
+        items.swap(other.items);
+        std::swap(numQueued, other.numQueued);
+        std::swap(range, other.range);
+        std::swap(generation, other.generation);
+        std::swap(maxSeqno, other.maxSeqno);
+        std::swap(maxCas, other.maxCas);
+        std::swap(flushStart, other.flushStart);
+    }
+
+    uint16_t vbid;
+    RCPtr<VBucket> vb;
+    //! Sets and deletes to persist, one per key
+    std::vector<queued_item> items;
+    //! Items taken off the queues, before deduplication
+    size_t numQueued;
+    snapshot_range_t range;
+    uint64_t generation;
+    uint64_t maxSeqno;
+    uint64_t maxCas;
+    rel_time_t flushStart;
+};
+
+/**
+ * The persistence notifications owed for a flushed vbucket. These are
+ * held back while its commit waits for the sync of a group commit.
+ */
+struct FlushCompletion {
+    FlushCompletion() : persistedSeqno(0), persisted(false) { }
+
+    RCPtr<VBucket> vb;
+    //! Last seqno on disk after the commit (0 if nothing was committed)
+    uint64_t persistedSeqno;
+    //! True if no items were left behind in the reject queue
+    bool persisted;
+    //! The items committed, to be persisted again if the sync fails
+    std::vector<queued_item> items;
+};
+
 /**
  * Manager of all interaction with the persistence.
  */
@@ -454,6 +503,8 @@ public:
      *
      * @param key the key that was fetched
      * @param vbucket the vbucket in which the key lived
+     * @param fetchVb the vbucket the fetch was started on, whose fetches
+     *                that joined it are completed too
      * @param cookie the cookie of the requestor
      * @param init the timestamp of when the request came in
      * @param type whether the fetch is for a non-resident value or metadata of
@@ -461,6 +512,7 @@ public:
      */
     void completeBGFetch(const std::string &key,
                          uint16_t vbucket,
+                         const RCPtr<VBucket> &fetchVb,
                          const void *cookie,
                          hrtime_t init,
                          bool isMeta);
@@ -702,6 +754,8 @@ public:
 
     void setBackfillMemoryThreshold(double threshold);
 
+    void setCheckpointMemoryThreshold(double threshold);
+
     void setExpiryPagerSleeptime(size_t val);
 
     void enableAccessScannerTask();
@@ -761,12 +815,52 @@ public:
      */
     bool isMemoryUsageTooHigh();
 
+    /**
+     * Checks whether the items held by checkpoints exceed their share
+     * of the bucket quota.
+     * To be used by the checkpoint remover.
+     */
+    bool isCheckpointMemoryTooHigh();
+
     /**
      * Flushes all items waiting for persistence in a given vbucket
      * @param vbid The id of the vbucket to flush
+     * @param prefetched A batch already collected for this vbucket by
+     *                   collectFlushBatch (may be NULL). It is consumed
+     *                   unless RETRY_FLUSH_VBUCKET is returned.
+     * @param deferred If not NULL, the persistence notifications are
+     *                 appended here for endFlushGroup instead of being sent
      * @return The amount of items flushed
      */
-    int flushVBucket(uint16_t vbid);
+    int flushVBucket(uint16_t vbid, FlushBatch *prefetched = NULL,
+                     std::vector<FlushCompletion> *deferred = NULL);
+
+    /**
+     * Start a group commit on a shard: the vbuckets flushed with deferred
+     * notifications from now on only become durable, and are only
+     * reported as persisted, at endFlushGroup.
+     */
+    void beginFlushGroup(uint16_t shardId);
+
+    /**
+     * Sync every commit made since beginFlushGroup and send the deferred
+     * persistence notifications. If the sync fails, no notification is sent
+     * and the committed items are queued to be persisted again.
+     */
+    void endFlushGroup(uint16_t shardId,
+                       std::vector<FlushCompletion> &deferred);
+
+    /**
+     * Collect and deduplicate the items waiting for persistence in a
+     * given vbucket so that a later flushVBucket call only has to write
+     * them out. Used by the flusher to prepare the next vbucket while the
+     * current one is being committed.
+     *
+     * @param vbid The id of the vbucket to collect from
+     * @param batch Filled in with the items to persist
+     * @return false if the vbucket couldn't be collected from right now
+     */
+    bool collectFlushBatch(uint16_t vbid, FlushBatch &batch);
 
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
 
@@ -870,6 +964,10 @@ private:
     }
 
     void flushOneDeleteAll(void);
+    void collectFlushBatch_UNLOCKED(RCPtr<VBucket> &vb, FlushBatch &batch);
+    int persistFlushBatch_UNLOCKED(FlushBatch &batch);
+    void completeFlush(FlushCompletion &done);
+    void requeueFlush(FlushCompletion &done);
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
                                           RCPtr<VBucket> &vb);
 
@@ -913,6 +1011,9 @@ private:
      * Used by flush operations: flushVB, deleteVB, compactVB, snapshotVB */
     Mutex                          *vb_mutexes;
     AtomicValue<bool>              *schedule_vbstate_persist;
+    //! Bumped (under vb_mutexes) whenever unpersisted items are thrown
+    //! away, invalidating any flush batch collected before then.
+    uint64_t                       *vb_flush_generation;
     std::vector<MutationLog*>       accessLog;
 
     AtomicValue<size_t> bgFetchQueue;
@@ -927,6 +1028,7 @@ private:
     Mutex vbsetMutex;
     uint32_t bgFetchDelay;
     double backfillMemoryThreshold;
+    double checkpointMemoryThreshold;
     struct ExpiryPagerDelta {
         ExpiryPagerDelta() : sleeptime(0), task(0) {}
         Mutex mutex;
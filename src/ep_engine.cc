@@ -408,6 +408,17 @@ extern "C" {
                 } else {
                     throw std::runtime_error("value out of range.");
                 }
+            } else if (strcmp(keyz, "flusher_group_commit_max_latency") == 0) {
+                char *ptr = NULL;
+                checkNumeric(valz);
+                uint64_t vsize = strtoull(valz, &ptr, 10);
+                validate(vsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setFlusherGroupCommitMaxLatency(vsize);
+            } else if (strcmp(keyz, "flusher_group_commit_max_vbuckets") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 1024);
+                e->getConfiguration().setFlusherGroupCommitMaxVbuckets(v);
             } else if (strcmp(keyz, "max_size") == 0) {
                 char *ptr = NULL;
                 checkNumeric(valz);
@@ -435,6 +446,10 @@ extern "C" {
                 checkNumeric(valz);
                 validate(v, 0, 100);
                 e->getConfiguration().setBackfillMemThreshold(v);
+            } else if (strcmp(keyz, "chk_mem_threshold") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, 100);
+                e->getConfiguration().setChkMemThreshold(v);
             } else if (strcmp(keyz, "mutation_mem_threshold") == 0) {
                 checkNumeric(valz);
                 validate(v, 0, 100);
@@ -511,6 +526,22 @@ extern "C" {
                 validate(v, 0, std::numeric_limits<int>::max());
                 e->getConfiguration().setMaxNumNonio(v);
                 ExecutorPool::get()->setMaxNonIO(v);
+            } else if (strcmp(keyz, "executor_share_reader") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 10000);
+                e->getConfiguration().setExecutorShareReader(v);
+            } else if (strcmp(keyz, "executor_share_writer") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 10000);
+                e->getConfiguration().setExecutorShareWriter(v);
+            } else if (strcmp(keyz, "executor_share_auxio") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 10000);
+                e->getConfiguration().setExecutorShareAuxio(v);
+            } else if (strcmp(keyz, "executor_share_nonio") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, 10000);
+                e->getConfiguration().setExecutorShareNonio(v);
             } else if (strcmp(keyz, "bfilter_enabled") == 0) {
                 if (strcmp(valz, "true") == 0) {
                     e->getConfiguration().setBfilterEnabled(true);
@@ -1996,6 +2027,14 @@ public:
             engine.setGetlDefaultTimeout(value);
         } else if (key.compare("max_item_size") == 0) {
             engine.setMaxItemSize(value);
+        } else if (key.compare("executor_share_reader") == 0) {
+            engine.getWorkLoadPolicy().setShare(READER_TASK_IDX, value);
+        } else if (key.compare("executor_share_writer") == 0) {
+            engine.getWorkLoadPolicy().setShare(WRITER_TASK_IDX, value);
+        } else if (key.compare("executor_share_auxio") == 0) {
+            engine.getWorkLoadPolicy().setShare(AUXIO_TASK_IDX, value);
+        } else if (key.compare("executor_share_nonio") == 0) {
+            engine.getWorkLoadPolicy().setShare(NONIO_TASK_IDX, value);
         }
     }
 
@@ -2024,6 +2063,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    HashTable::setDefaultHashFunction(configuration.getHtHashFunction());
+    HashTable::setDefaultLayout(configuration.getHtLayout());
+    HashTable::setDefaultResizeChunkSize(
+                                    configuration.getHtResizeChunkSize());
     StoredValue::setMutationMemoryThreshold(
                                       configuration.getMutationMemThreshold());
 
@@ -2065,6 +2108,21 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         return ENGINE_FAILED;
     }
 
+    workload->setShare(READER_TASK_IDX,
+                       configuration.getExecutorShareReader());
+    configuration.addValueChangedListener("executor_share_reader",
+                                       new EpEngineValueChangeListener(*this));
+    workload->setShare(WRITER_TASK_IDX,
+                       configuration.getExecutorShareWriter());
+    configuration.addValueChangedListener("executor_share_writer",
+                                       new EpEngineValueChangeListener(*this));
+    workload->setShare(AUXIO_TASK_IDX, configuration.getExecutorShareAuxio());
+    configuration.addValueChangedListener("executor_share_auxio",
+                                       new EpEngineValueChangeListener(*this));
+    workload->setShare(NONIO_TASK_IDX, configuration.getExecutorShareNonio());
+    configuration.addValueChangedListener("executor_share_nonio",
+                                       new EpEngineValueChangeListener(*this));
+
     dcpConnMap_ = new DcpConnMap(*this);
     tapConnMap = new TapConnMap(*this);
     tapConfig = new TapConfig(*this);
@@ -3058,6 +3116,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_commit_num", epstats.flusherCommits,
                     add_stat, cookie);
+    add_casted_stat("ep_flusher_prefetched_batches",
+                    epstats.flusherPrefetchedBatches, add_stat, cookie);
+    add_casted_stat("ep_flusher_group_commits",
+                    epstats.flusherGroupCommits, add_stat, cookie);
+    add_casted_stat("ep_flusher_group_commit_vbuckets",
+                    epstats.flusherGroupCommitVBuckets, add_stat, cookie);
     add_casted_stat("ep_commit_time",
                     epstats.commit_time, add_stat, cookie);
     add_casted_stat("ep_commit_time_total",
@@ -3305,6 +3369,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 #endif
     add_casted_stat("ep_storedval_num", stats.numStoredVal, add_stat, cookie);
     add_casted_stat("ep_overhead", stats.memOverhead, add_stat, cookie);
+    add_casted_stat("ep_checkpoint_memory", stats.checkpointMemory,
+                    add_stat, cookie);
     add_casted_stat("ep_item_num", stats.numItem, add_stat, cookie);
     add_casted_stat("ep_total_cache_size",
                     activeCountVisitor.getCacheSize() +
@@ -3321,6 +3387,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_bg_meta_fetched", epstats.bg_meta_fetched,
                     add_stat, cookie);
+    add_casted_stat("ep_bg_fetch_joined", epstats.bgFetchJoined,
+                    add_stat, cookie);
     add_casted_stat("ep_bg_remaining_jobs", epstats.numRemainingBgJobs,
                     add_stat, cookie);
     add_casted_stat("ep_max_bg_remaining_jobs", epstats.maxRemainingBgJobs,
@@ -3336,6 +3404,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_items_rm_from_checkpoints",
                     epstats.itemsRemovedFromCheckpoints,
                     add_stat, cookie);
+    add_casted_stat("ep_items_expelled_from_checkpoints",
+                    epstats.itemsExpelledFromCheckpoints,
+                    add_stat, cookie);
+    add_casted_stat("ep_cursors_dropped", epstats.cursorsDropped,
+                    add_stat, cookie);
     add_casted_stat("ep_num_value_ejects", epstats.numValueEjects,
                     add_stat, cookie);
     add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects,
@@ -3493,6 +3566,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
     add_casted_stat("ep_kv_size", stats.currentSize, add_stat, cookie);
     add_casted_stat("ep_value_size", stats.totalValueSize, add_stat, cookie);
     add_casted_stat("ep_overhead", stats.memOverhead, add_stat, cookie);
+    add_casted_stat("ep_checkpoint_memory", stats.checkpointMemory,
+                    add_stat, cookie);
     add_casted_stat("ep_max_size", stats.getMaxDataSize(), add_stat, cookie);
     add_casted_stat("ep_mem_low_wat", stats.mem_low_wat, add_stat, cookie);
     add_casted_stat("ep_mem_high_wat", stats.mem_high_wat, add_stat, cookie);
@@ -3514,6 +3589,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
     add_casted_stat("ep_storedval_overhead", "unknown", add_stat, cookie);
 #endif
     add_casted_stat("ep_storedval_num", stats.numStoredVal, add_stat, cookie);
+    add_casted_stat("ep_inline_value_num", stats.numInlineValue,
+                    add_stat, cookie);
+    add_casted_stat("ep_inline_value_saving",
+                    stats.numInlineValue.load() *
+                    StoredValue::inlineValueSaving, add_stat, cookie);
     add_casted_stat("ep_item_num", stats.numItem, add_stat, cookie);
 
 
@@ -3625,6 +3705,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.getSize(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:locks", vbid);
             add_casted_stat(buf, vb->ht.getNumLocks(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:layout", vbid);
+            add_casted_stat(buf,
+                            vb->ht.getLayout() == HT_LAYOUT_BUCKETIZED ?
+                            "bucketized" : "chained", add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:overhead", vbid);
+            add_casted_stat(buf, vb->ht.memorySize(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:min_depth", vbid);
             add_casted_stat(buf, depthVisitor.min == -1 ? 0 : depthVisitor.min,
                             add_stat, cookie);
@@ -3642,6 +3728,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted", vbid);
             add_casted_stat(buf, depthVisitor.memUsed, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:inline_values", vbid);
+            add_casted_stat(buf, vb->ht.numInlineValues, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:inline_saving", vbid);
+            add_casted_stat(buf, vb->ht.numInlineValues.load() *
+                            StoredValue::inlineValueSaving, add_stat, cookie);
 
             return false;
         }
@@ -4022,6 +4113,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doDcpStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_dcp_queue_backfillremaining",
                     aggregator.conn_queueBackfillRemaining, add_stat, cookie);
+    add_casted_stat("ep_dcp_backfills_shared",
+                    dcpConnMap_->getNumSharedBackfills(), add_stat, cookie);
 
     return ENGINE_SUCCESS;
 }
@@ -4151,6 +4244,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     // Misc
     add_casted_stat("notify_io", stats.notifyIOHisto, add_stat, cookie);
     add_casted_stat("batch_read", stats.getMultiHisto, add_stat, cookie);
+    add_casted_stat("ht_resize_stall", stats.htResizeStallHisto,
+                    add_stat, cookie);
 
     // Disk stats
     add_casted_stat("disk_insert", stats.diskInsertHisto, add_stat, cookie);
@@ -4158,6 +4253,13 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("disk_del", stats.diskDelHisto, add_stat, cookie);
     add_casted_stat("disk_vb_del", stats.diskVBDelHisto, add_stat, cookie);
     add_casted_stat("disk_commit", stats.diskCommitHisto, add_stat, cookie);
+    add_casted_stat("flush_collect", stats.flushCollectHisto,
+                    add_stat, cookie);
+    add_casted_stat("flush_write", stats.flushWriteHisto, add_stat, cookie);
+    add_casted_stat("flush_complete", stats.flushCompleteHisto,
+                    add_stat, cookie);
+    add_casted_stat("flush_group_sync", stats.flushGroupSyncHisto,
+                    add_stat, cookie);
     add_casted_stat("disk_vbstate_snapshot", stats.snapshotVbucketHisto,
                     add_stat, cookie);
 
@@ -4175,6 +4277,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doSchedulerStats(const void
                         stats.schedulingHisto[i],
                         add_stat, cookie);
     }
+    add_casted_stat("numa_local_tasks", stats.numaLocalTasks, add_stat, cookie);
+    add_casted_stat("numa_remote_tasks", stats.numaRemoteTasks,
+                    add_stat, cookie);
 
     return ENGINE_SUCCESS;
 }
@@ -4252,6 +4357,22 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doWorkloadStats(const void
     snprintf(statname, sizeof(statname), "ep_workload:num_sleepers");
     add_casted_stat(statname, numSleepers, add_stat, cookie);
 
+    if (expool->isFairShare()) {
+        static const char *typeNames[] = { "writer", "reader", "auxio",
+                                           "nonio" };
+        for (int i = 0; i < NUM_TASK_GROUPS; ++i) {
+            task_type_t type = static_cast<task_type_t>(i);
+            snprintf(statname, sizeof(statname), "ep_workload:share_%s",
+                     typeNames[i]);
+            add_casted_stat(statname, workload->getShare(type), add_stat,
+                            cookie);
+            snprintf(statname, sizeof(statname), "ep_workload:vruntime_%s",
+                     typeNames[i]);
+            add_casted_stat(statname, workload->getVirtualRuntime(type),
+                            add_stat, cookie);
+        }
+    }
+
     expool->doTaskQStat(ObjectRegistry::getCurrentEngine(),
                                       cookie, add_stat);
     return ENGINE_SUCCESS;
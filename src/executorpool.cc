@@ -18,9 +18,14 @@
 #include "config.h"
 
 #include <algorithm>
+#include <fstream>
 #include <queue>
 #include <sstream>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include "statwriter.h"
 #include "taskqueue.h"
 #include "executorpool.h"
@@ -126,6 +131,58 @@ size_t ExecutorPool::getNumReaders(void) {
     return count;
 }
 
+#ifdef __linux__
+/**
+ * Parse a list of ids in the sysfs format, like "0-3,8-11".
+ */
+static std::vector<int> parseIdList(const std::string &list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first, last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n == 1) {
+            last = first;
+        } else if (n != 2) {
+            continue;
+        }
+        for (int id = first; id <= last; ++id) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+#endif
+
+/**
+ * Get the CPUs of each online NUMA node of the host that has any.
+ */
+static std::vector<std::vector<int> > getNumaTopology(void) {
+    std::vector<std::vector<int> > nodes;
+#ifdef __linux__
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (!std::getline(online, list)) {
+        return nodes;
+    }
+
+    std::vector<int> nodeIds = parseIdList(list);
+    for (size_t i = 0; i < nodeIds.size(); ++i) {
+        std::stringstream path;
+        path << "/sys/devices/system/node/node" << nodeIds[i] << "/cpulist";
+        std::ifstream cpulist(path.str().c_str());
+        if (std::getline(cpulist, list)) {
+            std::vector<int> cpus = parseIdList(list);
+            if (!cpus.empty()) {
+                nodes.push_back(cpus);
+            }
+        }
+    }
+#endif
+    return nodes;
+}
+
 ExecutorPool *ExecutorPool::get(void) {
     if (!instance) {
         LockHolder lh(initGuard);
@@ -137,7 +194,9 @@ ExecutorPool *ExecutorPool::get(void) {
             instance = new ExecutorPool(config.getMaxThreads(),
                     NUM_TASK_GROUPS, config.getMaxNumReaders(),
                     config.getMaxNumWriters(), config.getMaxNumAuxio(),
-                    config.getMaxNumNonio());
+                    config.getMaxNumNonio(), config.isExecutorWorkStealing(),
+                    config.isExecutorNumaAware(),
+                    config.isExecutorFairShare());
             ObjectRegistry::onSwitchThread(epe);
         }
     }
@@ -146,9 +205,13 @@ ExecutorPool *ExecutorPool::get(void) {
 
 ExecutorPool::ExecutorPool(size_t maxThreads, size_t nTaskSets,
                            size_t maxReaders, size_t maxWriters,
-                           size_t maxAuxIO,   size_t maxNonIO) :
-                  numTaskSets(nTaskSets), totReadyTasks(0),
-                  isHiPrioQset(false), isLowPrioQset(false), numBuckets(0) {
+                           size_t maxAuxIO,   size_t maxNonIO,
+                           bool stealing, bool numaAware, bool fair) :
+                  numTaskSets(nTaskSets), workStealing(stealing),
+                  fairShare(fair),
+                  totReadyTasks(0),
+                  isHiPrioQset(false), isLowPrioQset(false), numBuckets(0),
+                  numSleepers(0) {
     size_t numCPU = getNumCPU();
     size_t numThreads = (size_t)((numCPU * 3)/4);
     numThreads = (numThreads < EP_MIN_NUM_THREADS) ?
@@ -165,6 +228,15 @@ ExecutorPool::ExecutorPool(size_t maxThreads, size_t nTaskSets,
     maxWorkers[READER_TASK_IDX] = maxReaders;
     maxWorkers[AUXIO_TASK_IDX]  = maxAuxIO;
     maxWorkers[NONIO_TASK_IDX]  = maxNonIO;
+
+    if (numaAware) {
+        numaNodes = getNumaTopology();
+        if (numaNodes.size() < 2) {
+            LOG(EXTENSION_LOG_WARNING, "Not binding executor threads to NUMA "
+                "nodes as the host has %d node(s)", (int)numaNodes.size());
+            numaNodes.clear();
+        }
+    }
 }
 
 ExecutorPool::~ExecutorPool(void) {
@@ -186,11 +258,28 @@ ExecutorPool::~ExecutorPool(void) {
 // polling frequencies as follows ...
 #define LOW_PRIORITY_FREQ 5 // 1 out of 5 times threads check low priority Q
 
+// In work stealing mode threads poll the shared TaskQueues before their run
+// queue 1 out of 8 times, so that tasks which keep running again right away
+// do not hold back newly scheduled ones
+#define SHARED_QUEUE_FREQ 8
+
 TaskQueue *ExecutorPool::_nextTask(ExecutorThread &t, uint8_t tick) {
     if (!tick) {
         return NULL;
     }
 
+    if (workStealing) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        // Unless a snoozed task is due, go for the ready tasks first
+        if ((tick % SHARED_QUEUE_FREQ) && less_tv(now, t.waketime)) {
+            TaskQueue *q = _nextRunQueueTask(t);
+            if (q) {
+                return q;
+            }
+        }
+    }
+
     unsigned int myq = t.startIndex;
     TaskQueue *checkQ; // which TaskQueue set should be polled first
     TaskQueue *checkNextQ; // which set of TaskQueue should be polled next
@@ -231,6 +320,111 @@ TaskQueue *ExecutorPool::nextTask(ExecutorThread &t, uint8_t tick) {
     return tq;
 }
 
+TaskQueue *ExecutorPool::_nextRunQueueTask(ExecutorThread &t) {
+    TaskQpair tqp;
+    {
+        LockHolder lh(t.runQueueLock);
+        if (!t.runQueue.empty()) {
+            tqp = t.runQueue.top();
+            t.runQueue.pop();
+        }
+    }
+
+    if (!tqp.first && !_stealTask(t, tqp)) {
+        return NULL;
+    }
+    lessWork(tqp.second->getQueueType());
+
+    t.currentTask = tqp.first;
+    if (t.currentTask->isdead()) {
+        return tqp.second; // cleaned out without taking up capacity
+    }
+
+    t.curTaskType = tryNewWork(tqp.second->getQueueType());
+    if (t.curTaskType != NO_TASK_TYPE) {
+        return tqp.second;
+    }
+
+    // We hit the limit on workers of this type, so let the task wait in the
+    // pending queue of its TaskQueue like any other task
+    tqp.second->pend(t.currentTask);
+    t.currentTask.reset();
+    return NULL;
+}
+
+bool ExecutorPool::_stealTask(ExecutorThread &t, TaskQpair &tqp) {
+    if (!numReadyTasks[t.startIndex]) {
+        return false;
+    }
+
+    size_t numThreads = threadQ.size();
+    // Look for a victim on the NUMA node of this thread before any other
+    for (int pass = t.numaNode < 0 ? 1 : 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < numThreads; ++i) {
+            size_t idx = (t.nextVictim + i) % numThreads;
+            ExecutorThread *victim = threadQ[idx];
+            if (victim == &t || victim->startIndex != t.startIndex ||
+                (!pass && victim->numaNode != t.numaNode)) {
+                continue;
+            }
+
+            LockHolder lh(victim->runQueueLock);
+            if (!victim->runQueue.empty()) {
+                tqp = victim->runQueue.top();
+                victim->runQueue.pop();
+                t.nextVictim = idx;
+                t.numStolen++;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void ExecutorPool::_runNext(ExecutorThread &t, ExTask &task, TaskQueue *q) {
+    task_type_t qType = q->getQueueType();
+    addWork(1, qType); // before any thread can steal it
+
+    size_t queued;
+    {
+        LockHolder lh(t.runQueueLock);
+        t.runQueue.push(TaskQpair(task, q));
+        queued = t.runQueue.size();
+    }
+
+    // This thread runs one of them next, let a sleeping one steal another
+    if (queued > 1 && numSleepers) {
+        size_t numToWake = 1;
+        getSleepQ(qType)->doWake(numToWake);
+    }
+}
+
+void ExecutorPool::runNext(ExecutorThread &t, ExTask &task, TaskQueue *q) {
+    EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
+    _runNext(t, task, q);
+    ObjectRegistry::onSwitchThread(epe);
+}
+
+void ExecutorPool::bindToNumaNode(ExecutorThread &t) {
+    if (t.numaNode < 0 || (size_t)t.numaNode >= numaNodes.size()) {
+        return;
+    }
+#ifdef __linux__
+    const std::vector<int> &cpus = numaNodes[t.numaNode];
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &cpuset);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+        LOG(EXTENSION_LOG_WARNING, "%s: Failed to bind to the CPUs of NUMA "
+            "node %d: %s", t.getName().c_str(), t.numaNode, strerror(errno));
+    }
+#endif
+}
+
 void ExecutorPool::addWork(size_t newWork, task_type_t qType) {
     if (newWork) {
         totReadyTasks.fetch_add(newWork);
@@ -461,28 +655,41 @@ bool ExecutorPool::_startWorkers(void) {
         ss << "reader_worker_" << tidx;
 
         threadQ.push_back(new ExecutorThread(this, READER_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
     for (size_t tidx = 0; tidx < numWriters; ++tidx) {
         std::stringstream ss;
         ss << "writer_worker_" << numReaders + tidx;
 
         threadQ.push_back(new ExecutorThread(this, WRITER_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
     for (size_t tidx = 0; tidx < numAuxIO; ++tidx) {
         std::stringstream ss;
         ss << "auxio_worker_" << numReaders + numWriters + tidx;
 
         threadQ.push_back(new ExecutorThread(this, AUXIO_TASK_IDX, ss.str()));
-        threadQ.back()->start();
     }
     for (size_t tidx = 0; tidx < numNonIO; ++tidx) {
         std::stringstream ss;
         ss << "nonio_worker_" << numReaders + numWriters + numAuxIO + tidx;
 
         threadQ.push_back(new ExecutorThread(this, NONIO_TASK_IDX, ss.str()));
-        threadQ.back()->start();
+    }
+
+    if (!numaNodes.empty()) {
+        // Spread the threads of each type evenly over the nodes
+        LOG(EXTENSION_LOG_WARNING, "Binding executor threads to %d NUMA "
+            "nodes", (int)numaNodes.size());
+        std::vector<size_t> numOfType(numTaskSets, 0);
+        for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
+            ExecutorThread *t = threadQ[tidx];
+            t->numaNode = numOfType[t->startIndex]++ % numaNodes.size();
+        }
+    }
+
+    // Start the threads once they are all in threadQ, which threads that
+    // steal tasks walk without a lock
+    for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
+        threadQ[tidx]->start();
     }
 
     if (!maxWorkers[WRITER_TASK_IDX]) {
@@ -621,6 +828,14 @@ void ExecutorPool::doTaskQStat(EventuallyPersistentEngine *engine,
                      hpTaskQ[i]->getName().c_str());
             add_casted_stat(statname, hpTaskQ[i]->getReadyQueueSize(), add_stat,
                             cookie);
+            snprintf(statname, sizeof(statname), "ep_workload:%s:TimerSlipAvg",
+                     hpTaskQ[i]->getName().c_str());
+            add_casted_stat(statname, hpTaskQ[i]->getAvgTimerSlip(), add_stat,
+                            cookie);
+            snprintf(statname, sizeof(statname), "ep_workload:%s:TimerSlipMax",
+                     hpTaskQ[i]->getName().c_str());
+            add_casted_stat(statname, hpTaskQ[i]->getMaxTimerSlip(), add_stat,
+                            cookie);
             size_t pendingQsize = hpTaskQ[i]->getPendingQueueSize();
             if (pendingQsize > 0) {
                 snprintf(statname, sizeof(statname), "ep_workload:%s:PendingQ",
@@ -639,6 +854,14 @@ void ExecutorPool::doTaskQStat(EventuallyPersistentEngine *engine,
                      lpTaskQ[i]->getName().c_str());
             add_casted_stat(statname, lpTaskQ[i]->getReadyQueueSize(), add_stat,
                             cookie);
+            snprintf(statname, sizeof(statname), "ep_workload:%s:TimerSlipAvg",
+                     lpTaskQ[i]->getName().c_str());
+            add_casted_stat(statname, lpTaskQ[i]->getAvgTimerSlip(), add_stat,
+                            cookie);
+            snprintf(statname, sizeof(statname), "ep_workload:%s:TimerSlipMax",
+                     lpTaskQ[i]->getName().c_str());
+            add_casted_stat(statname, lpTaskQ[i]->getMaxTimerSlip(), add_stat,
+                            cookie);
             size_t pendingQsize = lpTaskQ[i]->getPendingQueueSize();
             if (pendingQsize > 0) {
                 snprintf(statname, sizeof(statname), "ep_workload:%s:PendingQ",
@@ -676,7 +899,8 @@ static void showJobLog(const char *logname, const char *prefix,
 }
 
 static void addWorkerStats(const char *prefix, ExecutorThread *t,
-                           const void *cookie, ADD_STAT add_stat) {
+                           bool workStealing, const void *cookie,
+                           ADD_STAT add_stat) {
     char statname[80] = {0};
     snprintf(statname, sizeof(statname), "%s:state", prefix);
     add_casted_stat(statname, t->getStateName().c_str(), add_stat, cookie);
@@ -696,6 +920,18 @@ static void addWorkerStats(const char *prefix, ExecutorThread *t,
     abstime = t->getCurTime().tv_sec*1000000 +
               t->getCurTime().tv_usec;
     add_casted_stat(statname, abstime, add_stat, cookie);
+
+    if (t->getNumaNode() >= 0) {
+        snprintf(statname, sizeof(statname), "%s:numa_node", prefix);
+        add_casted_stat(statname, t->getNumaNode(), add_stat, cookie);
+    }
+
+    if (workStealing) {
+        snprintf(statname, sizeof(statname), "%s:run_queue", prefix);
+        add_casted_stat(statname, t->getRunQueueSize(), add_stat, cookie);
+        snprintf(statname, sizeof(statname), "%s:stolen", prefix);
+        add_casted_stat(statname, t->getNumStolen(), add_stat, cookie);
+    }
 }
 
 void ExecutorPool::doWorkerStat(EventuallyPersistentEngine *engine,
@@ -708,7 +944,7 @@ void ExecutorPool::doWorkerStat(EventuallyPersistentEngine *engine,
     //TODO: implement tracking per engine stats ..
     for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
         addWorkerStats(threadQ[tidx]->getName().c_str(), threadQ[tidx],
-                     cookie, add_stat);
+                       workStealing, cookie, add_stat);
         showJobLog("log", threadQ[tidx]->getName().c_str(),
                    threadQ[tidx]->getLog(), cookie, add_stat);
         showJobLog("slow", threadQ[tidx]->getName().c_str(),
@@ -19,6 +19,7 @@
 
 #include "config.h"
 
+#include <deque>
 #include <map>
 #include <set>
 #include <queue>
@@ -38,7 +39,22 @@ typedef std::pair<RingBuffer<TaskLogEntry>*, RingBuffer<TaskLogEntry> *>
                                                                 TaskLog;
 typedef std::vector<TaskQueue *> TaskQ;
 
+/**
+ * Order the tasks of a thread's run queue like a TaskQueue orders its
+ * ready queue.
+ */
+class CompareTaskQpairByPriority {
+public:
+    bool operator()(TaskQpair &t1, TaskQpair &t2) {
+        return CompareByPriority()(t1.first, t2.first);
+    }
+};
+
+typedef std::priority_queue<TaskQpair, std::deque<TaskQpair>,
+                            CompareTaskQpairByPriority> RunQueue;
+
 class ExecutorPool {
+    friend class ExecutorPoolTest;
 public:
 
     void addWork(size_t newWork, task_type_t qType);
@@ -63,6 +79,52 @@ public:
 
     TaskQueue *nextTask(ExecutorThread &t, uint8_t tick);
 
+    /**
+     * Whether threads keep ready tasks in run queues of their own, which
+     * idle threads of the same type steal from, rather than taking every
+     * task from the shared TaskQueues.
+     */
+    bool isWorkStealing(void) { return workStealing; }
+
+    /**
+     * Whether the ready tasks of each type are ordered by the virtual
+     * runtime of their bucket, so that buckets share the threads of a type
+     * by the weights in their WorkLoadPolicy.
+     */
+    bool isFairShare(void) { return fairShare; }
+
+    /**
+     * Queue a task that is ready to run again on the run queue of the
+     * thread that just ran it.
+     */
+    void runNext(ExecutorThread &t, ExTask &task, TaskQueue *q);
+
+    /**
+     * Number of NUMA nodes the threads are spread over, or 0 when threads
+     * are not bound to nodes.
+     */
+    size_t getNumNumaNodes(void) { return numaNodes.size(); }
+
+    /**
+     * Get the NUMA node a task should preferably run on, which is derived
+     * from the shard the task works on.
+     *
+     * @return the node, or -1 if the task may run on any node
+     */
+    int getHomeNode(ExTask &task) {
+        int shard = task->getShardAffinity();
+        if (numaNodes.empty() || shard < 0) {
+            return -1;
+        }
+        return shard % numaNodes.size();
+    }
+
+    /**
+     * Bind the calling thread to the CPUs of the NUMA node of the given
+     * executor thread.
+     */
+    void bindToNumaNode(ExecutorThread &t);
+
     TaskQueue *getSleepQ(unsigned int curTaskType) {
         return isHiPrioQset ? hpTaskQ[curTaskType] : lpTaskQ[curTaskType];
     }
@@ -126,10 +188,13 @@ public:
 private:
 
     ExecutorPool(size_t t, size_t nTaskSets, size_t r, size_t w, size_t a,
-                 size_t n);
+                 size_t n, bool stealing, bool numaAware, bool fair);
     ~ExecutorPool(void);
 
     TaskQueue* _nextTask(ExecutorThread &t, uint8_t tick);
+    TaskQueue* _nextRunQueueTask(ExecutorThread &t);
+    bool _stealTask(ExecutorThread &t, TaskQpair &tqp);
+    void _runNext(ExecutorThread &t, ExTask &task, TaskQueue *q);
     bool _cancel(size_t taskId, bool eraseTask=false);
     bool _wake(size_t taskId);
     bool _startWorkers(void);
@@ -142,6 +207,11 @@ private:
 
     size_t numTaskSets; // safe to read lock-less not altered after creation
     size_t maxGlobalThreads;
+    bool workStealing; // not altered after creation either
+    bool fairShare; // nor this
+
+    //! The CPUs of each NUMA node, when threads are bound to nodes
+    std::vector<std::vector<int> > numaNodes;
 
     AtomicValue<size_t> totReadyTasks;
     SyncObject mutex; // Thread management condition var + mutex
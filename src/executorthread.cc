@@ -69,6 +69,10 @@ void ExecutorThread::run() {
 
     LOG(EXTENSION_LOG_DEBUG, "Thread %s running..", getName().c_str());
 
+    if (numaNode >= 0) {
+        manager->bindToNumaNode(*this);
+    }
+
     for (uint8_t tick = 1;; tick++) {
         currentTask.reset();
         if (state != EXECUTOR_RUNNING) {
@@ -97,6 +101,15 @@ void ExecutorThread::run() {
             engine->getEpStore()->logQTime(currentTask->getTypeId(),
                                    diffsec*1000000 + diffusec);
 
+            if (numaNode >= 0) {
+                int homeNode = manager->getHomeNode(currentTask);
+                if (homeNode == numaNode) {
+                    engine->getEpStats().numaLocalTasks++;
+                } else if (homeNode >= 0) {
+                    engine->getEpStats().numaRemoteTasks++;
+                }
+            }
+
             taskStart = gethrtime();
             rel_time_t startReltime = ep_current_time();
             try {
@@ -113,6 +126,12 @@ void ExecutorThread::run() {
                 hrtime_t runtime((gethrtime() - taskStart) / 1000);
                 engine->getEpStore()->logRunTime(currentTask->getTypeId(),
                                                runtime);
+                if (manager->isFairShare()) {
+                    engine->getWorkLoadPolicy().chargeRuntime(
+                                                q->getQueueType(),
+                                                currentTask->fairShareTag,
+                                                runtime);
+                }
                 ObjectRegistry::onSwitchThread(NULL);
                 addLogEntry(engine->getName() + currentTask->getDescription(),
                         q->getQueueType(), runtime, startReltime,
@@ -128,11 +147,18 @@ void ExecutorThread::run() {
                     struct timeval timetowake;
                     // if a task has not set snooze, update its waketime to now
                     // before rescheduling for more accurate timing histograms
-                    if (less_eq_tv(currentTask->waketime, now)) {
+                    bool runAgain = less_eq_tv(currentTask->waketime, now);
+                    if (runAgain) {
                         currentTask->waketime = now;
                     }
                     // release capacity back to TaskQueue ..
                     manager->doneWork(curTaskType);
+                    if (runAgain && manager->isWorkStealing() &&
+                        !manager->isFairShare()) {
+                        // Keep it on this thread, clear of the TaskQueue
+                        manager->runNext(*this, currentTask, q);
+                        continue;
+                    }
                     timetowake = q->reschedule(currentTask, curTaskType);
                     // record min waketime ...
                     if (less_tv(timetowake, waketime)) {
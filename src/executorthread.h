@@ -29,6 +29,7 @@
 
 #include "atomic.h"
 #include "common.h"
+#include "executorpool.h"
 #include "mutex.h"
 #include "objectregistry.h"
 #include "tasks.h"
@@ -55,6 +56,7 @@ typedef enum {
 
 class ExecutorThread {
     friend class ExecutorPool;
+    friend class ExecutorPoolTest;
     friend class TaskQueue;
 public:
 
@@ -63,6 +65,7 @@ public:
           startIndex(startingQueue), name(nm),
           state(EXECUTOR_CREATING), taskStart(0),
           currentTask(NULL), curTaskType(NO_TASK_TYPE),
+          nextVictim(0), numStolen(0), numaNode(-1),
           tasklog(TASK_LOG_SIZE), slowjobs(TASK_LOG_SIZE) {
               set_max_tv(waketime);
     }
@@ -117,6 +120,15 @@ public:
 
     struct timeval getCurTime(void) { return now; }
 
+    size_t getRunQueueSize(void) {
+        LockHolder lh(runQueueLock);
+        return runQueue.size();
+    }
+
+    size_t getNumStolen(void) { return numStolen; }
+
+    int getNumaNode(void) { return numaNode; }
+
 private:
 
     cb_thread_t thread;
@@ -132,6 +144,18 @@ private:
     ExTask currentTask;
     task_type_t curTaskType;
 
+    //! Ready tasks this thread runs next, in work stealing mode. Idle
+    //! threads of the same type steal from it.
+    Mutex runQueueLock;
+    RunQueue runQueue;
+    //! Where in the pool's threads to look for the next task to steal
+    size_t nextVictim;
+    //! The tasks taken from the run queues of other threads
+    AtomicValue<size_t> numStolen;
+
+    //! The NUMA node this thread is bound to, or -1 if it is not bound
+    int numaNode;
+
     Mutex logMutex;
     RingBuffer<TaskLogEntry> tasklog;
     RingBuffer<TaskLogEntry> slowjobs;
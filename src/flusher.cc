@@ -25,6 +25,7 @@
 #include <vector>
 #include <sstream>
 
+#include "ep_engine.h"
 #include "flusher.h"
 
 bool Flusher::stop(bool isForceShutdown) {
@@ -137,6 +138,16 @@ void Flusher::schedule_UNLOCKED() {
     this->setTaskId(task->getId());
     iom->schedule(task, WRITER_TASK_IDX);
     cb_assert(taskId > 0);
+
+    Configuration &config = store->getEPEngine().getConfiguration();
+    if (config.isFlusherPipeliningEnabled() && !collectorTaskId) {
+        ExTask collector = new FlushCollectorTask(
+                                  ObjectRegistry::getCurrentEngine(), this,
+                                  Priority::FlushCollectorPriority,
+                                  shard->getId());
+        collectorTaskId = collector->getId();
+        iom->schedule(collector, NONIO_TASK_IDX);
+    }
 }
 
 void Flusher::start() {
@@ -166,12 +177,17 @@ bool Flusher::step(GlobalTask *task) {
             if (_state == pausing) {
                 transition_state(paused);
             }
+            endFlushGroup();
             // Indefinitely put task to sleep..
             task->snooze(INT_MAX);
             return true;
         case running:
             {
                 flushVB();
+                if (canSnooze() || _state != running ||
+                    store->diskFlushAll) {
+                    endFlushGroup();
+                }
                 if (_state == running) {
                     double tosleep = computeMinSleepTime();
                     if (tosleep > 0) {
@@ -188,12 +204,17 @@ bool Flusher::step(GlobalTask *task) {
                 LOG(EXTENSION_LOG_DEBUG, "%s", ss.str().c_str());
             }
             completeFlush();
+            endFlushGroup();
             LOG(EXTENSION_LOG_DEBUG, "Flusher stopped");
             transition_state(stopped);
         case stopped:
             {
                 LockHolder lh(taskMutex);
                 taskId = 0;
+                if (collectorTaskId) {
+                    ExecutorPool::get()->cancel(collectorTaskId);
+                    collectorTaskId = 0;
+                }
                 return false;
             }
         default:
@@ -248,6 +269,17 @@ void Flusher::flushVB(void) {
         for (; itr != vbs.end(); ++itr) {
             lpVbs.push(static_cast<uint16_t>(*itr));
         }
+
+        // Drop batches collected from vbuckets deleted since
+        LockHolder lh(prefetchSync);
+        std::map<uint16_t, FlushBatch>::iterator it = prefetched.begin();
+        while (it != prefetched.end()) {
+            if (store->getVBucket(it->first).get() != it->second.vb.get()) {
+                prefetched.erase(it++);
+            } else {
+                ++it;
+            }
+        }
     }
 
     if (!doHighPriority && shard->highPriorityCount.load() > 0) {
@@ -271,7 +303,7 @@ void Flusher::flushVB(void) {
     } else if (!hpVbs.empty()) {
         uint16_t vbid = hpVbs.front();
         hpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
+        if (flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
             hpVbs.push(vbid);
         }
     } else {
@@ -280,8 +312,133 @@ void Flusher::flushVB(void) {
         }
         uint16_t vbid = lpVbs.front();
         lpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
+        if (flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
             lpVbs.push(vbid);
         }
     }
 }
+
+int Flusher::flushVBucket(uint16_t vbid) {
+    FlushBatch batch;
+    bool havePrefetched = claimPrefetched(vbid, batch);
+
+    // Let the collector gather the next vbucket while this one commits
+    requestPrefetch(vbid);
+
+    Configuration &config = store->getEPEngine().getConfiguration();
+    size_t maxLatency = config.getFlusherGroupCommitMaxLatency();
+    if (groupOpen && inFlushGroup(vbid)) {
+        // A vbucket is only committed once per group
+        endFlushGroup();
+    }
+    if (maxLatency > 0 && _state == running && !groupOpen) {
+        store->beginFlushGroup(shard->getId());
+        groupStart = gethrtime();
+        groupOpen = true;
+    }
+
+    int rv = store->flushVBucket(vbid, havePrefetched ? &batch : NULL,
+                                 groupOpen ? &groupCompletions : NULL);
+    if (rv == RETRY_FLUSH_VBUCKET && batch.numQueued > 0) {
+        // Keep it until the vbucket comes round again
+        LockHolder lh(prefetchSync);
+        prefetched[vbid].swap(batch);
+    }
+
+    if (groupOpen &&
+        (groupCompletions.size() >= config.getFlusherGroupCommitMaxVbuckets() ||
+         (gethrtime() - groupStart) / 1000 >= maxLatency)) {
+        endFlushGroup();
+    }
+    return rv;
+}
+
+bool Flusher::inFlushGroup(uint16_t vbid) {
+    std::vector<FlushCompletion>::iterator it = groupCompletions.begin();
+    for (; it != groupCompletions.end(); ++it) {
+        if (it->vb->getId() == vbid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Flusher::endFlushGroup() {
+    if (!groupOpen) {
+        return;
+    }
+    store->endFlushGroup(shard->getId(), groupCompletions);
+    groupOpen = false;
+}
+
+void Flusher::requestPrefetch(uint16_t current) {
+    if (!collectorTaskId || _state != running) {
+        return;
+    }
+
+    uint16_t next;
+    if (!hpVbs.empty()) {
+        next = hpVbs.front();
+    } else if (!lpVbs.empty()) {
+        next = lpVbs.front();
+    } else {
+        return;
+    }
+
+    if (next == current) {
+        return;
+    }
+
+    LockHolder lh(prefetchSync);
+    if (prefetchPending != -1 || prefetchCollecting != -1 ||
+        prefetched.find(next) != prefetched.end()) {
+        return;
+    }
+    prefetchPending = next;
+    lh.unlock();
+    ExecutorPool::get()->wake(collectorTaskId);
+}
+
+bool Flusher::claimPrefetched(uint16_t vbid, FlushBatch &batch) {
+    LockHolder lh(prefetchSync);
+    if (prefetchPending == vbid) {
+        prefetchPending = -1;
+    }
+    while (prefetchCollecting == vbid) {
+        prefetchSync.wait();
+    }
+
+    std::map<uint16_t, FlushBatch>::iterator it = prefetched.find(vbid);
+    if (it == prefetched.end()) {
+        return false;
+    }
+    batch.swap(it->second);
+    prefetched.erase(it);
+    return true;
+}
+
+bool Flusher::collect(GlobalTask *task) {
+    // Sleep until the next request; a wake while collecting reruns us.
+    task->snooze(INT_MAX);
+
+    LockHolder lh(prefetchSync);
+    if (prefetchPending == -1) {
+        return true;
+    }
+    uint16_t vbid = static_cast<uint16_t>(prefetchPending);
+    prefetchPending = -1;
+    prefetchCollecting = vbid;
+    lh.unlock();
+
+    FlushBatch batch;
+    bool collected = store->collectFlushBatch(vbid, batch);
+
+    lh.lock();
+    if (collected && batch.numQueued > 0) {
+        prefetched[vbid].swap(batch);
+        ++store->getEPEngine().getEpStats().flusherPrefetchedBatches;
+    }
+    prefetchCollecting = -1;
+    prefetchSync.notify();
+    return true;
+}
@@ -29,6 +29,7 @@
 #include "common.h"
 #include "ep.h"
 #include "executorthread.h"
+#include "syncobject.h"
 
 #define NO_VBUCKETS_INSTANTIATED 0xFFFF
 #define RETRY_FLUSH_VBUCKET (-1)
@@ -56,9 +57,11 @@ class Flusher {
 public:
 
     Flusher(EventuallyPersistentStore *st, KVShard *k) :
-        store(st), _state(initializing), taskId(0), minSleepTime(0.1),
-        forceShutdownReceived(false), doHighPriority(false),
-        numHighPriority(0), pendingMutation(false), shard(k) { }
+        store(st), _state(initializing), taskId(0), collectorTaskId(0),
+        minSleepTime(0.1), forceShutdownReceived(false),
+        doHighPriority(false), numHighPriority(0), pendingMutation(false),
+        prefetchPending(-1), prefetchCollecting(-1), groupStart(0),
+        groupOpen(false), shard(k) { }
 
     ~Flusher() {
         if (_state != stopped) {
@@ -77,6 +80,12 @@ public:
     void wake(void);
     bool step(GlobalTask *task);
 
+    /**
+     * Collect the flush batch requested by the flusher task, so that it
+     * is ready by the time that vbucket comes up for flushing.
+     */
+    bool collect(GlobalTask *task);
+
     enum flusher_state state() const;
     const char * stateName() const;
 
@@ -94,6 +103,11 @@ public:
 private:
     bool transition_state(enum flusher_state to);
     void flushVB();
+    int flushVBucket(uint16_t vbid);
+    void requestPrefetch(uint16_t current);
+    bool claimPrefetched(uint16_t vbid, FlushBatch &batch);
+    bool inFlushGroup(uint16_t vbid);
+    void endFlushGroup();
     void completeFlush();
     void schedule_UNLOCKED();
     double computeMinSleepTime();
@@ -108,6 +122,7 @@ private:
     AtomicValue<enum flusher_state> _state;
     Mutex                        taskMutex;
     size_t                       taskId;
+    size_t                       collectorTaskId;
 
     double                   minSleepTime;
     rel_time_t               flushStart;
@@ -118,6 +133,20 @@ private:
     size_t numHighPriority;
     AtomicValue<bool> pendingMutation;
 
+    // Guards the batch collection handed off to the collector task
+    SyncObject prefetchSync;
+    //! vbucket the collector should collect next, or -1
+    int prefetchPending;
+    //! vbucket the collector is collecting right now, or -1
+    int prefetchCollecting;
+    //! Collected batches waiting for their vbucket to be flushed
+    std::map<uint16_t, FlushBatch> prefetched;
+
+    //! Vbuckets committed in the open group, awaiting its sync
+    std::vector<FlushCompletion> groupCompletions;
+    hrtime_t groupStart;
+    bool groupOpen;
+
     KVShard *shard;
 
     DISALLOW_COPY_AND_ASSIGN(Flusher);
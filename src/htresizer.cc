@@ -23,26 +23,66 @@
 
 static const double FREQUENCY(60.0);
 
+// How often we reclaim what writers have retired from the hash tables.
+static const double RECLAIM_FREQUENCY(1.0);
+
+// How long we migrate buckets for before giving other tasks a turn, and
+// how long we then wait before resuming.
+static const hrtime_t CHUNK_DURATION(10 * 1000 * 1000);
+static const double PAUSE_TIME(0.01);
+
 /**
  * Look at all the hash tables and make sure they're sized appropriately.
  */
-class ResizingVisitor : public VBucketVisitor {
+class ResizingVisitor : public PauseResumeEPStoreVisitor,
+                        public PauseResumeHashTableResizer {
 public:
 
-    ResizingVisitor() { }
+    ResizingVisitor(hrtime_t d, bool r) : deadline(d), resizing(r) { }
+
+    bool visit(uint16_t vbucket_id, HashTable &ht) {
+        (void)vbucket_id;
+        ht.reclaimRetired();
+        if (resizing) {
+            // A no-op while a previous resize is still being migrated.
+            ht.resize();
+        }
+        // A table that visitors are walking can't be migrated until they
+        // are done. Rather than retry it every PAUSE_TIME, move on and pick
+        // its resize up again on the next pass.
+        ht.pauseResumeResize(*this);
+        return gethrtime() < deadline;
+    }
 
-    bool visitBucket(RCPtr<VBucket> &vb) {
-        vb->ht.resize();
-        return false;
+    bool migrated(hrtime_t stall) {
+        (void)stall;
+        return gethrtime() < deadline;
     }
 
+private:
+    const hrtime_t deadline;
+    const bool resizing;
 };
 
 bool HashtableResizerTask::run(void) {
-    shared_ptr<ResizingVisitor> pv(new ResizingVisitor);
-    store->visit(pv, "Hashtable resizer", NONIO_TASK_IDX,
-            Priority::ItemPagerPriority);
+    if (position == store->startPosition()) {
+        // Only look for tables to resize every FREQUENCY; the passes in
+        // between just reclaim and carry on with incremental resizes.
+        hrtime_t now = gethrtime();
+        resizing = now >= nextResize;
+        if (resizing) {
+            nextResize = now + static_cast<hrtime_t>(FREQUENCY * 1000000000);
+        }
+    }
+
+    ResizingVisitor visitor(gethrtime() + CHUNK_DURATION, resizing);
+    position = store->pauseResumeVisit(visitor, position);
 
-    snooze(FREQUENCY);
+    if (position == store->endPosition()) {
+        position = store->startPosition();
+        snooze(RECLAIM_FREQUENCY);
+    } else {
+        snooze(PAUSE_TIME);
+    }
     return true;
 }
@@ -22,20 +22,25 @@
 
 #include <string>
 
+#include "ep.h"
 #include "tasks.h"
 
-class EventuallyPersistentStore;
-
 /**
  * Look around at hash tables and verify they're all sized
  * appropriately.
+ *
+ * Incremental resizes are driven a chunk of buckets at a time, pausing
+ * whenever the task has run for a while so other tasks get a turn.
+ * The task also reclaims what writers have retired from the hash tables,
+ * visiting them more often than it looks for tables to resize.
  */
 class HashtableResizerTask : public GlobalTask {
 public:
 
     HashtableResizerTask(EventuallyPersistentStore *s, double sleepTime) :
     GlobalTask(&s->getEPEngine(), Priority::HTResizePriority, sleepTime, false),
-    store(s) {}
+    store(s), position(s->startPosition()), resizing(false),
+    nextResize(0) {}
 
     bool run(void);
 
@@ -45,6 +50,14 @@ public:
 
 private:
     EventuallyPersistentStore *store;
+
+    // Opaque marker indicating how far through the epStore we have got.
+    EventuallyPersistentStore::Position position;
+
+    // Whether the current pass looks for tables to resize, and when the
+    // next pass that does may start.
+    bool resizing;
+    hrtime_t nextResize;
 };
 
 #endif  // SRC_HTRESIZER_H_
@@ -21,6 +21,8 @@
 #include "cJSON.h"
 #include <snappy-c.h>
 
+#include <vector>
+
 AtomicValue<uint64_t> Item::casCounter(1);
 const uint32_t Item::metaDataSize(2*sizeof(uint32_t) + 2*sizeof(uint64_t) + 2);
 
@@ -459,3 +461,74 @@ ENGINE_ERROR_CODE Item::prepend(const Item &i, size_t maxItemSize) {
             value->getDataType(), i.getDataType());
     return ENGINE_FAILED;
 }
+
+/**
+ * Create a Blob holding the given value with the datatype set, keeping any
+ * other extended metadata of the Blob it replaces
+ */
+static Blob* newBlobWithDataType(const value_t &old, const char *buf,
+                                 size_t len, uint8_t datatype) {
+    std::vector<uint8_t> extMeta(EXT_META_LEN, 0);
+    if (old->getExtLen() > 0) {
+        extMeta.assign(old->getExtMeta(),
+                       old->getExtMeta() + old->getExtLen());
+    }
+    extMeta[0] = datatype;
+    return Blob::New(buf, len, &extMeta[0],
+                     static_cast<uint8_t>(extMeta.size()));
+}
+
+bool Item::compressValue() {
+    if (!value.get() || value->vlength() == 0) {
+        return false;
+    }
+
+    uint8_t datatype = value->getDataType();
+    if (datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED ||
+        datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) {
+        return false;
+    }
+
+    size_t len = snappy_max_compressed_length(value->vlength());
+    char *buf = (char *) malloc(len);
+    if (!doCompress(value->getData(), value->vlength(), buf, &len) ||
+        len >= value->vlength()) {
+        free(buf);
+        return false;
+    }
+
+    datatype = (datatype == PROTOCOL_BINARY_DATATYPE_JSON) ?
+        PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON :
+        PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+    value.reset(newBlobWithDataType(value, buf, len, datatype));
+    free(buf);
+    return true;
+}
+
+bool Item::decompressValue() {
+    if (!value.get()) {
+        return true;
+    }
+
+    uint8_t datatype = value->getDataType();
+    if (datatype != PROTOCOL_BINARY_DATATYPE_COMPRESSED &&
+        datatype != PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) {
+        return true;
+    }
+
+    size_t len;
+    if (!getUnCompressedLength(value->getData(), value->vlength(), &len)) {
+        return false;
+    }
+    char *buf = (char *) malloc(len);
+    if (!doUnCompress(value->getData(), value->vlength(), buf, &len)) {
+        free(buf);
+        return false;
+    }
+
+    datatype = (datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) ?
+        PROTOCOL_BINARY_DATATYPE_JSON : PROTOCOL_BINARY_RAW_BYTES;
+    value.reset(newBlobWithDataType(value, buf, len, datatype));
+    free(buf);
+    return true;
+}
@@ -515,6 +515,22 @@ public:
      */
     ENGINE_ERROR_CODE prepend(const Item &item, size_t maxItemSize);
 
+    /**
+     * Replace the value with its Snappy compressed form, if it isn't
+     * compressed already and compressing it makes it smaller. Only this
+     * item's reference is replaced, any Blob it shared is left untouched.
+     *
+     * @return true if the value was compressed
+     */
+    bool compressValue();
+
+    /**
+     * Replace a Snappy compressed value with its uncompressed form.
+     *
+     * @return false if the value is compressed but couldn't be inflated
+     */
+    bool decompressValue();
+
     uint16_t getVBucketId(void) const {
         return vbucketId;
     }
@@ -247,6 +247,23 @@ public:
      */
     virtual void rollback() = 0;
 
+    /**
+     * Start a group commit: commits from now on may hold back their final
+     * sync until endSyncGroup(), so that the commits of several vbuckets
+     * can be made durable together.
+     */
+    virtual void beginSyncGroup() { }
+
+    /**
+     * Make every commit since beginSyncGroup() durable.
+     *
+     * @return false if a sync failed; the commits since beginSyncGroup()
+     *         may then not be durable and have to be made again
+     */
+    virtual bool endSyncGroup() {
+        return true;
+    }
+
     /**
      * Get the properties of the underlying storage.
      */
@@ -40,7 +40,20 @@ public:
     /**
      * Acquire the lock in the given mutex.
      */
-    LockHolder(Mutex &m, bool tryLock = false) : mutex(m), locked(false) {
+    LockHolder(Mutex &m, bool tryLock = false) : mutex(m), seqMutex(NULL),
+                                                 locked(false) {
+        if (tryLock) {
+            trylock();
+        } else {
+            lock();
+        }
+    }
+
+    /**
+     * Acquire the lock in the given seqlock mutex, bumping its sequence.
+     */
+    LockHolder(SeqMutex &m, bool tryLock = false) : mutex(m), seqMutex(&m),
+                                                    locked(false) {
         if (tryLock) {
             trylock();
         } else {
@@ -52,7 +65,9 @@ public:
      * Copy constructor hands this lock to the new copy and then
      * consider it released locally (i.e. renders unlock() a noop).
      */
-    LockHolder(const LockHolder& from) : mutex(from.mutex), locked(true) {
+    LockHolder(const LockHolder& from) : mutex(from.mutex),
+                                         seqMutex(from.seqMutex),
+                                         locked(true) {
         const_cast<LockHolder*>(&from)->locked = false;
     }
 
@@ -67,7 +82,11 @@ public:
      * Relock a lock that was manually unlocked.
      */
     void lock() {
-        mutex.acquire();
+        if (seqMutex) {
+            seqMutex->acquire();
+        } else {
+            mutex.acquire();
+        }
         locked = true;
     }
 
@@ -75,7 +94,7 @@ public:
      * Retry to acquire a lock due to initial failure or manual unlock.
      */
     bool trylock() {
-        locked = mutex.tryAcquire();
+        locked = seqMutex ? seqMutex->tryAcquire() : mutex.tryAcquire();
         return locked;
     }
 
@@ -92,12 +111,17 @@ public:
     void unlock() {
         if (locked) {
             locked = false;
-            mutex.release();
+            if (seqMutex) {
+                seqMutex->release();
+            } else {
+                mutex.release();
+            }
         }
     }
 
 private:
     Mutex &mutex;
+    SeqMutex *seqMutex;
     bool locked;
 
     void operator=(const LockHolder&);
@@ -106,6 +130,7 @@ private:
 /**
  * RAII lock holder over multiple locks.
  */
+template <class M = Mutex>
 class MultiLockHolder {
 public:
 
@@ -115,9 +140,9 @@ public:
      * @param m beginning of an array of locks
      * @param n the number of locks to lock
      */
-    MultiLockHolder(Mutex *m, size_t n) : mutexes(m),
-                                          locked(new bool[n]),
-                                          n_locks(n) {
+    MultiLockHolder(M *m, size_t n) : mutexes(m),
+                                      locked(new bool[n]),
+                                      n_locks(n) {
         std::fill_n(locked, n_locks, false);
         lock();
     }
@@ -151,7 +176,7 @@ public:
     }
 
 private:
-    Mutex  *mutexes;
+    M      *mutexes;
     bool   *locked;
     size_t  n_locks;
 
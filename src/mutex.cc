@@ -18,6 +18,8 @@
 #include "config.h"
 #include "mutex.h"
 
+#include "atomic.h"
+
 Mutex::Mutex() : held(false)
 {
     cb_mutex_initialize(&mutex);
@@ -45,3 +47,35 @@ void Mutex::release() {
     setHolder(false);
     cb_mutex_exit(&mutex);
 }
+
+uint32_t SeqMutex::readBegin() const {
+    uint32_t seq = sequence;
+    ep_sync_synchronize();
+    return seq;
+}
+
+bool SeqMutex::readValidate(uint32_t seq) const {
+    ep_sync_synchronize();
+    return (seq & 1) == 0 && sequence == seq;
+}
+
+void SeqMutex::acquire() {
+    Mutex::acquire();
+    ++sequence;
+    ep_sync_synchronize();
+}
+
+bool SeqMutex::tryAcquire() {
+    if (Mutex::tryAcquire()) {
+        ++sequence;
+        ep_sync_synchronize();
+        return true;
+    }
+    return false;
+}
+
+void SeqMutex::release() {
+    ep_sync_synchronize();
+    ++sequence;
+    Mutex::release();
+}
@@ -43,7 +43,7 @@ protected:
 
     // The holders of locks twiddle these flags.
     friend class LockHolder;
-    friend class MultiLockHolder;
+    template <class M> friend class MultiLockHolder;
 
     void acquire(void);
     bool tryAcquire(void);
@@ -62,4 +62,44 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
 
+/**
+ * A Mutex which also maintains a sequence number, odd while the mutex is
+ * held. Readers can use it to check that the data it protects wasn't
+ * modified while they read it without taking the mutex (a seqlock).
+ */
+class SeqMutex : public Mutex {
+public:
+    SeqMutex() : sequence(0) {}
+
+    /**
+     * Start an optimistic read.
+     *
+     * @return the sequence number to pass to readValidate(); odd if the
+     *         mutex is currently held, in which case the read will fail
+     */
+    uint32_t readBegin(void) const;
+
+    /**
+     * Check that the mutex wasn't held at any time since readBegin().
+     */
+    bool readValidate(uint32_t seq) const;
+
+protected:
+
+    friend class LockHolder;
+    template <class M> friend class MultiLockHolder;
+
+    // These hide (rather than override) the Mutex versions, so only
+    // holders which know they have a SeqMutex maintain the sequence.
+    void acquire(void);
+    bool tryAcquire(void);
+    void release(void);
+
+private:
+    // Only written by the holder of the mutex.
+    volatile uint32_t sequence;
+
+    DISALLOW_COPY_AND_ASSIGN(SeqMutex);
+};
+
 #endif  // SRC_MUTEX_H_
@@ -42,6 +42,9 @@ const Priority Priority::AccessScannerPriority(ACCESS_SCANNER_ID, 3);
 // Priorities for NON-IO tasks
 const Priority Priority::PendingOpsPriority(PENDING_OPS_ID, 0);
 const Priority Priority::TapConnNotificationPriority(TAP_CONN_NOTIFICATION_ID, 5);
+const Priority Priority::FlushCollectorPriority(FLUSH_COLLECTOR_ID, 5);
+const Priority Priority::ActiveStreamChkptProcessorPriority(
+                                        ACTIVE_STREAM_CHKPT_PROCESSOR_ID, 5);
 const Priority Priority::CheckpointRemoverPriority(CHECKPOINT_REMOVER_ID, 6);
 const Priority Priority::TapConnectionReaperPriority(TAP_CONNECTION_REAPER_ID, 6);
 const Priority Priority::VBMemoryDeletionPriority(VB_MEMORY_DELETION_ID, 6);
@@ -110,6 +113,10 @@ const char *Priority::getTypeName(const type_id_t i) {
                 return "conn_manager_tasks";
             case DEFRAGMENTER_ID:
                 return "defragmenter_tasks";
+            case FLUSH_COLLECTOR_ID:
+                return "flush_collector_tasks";
+            case ACTIVE_STREAM_CHKPT_PROCESSOR_ID:
+                return "chkpt_processor_tasks";
             default: break;
         }
 
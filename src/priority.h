@@ -52,6 +52,8 @@ typedef enum {
     PENDING_OPS_ID,
     TAP_CONN_MGR_ID,
     DEFRAGMENTER_ID,
+    FLUSH_COLLECTOR_ID,
+    ACTIVE_STREAM_CHKPT_PROCESSOR_ID,
 
     MAX_TYPE_ID // Keep this as the last enum value
 } type_id_t;
@@ -93,6 +95,8 @@ public:
     static const Priority PendingOpsPriority;
     static const Priority TapConnMgrPriority;
     static const Priority DefragmenterTaskPriority;
+    static const Priority FlushCollectorPriority;
+    static const Priority ActiveStreamChkptProcessorPriority;
 
     bool operator==(const Priority &other) const {
         return other.getPriorityValue() == this->priority;
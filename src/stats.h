@@ -55,6 +55,9 @@ public:
         diskQueueSize(0),
         flusher_todo(0),
         flusherCommits(0),
+        flusherPrefetchedBatches(0),
+        flusherGroupCommits(0),
+        flusherGroupCommitVBuckets(0),
         cumulativeFlushTime(0),
         cumulativeCommitTime(0),
         tooYoung(0),
@@ -77,6 +80,8 @@ public:
         pagerRuns(0),
         expiryPagerRuns(0),
         itemsRemovedFromCheckpoints(0),
+        itemsExpelledFromCheckpoints(0),
+        cursorsDropped(0),
         numValueEjects(0),
         numFailedEjects(0),
         numNotMyVBuckets(0),
@@ -87,7 +92,9 @@ public:
         numStoredVal(0),
         totalStoredValSize(0),
         storedValOverhead(0),
+        numInlineValue(0),
         memOverhead(0),
+        checkpointMemory(0),
         numItem(0),
         totalMemory(0),
         memoryTrackerEnabled(false),
@@ -101,6 +108,7 @@ public:
         pendingCompactions(0),
         bg_fetched(0),
         bg_meta_fetched(0),
+        bgFetchJoined(0),
         numRemainingBgJobs(0),
         bgNumOperations(0),
         maxRemainingBgJobs(0),
@@ -146,6 +154,8 @@ public:
         rollbackCount(0),
         defragNumVisited(0),
         defragNumMoved(0),
+        numaLocalTasks(0),
+        numaRemoteTasks(0),
         dirtyAgeHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
         diskCommitHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
         mlogCompactorHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
@@ -213,6 +223,12 @@ public:
     AtomicValue<size_t> flusher_todo;
     //! Number of transaction commits.
     AtomicValue<size_t> flusherCommits;
+    //! Number of flush batches collected while a previous one was written.
+    AtomicValue<size_t> flusherPrefetchedBatches;
+    //! Number of group commits synced.
+    AtomicValue<size_t> flusherGroupCommits;
+    //! Number of vbucket commits made durable by group commits.
+    AtomicValue<size_t> flusherGroupCommitVBuckets;
     //! Total time spent flushing.
     AtomicValue<size_t> cumulativeFlushTime;
     //! Total time spent committing.
@@ -260,6 +276,10 @@ public:
     AtomicValue<size_t> expiryPagerRuns;
     //! Number of items removed from closed unreferenced checkpoints.
     AtomicValue<size_t> itemsRemovedFromCheckpoints;
+    //! Number of items expelled from checkpoints still referenced by cursors.
+    AtomicValue<size_t> itemsExpelledFromCheckpoints;
+    //! Number of cursors dropped for lagging behind the persistence cursor.
+    AtomicValue<size_t> cursorsDropped;
     //! Number of times a value is ejected
     AtomicValue<size_t> numValueEjects;
     //! Number of times a value could not be ejected
@@ -280,8 +300,12 @@ public:
     AtomicValue<size_t> totalStoredValSize;
     //! Total size of StoredVal memory overhead
     AtomicValue<size_t> storedValOverhead;
+    //! Number of values held inline in their StoredValue
+    AtomicValue<size_t> numInlineValue;
     //! Amount of memory used to track items and what-not.
     AtomicValue<size_t> memOverhead;
+    //! Size of the items held by checkpoints.
+    AtomicValue<size_t> checkpointMemory;
     //! Total number of Item objects
     AtomicValue<size_t> numItem;
     //! The total amount of memory used by this bucket (From memory tracking)
@@ -315,6 +339,8 @@ public:
     AtomicValue<size_t> bg_fetched;
     //! Number of times meta background fetches occurred.
     AtomicValue<size_t> bg_meta_fetched;
+    //! Number of background fetches served by a read already in flight.
+    AtomicValue<size_t> bgFetchJoined;
     //! Number of remaining bg fetch jobs.
     AtomicValue<size_t> numRemainingBgJobs;
     //! The number of samples the bgWaitDelta and bgLoadDelta contains of
@@ -445,6 +471,11 @@ public:
      */
     AtomicValue<size_t> defragNumMoved;
 
+    //! The number of shard tasks run by a thread on their home NUMA node
+    AtomicValue<size_t> numaLocalTasks;
+    //! The number of shard tasks run by a thread on another NUMA node
+    AtomicValue<size_t> numaRemoteTasks;
+
     //! Histogram of queue processing dirty age.
     Histogram<hrtime_t> dirtyAgeHisto;
 
@@ -510,6 +541,18 @@ public:
     //! Histogram of disk commits
     Histogram<hrtime_t> diskCommitHisto;
 
+    //! Histogram of collecting and deduplicating a vbucket's flush batch
+    Histogram<hrtime_t> flushCollectHisto;
+
+    //! Histogram of handing a flush batch's items to the KVStore
+    Histogram<hrtime_t> flushWriteHisto;
+
+    //! Histogram of post-commit flusher work (notifications, cleanup)
+    Histogram<hrtime_t> flushCompleteHisto;
+
+    //! Histogram of syncing the vbucket files of a group commit
+    Histogram<hrtime_t> flushGroupSyncHisto;
+
     //! Histogram of setting vbucket state
     Histogram<hrtime_t> snapshotVbucketHisto;
 
@@ -519,6 +562,9 @@ public:
     //! Historgram of batch reads
     Histogram<hrtime_t> getMultiHisto;
 
+    //! Histogram of time hash tables were locked for while being resized
+    Histogram<hrtime_t> htResizeStallHisto;
+
     // ! Histogram of various task wait times
     Histogram<hrtime_t> *schedulingHisto;
 
@@ -534,6 +580,8 @@ public:
         commit_time.store(0);
         pagerRuns.store(0);
         itemsRemovedFromCheckpoints.store(0);
+        itemsExpelledFromCheckpoints.store(0);
+        cursorsDropped.store(0);
         numValueEjects.store(0);
         numFailedEjects.store(0);
         numNotMyVBuckets.store(0);
@@ -564,6 +612,8 @@ public:
         alogRuns.store(0);
         defragNumVisited.store(0),
         defragNumMoved.store(0);
+        numaLocalTasks.store(0);
+        numaRemoteTasks.store(0);
 
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
@@ -588,11 +638,16 @@ public:
         diskDelHisto.reset();
         diskVBDelHisto.reset();
         diskCommitHisto.reset();
+        flushCollectHisto.reset();
+        flushWriteHisto.reset();
+        flushCompleteHisto.reset();
+        flushGroupSyncHisto.reset();
 
         itemAllocSizeHisto.reset();
         dirtyAgeHisto.reset();
         mlogCompactorHisto.reset();
         getMultiHisto.reset();
+        htResizeStallHisto.reset();
     }
 
     // Used by stats logging infrastructure.
@@ -17,10 +17,13 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <limits>
 #include <string>
+#include <vector>
 
 #include "stored-value.h"
+#include "threadlocal.h"
 
 #ifndef DEFAULT_HT_SIZE
 #define DEFAULT_HT_SIZE 1531
@@ -28,10 +31,76 @@
 
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+size_t HashTable::defaultResizeChunkSize = 0;
+ht_hash_function_t HashTable::defaultHashFunction = HT_HASH_DJB2;
+ht_layout_t HashTable::defaultLayout = HT_LAYOUT_CHAINED;
+const uint32_t HashTable::hashSeed = 5381;
 double StoredValue::mutation_mem_threshold = 0.9;
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
 const int64_t StoredValue::state_temp_init = -5;
+const size_t StoredValue::maxInlineValueSize = 40;
+const size_t StoredValue::inlineValueSaving =
+    sizeof(Blob) - StoredValue::inlineHeaderSize;
+
+/**
+ * Per-thread reader counts for each parity of the epoch, padded so
+ * threads in different slots don't share a cache line.
+ */
+struct EpochSlot {
+    AtomicValue<uint32_t> readers[2];
+    char pad[64 - 2 * sizeof(AtomicValue<uint32_t>)];
+};
+
+static const size_t numEpochSlots = 128;
+static EpochSlot epochSlots[numEpochSlots];
+static AtomicValue<uint32_t> nextEpochSlot;
+static AtomicValue<uint64_t> globalEpoch;
+static ThreadLocal<EpochSlot*> threadEpochSlot;
+
+static EpochSlot &getEpochSlot() {
+    EpochSlot *slot = threadEpochSlot.get();
+    if (slot == NULL) {
+        slot = &epochSlots[nextEpochSlot.fetch_add(1) % numEpochSlots];
+        threadEpochSlot.set(slot);
+    }
+    return *slot;
+}
+
+ReadEpoch::Guard::Guard() {
+    EpochSlot &slot = getEpochSlot();
+    while (true) {
+        uint64_t e = globalEpoch.load();
+        readers = &slot.readers[e & 1];
+        ++(*readers);
+        if (globalEpoch.load() == e) {
+            break;
+        }
+        // The epoch moved on before we were counted; try again so we
+        // never count against an epoch that's already been waited out.
+        --(*readers);
+    }
+}
+
+ReadEpoch::Guard::~Guard() {
+    --(*readers);
+}
+
+uint64_t ReadEpoch::current() {
+    return globalEpoch.load();
+}
+
+bool ReadEpoch::tryAdvance() {
+    uint64_t e = globalEpoch.load();
+    // Readers of the previous epoch (same parity as the next one) must
+    // all be done before we can move on.
+    for (size_t i = 0; i < numEpochSlots; ++i) {
+        if (epochSlots[i].readers[(e + 1) & 1].load() != 0) {
+            return false;
+        }
+    }
+    return globalEpoch.compare_exchange_strong(e, e + 1);
+}
 
 static ssize_t prime_size_table[] = {
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3079, 6143, 12289, 24571, 49157,
@@ -42,14 +111,56 @@ static ssize_t prime_size_table[] = {
 
 bool StoredValue::ejectValue(HashTable &ht, item_eviction_policy_t policy) {
     if (eligibleForEviction(policy)) {
-        reduceCacheSize(ht, value->length());
-        markNotResident();
-        value = NULL;
+        reduceCacheSize(ht, externalValueLen());
+        markNotResident(ht);
         return true;
     }
     return false;
 }
 
+void StoredValue::releaseValue(HashTable &ht) {
+    if (hasInlineValue()) {
+        inlineArea()[1] = 0;
+        --ht.numInlineValues;
+        --ht.stats.numInlineValue;
+    } else if (value.get()) {
+        // Unlink before retiring, so no reader can find it afterwards.
+        value_t old(value);
+        value.reset();
+        ht.retire(NULL, old, NULL);
+    }
+}
+
+void StoredValue::assignValue(const value_t &v, HashTable &ht) {
+    if (v.get() && v->length() <= inlineCapacity()) {
+        uint8_t *area = inlineArea();
+        std::memcpy(area + inlineHeaderSize, v->getBlob(), v->length());
+        area[2] = v->getExtLen();
+        area[1] = static_cast<uint8_t>(v->length());
+        ++ht.numInlineValues;
+        ++ht.stats.numInlineValue;
+    } else {
+        value = v;
+    }
+}
+
+Blob *StoredValue::inlineBlob() const {
+    const uint8_t *area = inlineArea();
+    const char *data = reinterpret_cast<const char*>(area + inlineHeaderSize);
+    // An optimistic reader may see a torn length; keep within the area
+    // (the copy will be thrown away).
+    size_t len = std::min(static_cast<size_t>(area[1]), inlineCapacity());
+    uint8_t extLen = area[2];
+    if (len < FLEX_DATA_OFFSET + extLen) {
+        len = FLEX_DATA_OFFSET;
+        extLen = 0;
+    }
+    return Blob::New(data + FLEX_DATA_OFFSET + extLen,
+                     len - FLEX_DATA_OFFSET - extLen,
+                     reinterpret_cast<uint8_t*>(const_cast<char*>(data)) +
+                     FLEX_DATA_OFFSET, extLen);
+}
+
 void StoredValue::referenced() {
     if (nru > MIN_NRU_VALUE) {
         --nru;
@@ -99,8 +210,9 @@ bool StoredValue::unlocked_restoreValue(Item *itm, HashTable &ht) {
     }
     deleted = false;
     conflictResMode = itm->getConflictResMode();
-    value = itm->getValue();
-    increaseCacheSize(ht, value->length());
+    releaseValue(ht);
+    assignValue(itm->getValue(), ht);
+    increaseCacheSize(ht, externalValueLen());
     return true;
 }
 
@@ -163,26 +275,13 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
                                             vptr->metaDataSize());
             StoredValue::reduceCacheSize(*this, vptr->size());
 
-            int bucket_num = getBucketForHash(hash(vptr->getKey()));
-            StoredValue *v = values[bucket_num];
             // Remove the item from the hash table.
-            if (v == vptr) {
-                values[bucket_num] = v->next;
-            } else {
-                while (v->next) {
-                    if (v->next == vptr) {
-                        v->next = v->next->next;
-                        break;
-                    } else {
-                        v = v->next;
-                    }
-                }
-            }
+            unlinkValue(getBucketForHash(hash(vptr->getKey())), vptr);
 
             if (vptr->isResident()) {
                 ++stats.numValueEjects;
             }
-            if (!vptr->isResident() && !v->isTempItem()) {
+            if (!vptr->isResident() && !vptr->isTempItem()) {
                 --numNonResidentItems; // Decrement because the item is
                                        // fully evicted.
             }
@@ -190,7 +289,7 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
             ++numEjects;
             updateMaxDeletedRevSeqno(vptr->getRevSeqno());
 
-            delete vptr; // Free the item.
+            retire(vptr, value_t(), NULL); // Free the item.
             vptr = NULL;
             return true;
         } else {
@@ -212,13 +311,13 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
     StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
 
     if (v == NULL) {
-        v = valFact(itm, values[bucket_num], *this);
+        v = valFact(itm, NULL, *this);
         v->markClean();
         if (partial) {
-            v->markNotResident();
+            v->markNotResident(*this);
             ++numNonResidentItems;
         }
-        values[bucket_num] = v;
+        linkValue(bucket_num, hash(itm.getKey()), v);
         ++numItems;
         v->setNewCacheItem(false);
     } else {
@@ -291,6 +390,35 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+/**
+ * Set the number of buckets an incremental resize migrates per chunk.
+ */
+void HashTable::setDefaultResizeChunkSize(size_t to) {
+    defaultResizeChunkSize = to;
+}
+
+/**
+ * Set the bucket layout used by newly created hashtables.
+ */
+void HashTable::setDefaultLayout(const std::string &name) {
+    if (name.compare("chained") == 0) {
+        defaultLayout = HT_LAYOUT_CHAINED;
+    } else if (name.compare("bucketized") == 0) {
+        defaultLayout = HT_LAYOUT_BUCKETIZED;
+    }
+}
+
+/**
+ * Set the hash function used by newly created hashtables.
+ */
+void HashTable::setDefaultHashFunction(const std::string &name) {
+    if (name.compare("djb2") == 0) {
+        defaultHashFunction = HT_HASH_DJB2;
+    } else if (name.compare("murmur3") == 0) {
+        defaultHashFunction = HT_HASH_MURMUR3;
+    }
+}
+
 HashTableStatVisitor HashTable::clear(bool deactivate) {
     HashTableStatVisitor rv;
 
@@ -298,18 +426,36 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
         // If not deactivating, assert we're already active.
         cb_assert(isActive());
     }
-    MultiLockHolder mlh(mutexes, n_locks);
+    MultiLockHolder<SeqMutex> mlh(mutexes, n_locks);
     if (deactivate) {
         setActiveState(false);
     }
-    for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
+    std::vector<StoredValue*> removed;
+    for (int i = 0; i < (int)totalBuckets(); i++) {
+        BucketIterator it = bucketIterator(i);
+        while (StoredValue *v = it.next()) {
             rv.visit(v);
-            values[i] = v->next;
-            delete v;
+            removed.push_back(v);
         }
     }
+    if (buckets) {
+        memset(buckets, 0, size * sizeof(HashBucket));
+    } else {
+        memset(values, 0, size * sizeof(StoredValue*));
+    }
+    if (oldBuckets) {
+        memset(oldBuckets, 0, oldSize * sizeof(HashBucket));
+    } else if (oldValues) {
+        memset(oldValues, 0, oldSize * sizeof(StoredValue*));
+    }
+    std::vector<StoredValue*>::iterator it;
+    for (it = removed.begin(); it != removed.end(); ++it) {
+        retire(*it, value_t(), NULL);
+    }
+    if (oldSize != 0) {
+        // Nothing left to migrate, so drop the old array now.
+        migrateBuckets(oldSize - migrated);
+    }
 
     stats.currentSize.fetch_sub(rv.memSize - rv.valSize);
     cb_assert(stats.currentSize.load() < GIGANTOR);
@@ -338,7 +484,7 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
+    MultiLockHolder<SeqMutex> mlh(mutexes, n_locks);
     if (visitors.load() > 0) {
         // Do not allow a resize while any visitors are actually
         // processing.  The next attempt will have to pick it up.  New
@@ -347,41 +493,361 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
+    if (oldSize != 0) {
+        // An incremental resize must complete before another can start.
+        return;
+    }
+
+    hrtime_t start = gethrtime();
+
     // Get a place for the new items.
-    StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
-                                                        sizeof(StoredValue*)));
+    StoredValue **newValues = NULL;
+    HashBucket *newBuckets = NULL;
+    void *newMem = NULL;
     // If we can't allocate memory, don't move stuff around.
-    if (!newValues) {
+    if (!allocateBuckets(newSize, &newValues, &newBuckets, &newMem)) {
         return;
     }
 
     stats.memOverhead.fetch_sub(memorySize());
     ++numResizes;
 
+    // The current array becomes the old one, with nothing migrated yet.
+    oldSize = size;
+    migrated = 0;
+    oldValues = values;
+    oldBuckets = buckets;
+    oldBucketMem = bucketMem;
+
     // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
+    ++resizeSequence;
     size = newSize;
-    ep_sync_synchronize();
+    values = newValues;
+    buckets = newBuckets;
+    bucketMem = newMem;
+    ++resizeSequence;
 
-    // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            values[i] = v->next;
+    stats.memOverhead.fetch_add(memorySize());
+    cb_assert(stats.memOverhead.load() < GIGANTOR);
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(),
-                                                  v->getKeyLen()));
-            v->next = newValues[newBucket];
-            newValues[newBucket] = v;
+    if (resizeChunkSize == 0) {
+        // Move existing records into the new space.
+        migrateBuckets(oldSize);
+    }
+
+    stats.htResizeStallHisto.add((gethrtime() - start) / 1000);
+}
+
+bool HashTable::pauseResumeResize(PauseResumeHashTableResizer &resizer) {
+    while (true) {
+        hrtime_t stall;
+        {
+            MultiLockHolder<SeqMutex> mlh(mutexes, n_locks);
+            if (oldSize == 0) {
+                return true;
+            }
+            if (visitors.load() > 0) {
+                // Visitors expect every value to stay in its bucket
+                // until they are done; try again later.
+                return false;
+            }
+
+            hrtime_t start = gethrtime();
+            migrateBuckets(resizeChunkSize ? resizeChunkSize : oldSize);
+            stall = (gethrtime() - start) / 1000;
+        }
+        stats.htResizeStallHisto.add(stall);
+
+        if (!resizer.migrated(stall)) {
+            return !isResizing();
         }
     }
+}
 
-    // values still points to the old (now empty) table.
-    free(values);
-    values = newValues;
+void HashTable::migrateBuckets(size_t n) {
+    const size_t end = std::min(migrated + n, oldSize);
+    ++resizeSequence;
+    for (size_t i = migrated; i < end; i++) {
+        BucketIterator it(oldValues, oldBuckets, i);
+        while (StoredValue *v = it.next()) {
+            int h = hash(v->getKeyBytes(), v->getKeyLen());
+            int bucket_num = abs(h % static_cast<int>(size));
+            linkValue(values, buckets, bucket_num, h, v);
+        }
+        if (oldBuckets) {
+            memset(&oldBuckets[i], 0, sizeof(HashBucket));
+        } else {
+            oldValues[i] = NULL;
+        }
+    }
+    migrated = end;
+
+    if (migrated == oldSize) {
+        // The old array no longer owns any values.
+        stats.memOverhead.fetch_sub(memorySize());
+        void *mem = oldBucketMem;
+        size_t memSize = oldSize * bucketSize();
+        oldValues = NULL;
+        oldBuckets = NULL;
+        oldBucketMem = NULL;
+        retire(NULL, value_t(), mem, memSize);
+        oldSize = 0;
+        migrated = 0;
+        stats.memOverhead.fetch_add(memorySize());
+        cb_assert(stats.memOverhead.load() < GIGANTOR);
+    }
+    ++resizeSequence;
+}
 
-    stats.memOverhead.fetch_add(memorySize());
-    cb_assert(stats.memOverhead.load() < GIGANTOR);
+void HashTable::retire(StoredValue *v, const value_t &blob, void *mem,
+                       size_t memSize) {
+    size_t bytes = memSize;
+    if (v) {
+        if (v->hasInlineValue()) {
+            --numInlineValues;
+            --stats.numInlineValue;
+        }
+        bytes += v->size();
+    }
+    if (blob.get()) {
+        bytes += blob->getSize();
+    }
+    stats.memOverhead.fetch_add(bytes);
+
+    // Writers only pay for the push until a batch of bytes has been
+    // retired, as reclaiming has to look at every reader's epoch.
+    bool reclaim;
+    {
+        SpinLockHolder lh(&retiredLock);
+        retired.push_back(Retired(ReadEpoch::current(), v, blob, mem, bytes));
+        retiredBytes += bytes;
+        reclaim = retiredBytes >= nextReclaimBytes;
+    }
+    if (!reclaim) {
+        return;
+    }
+
+    reclaimRetired();
+    SpinLockHolder lh(&retiredLock);
+    while (retiredBytes > maxRetiredBytes) {
+        // Optimistic readers only hold an epoch for a single lookup
+        lh.unlock();
+        sched_yield();
+        reclaimRetired();
+        lh.lock();
+    }
+    nextReclaimBytes = retiredBytes + retiredReclaimBytes;
+}
+
+void HashTable::reclaimRetired(bool all) {
+    if (!all) {
+        // Two advances guarantee everything retired so far is
+        // unreachable; don't wait if readers are holding the epoch back.
+        if (ReadEpoch::tryAdvance()) {
+            ReadEpoch::tryAdvance();
+        }
+    }
+
+    std::deque<Retired> reclaimable;
+    {
+        SpinLockHolder lh(&retiredLock);
+        uint64_t safe = ReadEpoch::current();
+        while (!retired.empty() &&
+               (all || retired.front().epoch + 2 <= safe)) {
+            retiredBytes -= retired.front().bytes;
+            reclaimable.push_back(retired.front());
+            retired.pop_front();
+        }
+    }
+
+    // Free outside of the spinlock, as dropping the last reference to
+    // a value may be expensive.
+    std::deque<Retired>::iterator it;
+    for (it = reclaimable.begin(); it != reclaimable.end(); ++it) {
+        delete it->sv;
+        free(it->mem);
+        stats.memOverhead.fetch_sub(it->bytes);
+    }
+}
+
+StoredValue *HashTable::optimisticFind(const std::string &key, int h,
+                                       StoredValue **vals, HashBucket *bkts,
+                                       int idx, const SeqMutex &mutex,
+                                       uint32_t seq) {
+    StoredValue *v;
+    if (bkts) {
+        HashBucket &b = bkts[idx];
+        uint8_t tag = HashBucket::tagForHash(h);
+        if (b.mayContain(tag)) {
+            for (int i = 0; i < HashBucket::numSlots; ++i) {
+                StoredValue *sv = b.slots[i];
+                if (b.tags[i] == tag && sv && sv->hasKey(key)) {
+                    return sv;
+                }
+            }
+        }
+        v = b.overflow;
+    } else {
+        v = vals[idx];
+    }
+
+    // A writer may relink the chain under us; every value we can reach
+    // stays allocated while we hold the epoch, but the chain could
+    // become a cycle, so check back with the lock now and again.
+    for (int steps = 1; v; ++steps) {
+        if (v->hasKey(key)) {
+            return v;
+        }
+        if ((steps % 64) == 0 && !mutex.readValidate(seq)) {
+            return NULL;
+        }
+        v = v->next;
+    }
+    return NULL;
+}
+
+Item *HashTable::optimisticGet(const std::string &key, uint16_t vbucket,
+                               bool trackReference) {
+    if (!isActive()) {
+        return NULL;
+    }
+
+    int h = hash(key);
+    ReadEpoch::Guard guard;
+
+    for (int attempt = 0; attempt < 4; ++attempt) {
+        uint32_t rseq = resizeSequence.load();
+        if (rseq & 1) {
+            continue;
+        }
+        ep_sync_synchronize();
+        size_t sz = size;
+        size_t osz = oldSize;
+        size_t mig = migrated;
+        StoredValue **vals = values;
+        HashBucket *bkts = buckets;
+        StoredValue **ovals = oldValues;
+        HashBucket *obkts = oldBuckets;
+        ep_sync_synchronize();
+        if (resizeSequence.load() != rseq) {
+            continue;
+        }
+
+        // Same mapping as getBucketForHash(), on our snapshot.
+        int idx;
+        size_t lock;
+        if (osz != 0 && static_cast<size_t>(abs(h % static_cast<int>(osz)))
+                                                                >= mig) {
+            idx = abs(h % static_cast<int>(osz));
+            lock = (sz + idx) % n_locks;
+            vals = ovals;
+            bkts = obkts;
+        } else {
+            idx = abs(h % static_cast<int>(sz));
+            lock = idx % n_locks;
+        }
+
+        const SeqMutex &mutex = mutexes[lock];
+        uint32_t seq = mutex.readBegin();
+        if ((seq & 1) || resizeSequence.load() != rseq) {
+            continue;
+        }
+
+        StoredValue *v = optimisticFind(key, h, vals, bkts, idx, mutex, seq);
+        if (!mutex.readValidate(seq)) {
+            continue;
+        }
+        if (!v || v->isDeleted() || v->isTempItem() || !v->isResident() ||
+            v->isExpired(ep_real_time()) ||
+            v->isLockedNoUpdate(ep_current_time()) ||
+            (trackReference && v->getNRUValue() > MIN_NRU_VALUE)) {
+            // Let the locked path deal with it.
+            return NULL;
+        }
+
+        Item *itm = v->toItem(false, vbucket);
+        if (mutex.readValidate(seq)) {
+            return itm;
+        }
+        delete itm;
+    }
+    return NULL;
+}
+
+void HashTable::linkValue(StoredValue **vals, HashBucket *bkts,
+                          int bucket_num, int h, StoredValue *v) {
+    StoredValue **head;
+    if (bkts) {
+        HashBucket &b = bkts[bucket_num];
+        for (int i = 0; i < HashBucket::numSlots; ++i) {
+            if (b.slots[i] == NULL) {
+                b.slots[i] = v;
+                b.tags[i] = HashBucket::tagForHash(h);
+                v->next = NULL;
+                return;
+            }
+        }
+        head = &b.overflow;
+    } else {
+        head = &vals[bucket_num];
+    }
+    v->next = *head;
+    *head = v;
+}
+
+bool HashTable::unlinkValue(int bucket_num, StoredValue *v) {
+    StoredValue **vals;
+    HashBucket *bkts;
+    int idx = locateBucket(bucket_num, &vals, &bkts);
+    StoredValue **pp;
+    if (bkts) {
+        HashBucket &b = bkts[idx];
+        for (int i = 0; i < HashBucket::numSlots; ++i) {
+            if (b.slots[i] == v) {
+                // Leave a hole rather than compacting so that anyone
+                // walking the bucket with a BucketIterator isn't upset.
+                b.slots[i] = NULL;
+                b.tags[i] = 0;
+                return true;
+            }
+        }
+        pp = &b.overflow;
+    } else {
+        pp = &vals[idx];
+    }
+
+    while (*pp) {
+        if (*pp == v) {
+            *pp = v->next;
+            return true;
+        }
+        pp = &(*pp)->next;
+    }
+    return false;
+}
+
+bool HashTable::allocateBuckets(size_t n, StoredValue ***vals,
+                                HashBucket **bkts, void **mem) {
+    if (layout == HT_LAYOUT_BUCKETIZED) {
+        // Over-allocate so the buckets can be aligned on a cache line.
+        const size_t align = sizeof(HashBucket);
+        *mem = calloc(n * sizeof(HashBucket) + align, 1);
+        if (!*mem) {
+            return false;
+        }
+        uintptr_t p = reinterpret_cast<uintptr_t>(*mem);
+        p = (p + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+        *bkts = reinterpret_cast<HashBucket*>(p);
+        *vals = NULL;
+    } else {
+        *mem = calloc(n, sizeof(StoredValue*));
+        if (!*mem) {
+            return false;
+        }
+        *vals = static_cast<StoredValue**>(*mem);
+        *bkts = NULL;
+    }
+    return true;
 }
 
 static size_t distance(size_t a, size_t b) {
@@ -402,6 +868,13 @@ void HashTable::resize() {
     int i(0);
     size_t new_size(0);
 
+    // A bucketized bucket holds several values in its slots, so aim for
+    // roughly two thirds of the slots in use rather than one value per
+    // bucket.
+    if (layout == HT_LAYOUT_BUCKETIZED) {
+        ni = (ni * 3) / (HashBucket::numSlots * 2);
+    }
+
     // Figure out where in the prime table we are.
     ssize_t target(static_cast<ssize_t>(ni));
     for (i = 0; prime_size_table[i] > 0 && prime_size_table[i] < target; ++i) {
@@ -436,22 +909,20 @@ void HashTable::visit(HashTableVisitor &visitor) {
     for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks);
          l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        for (int i = l; i < static_cast<int>(totalBuckets()); i+= n_locks) {
             cb_assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            cb_assert(v == NULL || i == getBucketForHash(hash(v->getKeyBytes(),
-                                                           v->getKeyLen())));
-            while (v) {
-                StoredValue *tmp = v->next;
+            BucketIterator it = bucketIterator(i);
+            while (StoredValue *v = it.next()) {
+                cb_assert(i == getBucketForHash(hash(v->getKeyBytes(),
+                                                     v->getKeyLen())));
                 visitor.visit(v);
-                v = tmp;
             }
             ++visited;
         }
         lh.unlock();
         aborted = !visitor.shouldContinue();
     }
-    cb_assert(aborted || visited == size);
+    cb_assert(aborted || visited == totalBuckets());
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
@@ -463,23 +934,22 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        for (int i = l; i < static_cast<int>(totalBuckets()); i+= n_locks) {
             size_t depth = 0;
-            StoredValue *p = values[i];
-            cb_assert(p == NULL || i == getBucketForHash(hash(p->getKeyBytes(),
-                                                           p->getKeyLen())));
             size_t mem(0);
-            while (p) {
+            BucketIterator it = bucketIterator(i);
+            while (StoredValue *p = it.next()) {
+                cb_assert(i == getBucketForHash(hash(p->getKeyBytes(),
+                                                     p->getKeyLen())));
                 depth++;
                 mem += p->size();
-                p = p->next;
             }
             visitor.visit(i, depth, mem);
             ++visited;
         }
     }
 
-    cb_assert(visited == size);
+    cb_assert(visited == totalBuckets());
 }
 
 HashTable::Position
@@ -493,52 +963,62 @@ HashTable::pauseResumeVisit(PauseResumeHashTableVisitor& visitor,
     bool paused = false;
     VisitorTracker vt(&visitors);
 
+    // Buckets of an incremental resize in progress are visited too. Once
+    // we hold a lock the migration can't make progress until we're done.
+    size_t nbuckets = totalBuckets();
+
     // Start from the requested lock number if in range.
     size_t lock = (start_pos.lock < n_locks) ? start_pos.lock : 0;
     size_t hash_bucket = 0;
 
     for (; isActive() && !paused && lock < n_locks; lock++) {
         LockHolder lh(mutexes[lock]);
+        nbuckets = totalBuckets();
 
         // If the bucket position is *this* lock, then start from the
         // recorded bucket (as long as we haven't resized).
         hash_bucket = lock;
         if (start_pos.lock == lock &&
-            start_pos.ht_size == size &&
-            start_pos.hash_bucket < size) {
+            start_pos.ht_size == nbuckets &&
+            start_pos.hash_bucket < nbuckets) {
             hash_bucket = start_pos.hash_bucket;
         }
 
         // Iterate across all values in the hash buckets owned by this lock.
         // Note: we don't record how far into the bucket linked-list we
         // pause at; so any restart will begin from the next bucket.
-        for (; !paused && hash_bucket < size; hash_bucket += n_locks) {
-            StoredValue *v = values[hash_bucket];
-            while (!paused && v) {
-                StoredValue *tmp = v->next;
+        for (; !paused && hash_bucket < nbuckets; hash_bucket += n_locks) {
+            BucketIterator it = bucketIterator(hash_bucket);
+            StoredValue *v;
+            while (!paused && (v = it.next()) != NULL) {
+                // The visitor may swap the value for a new copy (see the
+                // defragmenter); optimistic readers may still use the old.
+                value_t before = v->value;
                 paused = !visitor.visit(*v);
-                v = tmp;
+                if (v->value.get() != before.get() && before.get()) {
+                    retire(NULL, before, NULL);
+                }
             }
         }
 
         // If the visitor paused us before we visited all hash buckets owned
         // by this lock, we don't want to skip the remaining hash buckets, so
         // stop the outer for loop from advancing to the next lock.
-        if (paused && hash_bucket < size) {
+        if (paused && hash_bucket < nbuckets) {
             break;
         }
 
-        // Finished all buckets owned by this lock. Set hash_bucket to 'size'
-        // to give a consistent marker for "end of lock".
-        hash_bucket = size;
+        // Finished all buckets owned by this lock. Set hash_bucket to
+        // 'nbuckets' to give a consistent marker for "end of lock".
+        hash_bucket = nbuckets;
     }
 
     // Return the *next* location that should be visited.
-    return HashTable::Position(size, lock, hash_bucket);
+    return HashTable::Position(nbuckets, lock, hash_bucket);
 }
 
 HashTable::Position HashTable::endPosition() const  {
-    return HashTable::Position(size, n_locks, size);
+    return HashTable::Position(totalBuckets(), n_locks, totalBuckets());
 }
 
 add_type_t HashTable::unlocked_add(int &bucket_num,
@@ -588,8 +1068,8 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                     return ADD_TMP_AND_BG_FETCH;
                 }
             }
-            v = valFact(itm, values[bucket_num], *this, isDirty);
-            values[bucket_num] = v;
+            v = valFact(itm, NULL, *this, isDirty);
+            linkValue(bucket_num, hash(itm.getKey()), v);
 
             if (v->isTempItem()) {
                 ++numTempItems;
@@ -617,7 +1097,7 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
             unlocked_ejectItem(v, policy);
         }
         if (v && v->isTempItem()) {
-            v->markNotResident();
+            v->markNotResident(*this);
             v->setNRUValue(MAX_NRU_VALUE);
         }
     }
@@ -691,7 +1171,7 @@ bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm) {
 }
 
 Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
-    Item* itm = new Item(getKey(), getFlags(), getExptime(), value,
+    Item* itm = new Item(getKey(), getFlags(), getExptime(), getValue(),
                          lck ? static_cast<uint64_t>(-1) : getCas(),
                          bySeqno, vbucket, getRevSeqno());
 
@@ -708,6 +1188,10 @@ Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
 }
 
 void StoredValue::reallocate() {
+    if (!value.get()) {
+        // Nothing to move; an inline value moves with its StoredValue.
+        return;
+    }
     // Allocate a new Blob for this stored value; copy the existing Blob to
     // the new one and free the old.
     value_t new_val(Blob::Copy(*value));
@@ -716,13 +1200,16 @@ void StoredValue::reallocate() {
 
 Item *HashTable::getRandomKeyFromSlot(int slot) {
     LockHolder lh = getLockedBucket(slot);
-    StoredValue *v = values[slot];
+    if (slot >= static_cast<int>(totalBuckets())) {
+        // An incremental resize finished before we got the lock.
+        return NULL;
+    }
+    BucketIterator it = bucketIterator(slot);
 
-    while (v) {
+    while (StoredValue *v = it.next()) {
         if (!v->isTempItem() && !v->isDeleted() && v->isResident()) {
             return v->toItem(false, 0);
         }
-        v = v->next;
     }
 
     return NULL;
@@ -730,13 +1217,14 @@ Item *HashTable::getRandomKeyFromSlot(int slot) {
 
 Item* HashTable::getRandomKey(long rnd) {
     /* Try to locate a partition */
-    size_t start = rnd % size;
+    size_t nbuckets = totalBuckets();
+    size_t start = rnd % nbuckets;
     size_t curr = start;
     Item *ret;
 
     do {
         ret = getRandomKeyFromSlot(curr++);
-        if (curr == size) {
+        if (curr == nbuckets) {
             curr = 0;
         }
     } while (ret == NULL && curr != start);
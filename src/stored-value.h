@@ -23,6 +23,7 @@
 #include <algorithm>
 #include <climits>
 #include <cstring>
+#include <deque>
 #include <string>
 
 #include "common.h"
@@ -31,6 +32,7 @@
 #include "item.h"
 #include "item_pager.h"
 #include "locks.h"
+#include "murmurhash3.h"
 #include "stats.h"
 
 // Forward declaration for StoredValue
@@ -163,11 +165,40 @@ public:
 
     /**
      * Get this item's value.
+     *
+     * A value held inline is copied into a new Blob, so callers only
+     * wanting to look at the bytes should use getValueData() instead.
      */
-    const value_t &getValue() const {
+    value_t getValue() const {
+        if (hasInlineValue()) {
+            return value_t(inlineBlob());
+        }
         return value;
     }
 
+    /**
+     * Get this item's value bytes (not including extended meta data)
+     * in place, without copying a value held inline.
+     *
+     * The item must be resident, and the pointer is only valid while the
+     * bucket lock is held.
+     */
+    const char *getValueData() const {
+        if (hasInlineValue()) {
+            const uint8_t *area = inlineArea();
+            return reinterpret_cast<const char*>(area) + inlineHeaderSize +
+                   FLEX_DATA_OFFSET + area[2];
+        }
+        return value->getData();
+    }
+
+    /**
+     * True if this item's value is held inline (see maxInlineValueSize).
+     */
+    bool hasInlineValue() const {
+        return inlineLength() != 0;
+    }
+
     /**
      * Get the expiration time of this item.
      *
@@ -208,7 +239,8 @@ public:
     void setValue(Item &itm, HashTable &ht, bool preserveSeqno) {
         size_t currSize = size();
         reduceCacheSize(ht, currSize);
-        value = itm.getValue();
+        releaseValue(ht);
+        assignValue(itm.getValue(), ht);
         deleted = false;
         flags = itm.getFlags();
         bySeqno = itm.getBySeqno();
@@ -230,9 +262,9 @@ public:
     /**
      * Reset the value of this item.
      */
-    void resetValue() {
+    void resetValue(HashTable &ht) {
         cb_assert(!isDeleted());
-        markNotResident();
+        markNotResident(ht);
         // item no longer resident once reset the value
         deleted = true;
     }
@@ -368,7 +400,15 @@ public:
         if (isDeleted() || !isResident()) {
             return 0;
         }
-        return value->length();
+        return hasInlineValue() ? inlineLength() : value->length();
+    }
+
+    /**
+     * Get the length of the value held outside this StoredValue, i.e.
+     * not inline (where getObjectSize() already accounts for it).
+     */
+    size_t externalValueLen() const {
+        return hasInlineValue() ? 0 : valuelen();
     }
 
     /**
@@ -377,11 +417,11 @@ public:
      * @return the amount of memory used by this item.
      */
     size_t size() {
-        return sizeof(StoredValue) + getKeyLen() + valuelen();
+        return getObjectSize() + externalValueLen();
     }
 
     size_t metaDataSize() {
-        return sizeof(StoredValue) + getKeyLen();
+        return getObjectSize();
     }
 
     /**
@@ -398,15 +438,27 @@ public:
         return true;
     }
 
+    /**
+     * Return true if this item is locked as of the given timestamp,
+     * without clearing an expired lock, for readers that don't hold the
+     * bucket lock.
+     *
+     * @param curtime lock expiration marker (usually the current time)
+     * @return true if the item is locked
+     */
+    bool isLockedNoUpdate(rel_time_t curtime) const {
+        return lock_expiry != 0 && curtime <= lock_expiry;
+    }
+
     /**
      * True if this value is resident in memory currently.
      */
     bool isResident() const {
-        return value.get() != NULL;
+        return value.get() != NULL || hasInlineValue();
     }
 
-    void markNotResident() {
-        value.reset();
+    void markNotResident(HashTable &ht) {
+        releaseValue(ht);
     }
 
     /**
@@ -424,8 +476,8 @@ public:
             return;
         }
 
-        reduceCacheSize(ht, valuelen());
-        resetValue();
+        reduceCacheSize(ht, externalValueLen());
+        resetValue(ht);
         markDirty();
         if (!isMetaDelete) {
             setCas(getCas() + 1);
@@ -482,12 +534,28 @@ public:
     static const int64_t state_non_existent_key;
     static const int64_t state_temp_init;
 
+    /**
+     * Values (including their extended meta data) no longer than this
+     * are held inline in the StoredValue's own allocation rather than in
+     * a Blob of their own.
+     */
+    static const size_t maxInlineValueSize;
+
+    /**
+     * Memory saved for each value held inline.
+     */
+    static const size_t inlineValueSaving;
+
     ~StoredValue() {
         ObjectRegistry::onDeleteStoredValue(this);
     }
 
     size_t getObjectSize() const {
-        return sizeof(StoredValue) + keylen;
+        size_t rv = sizeof(StoredValue) + keylen;
+        if (hasInlineArea) {
+            rv += inlineHeaderSize + inlineCapacity();
+        }
+        return rv;
     }
 
     /**
@@ -499,9 +567,8 @@ public:
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
-                bool setDirty = true) :
-        value(itm.getValue()), next(n), bySeqno(itm.getBySeqno()),
-        flags(itm.getFlags()) {
+                bool setDirty = true, uint8_t inlineCap = 0) :
+        next(n), bySeqno(itm.getBySeqno()), flags(itm.getFlags()) {
         cas = itm.getCas();
         exptime = itm.getExptime();
         deleted = false;
@@ -511,6 +578,14 @@ private:
         keylen = itm.getNKey();
         revSeqno = itm.getRevSeqno();
         conflictResMode = revision_seqno;
+        hasInlineArea = inlineCap != 0;
+        if (hasInlineArea) {
+            uint8_t *area = inlineArea();
+            area[0] = inlineCap;
+            area[1] = 0;
+            area[2] = 0;
+        }
+        assignValue(itm.getValue(), ht);
 
         if (setDirty) {
             markDirty();
@@ -538,6 +613,7 @@ private:
     bool               _isDirty  :  1; // 1 bit
     bool               deleted   :  1;
     bool               newCacheItem : 1;
+    bool               hasInlineArea : 1;
     uint8_t            conflictResMode : 2;
     uint8_t            nru       :  2; //!< True if referenced since last sweep
     uint8_t            keylen;
@@ -548,6 +624,44 @@ private:
     static void increaseCacheSize(HashTable &ht, size_t by);
     static void reduceCacheSize(HashTable &ht, size_t by);
     static bool hasAvailableSpace(EPStats&, const Item &item);
+
+    /**
+     * Drop our reference to the value, leaving it to the hash table to
+     * free once no optimistic reader can still be copying it.
+     */
+    void releaseValue(HashTable &ht);
+
+    /**
+     * Take the given value, copying it inline if it fits. Any previous
+     * value must have been released.
+     */
+    void assignValue(const value_t &v, HashTable &ht);
+
+    /*
+     * Small values live in an area following the key, if the factory
+     * made room for one: its capacity, the length of the value held
+     * (0 if none), the value's extended meta data length and then the
+     * value's bytes as they would appear in a Blob.
+     */
+    static const size_t inlineHeaderSize = 3;
+
+    uint8_t *inlineArea() const {
+        return reinterpret_cast<uint8_t*>(const_cast<char*>(keybytes)) +
+               keylen;
+    }
+
+    size_t inlineCapacity() const {
+        return hasInlineArea ? inlineArea()[0] : 0;
+    }
+
+    size_t inlineLength() const {
+        return hasInlineArea ? inlineArea()[1] : 0;
+    }
+
+    /**
+     * Copy the value held inline into a new Blob.
+     */
+    Blob *inlineBlob() const;
     static double mutation_mem_threshold;
 
     DISALLOW_COPY_AND_ASSIGN(StoredValue);
@@ -605,6 +719,7 @@ public:
 };
 
 class PauseResumeHashTableVisitor;
+class PauseResumeHashTableResizer;
 
 /**
  * Hash table visitor that reports the depth of each hashtable bucket.
@@ -739,8 +854,19 @@ private:
         cb_assert(key.length() < 256);
         size_t len = key.length() + base;
 
+        // Make room for small values to be held inline, rounding up so
+        // the value can grow a little (counters) without needing a Blob.
+        const value_t &val = itm.getValue();
+        uint8_t inlineCap = 0;
+        if (val.get() && val->length() <= StoredValue::maxInlineValueSize) {
+            inlineCap = static_cast<uint8_t>(
+                std::min((val->length() + 7) & ~static_cast<size_t>(7),
+                         StoredValue::maxInlineValueSize));
+            len += StoredValue::inlineHeaderSize + inlineCap;
+        }
+
         StoredValue *t = new (::operator new(len))
-                         StoredValue(itm, n, *stats, ht, setDirty);
+                         StoredValue(itm, n, *stats, ht, setDirty, inlineCap);
         std::memcpy(t->keybytes, key.data(), key.length());
         return t;
     }
@@ -748,6 +874,100 @@ private:
     EPStats                *stats;
 };
 
+/**
+ * The ways a HashTable may lay out its hash buckets in memory.
+ */
+typedef enum {
+    HT_LAYOUT_CHAINED,    //!< One pointer per bucket to a chain of values
+    HT_LAYOUT_BUCKETIZED  //!< Cache-line sized buckets of tagged pointers
+} ht_layout_t;
+
+/**
+ * A cache-line sized hash bucket used by the bucketized layout.
+ *
+ * Up to numSlots values are referenced directly from the bucket along
+ * with a one-byte tag taken from the hash of their key, so a lookup
+ * only dereferences a StoredValue whose tag matches. Values that don't
+ * fit in the slots are chained off overflow through StoredValue::next.
+ */
+class HashBucket {
+public:
+    static const int numSlots = 6;
+
+    /**
+     * Compute the (non-zero) tag to use for the given hash.
+     */
+    static uint8_t tagForHash(int h) {
+        uint8_t tag = static_cast<uint8_t>(static_cast<uint32_t>(h) >> 24);
+        return tag ? tag : 1;
+    }
+
+    /**
+     * Check all tags at once; false means none of the slots can
+     * hold a value with the given tag.
+     */
+    bool mayContain(uint8_t tag) const {
+        uint64_t all;
+        std::memcpy(&all, tags, sizeof(all));
+        uint64_t x = all ^ (0x0101010101010101ULL * tag);
+        return ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) != 0;
+    }
+
+    uint8_t      tags[8];
+    StoredValue *slots[numSlots];
+    StoredValue *overflow;
+};
+
+static_assert(sizeof(void*) != 8 || sizeof(HashBucket) == 64,
+              "HashBucket must fill exactly one cache line");
+
+/**
+ * The hash functions a HashTable may use to map keys onto buckets.
+ */
+typedef enum {
+    HT_HASH_DJB2,     //!< Byte-at-a-time DJB2 variant (default)
+    HT_HASH_MURMUR3   //!< MurmurHash3 x86_32, word-at-a-time
+} ht_hash_function_t;
+
+/**
+ * Epoch based reclamation for optimistic (unlocked) hash table readers.
+ *
+ * Readers hold a Guard while they look at a table without its locks.
+ * Writers retire rather than free anything such a reader could be
+ * looking at, recording the epoch it was retired in; it can be freed
+ * once the epoch has moved on by two, as by then every reader that was
+ * around when it was retired has finished.
+ */
+class ReadEpoch {
+public:
+    /**
+     * Marks the calling thread as reading for the Guard's lifetime.
+     */
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+
+    private:
+        AtomicValue<uint32_t> *readers;
+
+        DISALLOW_COPY_AND_ASSIGN(Guard);
+    };
+
+    /**
+     * Get the current epoch.
+     */
+    static uint64_t current();
+
+    /**
+     * Move on to the next epoch, unless readers from the previous one
+     * are still active.
+     *
+     * @return true if the epoch moved on
+     */
+    static bool tryAdvance();
+};
+
 /**
  * A container of StoredValue instances.
  */
@@ -803,17 +1023,26 @@ public:
     HashTable(EPStats &st, size_t s = 0, size_t l = 0) :
         maxDeletedRevSeqno(0), numTotalItems(0),
         numNonResidentItems(0), numEjects(0),
-        memSize(0), cacheSize(0), metaDataMemory(0), stats(st),
+        memSize(0), cacheSize(0), metaDataMemory(0), numInlineValues(0),
+        retiredBytes(0), nextReclaimBytes(retiredReclaimBytes), stats(st),
         valFact(st), visitors(0), numItems(0), numResizes(0),
-        numTempItems(0)
+        numTempItems(0), hashFunction(defaultHashFunction),
+        layout(defaultLayout), resizeChunkSize(defaultResizeChunkSize)
     {
         size = HashTable::getNumBuckets(s);
         n_locks = HashTable::getNumLocks(l);
         cb_assert(size > 0);
         cb_assert(n_locks > 0);
         cb_assert(visitors == 0);
-        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
-        mutexes = new Mutex[n_locks];
+        bool allocated = allocateBuckets(size, &values, &buckets, &bucketMem);
+        cb_assert(allocated);
+        oldSize = 0;
+        migrated = 0;
+        oldValues = NULL;
+        oldBuckets = NULL;
+        oldBucketMem = NULL;
+        resizeSequence.store(0);
+        mutexes = new SeqMutex[n_locks];
         activeState = true;
     }
 
@@ -828,21 +1057,36 @@ public:
 #endif
         }
         delete []mutexes;
-        free(values);
+        free(bucketMem);
         values = NULL;
+        buckets = NULL;
+        reclaimRetired(true);
     }
 
     size_t memorySize() {
         return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + ((size + oldSize) * bucketSize())
+            + (n_locks * sizeof(SeqMutex));
     }
 
     /**
-     * Get the number of hash table buckets this hash table has.
+     * Get the bucket layout this hash table was created with.
+     */
+    ht_layout_t getLayout() const {
+        return layout;
+    }
+
+    /**
+     * Get the number of hash table buckets this hash table has (or will
+     * have once an incremental resize in progress has completed).
      */
     size_t getSize(void) { return size; }
 
+    /**
+     * Is an incremental resize still migrating buckets?
+     */
+    bool isResizing(void) const { return oldSize != 0; }
+
     /**
      * Get the number of locks in this hash table.
      */
@@ -904,9 +1148,28 @@ public:
 
     /**
      * Resize to the specified size.
+     *
+     * If the table was created with a resize chunk size (see
+     * setDefaultResizeChunkSize()), this only allocates the new bucket
+     * array; the values are then moved across a chunk of buckets at a time
+     * by pauseResumeResize(). Otherwise all values are moved before
+     * returning, with every bucket locked for the duration.
      */
     void resize(size_t to);
 
+    /**
+     * Continue an incremental resize, migrating one chunk of buckets at a
+     * time and allowing the migration to be paused after any chunk.
+     *
+     * How far the migration has got is recorded in the hash table itself,
+     * so a subsequent call resumes where the previous one paused.
+     *
+     * @param resizer consulted after each chunk to see if we should pause
+     * @return true if no resize is in progress any more, false if paused
+     *         or if visitors stopped the migration from starting
+     */
+    bool pauseResumeResize(PauseResumeHashTableResizer &resizer);
+
     /**
      * Find the item with the given key.
      *
@@ -920,6 +1183,32 @@ public:
         return unlocked_find(key, bucket_num, false, trackReference);
     }
 
+    /**
+     * Get a copy of an item without taking the lock for its bucket.
+     *
+     * Only succeeds for a resident, live, unlocked item which (if
+     * trackReference is set) is already marked as recently referenced,
+     * and only if no writer modified the bucket meanwhile. Callers should
+     * use the locked path when this returns NULL.
+     *
+     * @param key the key to find
+     * @param vbucket the vbucket to set in the returned item
+     * @param trackReference true if the read should count as a reference
+     * @return a new item, or NULL
+     */
+    Item *optimisticGet(const std::string &key, uint16_t vbucket,
+                        bool trackReference = true);
+
+    /**
+     * Free whatever has been retired by writers that no optimistic reader
+     * can still be looking at. Called by writers once enough has been
+     * retired, and periodically by the hashtable resizer task.
+     *
+     * @param all free everything retired; only safe when no optimistic
+     *            readers can be using this hash table
+     */
+    void reclaimRetired(bool all = false);
+
     /**
      * Find a resident item
      *
@@ -1039,9 +1328,9 @@ public:
         } else if (cas != 0) {
             rv = NOT_FOUND;
         } else {
-            int bucket_num = getBucketForHash(hash(itm.getKey()));
-            v = valFact(itm, values[bucket_num], *this);
-            values[bucket_num] = v;
+            int h = hash(itm.getKey());
+            v = valFact(itm, NULL, *this);
+            linkValue(getBucketForHash(h), h, v);
             ++numItems;
             ++numTotalItems;
             if (nru <= MAX_NRU_VALUE && !v->isTempItem()) {
@@ -1232,19 +1521,14 @@ public:
      */
     StoredValue *unlocked_find(const std::string &key, int bucket_num,
                                bool wantsDeleted=false, bool trackReference=true) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced();
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+        StoredValue *v = findInBucket(key, bucket_num);
+        if (v) {
+            if (trackReference && !v->isDeleted()) {
+                v->referenced();
+            }
+            if (wantsDeleted || !v->isDeleted()) {
+                return v;
             }
-            v = v->next;
         }
         return NULL;
     }
@@ -1252,6 +1536,10 @@ public:
     /**
      * Compute a hash for the given string.
      *
+     * The function used is fixed when the hash table is created (see
+     * setDefaultHashFunction()), as every key must keep hashing to the
+     * same bucket for the lifetime of the table.
+     *
      * @param str the beginning of the string
      * @param len the number of bytes in the string
      *
@@ -1259,6 +1547,12 @@ public:
      */
     inline int hash(const char *str, const size_t len) {
         cb_assert(isActive());
+        if (hashFunction == HT_HASH_MURMUR3) {
+            uint32_t h;
+            MurmurHash3_x86_32(str, static_cast<int>(len), hashSeed, &h);
+            return static_cast<int>(h);
+        }
+
         int h=5381;
 
         for(size_t i=0; i < len; i++) {
@@ -1344,56 +1638,26 @@ public:
      */
     bool unlocked_del(const std::string &key, int bucket_num) {
         cb_assert(isActive());
-        StoredValue *v = values[bucket_num];
-
-        // Special case empty bucket.
+        StoredValue *v = findInBucket(key, bucket_num);
         if (!v) {
             return false;
         }
 
-        // Special case the first one
-        if (v->hasKey(key)) {
-            if (!v->isDeleted() && v->isLocked(ep_current_time())) {
-                return false;
-            }
-
-            values[bucket_num] = v->next;
-            StoredValue::reduceCacheSize(*this, v->size());
-            StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
-            if (v->isTempItem()) {
-                --numTempItems;
-            } else {
-                --numItems;
-                --numTotalItems;
-            }
-            delete v;
-            return true;
+        if (!v->isDeleted() && v->isLocked(ep_current_time())) {
+            return false;
         }
 
-        while (v->next) {
-            if (v->next->hasKey(key)) {
-                StoredValue *tmp = v->next;
-                if (!tmp->isDeleted() && tmp->isLocked(ep_current_time())) {
-                    return false;
-                }
-
-                v->next = v->next->next;
-                StoredValue::reduceCacheSize(*this, tmp->size());
-                StoredValue::reduceMetaDataSize(*this, stats, tmp->metaDataSize());
-                if (tmp->isTempItem()) {
-                    --numTempItems;
-                } else {
-                    --numItems;
-                    --numTotalItems;
-                }
-                delete tmp;
-                return true;
-            } else {
-                v = v->next;
-            }
+        unlinkValue(bucket_num, v);
+        StoredValue::reduceCacheSize(*this, v->size());
+        StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
+        if (v->isTempItem()) {
+            --numTempItems;
+        } else {
+            --numItems;
+            --numTotalItems;
         }
-
-        return false;
+        retire(v, value_t(), NULL);
+        return true;
     }
 
     /**
@@ -1473,6 +1737,34 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Set the number of buckets an incremental resize of a hash table
+     * created from now on migrates while holding all of its locks. Zero
+     * disables incremental resizing.
+     */
+    static void setDefaultResizeChunkSize(size_t);
+
+    /**
+     * Set the bucket layout used by hash tables created from now on.
+     *
+     * @param name "chained" or "bucketized"; unknown names are ignored
+     */
+    static void setDefaultLayout(const std::string &name);
+
+    /**
+     * Set the hash function used by hash tables created from now on.
+     *
+     * @param name "djb2" or "murmur3"; unknown names are ignored
+     */
+    static void setDefaultHashFunction(const std::string &name);
+
+    /**
+     * Get the hash function this hash table was created with.
+     */
+    ht_hash_function_t getHashFunction() const {
+        return hashFunction;
+    }
+
     /**
      * Get the max deleted revision seqno seen so far.
      */
@@ -1512,17 +1804,224 @@ public:
     AtomicValue<size_t>       cacheSize;
     //! Meta-data size.
     AtomicValue<size_t>       metaDataMemory;
+    //! Number of values held inline in their StoredValue.
+    AtomicValue<size_t>       numInlineValues;
 
 private:
     friend class StoredValue;
 
+    /**
+     * Walks the values held in one hash bucket, whichever layout the
+     * table uses. The value returned by next() may be unlinked (and
+     * freed) by the caller before calling next() again.
+     */
+    class BucketIterator {
+    public:
+        BucketIterator(StoredValue **vals, HashBucket *bkts, size_t bucket_num)
+            : bucket(bkts ? &bkts[bucket_num] : NULL), slot(0),
+              chain(bkts ? NULL : vals[bucket_num]) {}
+
+        StoredValue *next() {
+            if (bucket) {
+                while (slot < HashBucket::numSlots) {
+                    StoredValue *v = bucket->slots[slot++];
+                    if (v) {
+                        return v;
+                    }
+                }
+                chain = bucket->overflow;
+                bucket = NULL;
+            }
+            StoredValue *v = chain;
+            if (v) {
+                chain = v->next;
+            }
+            return v;
+        }
+
+    private:
+        HashBucket  *bucket;
+        int          slot;
+        StoredValue *chain;
+    };
+
+    BucketIterator bucketIterator(size_t bucket_num) {
+        StoredValue **vals;
+        HashBucket *bkts;
+        int idx = locateBucket(bucket_num, &vals, &bkts);
+        return BucketIterator(vals, bkts, idx);
+    }
+
+    /**
+     * Find the array holding the given bucket.
+     *
+     * While an incremental resize is in progress the buckets of the old
+     * array not yet migrated are numbered from size upwards, so every
+     * bucket keeps a single number (and hence a single lock) until it has
+     * been migrated.
+     *
+     * @return the index of the bucket within the array found
+     */
+    int locateBucket(int bucket_num, StoredValue ***vals, HashBucket **bkts) {
+        if (bucket_num >= static_cast<int>(size)) {
+            *vals = oldValues;
+            *bkts = oldBuckets;
+            return bucket_num - static_cast<int>(size);
+        }
+        *vals = values;
+        *bkts = buckets;
+        return bucket_num;
+    }
+
+    /**
+     * Number of buckets including those of an old array still being
+     * migrated by an incremental resize.
+     */
+    size_t totalBuckets() const {
+        return size + oldSize;
+    }
+
+    /**
+     * Find the value with the given key in a (locked) bucket, including
+     * deleted values.
+     */
+    StoredValue *findInBucket(const std::string &key, int bucket_num) {
+        StoredValue **vals;
+        HashBucket *bkts;
+        int idx = locateBucket(bucket_num, &vals, &bkts);
+        StoredValue *v;
+        if (bkts) {
+            HashBucket &b = bkts[idx];
+            uint8_t tag = HashBucket::tagForHash(hash(key));
+            if (b.mayContain(tag)) {
+                for (int i = 0; i < HashBucket::numSlots; ++i) {
+                    if (b.tags[i] == tag && b.slots[i]->hasKey(key)) {
+                        return b.slots[i];
+                    }
+                }
+            }
+            v = b.overflow;
+        } else {
+            v = vals[idx];
+        }
+
+        while (v) {
+            if (v->hasKey(key)) {
+                return v;
+            }
+            v = v->next;
+        }
+        return NULL;
+    }
+
+    /**
+     * Link a value into the given (locked) bucket.
+     *
+     * @param bucket_num the bucket the value belongs in
+     * @param h the hash of the value's key
+     * @param v the value to link in
+     */
+    void linkValue(int bucket_num, int h, StoredValue *v) {
+        StoredValue **vals;
+        HashBucket *bkts;
+        int idx = locateBucket(bucket_num, &vals, &bkts);
+        linkValue(vals, bkts, idx, h, v);
+    }
+
+    static void linkValue(StoredValue **vals, HashBucket *bkts,
+                          int bucket_num, int h, StoredValue *v);
+
+    /**
+     * Unlink a value from the given (locked) bucket without freeing it.
+     *
+     * @return true if the value was found in the bucket
+     */
+    bool unlinkValue(int bucket_num, StoredValue *v);
+
+    /**
+     * Allocate (zeroed) storage for n buckets of the table's layout.
+     * Exactly one of vals and bkts is set on success.
+     */
+    bool allocateBuckets(size_t n, StoredValue ***vals, HashBucket **bkts,
+                         void **mem);
+
+    /**
+     * Move the next n buckets of an incremental resize to the new array,
+     * freeing the old array once it is empty. All locks must be held.
+     */
+    void migrateBuckets(size_t n);
+
+    /**
+     * Something unlinked from the table (a StoredValue, a value or a
+     * bucket array) which an optimistic reader may still be looking at.
+     */
+    struct Retired {
+        Retired(uint64_t e, StoredValue *v, const value_t &b, void *m,
+                size_t n)
+            : epoch(e), sv(v), blob(b), mem(m), bytes(n) {}
+
+        uint64_t     epoch;
+        StoredValue *sv;
+        value_t      blob;
+        void        *mem;
+        size_t       bytes;
+    };
+
+    /**
+     * Free the given StoredValue, value and/or memory once no optimistic
+     * reader can be looking at them. They must already be unreachable
+     * from the table. Until then they are charged to memOverhead.
+     *
+     * @param memSize the size of mem
+     */
+    void retire(StoredValue *v, const value_t &blob, void *mem,
+                size_t memSize = 0);
+
+    // Retired bytes after which a writer tries to reclaim rather than
+    // leave it to the resizer task; this succeeds unless an optimistic
+    // reader still holds an older epoch.
+    static const size_t retiredReclaimBytes = 256 * 1024;
+    // Retired bytes beyond which a writer waits for the optimistic
+    // readers holding them back.
+    static const size_t maxRetiredBytes = 16 * 1024 * 1024;
+
+    /**
+     * Look for a key without holding the bucket's lock, giving up if the
+     * bucket is modified while we look.
+     */
+    StoredValue *optimisticFind(const std::string &key, int h,
+                                StoredValue **vals, HashBucket *bkts,
+                                int idx, const SeqMutex &mutex,
+                                uint32_t seq);
+
+    size_t bucketSize() const {
+        return layout == HT_LAYOUT_BUCKETIZED ? sizeof(HashBucket)
+                                              : sizeof(StoredValue*);
+    }
+
     inline bool isActive() const { return activeState; }
     inline void setActiveState(bool newv) { activeState = newv; }
 
     size_t               size;
     size_t               n_locks;
     StoredValue        **values;
-    Mutex               *mutexes;
+    HashBucket          *buckets;
+    void                *bucketMem;
+    // The array being migrated away from by an incremental resize;
+    // buckets below migrated have already been moved.
+    size_t               oldSize;
+    size_t               migrated;
+    StoredValue        **oldValues;
+    HashBucket          *oldBuckets;
+    void                *oldBucketMem;
+    // Odd while the bucket arrays (or their sizes) are being changed.
+    AtomicValue<uint32_t> resizeSequence;
+    SeqMutex            *mutexes;
+    std::deque<Retired>  retired;
+    size_t               retiredBytes;
+    // retiredBytes at which the next writer tries to reclaim
+    size_t               nextReclaimBytes;
+    SpinLock             retiredLock;
     EPStats&             stats;
     StoredValueFactory   valFact;
     AtomicValue<size_t>       visitors;
@@ -1530,11 +2029,24 @@ private:
     AtomicValue<size_t>       numResizes;
     AtomicValue<size_t>       numTempItems;
     bool                 activeState;
+    const ht_hash_function_t hashFunction;
+    const ht_layout_t    layout;
+    const size_t         resizeChunkSize;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static size_t                 defaultResizeChunkSize;
+    static ht_hash_function_t     defaultHashFunction;
+    static ht_layout_t            defaultLayout;
+    static const uint32_t         hashSeed;
 
     int getBucketForHash(int h) {
+        if (oldSize != 0) {
+            int old_bucket = abs(h % static_cast<int>(oldSize));
+            if (old_bucket >= static_cast<int>(migrated)) {
+                return static_cast<int>(size) + old_bucket;
+            }
+        }
         return abs(h % static_cast<int>(size));
     }
 
@@ -1566,5 +2078,23 @@ public:
     virtual bool visit(StoredValue& v) = 0;
 };
 
+/**
+ * Base class for driving an incremental hash table resize with
+ * pause/resume support.
+ */
+class PauseResumeHashTableResizer {
+public:
+    virtual ~PauseResumeHashTableResizer() {}
+
+    /**
+     * Called after each chunk of buckets has been migrated.
+     *
+     * @param stall how long (in microseconds) the hash table was locked
+     *              while migrating the chunk
+     * @return True if migration should continue, otherwise false.
+     */
+    virtual bool migrated(hrtime_t stall) = 0;
+};
+
 
 #endif  // SRC_STORED_VALUE_H_
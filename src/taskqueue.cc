@@ -19,9 +19,19 @@
 #include "taskqueue.h"
 #include "executorpool.h"
 #include "executorthread.h"
+#include "ep_engine.h"
+
+static struct timeval timeNow() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now;
+}
 
 TaskQueue::TaskQueue(ExecutorPool *m, task_type_t t, const char *nm) :
-    name(nm), queueType(t), manager(m), sleepers(0)
+    name(nm), queueType(t), manager(m), sleepers(0),
+    nodeReadyQueues(m->getNumNumaNodes()), numNodeReadyTasks(0),
+    futureQueue(TASK_TIMER_TICK_USEC, timeNow()), numTimerExpiries(0),
+    totTimerSlip(0), maxTimerSlip(0), virtualTime(0)
 {
     // EMPTY
 }
@@ -36,7 +46,7 @@ const std::string TaskQueue::getName() const {
 
 size_t TaskQueue::getReadyQueueSize() {
     LockHolder lh(mutex);
-    return readyQueue.size();
+    return readyQueue.size() + numNodeReadyTasks;
 }
 
 size_t TaskQueue::getFutureQueueSize() {
@@ -49,9 +59,72 @@ size_t TaskQueue::getPendingQueueSize() {
     return pendingQueue.size();
 }
 
-ExTask TaskQueue::_popReadyTask(void) {
-    ExTask t = readyQueue.top();
-    readyQueue.pop();
+uint64_t TaskQueue::getAvgTimerSlip() {
+    LockHolder lh(mutex);
+    return numTimerExpiries ? totTimerSlip / numTimerExpiries : 0;
+}
+
+uint64_t TaskQueue::getMaxTimerSlip() {
+    LockHolder lh(mutex);
+    return maxTimerSlip;
+}
+
+void TaskQueue::_pushReadyTask(ExTask &task) {
+    if (manager->isFairShare()) {
+        // Start-time fair queuing: a bucket that used less than its share
+        // of this queue's threads does not bank the idle time
+        WorkLoadPolicy &workload = task->getEngine()->getWorkLoadPolicy();
+        task->fairShareTag = std::max(workload.getVirtualRuntime(queueType),
+                                      virtualTime);
+    }
+
+    int node = manager->getHomeNode(task);
+    if (node < 0 || (size_t)node >= nodeReadyQueues.size()) {
+        readyQueue.push(task);
+    } else {
+        nodeReadyQueues[node].push(task);
+        numNodeReadyTasks++;
+    }
+}
+
+ReadyQueue *TaskQueue::_nextReadyQueue(ExecutorThread &t) {
+    if (!numNodeReadyTasks) {
+        return readyQueue.empty() ? NULL : &readyQueue;
+    }
+
+    // The tasks of this thread's node compete with the tasks without a
+    // home node on priority
+    if (t.numaNode >= 0 && (size_t)t.numaNode < nodeReadyQueues.size() &&
+        !nodeReadyQueues[t.numaNode].empty()) {
+        ReadyQueue *local = &nodeReadyQueues[t.numaNode];
+        if (readyQueue.empty()) {
+            return local;
+        }
+        ExTask localTop = local->top();
+        ExTask sharedTop = readyQueue.top();
+        return CompareByPriority()(localTop, sharedTop) ? &readyQueue : local;
+    }
+    if (!readyQueue.empty()) {
+        return &readyQueue;
+    }
+
+    // Rather than stay idle, run a task away from its home node
+    for (size_t i = 0; i < nodeReadyQueues.size(); ++i) {
+        if (!nodeReadyQueues[i].empty()) {
+            return &nodeReadyQueues[i];
+        }
+    }
+    return NULL;
+}
+
+ExTask TaskQueue::_popReadyTask(ExecutorThread &thread) {
+    ReadyQueue *q = _nextReadyQueue(thread);
+    ExTask t = q->top();
+    q->pop();
+    if (q != &readyQueue) {
+        numNodeReadyTasks--;
+    }
+    virtualTime = std::max(virtualTime, t->fairShareTag);
     manager->lessWork(queueType);
     return t;
 }
@@ -120,15 +193,17 @@ bool TaskQueue::_fetchNextTask(ExecutorThread &t, bool toSleep) {
 
     size_t numToWake = _moveReadyTasks(t.now);
 
-    if (!futureQueue.empty() && t.startIndex == queueType &&
-        less_tv(futureQueue.top()->waketime, t.waketime)) {
-        t.waketime = futureQueue.top()->waketime; // record earliest waketime
+    struct timeval nextExpiry;
+    if (t.startIndex == queueType && futureQueue.nextExpiry(nextExpiry) &&
+        less_tv(nextExpiry, t.waketime)) {
+        t.waketime = nextExpiry; // record earliest waketime
     }
 
-    if (!readyQueue.empty() && readyQueue.top()->isdead()) {
-        t.currentTask = _popReadyTask(); // clean out dead tasks first
+    ReadyQueue *rq = _nextReadyQueue(t);
+    if (rq && rq->top()->isdead()) {
+        t.currentTask = _popReadyTask(t); // clean out dead tasks first
         ret = true;
-    } else if (!readyQueue.empty() || !pendingQueue.empty()) {
+    } else if (rq || !pendingQueue.empty()) {
         t.curTaskType = manager->tryNewWork(queueType);
         if (t.curTaskType != NO_TASK_TYPE) {
             // if this TaskQueue has obtained capacity for the thread, then we must
@@ -137,11 +212,18 @@ bool TaskQueue::_fetchNextTask(ExecutorThread &t, bool toSleep) {
             // the readyQueue (sorted by priority)
             _checkPendingQueue();
 
-            ExTask tid = _popReadyTask(); // and pop out the top task
+            ExTask tid = _popReadyTask(t); // and pop out the top task
             t.currentTask = tid; // assign task to thread
             ret = true;
-        } else if (!readyQueue.empty()) { // We hit limit on max # workers
-            ExTask tid = _popReadyTask(); // that can work on current Q type!
+
+            if (manager->isWorkStealing()) {
+                // The threads woken below steal the next batch of ready
+                // tasks from this thread rather than contend on this
+                // TaskQueue
+                _moveToRunQueue(t);
+            }
+        } else if (rq) { // We hit limit on max # workers
+            ExTask tid = _popReadyTask(t); // that can work on current Q type!
             pendingQueue.push_back(tid);
             numToWake = numToWake ? numToWake - 1 : 0; // 1 fewer task ready
         } else { // Let the task continue waiting in pendingQueue
@@ -164,21 +246,11 @@ bool TaskQueue::fetchNextTask(ExecutorThread &thread, bool toSleep) {
 }
 
 size_t TaskQueue::_moveReadyTasks(struct timeval tv) {
-    if (!readyQueue.empty()) {
+    if (!readyQueue.empty() || numNodeReadyTasks) {
         return 0;
     }
 
-    size_t numReady = 0;
-    while (!futureQueue.empty()) {
-        ExTask tid = futureQueue.top();
-        if (less_eq_tv(tid->waketime, tv)) {
-            futureQueue.pop();
-            readyQueue.push(tid);
-            numReady++;
-        } else {
-            break;
-        }
-    }
+    size_t numReady = _expireFutureTasks(tv);
 
     manager->addWork(numReady, queueType);
 
@@ -186,10 +258,72 @@ size_t TaskQueue::_moveReadyTasks(struct timeval tv) {
     return numReady ? numReady - 1 : 0;
 }
 
+size_t TaskQueue::_expireFutureTasks(const struct timeval &now) {
+    size_t numReady = 0;
+    futureQueue.expire(now, expiredTasks);
+    for (size_t i = 0; i < expiredTasks.size(); ++i) {
+        ExTask &tid = expiredTasks[i];
+        if (less_tv(now, tid->waketime) && !tid->isdead()) {
+            // snoozed for longer while it was waiting
+            futureQueue.add(tid->getId(), tid, tid->waketime, now);
+            continue;
+        }
+
+        if (less_eq_tv(tid->waketime, now)) { // not a cancelled task
+            uint64_t slip = (now.tv_sec - tid->waketime.tv_sec) * 1000000LL +
+                            (now.tv_usec - tid->waketime.tv_usec);
+            numTimerExpiries++;
+            totTimerSlip += slip;
+            maxTimerSlip = std::max(maxTimerSlip, slip);
+        }
+        _pushReadyTask(tid);
+        numReady++;
+    }
+    expiredTasks.clear();
+    return numReady;
+}
+
+void TaskQueue::_addFutureTask(ExTask &task) {
+    futureQueue.add(task->getId(), task, task->waketime, timeNow());
+}
+
+void TaskQueue::_moveToRunQueue(ExecutorThread &t) {
+    // Tasks homed on other NUMA nodes are left to the threads of those nodes
+    ReadyQueue *local = NULL;
+    if (t.numaNode >= 0 && (size_t)t.numaNode < nodeReadyQueues.size()) {
+        local = &nodeReadyQueues[t.numaNode];
+    }
+
+    // The tasks remain counted as ready tasks of the queue type
+    LockHolder lh(t.runQueueLock);
+    for (size_t moved = 0; moved < TASK_RUN_QUEUE_BATCH; ++moved) {
+        ReadyQueue *q = &readyQueue;
+        if (local && !local->empty()) {
+            if (readyQueue.empty()) {
+                q = local;
+            } else {
+                ExTask localTop = local->top();
+                ExTask sharedTop = readyQueue.top();
+                if (!CompareByPriority()(localTop, sharedTop)) {
+                    q = local;
+                }
+            }
+        }
+        if (q->empty()) {
+            break;
+        }
+        t.runQueue.push(TaskQpair(q->top(), this));
+        q->pop();
+        if (q != &readyQueue) {
+            numNodeReadyTasks--;
+        }
+    }
+}
+
 void TaskQueue::_checkPendingQueue(void) {
     if (!pendingQueue.empty()) {
         ExTask runnableTask = pendingQueue.front();
-        readyQueue.push(runnableTask);
+        _pushReadyTask(runnableTask);
         manager->addWork(1, queueType);
         pendingQueue.pop_front();
     }
@@ -201,10 +335,8 @@ struct timeval TaskQueue::_reschedule(ExTask &task, task_type_t &curTaskType) {
 
     LockHolder lh(mutex);
 
-    futureQueue.push(task);
-    if (curTaskType == queueType) {
-        waktime = futureQueue.top()->waketime;
-    } else {
+    _addFutureTask(task);
+    if (curTaskType != queueType || !futureQueue.nextExpiry(waktime)) {
         set_max_tv(waktime);
     }
 
@@ -221,7 +353,7 @@ struct timeval TaskQueue::reschedule(ExTask &task, task_type_t &curTaskType) {
 void TaskQueue::_schedule(ExTask &task) {
     LockHolder lh(mutex);
 
-    futureQueue.push(task);
+    _addFutureTask(task);
 
     LOG(EXTENSION_LOG_DEBUG, "%s: Schedule a task \"%s\" id %d",
             name.c_str(), task->getDescription().c_str(), task->getId());
@@ -250,12 +382,13 @@ void TaskQueue::_wake(ExTask &task) {
     LOG(EXTENSION_LOG_DEBUG, "%s: Wake a task \"%s\" id %d", name.c_str(),
             task->getDescription().c_str(), task->getId());
 
-    // MB-9986: Re-sort futureQueue for now. TODO: avoid this O(N) overhead
-    std::queue<ExTask> notReady;
-    while (!futureQueue.empty()) {
-        ExTask tid = futureQueue.top();
-        notReady.push(tid);
-        futureQueue.pop();
+    // Note that this task that we are waking may nor may not be blocked in Q
+    task->waketime = now;
+    task->setState(TASK_RUNNING, TASK_SNOOZED);
+
+    if (futureQueue.remove(task->getId())) {
+        _pushReadyTask(task);
+        numReady++;
     }
 
     // Wake thread-count-serialized tasks too
@@ -263,27 +396,16 @@ void TaskQueue::_wake(ExTask &task) {
          it != pendingQueue.end();) {
         ExTask tid = *it;
         if (tid->getId() == task->getId() || tid->isdead()) {
-            notReady.push(tid);
+            _pushReadyTask(tid);
+            numReady++;
             it = pendingQueue.erase(it);
         } else {
             it++;
         }
     }
 
-    // Note that this task that we are waking may nor may not be blocked in Q
-    task->waketime = now;
-    task->setState(TASK_RUNNING, TASK_SNOOZED);
-
-    while (!notReady.empty()) {
-        ExTask tid = notReady.front();
-        if (less_eq_tv(tid->waketime, now) || tid->isdead()) {
-            readyQueue.push(tid);
-            numReady++;
-        } else {
-            futureQueue.push(tid);
-        }
-        notReady.pop();
-    }
+    // along with the other tasks that are due by now
+    numReady += _expireFutureTasks(now);
 
     if (numReady) {
         manager->addWork(numReady, queueType);
@@ -302,6 +424,17 @@ void TaskQueue::wake(ExTask &task) {
     ObjectRegistry::onSwitchThread(epe);
 }
 
+void TaskQueue::_pend(ExTask &task) {
+    LockHolder lh(mutex);
+    pendingQueue.push_back(task);
+}
+
+void TaskQueue::pend(ExTask &task) {
+    EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL, true);
+    _pend(task);
+    ObjectRegistry::onSwitchThread(epe);
+}
+
 const std::string TaskQueue::taskType2Str(task_type_t type) {
     switch (type) {
     case WRITER_TASK_IDX:
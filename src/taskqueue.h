@@ -20,15 +20,29 @@
 #include "config.h"
 
 #include <queue>
+#include <vector>
 
 #include "ringbuffer.h"
 #include "task_type.h"
 #include "tasks.h"
+#include "timerwheel.h"
+
+// Granularity of the timer wheel holding the snoozed tasks of a TaskQueue
+#define TASK_TIMER_TICK_USEC 1000
+
+// Most ready tasks a thread takes from a TaskQueue into its run queue at once
+// in work stealing mode, the rest are left to the other threads of the type
+#define TASK_RUN_QUEUE_BATCH 8
+
 class ExecutorPool;
 class ExecutorThread;
 
+typedef std::priority_queue<ExTask, std::deque<ExTask>,
+                            CompareByPriority> ReadyQueue;
+
 class TaskQueue {
     friend class ExecutorPool;
+    friend class ExecutorPoolTest;
 public:
     TaskQueue(ExecutorPool *m, task_type_t t, const char *nm);
     ~TaskQueue();
@@ -45,6 +59,11 @@ public:
 
     void wake(ExTask &task);
 
+    /**
+     * Let a ready task wait until a thread can take up a task of its type.
+     */
+    void pend(ExTask &task);
+
     static const std::string taskType2Str(task_type_t type);
 
     const std::string getName() const;
@@ -57,16 +76,30 @@ public:
 
     size_t getPendingQueueSize();
 
+    /**
+     * Average and maximum delay, in microseconds, between the time a
+     * snoozed task was due and the time it was made ready.
+     */
+    uint64_t getAvgTimerSlip();
+
+    uint64_t getMaxTimerSlip();
+
 private:
     void _schedule(ExTask &task);
     struct timeval _reschedule(ExTask &task, task_type_t &curTaskType);
     void _checkPendingQueue(void);
     bool _fetchNextTask(ExecutorThread &thread, bool toSleep);
     void _wake(ExTask &task);
+    void _pend(ExTask &task);
+    void _moveToRunQueue(ExecutorThread &thread);
     bool _doSleep(ExecutorThread &thread);
     void _doWake_UNLOCKED(size_t &numToWake);
     size_t _moveReadyTasks(struct timeval tv);
-    ExTask _popReadyTask(void);
+    void _pushReadyTask(ExTask &task);
+    ReadyQueue *_nextReadyQueue(ExecutorThread &thread);
+    size_t _expireFutureTasks(const struct timeval &now);
+    void _addFutureTask(ExTask &task);
+    ExTask _popReadyTask(ExecutorThread &thread);
 
     SyncObject mutex;
     const std::string name;
@@ -75,12 +108,21 @@ private:
     size_t sleepers; // number of threads sleeping in this taskQueue
 
     // sorted by task priority then waketime ..
-    std::priority_queue<ExTask, std::deque<ExTask >,
-                        CompareByPriority> readyQueue;
-    std::priority_queue<ExTask, std::deque<ExTask >,
-                        CompareByDueDate> futureQueue;
+    ReadyQueue readyQueue;
+    // ready tasks with a home NUMA node, by node
+    std::vector<ReadyQueue> nodeReadyQueues;
+    size_t numNodeReadyTasks;
+    // snoozed tasks, by waketime
+    TimerWheel<ExTask> futureQueue;
+    std::vector<ExTask> expiredTasks;
+    uint64_t numTimerExpiries;
+    uint64_t totTimerSlip;
+    uint64_t maxTimerSlip;
 
     std::list<ExTask> pendingQueue;
+
+    // fair share tag of the last task taken off the ready queues
+    uint64_t virtualTime;
 };
 
 #endif  // SRC_TASKQUEUE_H_
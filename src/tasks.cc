@@ -44,6 +44,10 @@ bool FlusherTask::run() {
     return flusher->step(this);
 }
 
+bool FlushCollectorTask::run() {
+    return flusher->collect(this);
+}
+
 bool VBSnapshotTask::run() {
     engine->getEpStore()->snapshotVBuckets(priority, shardID);
     return false;
@@ -98,10 +102,16 @@ bool VKeyStatBGFetchTask::run() {
     return false;
 }
 
+BGFetchTask::BGFetchTask(EventuallyPersistentEngine *e, const std::string &k,
+                         uint16_t vbid, const RCPtr<VBucket> &vb,
+                         const void *c, bool isMeta, const Priority &p,
+                         int sleeptime, bool shutdown) :
+    GlobalTask(e, p, sleeptime, shutdown), key(k), vbucket(vbid),
+    fetchVb(vb), cookie(c), metaFetch(isMeta), init(gethrtime()) { }
 
 bool BGFetchTask::run() {
-    engine->getEpStore()->completeBGFetch(key, vbucket, cookie, init,
-                                          metaFetch);
+    engine->getEpStore()->completeBGFetch(key, vbucket, fetchVb, cookie,
+                                          init, metaFetch);
     return false;
 }
 
@@ -39,6 +39,7 @@ class CompareTasksByDueDate;
 class CompareTasksByPriority;
 class EventuallyPersistentEngine;
 class Flusher;
+class VBucket;
 class Warmup;
 
 /**
@@ -62,7 +63,6 @@ typedef struct {
 } compaction_ctx;
 
 class GlobalTask : public RCValue {
-friend class CompareByDueDate;
 friend class CompareByPriority;
 friend class ExecutorPool;
 friend class ExecutorThread;
@@ -72,7 +72,8 @@ public:
                double sleeptime = 0, bool completeBeforeShutdown = true) :
           RCValue(), priority(p),
           blockShutdown(completeBeforeShutdown),
-          state(TASK_RUNNING), taskId(nextTaskId()), engine(e) {
+          state(TASK_RUNNING), taskId(nextTaskId()), engine(e),
+          fairShareTag(0) {
         snooze(sleeptime);
     }
 
@@ -125,6 +126,14 @@ public:
      */
     size_t getId() { return taskId; }
 
+    /**
+     * Returns the id of the shard whose data this task works on, which
+     * the ExecutorPool uses to keep the task on that shard's NUMA node.
+     *
+     * @return A shard id, or -1 if the task is not tied to a shard.
+     */
+    virtual int getShardAffinity() { return -1; }
+
     /**
      * Returns the type id of this task.
      *
@@ -155,6 +164,8 @@ protected:
     const size_t taskId;
     struct timeval waketime;
     EventuallyPersistentEngine *engine;
+    // virtual time at which the task was made ready, under fair share
+    uint64_t fairShareTag;
 
     static AtomicValue<size_t> task_id_counter;
     static size_t nextTaskId() { return task_id_counter.fetch_add(1); }
@@ -169,7 +180,8 @@ class FlusherTask : public GlobalTask {
 public:
     FlusherTask(EventuallyPersistentEngine *e, Flusher* f, const Priority &p,
                 uint16_t shardid, bool completeBeforeShutdown = true) :
-                GlobalTask(e, p, 0, completeBeforeShutdown), flusher(f) {
+                GlobalTask(e, p, 0, completeBeforeShutdown), flusher(f),
+                shardId(shardid) {
         std::stringstream ss;
         ss<<"Running a flusher loop: shard "<<shardid;
         desc = ss.str();
@@ -181,9 +193,46 @@ public:
         return desc;
     }
 
+    int getShardAffinity() {
+        return shardId;
+    }
+
 private:
     Flusher* flusher;
     std::string desc;
+    uint16_t shardId;
+};
+
+/**
+ * A task that collects and deduplicates the next vbucket's flush batch
+ * for a flusher while it commits the current one.
+ */
+class FlushCollectorTask : public GlobalTask {
+public:
+    FlushCollectorTask(EventuallyPersistentEngine *e, Flusher* f,
+                       const Priority &p, uint16_t shardid,
+                       bool completeBeforeShutdown = false) :
+                       GlobalTask(e, p, 0, completeBeforeShutdown),
+                       flusher(f), shardId(shardid) {
+        std::stringstream ss;
+        ss<<"Collecting the next flush batch: shard "<<shardid;
+        desc = ss.str();
+    }
+
+    bool run();
+
+    std::string getDescription() {
+        return desc;
+    }
+
+    int getShardAffinity() {
+        return shardId;
+    }
+
+private:
+    Flusher* flusher;
+    std::string desc;
+    uint16_t shardId;
 };
 
 /**
@@ -339,8 +388,10 @@ private:
 class BgFetcherTask : public GlobalTask {
 public:
     BgFetcherTask(EventuallyPersistentEngine *e, BgFetcher *b,
-                  const Priority &p, bool sleeptime = 0, bool shutdown = false)
-        : GlobalTask(e, p, sleeptime, shutdown), bgfetcher(b) { }
+                  const Priority &p, uint16_t shardid, bool sleeptime = 0,
+                  bool shutdown = false)
+        : GlobalTask(e, p, sleeptime, shutdown), bgfetcher(b),
+          shardId(shardid) { }
 
     bool run();
 
@@ -348,8 +399,13 @@ public:
         return std::string("Batching background fetch");
     }
 
+    int getShardAffinity() {
+        return shardId;
+    }
+
 private:
     BgFetcher *bgfetcher;
+    uint16_t shardId;
 };
 
 /**
@@ -403,10 +459,9 @@ private:
 class BGFetchTask : public GlobalTask {
 public:
     BGFetchTask(EventuallyPersistentEngine *e, const std::string &k,
-            uint16_t vbid, const void *c, bool isMeta,
-            const Priority &p, int sleeptime = 0, bool shutdown = false) :
-        GlobalTask(e, p, sleeptime, shutdown), key(k), vbucket(vbid),
-        cookie(c), metaFetch(isMeta), init(gethrtime()) { }
+            uint16_t vbid, const RCPtr<VBucket> &vb, const void *c,
+            bool isMeta, const Priority &p, int sleeptime = 0,
+            bool shutdown = false);
 
     bool run();
 
@@ -419,6 +474,8 @@ public:
 private:
     const std::string          key;
     uint16_t                   vbucket;
+    // the vbucket the read was started on, which fetches of the key join
+    RCPtr<VBucket>             fetchVb;
     const void                *cookie;
     bool                       metaFetch;
     hrtime_t                   init;
@@ -454,19 +511,14 @@ private:
 class CompareByPriority {
 public:
     bool operator()(ExTask &t1, ExTask &t2) {
-        return (t1->priority == t2->priority) ?
-               (t1->taskId   > t2->taskId)    :
-               (t1->priority < t2->priority);
-    }
-};
-
-/**
- * Order tasks by their ready date.
- */
-class CompareByDueDate {
-public:
-    bool operator()(ExTask &t1, ExTask &t2) {
-        return less_tv(t2->waketime, t1->waketime);
+        if (t1->priority == t2->priority) {
+            // Tasks of equal priority run by their fair share tag, which is
+            // always 0 unless the ExecutorPool shares threads between buckets
+            return (t1->fairShareTag == t2->fairShareTag) ?
+                   (t1->taskId       > t2->taskId)       :
+                   (t1->fairShareTag > t2->fairShareTag);
+        }
+        return t1->priority < t2->priority;
     }
 };
 
@@ -0,0 +1,329 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_TIMERWHEEL_H_
+#define SRC_TIMERWHEEL_H_ 1
+
+#include "config.h"
+
+#include <algorithm>
+#include <list>
+#include <vector>
+
+#include "common.h"
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/**
+ * A hierarchical timing wheel holding elements of type T until they are due.
+ *
+ * Time is cut into ticks of a fixed number of microseconds. A slot of the
+ * first level holds the elements due in one tick, a slot of level n spans
+ * TIMER_WHEEL_SLOTS^n ticks and is cascaded into the lower levels when time
+ * reaches it. Elements due beyond the last level wait in an overflow list
+ * which is filed again every time the last level wraps.
+ *
+ * Adding and removing an element are O(1), and all elements due within the
+ * same tick are released together. An element is never released before its
+ * due time, and at most one tick after it once expire() gets called.
+ *
+ * Elements are identified by an id given by the caller.
+ */
+template <typename T>
+class TimerWheel {
+public:
+
+    /**
+     * Construct an empty wheel ticking every tickUsec microseconds,
+     * starting from the given time.
+     */
+    TimerWheel(uint64_t tickUsec, const struct timeval &now)
+        : tick(tickUsec ? tickUsec : 1), current(floorTick(now)),
+          numElements(0) {
+        for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+            occupied[l] = 0;
+        }
+    }
+
+    /**
+     * Add an element which becomes due at the given time. An element with
+     * the same id that is already in the wheel is replaced.
+     */
+    void add(size_t id, const T &elm, const struct timeval &due,
+             const struct timeval &now) {
+        remove(id);
+
+        Entry entry(id, elm, due, ceilTick(due));
+        if (less_eq_tv(due, now) || entry.expiry < current) {
+            dueList.push_back(entry);
+            index[id] = Location(DUE_LEVEL, 0, --dueList.end());
+        } else {
+            std::list<Entry> single;
+            single.push_back(entry);
+            file(single, single.begin());
+        }
+        ++numElements;
+    }
+
+    /**
+     * Remove the element with the given id.
+     *
+     * @return true if the element was in the wheel
+     */
+    bool remove(size_t id) {
+        typename unordered_map<size_t, Location>::iterator itr = index.find(id);
+        if (itr == index.end()) {
+            return false;
+        }
+        Location &loc = itr->second;
+        std::list<Entry> &list = listAt(loc.level, loc.slot);
+        list.erase(loc.it);
+        if (loc.level >= 0 && loc.level < TIMER_WHEEL_LEVELS && list.empty()) {
+            occupied[loc.level] &= ~(uint64_t(1) << loc.slot);
+        }
+        index.erase(itr);
+        --numElements;
+        return true;
+    }
+
+    /**
+     * Is the element with the given id in the wheel?
+     */
+    bool contains(size_t id) const {
+        return index.find(id) != index.end();
+    }
+
+    /**
+     * Move all the elements that are due by the given time into out.
+     *
+     * @return the number of elements released
+     */
+    size_t expire(const struct timeval &now, std::vector<T> &out) {
+        size_t released = release(dueList, DUE_LEVEL, 0, out);
+
+        uint64_t nowTick = floorTick(now);
+        while (current <= nowTick) {
+            uint64_t next = nextEventTick();
+            if (next > nowTick) {
+                break;
+            }
+            current = next;
+            if (!(current & SLOT_MASK)) {
+                cascade();
+            }
+            size_t slot = current & SLOT_MASK;
+            released += release(wheel[0][slot], 0, slot, out);
+            ++current;
+        }
+        if (current <= nowTick) {
+            current = nowTick + 1;
+        }
+        return released;
+    }
+
+    /**
+     * Get the earliest time at which the wheel may have elements to
+     * release. The time may be earlier than the actual due time of any
+     * element when it only marks the cascading of a higher level.
+     *
+     * @return false if the wheel is empty
+     */
+    bool nextExpiry(struct timeval &tv) const {
+        if (!numElements) {
+            return false;
+        }
+        if (!dueList.empty()) {
+            tv = dueList.front().due;
+            return true;
+        }
+        uint64_t usec = nextEventTick() * tick;
+        tv.tv_sec = usec / 1000000;
+        tv.tv_usec = usec % 1000000;
+        return true;
+    }
+
+    /**
+     * How many elements are in the wheel?
+     */
+    size_t size() const {
+        return numElements;
+    }
+
+private:
+
+    static const int DUE_LEVEL = -1;
+    static const int OVERFLOW_LEVEL = TIMER_WHEEL_LEVELS;
+    static const uint64_t SLOT_MASK = TIMER_WHEEL_SLOTS - 1;
+    static const uint64_t NO_EVENT = ~uint64_t(0);
+
+    struct Entry {
+        Entry(size_t i, const T &e, const struct timeval &d, uint64_t x)
+            : id(i), elm(e), due(d), expiry(x) { }
+
+        size_t id;
+        T elm;
+        struct timeval due;
+        uint64_t expiry;
+    };
+
+    struct Location {
+        Location() : level(DUE_LEVEL), slot(0) { }
+        Location(int l, size_t s, typename std::list<Entry>::iterator i)
+            : level(l), slot(s), it(i) { }
+
+        int level;
+        size_t slot;
+        typename std::list<Entry>::iterator it;
+    };
+
+    static uint64_t toUsec(const struct timeval &tv) {
+        return uint64_t(tv.tv_sec) * 1000000 + uint64_t(tv.tv_usec);
+    }
+
+    uint64_t floorTick(const struct timeval &tv) const {
+        return toUsec(tv) / tick;
+    }
+
+    uint64_t ceilTick(const struct timeval &tv) const {
+        return (toUsec(tv) + tick - 1) / tick;
+    }
+
+    static uint64_t levelSpan(int level) {
+        return uint64_t(1) << (level * TIMER_WHEEL_SLOT_BITS);
+    }
+
+    std::list<Entry> &listAt(int level, size_t slot) {
+        if (level == DUE_LEVEL) {
+            return dueList;
+        } else if (level == OVERFLOW_LEVEL) {
+            return overflow;
+        }
+        return wheel[level][slot];
+    }
+
+    /**
+     * Move the entry at pos of the given list to the slot matching its
+     * expiry relative to the current tick.
+     */
+    void file(std::list<Entry> &from,
+              typename std::list<Entry>::iterator pos) {
+        uint64_t expiry = pos->expiry;
+        int level = OVERFLOW_LEVEL;
+        size_t slot = 0;
+        if (expiry < current) {
+            level = DUE_LEVEL;
+        } else {
+            uint64_t delta = expiry - current;
+            for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+                if (delta < levelSpan(l + 1)) {
+                    level = l;
+                    slot = (expiry >> (l * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+                    break;
+                }
+            }
+        }
+
+        std::list<Entry> &to = listAt(level, slot);
+        to.splice(to.end(), from, pos);
+        if (level >= 0 && level < TIMER_WHEEL_LEVELS) {
+            occupied[level] |= uint64_t(1) << slot;
+        }
+        index[pos->id] = Location(level, slot, pos);
+    }
+
+    /**
+     * Spread the higher level slots that start at the current tick over
+     * the lower levels. Called on every tick which is a multiple of the
+     * first level span.
+     */
+    void cascade() {
+        for (int l = 1; l <= TIMER_WHEEL_LEVELS; ++l) {
+            std::list<Entry> pending;
+            size_t slot = 0;
+            if (l < TIMER_WHEEL_LEVELS) {
+                slot = (current >> (l * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+                pending.splice(pending.end(), wheel[l][slot]);
+                occupied[l] &= ~(uint64_t(1) << slot);
+            } else {
+                pending.splice(pending.end(), overflow);
+            }
+            while (!pending.empty()) {
+                file(pending, pending.begin());
+            }
+            if (slot) { // the levels above have not wrapped
+                break;
+            }
+        }
+    }
+
+    size_t release(std::list<Entry> &list, int level, size_t slot,
+                   std::vector<T> &out) {
+        size_t released = list.size();
+        while (!list.empty()) {
+            Entry &entry = list.front();
+            index.erase(entry.id);
+            out.push_back(entry.elm);
+            list.pop_front();
+        }
+        if (level >= 0 && level < TIMER_WHEEL_LEVELS) {
+            occupied[level] &= ~(uint64_t(1) << slot);
+        }
+        numElements -= released;
+        return released;
+    }
+
+    /**
+     * The earliest tick, not before the current one, at which a slot has
+     * to be released or cascaded.
+     */
+    uint64_t nextEventTick() const {
+        uint64_t next = NO_EVENT;
+        for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+            if (!occupied[l]) {
+                continue;
+            }
+            uint64_t span = levelSpan(l);
+            uint64_t start = (current + span - 1) / span;
+            size_t from = start & SLOT_MASK;
+            for (size_t k = 0; k < TIMER_WHEEL_SLOTS; ++k) {
+                if (occupied[l] & (uint64_t(1) << ((from + k) & SLOT_MASK))) {
+                    next = std::min(next, (start + k) * span);
+                    break;
+                }
+            }
+        }
+        if (!overflow.empty()) {
+            uint64_t span = levelSpan(TIMER_WHEEL_LEVELS);
+            next = std::min(next, ((current + span - 1) / span) * span);
+        }
+        return next;
+    }
+
+    const uint64_t tick;
+    uint64_t current; // the next tick to be released
+
+    std::list<Entry> wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // bitmap of non-empty slots
+    std::list<Entry> dueList;
+    std::list<Entry> overflow;
+    unordered_map<size_t, Location> index;
+    size_t numElements;
+};
+
+#endif  // SRC_TIMERWHEEL_H_
@@ -135,6 +135,24 @@ VBucket::~VBucket() {
             ++num_pending_fetches;
         }
     }
+    // Fetches that joined a read aren't counted as remaining jobs. Nothing
+    // will complete them once the vbucket is gone, so tell their clients.
+    EventuallyPersistentEngine *engine = ObjectRegistry::getCurrentEngine();
+    vb_bgfetch_queue_t *inflight[] = { &inflightBGFetches,
+                                       &inflightBGMetaFetches };
+    for (size_t i = 0; i < 2; ++i) {
+        for (itr = inflight[i]->begin(); itr != inflight[i]->end(); ++itr) {
+            std::list<VBucketBGFetchItem *> &bgitems = itr->second;
+            std::list<VBucketBGFetchItem *>::iterator vit = bgitems.begin();
+            for (; vit != bgitems.end(); ++vit) {
+                if (engine) {
+                    engine->notifyIOComplete((*vit)->cookie,
+                                             ENGINE_NOT_MY_VBUCKET);
+                }
+                delete (*vit);
+            }
+        }
+    }
     stats.numRemainingBgJobs.fetch_sub(num_pending_fetches);
     pendingBGFetches.clear();
     delete failovers;
@@ -285,12 +303,47 @@ void VBucket::queueBGFetchItem(const std::string &key,
 
 bool VBucket::getBGFetchItems(vb_bgfetch_queue_t &fetches) {
     LockHolder lh(pendingBGFetchesLock);
+    vb_bgfetch_queue_t::iterator itr = pendingBGFetches.begin();
+    for (; itr != pendingBGFetches.end(); ++itr) {
+        bool metaOnly = VBucketBGFetchItem::metaOnly(itr->second);
+        vb_bgfetch_queue_t &inflight = metaOnly ? inflightBGMetaFetches :
+                                                  inflightBGFetches;
+        inflight[itr->first];
+    }
     fetches.insert(pendingBGFetches.begin(), pendingBGFetches.end());
     pendingBGFetches.clear();
     lh.unlock();
     return fetches.size() > 0;
 }
 
+bool VBucket::joinBGFetch(const std::string &key, VBucketBGFetchItem *fetch,
+                          bool start) {
+    LockHolder lh(pendingBGFetchesLock);
+    vb_bgfetch_queue_t &inflight = fetch->metaDataOnly ?
+                                   inflightBGMetaFetches : inflightBGFetches;
+    vb_bgfetch_queue_t::iterator itr = inflight.find(key);
+    if (itr != inflight.end()) {
+        itr->second.push_back(fetch);
+        return true;
+    }
+    if (start) {
+        inflight[key];
+    }
+    return false;
+}
+
+void VBucket::takeBGFetchWaiters(const std::string &key, bool metaOnly,
+                                 std::list<VBucketBGFetchItem *> &waiters) {
+    LockHolder lh(pendingBGFetchesLock);
+    vb_bgfetch_queue_t &inflight = metaOnly ? inflightBGMetaFetches :
+                                              inflightBGFetches;
+    vb_bgfetch_queue_t::iterator itr = inflight.find(key);
+    if (itr != inflight.end()) {
+        waiters.splice(waiters.end(), itr->second);
+        inflight.erase(itr);
+    }
+}
+
 void VBucket::addHighPriorityVBEntry(uint64_t id, const void *cookie,
                                      bool isBySeqno) {
     LockHolder lh(hpChksMutex);
@@ -350,9 +350,34 @@ public:
         backfill.isBackfillPhase = backfillPhase;
     }
 
+    /**
+     * Take the queued background fetches, marking their keys as being
+     * read so that later fetches of those keys join the reads.
+     */
     bool getBGFetchItems(vb_bgfetch_queue_t &fetches);
     void queueBGFetchItem(const std::string &key, VBucketBGFetchItem *fetch,
                           BgFetcher *bgFetcher);
+
+    /**
+     * Attach a background fetch to the disk read of the same kind (meta
+     * only or full) already in flight for its key, if any.
+     *
+     * @param key the key to fetch
+     * @param fetch the fetch; owned by the vbucket if it was attached
+     * @param start if no read can be joined, mark one of this kind as in
+     *              flight for the caller, who must then finish it with
+     *              takeBGFetchWaiters
+     * @return true if the fetch was attached
+     */
+    bool joinBGFetch(const std::string &key, VBucketBGFetchItem *fetch,
+                     bool start);
+
+    /**
+     * Finish the read in flight for a key: hand over the fetches that
+     * joined it, which now belong to the caller.
+     */
+    void takeBGFetchWaiters(const std::string &key, bool metaOnly,
+                            std::list<VBucketBGFetchItem *> &waiters);
     size_t numPendingBGFetchItems(void) {
         // do a dirty read of number of fetch items
         return pendingBGFetches.size();
@@ -498,6 +523,9 @@ private:
 
     Mutex pendingBGFetchesLock;
     vb_bgfetch_queue_t pendingBGFetches;
+    // Keys with a disk read in flight, with the fetches waiting on it
+    vb_bgfetch_queue_t inflightBGFetches;
+    vb_bgfetch_queue_t inflightBGMetaFetches;
 
     Mutex snapshotMutex;
     uint64_t persisted_snapshot_start;
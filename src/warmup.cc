@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <limits>
 #include <list>
 #include <map>
@@ -295,6 +296,7 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                 ++stats.warmedUpKeys;
                 ++stats.warmedUpValues;
         }
+        epstore->getWarmup()->itemLoaded(vb->getId());
     } else {
         stopLoading = true;
         delete i;
@@ -375,7 +377,7 @@ void LoadValueCallback::callback(CacheLookup &lookup)
 
 Warmup::Warmup(EventuallyPersistentStore *st) :
     state(), store(st), startTime(0), metadata(0), warmup(0),
-    threadtask_count(0),
+    threadtask_count(0), numScanTasks(0),
     estimateTime(0), estimatedItemCount(std::numeric_limits<size_t>::max()),
     cleanShutdown(true), corruptAccessLog(false), warmupComplete(false),
     estimatedWarmupCount(std::numeric_limits<size_t>::max())
@@ -387,12 +389,19 @@ Warmup::Warmup(EventuallyPersistentStore *st) :
     for (size_t i = 0; i < store->vbMap.numShards; i++) {
         shardKeyDumpStatus[i] = false;
     }
+    shardScanCursor = new AtomicValue<size_t>[store->vbMap.numShards];
+    vbProgress = new AtomicValue<int>[store->vbMap.getSize()];
+    vbLoadedItems = new AtomicValue<size_t>[store->vbMap.getSize()];
+    resetVBucketProgress();
 }
 
 Warmup::~Warmup() {
     delete [] shardVbStates;
     delete [] shardVbIds;
     delete [] shardKeyDumpStatus;
+    delete [] shardScanCursor;
+    delete [] vbProgress;
+    delete [] vbLoadedItems;
 }
 
 void Warmup::setEstimatedWarmupCount(size_t to)
@@ -550,10 +559,15 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
 void Warmup::scheduleKeyDump()
 {
     threadtask_count = 0;
+    resetVBucketProgress();
+    size_t scans = getScansPerShard();
+    numScanTasks = store->vbMap.shards.size() * scans;
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupKeyDump(*store, this,
-                                        i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        for (size_t j = 0; j < scans; j++) {
+            ExTask task = new WarmupKeyDump(*store, this,
+                                            i, Priority::WarmupPriority);
+            ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        }
     }
 
 }
@@ -561,26 +575,17 @@ void Warmup::scheduleKeyDump()
 void Warmup::keyDumpforShard(uint16_t shardId)
 {
     if (store->getROUnderlyingByShard(shardId)->isKeyDumpSupported()) {
-        KVStore* kvstore = store->getROUnderlyingByShard(shardId);
         LoadStorageKVPairCallback *load_cb =
             new LoadStorageKVPairCallback(store, false, state.getState());
         shared_ptr<Callback<GetValue> > cb(load_cb);
         shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
 
-        std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
-        for (; itr != shardVbIds[shardId].end(); ++itr) {
-            ScanContext* ctx = kvstore->initScanContext(cb, cl, *itr, 0, true,
-                                                        true, false);
-            if (ctx) {
-                kvstore->scan(ctx);
-                kvstore->destroyScanContext(ctx);
-            }
-        }
+        scanShardVBuckets(shardId, cb, cl, true);
 
         shardKeyDumpStatus[shardId] = true;
     }
 
-    if (++threadtask_count == store->vbMap.numShards) {
+    if (++threadtask_count == numScanTasks) {
         bool success = false;
         for (size_t i = 0; i < store->vbMap.numShards; i++) {
             if (shardKeyDumpStatus[i]) {
@@ -645,6 +650,7 @@ void Warmup::checkForAccessLog()
 void Warmup::scheduleLoadingAccessLog()
 {
     threadtask_count = 0;
+    resetVBucketProgress();
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
         ExTask task = new WarmupLoadAccessLog(*store, this, i,
                 Priority::WarmupPriority);
@@ -659,6 +665,10 @@ void Warmup::loadingAccessLog(uint16_t shardId)
         new LoadStorageKVPairCallback(store, true, state.getState());
     bool success = false;
     hrtime_t stTime = gethrtime();
+    std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
+    for (; itr != shardVbIds[shardId].end(); ++itr) {
+        vbProgress[*itr] = WARMUP_VB_LOADING;
+    }
     if (store->accessLog[shardId]->exists()) {
         try {
             store->accessLog[shardId]->open();
@@ -703,6 +713,11 @@ void Warmup::loadingAccessLog(uint16_t shardId)
         setEstimatedWarmupCount(estimatedCount);
     }
 
+    for (itr = shardVbIds[shardId].begin();
+         itr != shardVbIds[shardId].end(); ++itr) {
+        vbProgress[*itr] = WARMUP_VB_DONE;
+    }
+
     delete load_cb;
     if (++threadtask_count == store->vbMap.numShards) {
         if (!store->maybeEnableTraffic()) {
@@ -758,10 +773,15 @@ void Warmup::scheduleLoadingKVPairs()
     setEstimatedWarmupCount(estimatedItemCount);
 
     threadtask_count = 0;
+    resetVBucketProgress();
+    size_t scans = getScansPerShard();
+    numScanTasks = store->vbMap.shards.size() * scans;
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingKVPairs(*store, this,
-                                               i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        for (size_t j = 0; j < scans; j++) {
+            ExTask task = new WarmupLoadingKVPairs(*store, this,
+                                                   i, Priority::WarmupPriority);
+            ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        }
     }
 
 }
@@ -773,7 +793,6 @@ void Warmup::loadKVPairsforShard(uint16_t shardId)
         maybe_enable_traffic = true;
     }
 
-    KVStore* kvstore = store->getROUnderlyingByShard(shardId);
     LoadStorageKVPairCallback *load_cb =
         new LoadStorageKVPairCallback(store, maybe_enable_traffic,
                                       state.getState());
@@ -781,16 +800,9 @@ void Warmup::loadKVPairsforShard(uint16_t shardId)
     shared_ptr<Callback<CacheLookup> >
         cl(new LoadValueCallback(store->vbMap, state.getState()));
 
-    std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
-    for (; itr != shardVbIds[shardId].end(); ++itr) {
-        ScanContext* ctx = kvstore->initScanContext(cb, cl, *itr, 0, false,
-                                                    true, false);
-        if (ctx) {
-            kvstore->scan(ctx);
-            kvstore->destroyScanContext(ctx);
-        }
-    }
-    if (++threadtask_count == store->vbMap.numShards) {
+    scanShardVBuckets(shardId, cb, cl, false);
+
+    if (++threadtask_count == numScanTasks) {
         transition(WarmupState::Done);
     }
 }
@@ -801,34 +813,78 @@ void Warmup::scheduleLoadingData()
     setEstimatedWarmupCount(estimatedCount);
 
     threadtask_count = 0;
+    resetVBucketProgress();
+    size_t scans = getScansPerShard();
+    numScanTasks = store->vbMap.shards.size() * scans;
     for (size_t i = 0; i < store->vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingData(*store, this,
-                                            i, Priority::WarmupPriority);
-        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        for (size_t j = 0; j < scans; j++) {
+            ExTask task = new WarmupLoadingData(*store, this,
+                                                i, Priority::WarmupPriority);
+            ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+        }
     }
 }
 
 void Warmup::loadDataforShard(uint16_t shardId)
 {
-    KVStore* kvstore = store->getROUnderlyingByShard(shardId);
     LoadStorageKVPairCallback *load_cb =
         new LoadStorageKVPairCallback(store, true, state.getState());
     shared_ptr<Callback<GetValue> > cb(load_cb);
     shared_ptr<Callback<CacheLookup> >
         cl(new LoadValueCallback(store->vbMap, state.getState()));
 
-    std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
-    for (; itr != shardVbIds[shardId].end(); ++itr) {
-        ScanContext* ctx = kvstore->initScanContext(cb, cl, *itr, 0, false,
+    scanShardVBuckets(shardId, cb, cl, false);
+
+    if (++threadtask_count == numScanTasks) {
+        transition(WarmupState::Done);
+    }
+}
+
+size_t Warmup::getScansPerShard()
+{
+    size_t scans =
+        store->getEPEngine().getConfiguration().getWarmupParallelScans();
+    if (scans == 0) {
+        scans = ExecutorPool::get()->getNumReaders();
+    }
+    size_t numShards = store->vbMap.numShards;
+    return std::max((size_t)1, (scans + numShards - 1) / numShards);
+}
+
+void Warmup::resetVBucketProgress()
+{
+    for (size_t i = 0; i < store->vbMap.numShards; i++) {
+        shardScanCursor[i] = 0;
+    }
+    for (size_t vb = 0; vb < store->vbMap.getSize(); vb++) {
+        vbProgress[vb] = WARMUP_VB_PENDING;
+        vbLoadedItems[vb] = 0;
+    }
+}
+
+void Warmup::scanShardVBuckets(uint16_t shardId,
+                               shared_ptr<Callback<GetValue> > cb,
+                               shared_ptr<Callback<CacheLookup> > cl,
+                               bool keysOnly)
+{
+    KVStore* kvstore = store->getROUnderlyingByShard(shardId);
+    const std::vector<uint16_t> &vbs = shardVbIds[shardId];
+
+    // All the scan tasks of a shard take its vbuckets in turn, in the order
+    // set by populateShardVbStates, until none are left or traffic got
+    // enabled
+    size_t next;
+    while ((next = shardScanCursor[shardId].fetch_add(1)) < vbs.size() &&
+           !isComplete()) {
+        uint16_t vbid = vbs[next];
+        vbProgress[vbid] = WARMUP_VB_LOADING;
+        ScanContext* ctx = kvstore->initScanContext(cb, cl, vbid, 0, keysOnly,
                                                     true, false);
         if (ctx) {
             kvstore->scan(ctx);
             kvstore->destroyScanContext(ctx);
         }
-    }
-
-    if (++threadtask_count == store->vbMap.numShards) {
-        transition(WarmupState::Done);
+        vbProgress[vbid] = WARMUP_VB_DONE;
     }
 }
 
@@ -962,6 +1018,25 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
             addStat("estimated_value_count", estimatedWarmupCount,
             add_stat, c);
         }
+
+        // The vbuckets of each shard are known once initialized
+        if (state.getState() != WarmupState::Initialize) {
+            static const char *progressNames[] = { "pending", "loading",
+                                                   "done" };
+            char statname[80] = {0};
+            for (size_t i = 0; i < store->vbMap.numShards; i++) {
+                std::vector<uint16_t>::const_iterator it;
+                for (it = shardVbIds[i].begin(); it != shardVbIds[i].end();
+                     ++it) {
+                    snprintf(statname, sizeof(statname), "vb_%d:progress",
+                             *it);
+                    addStat(statname, progressNames[vbProgress[*it].load()],
+                            add_stat, c);
+                    snprintf(statname, sizeof(statname), "vb_%d:items", *it);
+                    addStat(statname, vbLoadedItems[*it].load(), add_stat, c);
+                }
+            }
+        }
    } else {
         addStat(NULL, "disabled", add_stat, c);
     }
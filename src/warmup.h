@@ -55,6 +55,15 @@ private:
     DISALLOW_COPY_AND_ASSIGN(WarmupState);
 };
 
+/**
+ * How far warmup got with loading a vbucket in the current state.
+ */
+typedef enum {
+    WARMUP_VB_PENDING,
+    WARMUP_VB_LOADING,
+    WARMUP_VB_DONE
+} warmup_vb_progress_t;
+
 //////////////////////////////////////////////////////////////////////////////
 //                                                                          //
 //    Helper class used to insert data into the epstore                     //
@@ -143,6 +152,13 @@ public:
         return warmupComplete.compare_exchange_strong(inverse, true);
     }
 
+    /**
+     * Count an item loaded into the given vbucket in the current state.
+     */
+    void itemLoaded(uint16_t vbid) {
+        vbLoadedItems[vbid]++;
+    }
+
     void initialize();
     void createVBuckets(uint16_t shardId);
     void estimateDatabaseItemCount(uint16_t shardId);
@@ -161,6 +177,13 @@ private:
 
     void populateShardVbStates();
 
+    size_t getScansPerShard();
+    void resetVBucketProgress();
+    void scanShardVBuckets(uint16_t shardId,
+                           shared_ptr<Callback<GetValue> > cb,
+                           shared_ptr<Callback<CacheLookup> > cl,
+                           bool keysOnly);
+
     void scheduleInitialize();
     void scheduleCreateVBuckets();
     void scheduleEstimateDatabaseItemCount();
@@ -183,8 +206,13 @@ private:
     std::vector<vbucket_state *> allVbStates;
     std::map<uint16_t, vbucket_state> *shardVbStates;
     AtomicValue<size_t> threadtask_count;
+    size_t numScanTasks; // tasks scheduled for the current scanning state
     bool *shardKeyDumpStatus;
     std::vector<uint16_t> *shardVbIds;
+    // index of the next vbucket of each shard to be scanned
+    AtomicValue<size_t> *shardScanCursor;
+    AtomicValue<int> *vbProgress;
+    AtomicValue<size_t> *vbLoadedItems;
 
     AtomicValue<hrtime_t> estimateTime;
     AtomicValue<size_t> estimatedItemCount;
@@ -19,8 +19,16 @@
 #define SRC_WORKLOAD_H_ 1
 
 #include "config.h"
+#include <algorithm>
 #include <string>
+#include "atomic.h"
 #include "common.h"
+#include "task_type.h"
+
+// The share of thread time a bucket gets by default under fair share
+// scheduling. One microsecond of runtime at this share adds one to the
+// virtual runtime of the bucket.
+#define DEFAULT_FAIR_SHARE 100
 
 typedef enum {
     HIGH_BUCKET_PRIORITY=6,
@@ -40,7 +48,12 @@ typedef enum {
 class WorkLoadPolicy {
 public:
     WorkLoadPolicy(int m, int s)
-        : maxNumWorkers(m), maxNumShards(s), workloadPattern(READ_HEAVY) { }
+        : maxNumWorkers(m), maxNumShards(s), workloadPattern(READ_HEAVY) {
+        for (int i = 0; i < NUM_TASK_GROUPS; ++i) {
+            shares[i] = DEFAULT_FAIR_SHARE;
+            vruntime[i] = 0;
+        }
+    }
 
     size_t getNumShards(void) {
         return maxNumShards;
@@ -76,11 +89,51 @@ public:
         workloadPattern = pattern;
     }
 
+    /**
+     * Set the weight of the bucket's tasks of the given type against the
+     * tasks of the other buckets, when the ExecutorPool shares out its
+     * threads fairly.
+     */
+    void setShare(task_type_t type, size_t share) {
+        shares[type] = share ? share : 1;
+    }
+
+    size_t getShare(task_type_t type) {
+        return shares[type];
+    }
+
+    /**
+     * Get the runtime of the bucket's tasks of the given type, scaled down
+     * by the bucket's share of that type.
+     */
+    uint64_t getVirtualRuntime(task_type_t type) {
+        return vruntime[type].load();
+    }
+
+    /**
+     * Charge the bucket for a task of the given type that ran for runtime
+     * microseconds, and that was made ready at the virtual time startTag.
+     */
+    void chargeRuntime(task_type_t type, uint64_t startTag,
+                       hrtime_t runtime) {
+        uint64_t charge = (uint64_t)runtime * DEFAULT_FAIR_SHARE /
+                          shares[type];
+        while (true) {
+            uint64_t oldValue = vruntime[type].load();
+            if (vruntime[type].compare_exchange_strong(oldValue,
+                                    std::max(oldValue, startTag) + charge)) {
+                break;
+            }
+        }
+    }
+
 private:
 
     int maxNumWorkers;
     int maxNumShards;
     volatile workload_pattern_t workloadPattern;
+    AtomicValue<size_t> shares[NUM_TASK_GROUPS];
+    AtomicValue<uint64_t> vruntime[NUM_TASK_GROUPS];
 };
 
 #endif  // SRC_WORKLOAD_H_
@@ -65,6 +65,7 @@ extern ItemMetaData last_meta;
 extern uint8_t dcp_last_op;
 extern uint8_t dcp_last_status;
 extern uint8_t dcp_last_nru;
+extern uint8_t dcp_last_datatype;
 extern uint16_t dcp_last_vbucket;
 extern uint32_t dcp_last_opaque;
 extern uint32_t dcp_last_flags;
@@ -82,6 +83,7 @@ extern uint64_t dcp_last_snap_start_seqno;
 extern uint64_t dcp_last_snap_end_seqno;
 extern uint16_t dcp_last_nmeta;
 extern const void *dcp_last_meta;
+extern const void *dcp_last_value;
 extern std::string dcp_last_key;
 extern vbucket_state_t dcp_last_vbucket_state;
 
@@ -1836,6 +1836,72 @@ static enum test_result test_restart(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_restart_io_uring(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    check(get_str_stat(h, h1, "ep_couchstore_io_uring_enabled") == "true",
+          "Expected io_uring to be enabled");
+
+    // Many more writes than the ring has room for, of varying sizes, to
+    // two vbucket files sharing the ring.
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    const int num_items = 500;
+    for (int j = 0; j < num_items; ++j) {
+        std::stringstream key, val;
+        key << "key" << j;
+        val << std::string(1 + (j * 37) % 3000, 'a' + j % 26);
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                    val.str().c_str(), &i, 0, j % 2) == ENGINE_SUCCESS,
+              "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Rewrite and delete some of them in a second round of commits
+    for (int j = 0; j < num_items; j += 5) {
+        std::stringstream key;
+        key << "key" << j;
+        if (j % 10 == 0) {
+            check(del(h, h1, key.str().c_str(), 0, j % 2) == ENGINE_SUCCESS,
+                  "Failed to delete a value");
+        } else {
+            item *i = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                        "rewritten", &i, 0, j % 2) == ENGINE_SUCCESS,
+                  "Failed to store a value");
+            h1->release(h, NULL, i);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_item_commit_failed") == 0,
+          "Expected no failed commits");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    for (int j = 0; j < num_items; ++j) {
+        std::stringstream key, val;
+        key << "key" << j;
+        if (j % 10 == 0) {
+            check(verify_key(h, h1, key.str().c_str(), j % 2)
+                  == ENGINE_KEY_ENOENT,
+                  "Expected a deleted item to stay deleted");
+            continue;
+        } else if (j % 5 == 0) {
+            val << "rewritten";
+        } else {
+            val << std::string(1 + (j * 37) % 3000, 'a' + j % 26);
+        }
+        check_key_value(h, h1, key.str().c_str(), val.str().data(),
+                        val.str().length(), j % 2);
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_restart_session_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     createTapConn(h, h1, "tap_client_thread");
 
@@ -3912,6 +3978,98 @@ static enum test_result test_dcp_producer_stream_req_disk(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+/**
+ * Step a producer until its stream ends, checking that it sends the
+ * mutations in seqno order without gaps.
+ */
+static void dcp_drain_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             const void *cookie, uint64_t first_seqno,
+                             uint64_t last_seqno) {
+    struct dcp_message_producers* producers = get_dcp_producers();
+    uint64_t expected = first_seqno;
+    bool done = false;
+    do {
+        ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
+        if (err == ENGINE_DISCONNECT) {
+            break;
+        }
+        switch (dcp_last_op) {
+            case PROTOCOL_BINARY_CMD_DCP_MUTATION:
+                check(dcp_last_byseqno == expected,
+                      "Expected every item in seqno order");
+                expected++;
+                break;
+            case PROTOCOL_BINARY_CMD_DCP_STREAM_END:
+                done = true;
+                break;
+            default:
+                break;
+        }
+        dcp_last_op = 0;
+    } while (!done);
+
+    check(expected == last_seqno + 1, "Expected the stream to get every item");
+    free(producers);
+}
+
+static enum test_result test_dcp_producer_shared_backfill(ENGINE_HANDLE *h,
+                                                          ENGINE_HANDLE_V1 *h1) {
+    int num_items = 400;
+    for (int j = 0; j < num_items; ++j) {
+        if (j == 200) {
+            wait_for_flusher_to_settle(h, h1);
+            stop_persistence(h, h1);
+        }
+        item *i = NULL;
+        std::stringstream ss;
+        ss << "key" << j;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "data", &i)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_stat_to_be_gte(h, h1, "vb_0:num_checkpoints", 2, "checkpoint");
+
+    uint64_t vb_uuid = get_ull_stat(h, h1, "vb_0:0:id", "failovers");
+    uint64_t rollback = 0;
+    uint32_t opaque = 1;
+
+    // The first stream scans the disk from the start. Its backfill buffer
+    // only takes a few items, so the scan waits for the stream to be
+    // stepped.
+    const void *cookie1 = testHarness.create_cookie();
+    check(h1->dcp.open(h, cookie1, ++opaque, 0, DCP_OPEN_PRODUCER,
+                       (void*)"shared1", 7) == ENGINE_SUCCESS,
+          "Failed dcp producer open connection.");
+    check(h1->dcp.stream_req(h, cookie1, 0, opaque, 0, 0, 200, vb_uuid, 0, 0,
+                             &rollback, mock_dcp_add_failover_log)
+          == ENGINE_SUCCESS, "Failed to initiate stream request");
+    wait_for_stat_to_be_gte(h, h1, "eq_dcpq:shared1:stream_0_backfill_disk_items",
+                            1, "dcp");
+
+    // The second stream starts ahead of the scan and subscribes to it
+    const void *cookie2 = testHarness.create_cookie();
+    check(h1->dcp.open(h, cookie2, ++opaque, 0, DCP_OPEN_PRODUCER,
+                       (void*)"shared2", 7) == ENGINE_SUCCESS,
+          "Failed dcp producer open connection.");
+    check(h1->dcp.stream_req(h, cookie2, 0, opaque, 0, 100, 200, vb_uuid, 100,
+                             100, &rollback, mock_dcp_add_failover_log)
+          == ENGINE_SUCCESS, "Failed to initiate stream request");
+    wait_for_stat_to_be(h, h1, "ep_dcp_backfills_shared", 1, "dcp");
+
+    // Stepping only the first stream fills the second stream's backfill
+    // buffer, which detaches it from the scan. It then resumes with a
+    // scan of its own.
+    dcp_drain_stream(h, h1, cookie1, 1, 200);
+    dcp_drain_stream(h, h1, cookie2, 101, 200);
+
+    check(get_int_stat(h, h1, "ep_dcp_backfills_shared", "dcp") == 1,
+          "Expected one backfill to share a scan");
+
+    testHarness.destroy_cookie(cookie1);
+    testHarness.destroy_cookie(cookie2);
+    return SUCCESS;
+}
+
 static enum test_result test_dcp_producer_stream_req_diskonly(ENGINE_HANDLE *h,
                                                               ENGINE_HANDLE_V1 *h1) {
     int num_items = 300;
@@ -3944,8 +4102,12 @@ static enum test_result test_dcp_producer_stream_req_diskonly(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
-static enum test_result test_dcp_producer_stream_req_mem(ENGINE_HANDLE *h,
-                                                         ENGINE_HANDLE_V1 *h1) {
+/**
+ * Store 300 items, of which only the last 100 are still in the checkpoints
+ * with chk_max_items=100, and stream those from memory.
+ */
+static void dcp_stream_from_memory(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   const void *cookie) {
     int num_items = 300;
     for (int j = 0; j < num_items; ++j) {
         if (j % 100 == 0) {
@@ -3964,11 +4126,218 @@ static enum test_result test_dcp_producer_stream_req_mem(ENGINE_HANDLE *h,
 
     uint64_t vb_uuid = get_ull_stat(h, h1, "vb_0:0:id", "failovers");
 
-    const void *cookie = testHarness.create_cookie();
-
     dcp_stream(h, h1, "unittest", cookie, 0, 0, 200, 300, vb_uuid, 200, 200,
                100, 0, 1, 0, 2);
+}
+
+static enum test_result test_dcp_producer_stream_req_mem(ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = testHarness.create_cookie();
+    dcp_stream_from_memory(h, h1, cookie);
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
+/**
+ * Get the average time, in microseconds, that the tasks of the given type
+ * waited to be run once due, from the bins of their schedulingHisto.
+ */
+static double get_avg_scheduling_latency(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1,
+                                         const std::string &taskType,
+                                         uint64_t &samples) {
+    vals.clear();
+    check(h1->get_stats(h, NULL, "scheduler", strlen("scheduler"),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get scheduler stats");
+
+    std::string prefix = taskType + "_";
+    double total = 0;
+    samples = 0;
+    std::map<std::string, std::string>::iterator it;
+    for (it = vals.begin(); it != vals.end(); ++it) {
+        const std::string &key = it->first;
+        unsigned long long start, end;
+        if (key.compare(0, prefix.size(), prefix) != 0 ||
+            sscanf(key.c_str() + prefix.size(), "%llu,%llu",
+                   &start, &end) != 2) {
+            continue;
+        }
+        uint64_t count = strtoull(it->second.c_str(), NULL, 10);
+        total += count * (start + end) / 2.0;
+        samples += count;
+    }
+    return samples ? total / samples : 0;
+}
+
+static enum test_result test_dcp_producer_checkpoint_processors(
+                                                         ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1) {
+    uint64_t runs;
+    get_avg_scheduling_latency(h, h1, "chkpt_processor_tasks", runs);
+    check(runs == 0, "Expected no checkpoint processor task before streaming");
+
+    const void *cookie = testHarness.create_cookie();
+    dcp_stream_from_memory(h, h1, cookie);
+
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:processor_tasks", "dcp") == 2,
+          "Expected the producer to have two processor tasks");
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:processor_queue", "dcp") == 0,
+          "Expected no stream left for the processor tasks");
+    get_avg_scheduling_latency(h, h1, "chkpt_processor_tasks", runs);
+    check(runs > 0, "Expected the checkpoint processor tasks to have run");
+
+    // Once the queue is drained the tasks sleep until a stream is queued
+    sleep(1);
+    get_avg_scheduling_latency(h, h1, "chkpt_processor_tasks", runs);
+    sleep(2);
+    uint64_t idleRuns;
+    get_avg_scheduling_latency(h, h1, "chkpt_processor_tasks", idleRuns);
+    check(idleRuns == runs, "Expected idle checkpoint processor tasks to sleep");
+
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
+static enum test_result test_dcp_producer_stream_shares_value(
+                                                         ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1) {
+    std::string value(1024 * 1024, 'x');
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", value.c_str(), &i)
+          == ENGINE_SUCCESS, "Failed to store a value");
+    h1->release(h, NULL, i);
+
+    // The value held by the hash table
+    check(h1->get(h, NULL, &i, "key", 3, 0) == ENGINE_SUCCESS,
+          "Failed to get the value");
+    item_info info;
+    info.nvalue = 1;
+    check(h1->get_item_info(h, NULL, i, &info), "Failed to get item info");
+    const void *data = info.value[0].iov_base;
+
+    const void *cookie = testHarness.create_cookie();
+    const char *name = "unittest";
+    uint32_t opaque = 1;
+
+    check(h1->dcp.open(h, cookie, ++opaque, 0, DCP_OPEN_PRODUCER, (void*)name,
+                       strlen(name)) == ENGINE_SUCCESS,
+          "Failed dcp producer open connection.");
+
+    uint64_t vb_uuid = get_ull_stat(h, h1, "vb_0:0:id", "failovers");
+    uint64_t rollback = 0;
+    check(h1->dcp.stream_req(h, cookie, 0, ++opaque, 0, 0, 1, vb_uuid, 0, 0,
+                             &rollback, mock_dcp_add_failover_log)
+                == ENGINE_SUCCESS,
+          "Failed to initiate stream request");
+
+    struct dcp_message_producers* producers = get_dcp_producers();
+
+    // The mutation is handed to the network layer pointing at the same value,
+    // not at a copy of it.
+    bool done = false;
+    int num_mutations = 0;
+    do {
+        ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
+        if (err == ENGINE_DISCONNECT) {
+            done = true;
+        } else {
+            switch (dcp_last_op) {
+                case PROTOCOL_BINARY_CMD_DCP_MUTATION:
+                    check(dcp_last_value == data,
+                          "Expected the mutation to share the stored value");
+                    num_mutations++;
+                    break;
+                case PROTOCOL_BINARY_CMD_DCP_STREAM_END:
+                    done = true;
+                    break;
+                default:
+                    break;
+            }
+            dcp_last_op = 0;
+        }
+    } while (!done);
+
+    check(num_mutations == 1, "Invalid number of mutations");
 
+    free(producers);
+    h1->release(h, NULL, i);
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
+static enum test_result test_dcp_producer_stream_compressed(
+                                                         ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1) {
+    std::string value(64 * 1024, 'x');
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", value.c_str(), &i)
+          == ENGINE_SUCCESS, "Failed to store a value");
+    h1->release(h, NULL, i);
+
+    const void *cookie = testHarness.create_cookie();
+    const char *name = "unittest";
+    uint32_t opaque = 1;
+
+    check(h1->dcp.open(h, cookie, ++opaque, 0, DCP_OPEN_PRODUCER, (void*)name,
+                       strlen(name)) == ENGINE_SUCCESS,
+          "Failed dcp producer open connection.");
+    check(h1->dcp.control(h, cookie, ++opaque, "enable_value_compression", 24,
+                          "true", 4) == ENGINE_SUCCESS,
+          "Failed to enable value compression");
+
+    uint64_t vb_uuid = get_ull_stat(h, h1, "vb_0:0:id", "failovers");
+    uint64_t rollback = 0;
+    check(h1->dcp.stream_req(h, cookie, 0, ++opaque, 0, 0, 1, vb_uuid, 0, 0,
+                             &rollback, mock_dcp_add_failover_log)
+                == ENGINE_SUCCESS,
+          "Failed to initiate stream request");
+
+    struct dcp_message_producers* producers = get_dcp_producers();
+
+    bool done = false;
+    int num_mutations = 0;
+    do {
+        ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
+        if (err == ENGINE_DISCONNECT) {
+            done = true;
+        } else {
+            switch (dcp_last_op) {
+                case PROTOCOL_BINARY_CMD_DCP_MUTATION:
+                    check(dcp_last_datatype ==
+                          PROTOCOL_BINARY_DATATYPE_COMPRESSED,
+                          "Expected the value to be sent compressed");
+                    check(dcp_last_packet_size < value.size(),
+                          "Expected the compressed value to be smaller");
+                    num_mutations++;
+                    break;
+                case PROTOCOL_BINARY_CMD_DCP_STREAM_END:
+                    done = true;
+                    break;
+                default:
+                    break;
+            }
+            dcp_last_op = 0;
+        }
+    } while (!done);
+
+    check(num_mutations == 1, "Invalid number of mutations");
+
+    check(get_ull_stat(h, h1, "eq_dcpq:unittest:compression_bytes_in", "dcp")
+          > get_ull_stat(h, h1, "eq_dcpq:unittest:compression_bytes_out",
+                         "dcp"),
+          "Expected the compression stats to show bytes saved");
+
+    // Only the stream's copy is compressed, not the stored value
+    item_info info;
+    check(get_item_info(h, h1, &info, "key"), "Failed to get item info");
+    check(info.datatype == PROTOCOL_BINARY_RAW_BYTES,
+          "Expected the stored value to be left uncompressed");
+
+    free(producers);
     testHarness.destroy_cookie(cookie);
 
     return SUCCESS;
@@ -5257,6 +5626,92 @@ static enum test_result test_dcp_consumer_mutate(ENGINE_HANDLE *h, ENGINE_HANDLE
     return SUCCESS;
 }
 
+static void dcp_send_mutations(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               const void *cookie, uint32_t opaque,
+                               uint64_t start, uint64_t end) {
+    check(h1->dcp.snapshot_marker(h, cookie, opaque, 0, start, end, 1)
+          == ENGINE_SUCCESS, "Failed to send snapshot marker");
+
+    for (uint64_t seqno = start; seqno <= end; ++seqno) {
+        std::stringstream ss;
+        ss << "key" << seqno;
+        std::string key = ss.str();
+        check(h1->dcp.mutation(h, cookie, opaque, key.c_str(), key.length(),
+                               "value", 5, 0, 0, 0, 0, seqno, 1, 0, 0, NULL,
+                               0, 0) == ENGINE_SUCCESS,
+              "Failed dcp mutate.");
+    }
+}
+
+static enum test_result test_dcp_consumer_batch_size(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 0, vbucket_state_replica),
+          "Failed to set vbucket state.");
+
+    const void *cookie = testHarness.create_cookie();
+    uint32_t opaque = 0xFFFF0000;
+    const char *name = "unittest";
+
+    check(h1->dcp.open(h, cookie, opaque, 0, 0, (void*)name, strlen(name))
+          == ENGINE_SUCCESS,
+          "Failed dcp consumer open connection.");
+
+    opaque = add_stream_for_consumer(h, h1, cookie, opaque, 0, 0,
+                                     PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:stream_0_batch_size", "dcp")
+          == 10, "Expected batches to start at the minimum size");
+
+    // Throttle the consumer so that the mutations pile up in the buffer
+    set_param(h, h1, protocol_binary_engine_param_tap,
+              "tap_throttle_queue_cap", "0");
+    // The write queue cap is applied when the engine stats are gathered
+    check(get_int_stat(h, h1, "ep_tap_throttle_queue_cap") == 0,
+          "Failed to throttle the consumer");
+    dcp_send_mutations(h, h1, cookie, opaque, 1, 500);
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:stream_0_buffer_items", "dcp")
+          == 500, "Expected all of the mutations to be buffered");
+
+    // Every full batch doubles the next one while memory is plentiful
+    set_param(h, h1, protocol_binary_engine_param_tap,
+              "tap_throttle_queue_cap", "-1");
+    check(get_int_stat(h, h1, "ep_tap_throttle_queue_cap") == -1,
+          "Failed to unthrottle the consumer");
+    wait_for_stat_to_be(h, h1, "eq_dcpq:unittest:stream_0_buffer_items", 0,
+                        "dcp");
+    wait_for_stat_to_be(h, h1, "vb_replica_curr_items", 500);
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:stream_0_batch_size", "dcp")
+          > 10, "Expected the batch size to grow");
+
+    // Make every mutation fail with ENOMEM, which must drop the batch size
+    // straight back down to the minimum
+    std::string maxSize = get_str_stat(h, h1, "ep_max_size");
+    std::stringstream ss;
+    ss << get_int_stat(h, h1, "mem_used") * 2;
+    set_param(h, h1, protocol_binary_engine_param_flush, "max_size",
+              ss.str().c_str());
+    set_param(h, h1, protocol_binary_engine_param_flush,
+              "mutation_mem_threshold", "10");
+    dcp_send_mutations(h, h1, cookie, opaque, 501, 600);
+    wait_for_stat_to_be(h, h1, "eq_dcpq:unittest:stream_0_batch_size", 10,
+                        "dcp");
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:stream_0_buffer_items", "dcp")
+          > 0, "Expected the failed mutations to stay buffered");
+
+    // Once there is room again the buffered mutations are all applied
+    set_param(h, h1, protocol_binary_engine_param_flush, "max_size",
+              maxSize.c_str());
+    set_param(h, h1, protocol_binary_engine_param_flush,
+              "mutation_mem_threshold", "98");
+    wait_for_stat_to_be(h, h1, "eq_dcpq:unittest:stream_0_buffer_items", 0,
+                        "dcp");
+    wait_for_stat_to_be(h, h1, "vb_replica_curr_items", 600);
+
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
 static enum test_result test_dcp_consumer_mutate_with_time_sync(
                                                         ENGINE_HANDLE *h,
                                                         ENGINE_HANDLE_V1 *h1) {
@@ -7461,6 +7916,46 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
+static enum test_result test_warmup_parallel_scans(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    const int numVbs = 8;
+    for (int vb = 0; vb < numVbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+        for (int i = 0; i < 100; ++i) {
+            item *it = NULL;
+            std::stringstream key;
+            key << "key-" << vb << "-" << i;
+            check(ENGINE_SUCCESS ==
+                  store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                        "somevalue", &it, 0, vb),
+                  "Error setting.");
+            h1->release(h, NULL, it);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Restart the server.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    check(get_int_stat(h, h1, "ep_warmup_value_count", "warmup") ==
+          numVbs * 100, "Warmup didn't load all the values");
+    for (int vb = 0; vb < numVbs; ++vb) {
+        std::stringstream progress, items;
+        progress << "ep_warmup_vb_" << vb << ":progress";
+        items << "ep_warmup_vb_" << vb << ":items";
+        check(get_str_stat(h, h1, progress.str().c_str(), "warmup") == "done",
+              "Expected every vbucket to be loaded");
+        check(get_int_stat(h, h1, items.str().c_str(), "warmup") == 100,
+              "Expected every item of a vbucket to be counted");
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_warmup_with_threshold(ENGINE_HANDLE *h,
                                                    ENGINE_HANDLE_V1 *h1) {
     item *it = NULL;
@@ -7650,6 +8145,112 @@ static enum test_result test_workload_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *
     return SUCCESS;
 }
 
+/**
+ * Store and persist the given number of keys, so that the flusher tasks
+ * have been run by the executor threads.
+ */
+static void store_and_persist_keys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   int num) {
+    for (int j = 0; j < num; ++j) {
+        item *i = NULL;
+        std::stringstream ss;
+        ss << "key" << j;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "somevalue",
+                    &i) == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    check(get_int_stat(h, h1, "ep_total_persisted") == num,
+          "Expected all the items to be persisted");
+}
+
+static enum test_result test_numa_aware_executor(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    store_and_persist_keys(h, h1, 100);
+
+    int numLocal = get_int_stat(h, h1, "numa_local_tasks", "scheduler");
+    int numRemote = get_int_stat(h, h1, "numa_remote_tasks", "scheduler");
+
+    // Threads are only bound on hosts with more than one NUMA node
+    vals.clear();
+    check(h1->get_stats(h, NULL, "dispatcher", strlen("dispatcher"),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get dispatcher stats");
+    bool bound = false;
+    std::map<std::string, std::string>::iterator it;
+    for (it = vals.begin(); it != vals.end(); ++it) {
+        const std::string &key = it->first;
+        if (key.size() > 10 && key.rfind(":numa_node") == key.size() - 10) {
+            bound = true;
+        }
+    }
+    if (bound) {
+        check(numLocal + numRemote > 0, "Expected the flushers to be counted");
+    } else {
+        check(numLocal == 0 && numRemote == 0,
+              "Expected no NUMA counts without bound threads");
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_fair_share_executor(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_workload:share_writer", "workload") == 200,
+          "Expected the configured writer share");
+    check(get_int_stat(h, h1, "ep_workload:share_reader", "workload") == 100,
+          "Expected the default reader share");
+
+    store_and_persist_keys(h, h1, 100);
+    check(get_int_stat(h, h1, "ep_workload:vruntime_writer", "workload") > 0,
+          "Expected the flusher runtime to be charged to the bucket");
+
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "executor_share_writer", "50"),
+          "Failed to set executor_share_writer");
+    check(get_int_stat(h, h1, "ep_workload:share_writer", "workload") == 50,
+          "Expected the writer share to be updated");
+    check(!set_param(h, h1, protocol_binary_engine_param_flush,
+                     "executor_share_writer", "0"),
+          "Expected a zero share to be rejected");
+    return SUCCESS;
+}
+
+/**
+ * Run the same workload with and without executor_work_stealing, and report
+ * the flusher's scheduling latency from schedulingHisto for comparison.
+ */
+static enum test_result test_executor_scheduling_latency(ENGINE_HANDLE *h,
+                                                         ENGINE_HANDLE_V1 *h1) {
+    bool stealing = get_str_stat(h, h1, "ep_executor_work_stealing") == "true";
+
+    store_and_persist_keys(h, h1, 1000);
+
+    // Only threads with run queues of their own report on them
+    vals.clear();
+    check(h1->get_stats(h, NULL, "dispatcher", strlen("dispatcher"),
+                        add_stats) == ENGINE_SUCCESS,
+          "Failed to get dispatcher stats");
+    bool runQueues = false;
+    std::map<std::string, std::string>::iterator it;
+    for (it = vals.begin(); it != vals.end(); ++it) {
+        const std::string &key = it->first;
+        if (key.size() > 10 && key.rfind(":run_queue") == key.size() - 10) {
+            runQueues = true;
+        }
+    }
+    check(runQueues == stealing,
+          "Expected run queues only in work stealing mode");
+
+    uint64_t samples;
+    double latency = get_avg_scheduling_latency(h, h1, "flusher_tasks",
+                                                samples);
+    check(samples > 0, "Expected the flusher's scheduling to be recorded");
+    fprintf(stderr, "flusher scheduling latency (work stealing %s): "
+            "%.0f usec average over %llu runs\n", stealing ? "on" : "off",
+            latency, (unsigned long long)samples);
+    return SUCCESS;
+}
+
 static enum test_result test_max_workload_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     check(h1->get_stats(h, testHarness.create_cookie(), "workload",
                         strlen("workload"), add_stats) == ENGINE_SUCCESS,
@@ -12393,6 +12994,9 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("warmup stats", test_warmup_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("warmup parallel scans", test_warmup_parallel_scans,
+                 test_setup, teardown, "warmup_parallel_scans=16", prepare,
+                 cleanup),
         TestCase("warmup with threshold", test_warmup_with_threshold,
                  test_setup, teardown,
                  "warmup_min_items_threshold=1", prepare, cleanup),
@@ -12411,6 +13015,19 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("ep workload stats", test_workload_stats,
                  test_setup, teardown, "max_num_shards=5;max_threads=10", prepare, cleanup),
+        TestCase("test numa aware executor", test_numa_aware_executor,
+                 test_setup, teardown, "executor_numa_aware=true", prepare,
+                 cleanup),
+        TestCase("test fair share executor", test_fair_share_executor,
+                 test_setup, teardown,
+                 "executor_fair_share=true;executor_share_writer=200",
+                 prepare, cleanup),
+        TestCase("executor scheduling latency (shared queues)",
+                 test_executor_scheduling_latency, test_setup, teardown,
+                 "executor_work_stealing=false", prepare, cleanup),
+        TestCase("executor scheduling latency (work stealing)",
+                 test_executor_scheduling_latency, test_setup, teardown,
+                 "executor_work_stealing=true", prepare, cleanup),
         TestCase("ep workload stats", test_max_workload_stats,
                  test_setup, teardown,
                  "max_num_shards=5;max_threads=14;max_num_auxio=1;max_num_nonio=4",
@@ -12511,6 +13128,10 @@ engine_test_t* get_tests(void) {
                  teardown, NULL, prepare, cleanup),
         TestCase("test restart with session stats", test_restart_session_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("test restart with io_uring writes", test_restart_io_uring,
+                 test_setup, teardown,
+                 "couchstore_io_uring_enabled=true;couchstore_io_uring_depth=4",
+                 prepare, cleanup),
         TestCase("set+get+restart+hit (bin)", test_restart_bin_val,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("flush+restart", test_flush_restart, test_setup,
@@ -12828,12 +13449,39 @@ engine_test_t* get_tests(void) {
         TestCase("test producer stream request (disk)",
                  test_dcp_producer_stream_req_disk, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
+        TestCase("test producer stream request (disk, shared scan)",
+                 test_dcp_producer_stream_req_disk, test_setup, teardown,
+                 "chk_remover_stime=1;chk_max_items=100;"
+                 "dcp_enable_shared_backfill=true", prepare, cleanup),
+        TestCase("test producer shared backfill",
+                 test_dcp_producer_shared_backfill, test_setup, teardown,
+                 "chk_remover_stime=1;chk_max_items=100;"
+                 "dcp_enable_shared_backfill=true;dcp_backfill_byte_limit=1024",
+                 prepare, cleanup),
+        TestCase("test producer stream request (disk, small read-ahead)",
+                 test_dcp_producer_stream_req_disk, test_setup, teardown,
+                 "chk_remover_stime=1;chk_max_items=100;"
+                 "couchstore_scan_read_ahead=7", prepare, cleanup),
+        TestCase("test producer stream request (disk, no read-ahead)",
+                 test_dcp_producer_stream_req_disk, test_setup, teardown,
+                 "chk_remover_stime=1;chk_max_items=100;"
+                 "couchstore_scan_read_ahead=0", prepare, cleanup),
         TestCase("test producer stream request (disk only)",
                  test_dcp_producer_stream_req_diskonly, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
         TestCase("test producer stream request (memory only)",
                  test_dcp_producer_stream_req_mem, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
+        TestCase("test producer stream request (shared value)",
+                 test_dcp_producer_stream_shares_value, test_setup, teardown,
+                 "defragmenter_enabled=false", prepare, cleanup),
+        TestCase("test producer stream request (compressed values)",
+                 test_dcp_producer_stream_compressed, test_setup, teardown,
+                 NULL, prepare, cleanup),
+        TestCase("test producer stream request (checkpoint processor tasks)",
+                 test_dcp_producer_checkpoint_processors, test_setup, teardown,
+                 "chk_remover_stime=1;chk_max_items=100;"
+                 "dcp_producer_processor_tasks=2", prepare, cleanup),
         TestCase("test producer stream request (latest flag)",
                  test_dcp_producer_stream_latest, test_setup, teardown, NULL,
                  prepare, cleanup),
@@ -12919,6 +13567,10 @@ engine_test_t* get_tests(void) {
         TestCase("dcp consumer mutate", test_dcp_consumer_mutate, test_setup,
                  teardown, "dcp_enable_flow_control=true;dcp_enable_noop=false",
                  prepare, cleanup),
+        TestCase("dcp consumer batch growth and reset",
+                 test_dcp_consumer_batch_size, test_setup, teardown,
+                 "dcp_enable_noop=false;tap_throttle_cap_pcnt=0",
+                 prepare, cleanup),
         TestCase("dcp consumer mutate with time sync",
                  test_dcp_consumer_mutate_with_time_sync, test_setup,
                  teardown, "dcp_enable_flow_control=true;dcp_enable_noop=false",
@@ -25,6 +25,7 @@
 uint8_t dcp_last_op;
 uint8_t dcp_last_status;
 uint8_t dcp_last_nru;
+uint8_t dcp_last_datatype;
 uint16_t dcp_last_vbucket;
 uint32_t dcp_last_opaque;
 uint32_t dcp_last_flags;
@@ -40,6 +41,7 @@ uint64_t dcp_last_snap_end_seqno;
 uint64_t dcp_last_byseqno;
 uint64_t dcp_last_revseqno;
 const void *dcp_last_meta;
+const void *dcp_last_value;
 uint16_t dcp_last_nmeta;
 std::string dcp_last_key;
 vbucket_state_t dcp_last_vbucket_state;
@@ -183,6 +185,8 @@ static ENGINE_ERROR_CODE mock_mutation(const void* cookie,
     dcp_last_meta = meta;
     dcp_last_nmeta = nmeta;
     dcp_last_nru = nru;
+    dcp_last_value = item->getData();
+    dcp_last_datatype = item->getDataType();
     dcp_last_packet_size = 55 + dcp_last_key.length() +
                            item->getValMemSize() + nmeta;
     return ENGINE_SUCCESS;
@@ -302,6 +306,7 @@ void clear_dcp_data() {
     dcp_last_op = 0;
     dcp_last_status = 0;
     dcp_last_nru = 0;
+    dcp_last_datatype = 0;
     dcp_last_vbucket = 0;
     dcp_last_opaque = 0;
     dcp_last_flags = 0;
@@ -314,6 +319,7 @@ void clear_dcp_data() {
     dcp_last_snap_start_seqno = 0;
     dcp_last_snap_end_seqno = 0;
     dcp_last_meta = NULL;
+    dcp_last_value = NULL;
     dcp_last_nmeta = 0;
     dcp_last_key.clear();
     dcp_last_vbucket_state = (vbucket_state_t)0;
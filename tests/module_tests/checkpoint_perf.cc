@@ -0,0 +1,174 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <iomanip>
+#include <iostream>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "stats.h"
+#include "vbucket.h"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+CheckpointConfig checkpoint_config;
+
+static void printResult(const std::string label, size_t value,
+                        const std::string units) {
+    std::cout.imbue(std::locale(""));
+
+    std::cout << std::setw(28) << label << ": "
+              << std::right << std::setw(11) << value << " " << units << std::endl;
+}
+
+/* Queues nitems new keys and then deduplicates each of them twice,
+ * reporting the memory overhead and the cost of queueDirty for both.
+ */
+static void benchmarkQueueDirty(size_t nitems) {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    size_t baseOverhead = global_stats.memOverhead;
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+
+    std::vector<queued_item> items;
+    for (size_t i = 0; i < nitems; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        items.push_back(queued_item(new Item(key.str(), vbucket->getId(),
+                                             queue_op_set, 0, 0)));
+    }
+
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < items.size(); ++i) {
+        manager->queueDirty(vbucket, items[i], true);
+    }
+    hrtime_t newItemTime = gethrtime() - start;
+    size_t overhead = global_stats.memOverhead - baseOverhead;
+
+    start = gethrtime();
+    for (int round = 0; round < 2; ++round) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            queued_item qi(new Item(items[i]->getKey(), vbucket->getId(),
+                                    queue_op_set, 0, 0));
+            manager->queueDirty(vbucket, qi, true);
+        }
+    }
+    hrtime_t dedupTime = gethrtime() - start;
+    size_t dedupOverhead = global_stats.memOverhead - baseOverhead;
+
+    printResult("overhead/item", overhead / nitems, "bytes");
+    printResult("overhead/item after dedup", dedupOverhead / nitems, "bytes");
+    printResult("queueDirty new item", newItemTime / nitems, "ns");
+    printResult("queueDirty dedup", dedupTime / (2 * nitems), "ns");
+
+    delete manager;
+}
+
+static void queueKeys(CheckpointManager *manager, RCPtr<VBucket> &vbucket,
+                      int from, int to) {
+    for (int i = from; i < to; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queued_item qi(new Item(key.str(), vbucket->getId(), queue_op_set,
+                                0, 0));
+        manager->queueDirty(vbucket, qi, true);
+    }
+}
+
+static void moveCursor(CheckpointManager *manager, const std::string &cursor,
+                       size_t numItems) {
+    bool isLastItem = false;
+    size_t sent = 0;
+    while (sent < numItems) {
+        queued_item qi = manager->nextItem(cursor, isLastItem);
+        if (qi->getOperation() == queue_op_set) {
+            ++sent;
+        }
+    }
+}
+
+/* Deduplicates keys behind and ahead of ncursors cursors parked in the
+ * middle of the open checkpoint; the cost should not grow with ncursors.
+ */
+static void benchmarkDedupCursors(int ncursors, int nrounds) {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+    std::vector<std::string> cursors;
+    for (int i = 0; i < ncursors; ++i) {
+        std::stringstream name;
+        name << "perf-client-" << i;
+        cursors.push_back(name.str());
+        manager->registerCursor(name.str());
+    }
+
+    queueKeys(manager, vbucket, 0, 1000);
+    moveCursor(manager, CheckpointManager::pCursorName, 500);
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        moveCursor(manager, cursors[i], 500);
+    }
+
+    hrtime_t start = gethrtime();
+    for (int round = 0; round < nrounds; ++round) {
+        for (int i = 0; i < 100; ++i) {
+            std::stringstream key;
+            key << "key-" << (i < 50 ? i : 900 + i);
+            queued_item qi(new Item(key.str(), vbucket->getId(),
+                                    queue_op_set, 0, 0));
+            manager->queueDirty(vbucket, qi, true);
+        }
+    }
+    hrtime_t dedupTime = gethrtime() - start;
+
+    std::stringstream label;
+    label << "queueDirty dedup " << ncursors << " cursors";
+    printResult(label.str(), dedupTime / (100 * nrounds), "ns");
+
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        manager->removeCursor(cursors[i]);
+    }
+    delete manager;
+}
+
+int main(void) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=1"));
+
+    benchmarkQueueDirty(50000);
+
+    const int cursors[] = { 0, 4, 16, 64, 256 };
+    for (size_t i = 0; i < sizeof(cursors) / sizeof(cursors[0]); ++i) {
+        benchmarkDedupCursors(cursors[i], 100);
+    }
+}
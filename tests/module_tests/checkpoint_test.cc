@@ -20,6 +20,7 @@
 #include <signal.h>
 
 #include <algorithm>
+#include <limits>
 #include <set>
 #include <vector>
 
@@ -317,9 +318,297 @@ void test_reset_checkpoint_id() {
     cb_assert(items.size() == 0);
 }
 
+static void queueKeys(CheckpointManager *manager, RCPtr<VBucket> &vbucket,
+                      int from, int to) {
+    for (int i = from; i < to; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queued_item qi(new Item(key.str(), vbucket->getId(), queue_op_set,
+                                0, 0));
+        manager->queueDirty(vbucket, qi, true);
+    }
+}
+
+void test_dedup_with_cursor() {
+    // A replica vbucket never closes its open checkpoint on its own
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+    const std::string cursor("dedup-client");
+    manager->registerCursor(cursor);
+
+    queueKeys(manager, vbucket, 0, 1000);
+
+    // Move the cursor halfway through the checkpoint
+    bool isLastItem = false;
+    size_t sent = 0;
+    while (sent < 500) {
+        queued_item qi = manager->nextItem(cursor, isLastItem);
+        if (qi->getOperation() == queue_op_set) {
+            ++sent;
+        }
+    }
+
+    // Keep updating keys behind the cursor, superseding the queued items
+    // often enough for the queue to be compacted underneath the cursor.
+    for (int round = 0; round < 100; ++round) {
+        queueKeys(manager, vbucket, 0, 100);
+    }
+    cb_assert(manager->getNumOpenChkItems() == 1001);
+    cb_assert(manager->getNumItemsForCursor(cursor) == 600);
+    cb_assert(manager->getNumItemsForCursor(CheckpointManager::pCursorName) ==
+              1000);
+
+    std::set<std::string> keys;
+    int64_t lastSeqno = 0;
+    while (true) {
+        queued_item qi = manager->nextItem(cursor, isLastItem);
+        if (qi->getOperation() == queue_op_empty) {
+            break;
+        }
+        cb_assert(qi->getOperation() == queue_op_set);
+        cb_assert(qi->getBySeqno() > lastSeqno);
+        lastSeqno = qi->getBySeqno();
+        cb_assert(keys.insert(qi->getKey()).second);
+    }
+    // The remaining 500 keys and the latest version of the updated ones
+    cb_assert(keys.size() == 600);
+    cb_assert(keys.count("key-0") == 1 && keys.count("key-999") == 1);
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForCursor(CheckpointManager::pCursorName, items);
+    cb_assert(items.size() == 1001);
+
+    manager->removeCursor(cursor);
+    delete manager;
+}
+
+void test_checkpoint_overhead() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    size_t baseOverhead = global_stats.memOverhead;
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+
+    std::vector<queued_item> items;
+    for (int i = 0; i < NUM_ITEMS; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        items.push_back(queued_item(new Item(key.str(), vbucket->getId(),
+                                             queue_op_set, 0, 0)));
+    }
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        manager->queueDirty(vbucket, items[i], true);
+    }
+    size_t overhead = global_stats.memOverhead - baseOverhead;
+
+    // Deduplicate every queued item twice
+    for (int round = 0; round < 2; ++round) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            queued_item qi(new Item(items[i]->getKey(), vbucket->getId(),
+                                    queue_op_set, 0, 0));
+            manager->queueDirty(vbucket, qi, true);
+        }
+    }
+    size_t dedupOverhead = global_stats.memOverhead - baseOverhead;
+
+    // Superseded slots are reclaimed, so deduplication can at most double
+    // the slots held for the items (and the table of chunks holding them).
+    size_t chunks = 2 * NUM_ITEMS / CheckpointQueue::chunkSize + 2;
+    cb_assert(dedupOverhead <= overhead +
+              chunks * CheckpointQueue::chunkSize * sizeof(queued_item) / 2 +
+              2 * chunks * (sizeof(queued_item*) + sizeof(size_t)));
+
+    delete manager;
+    cb_assert(global_stats.memOverhead == baseOverhead);
+}
+
+static void moveCursor(CheckpointManager *manager, const std::string &cursor,
+                       size_t numItems) {
+    bool isLastItem = false;
+    size_t sent = 0;
+    while (sent < numItems) {
+        queued_item qi = manager->nextItem(cursor, isLastItem);
+        cb_assert(qi->getOperation() != queue_op_empty);
+        if (qi->getOperation() == queue_op_set) {
+            ++sent;
+        }
+    }
+}
+
+void test_dedup_multiple_cursors() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    const int numCursors[] = {0, 4};
+
+    for (size_t n = 0; n < sizeof(numCursors) / sizeof(int); ++n) {
+        CheckpointManager *manager =
+            new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+        std::vector<std::string> cursors;
+        for (int i = 0; i < numCursors[n]; ++i) {
+            std::stringstream name;
+            name << "dedup-client-" << i;
+            cursors.push_back(name.str());
+            manager->registerCursor(name.str());
+        }
+
+        queueKeys(manager, vbucket, 0, 1000);
+        moveCursor(manager, CheckpointManager::pCursorName, 500);
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            moveCursor(manager, cursors[i], 500);
+        }
+
+        // Update keys behind and ahead of every cursor
+        for (int round = 0; round < 2; ++round) {
+            for (int i = 0; i < 100; ++i) {
+                std::stringstream key;
+                key << "key-" << (i < 50 ? i : 900 + i);
+                queued_item qi(new Item(key.str(), vbucket->getId(),
+                                        queue_op_set, 0, 0));
+                // Only an update of a key already persisted is counted in
+                // the disk queue again.
+                cb_assert(manager->queueDirty(vbucket, qi, true) ==
+                          (round == 0 && i < 50));
+            }
+        }
+
+        cb_assert(manager->getNumItemsForCursor(CheckpointManager::pCursorName)
+                  == 550);
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            cb_assert(manager->getNumItemsForCursor(cursors[i]) == 550);
+            manager->removeCursor(cursors[i]);
+        }
+        delete manager;
+    }
+}
+
+void test_batched_drain() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+    const std::string cursor("batch-client");
+    manager->registerCursor(cursor);
+    queueKeys(manager, vbucket, 0, 1000);
+
+    // An item budget splits the checkpoint into batches
+    size_t numBatches = 0;
+    size_t numSets = 0;
+    int64_t lastSeqno = 0;
+    while (true) {
+        std::vector<queued_item> items;
+        manager->getItemsForCursor(cursor, items, 100,
+                                   std::numeric_limits<size_t>::max());
+        if (items.empty()) {
+            break;
+        }
+        cb_assert(items.size() <= 100);
+        cb_assert(items.capacity() == items.size() ||
+                  items.capacity() == 100);
+        ++numBatches;
+        std::vector<queued_item>::iterator it = items.begin();
+        for (; it != items.end(); ++it) {
+            if ((*it)->getOperation() == queue_op_set) {
+                cb_assert((*it)->getBySeqno() > lastSeqno);
+                lastSeqno = (*it)->getBySeqno();
+                ++numSets;
+            }
+        }
+    }
+    // 1000 items and the checkpoint_start item
+    cb_assert(numBatches == 11);
+    cb_assert(numSets == 1000);
+    cb_assert(manager->getNumItemsForCursor(cursor) == 0);
+
+    // A byte budget stops the batch at the item that reaches it
+    const size_t maxBytes = 16384;
+    std::vector<queued_item> items;
+    manager->getItemsForCursor(CheckpointManager::pCursorName, items,
+                               std::numeric_limits<size_t>::max(), maxBytes);
+    size_t bytes = 0;
+    for (size_t i = 0; i < items.size(); ++i) {
+        cb_assert(bytes < maxBytes);
+        bytes += items[i]->size();
+    }
+    cb_assert(bytes >= maxBytes);
+    size_t remaining = 1001 - items.size();
+    cb_assert(manager->getNumItemsForCursor(CheckpointManager::pCursorName) ==
+              remaining);
+
+    // The unbounded drain grows the vector once for all the items left
+    std::vector<queued_item>().swap(items);
+    manager->getAllItemsForCursor(CheckpointManager::pCursorName, items);
+    cb_assert(items.size() == remaining);
+    cb_assert(items.capacity() == items.size());
+
+    manager->removeCursor(cursor);
+    delete manager;
+}
+
+void test_expel_items() {
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL));
+    size_t baseMemory = global_stats.checkpointMemory;
+    size_t baseExpelled = global_stats.itemsExpelledFromCheckpoints;
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 1, 0, 0);
+    const std::string cursor("expel-client");
+    manager->registerCursor(cursor);
+    queueKeys(manager, vbucket, 0, 1000);
+    size_t fullMemory = global_stats.checkpointMemory;
+    cb_assert(fullMemory > baseMemory);
+
+    // Persistence is done, the other cursor is halfway through
+    moveCursor(manager, CheckpointManager::pCursorName, 1000);
+    moveCursor(manager, cursor, 500);
+    std::list<std::string> behind = manager->getCursorsBehindPersistence();
+    cb_assert(behind.size() == 1 && behind.front() == cursor);
+
+    // Only persisted items are expelled, and none past the slowest cursor.
+    // The keys have the seqnos 2 to 1001.
+    cb_assert(manager->expelUnreferencedItems(101) == 100);
+    cb_assert(manager->expelUnreferencedItems(1001) == 400);
+    cb_assert(manager->expelUnreferencedItems(1001) == 0);
+    cb_assert(global_stats.itemsExpelledFromCheckpoints - baseExpelled == 500);
+    cb_assert(global_stats.checkpointMemory < fullMemory);
+    cb_assert(manager->getNumItemsForCursor(cursor) == 500);
+    cb_assert(manager->getNumItemsForCursor(CheckpointManager::pCursorName)
+              == 0);
+
+    // A cursor starting in the expelled range has to backfill it
+    CursorRegResult result = manager->registerCursorBySeqno("late-client", 50);
+    cb_assert(result.first == 502);
+    cb_assert(result.second);
+    std::vector<queued_item> items;
+    manager->getAllItemsForCursor("late-client", items);
+    cb_assert(items.size() == 501);
+    cb_assert(items[1]->getBySeqno() == 502);
+    cb_assert(!manager->registerCursor("tap-client", 1, true));
+
+    // An expelled key is a new item when it is updated again
+    size_t numItems = manager->getNumOpenChkItems();
+    queueKeys(manager, vbucket, 0, 1);
+    cb_assert(manager->getNumOpenChkItems() == numItems + 1);
+    queueKeys(manager, vbucket, 999, 1000);
+    cb_assert(manager->getNumOpenChkItems() == numItems + 1);
+
+    manager->removeCursor(cursor);
+    manager->removeCursor("late-client");
+    manager->removeCursor("tap-client");
+    delete manager;
+    cb_assert(global_stats.checkpointMemory == baseMemory);
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     basic_chk_test();
     test_reset_checkpoint_id();
+    test_dedup_with_cursor();
+    test_checkpoint_overhead();
+    test_dedup_multiple_cursors();
+    test_batched_drain();
+    test_expel_items();
 }
@@ -0,0 +1,320 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <string>
+
+#include "executorpool.h"
+#include "executorthread.h"
+#include "priority.h"
+#include "taskqueue.h"
+
+#undef NDEBUG
+
+class TestTask : public GlobalTask {
+public:
+    TestTask(const Priority &p) : GlobalTask(NULL, p) {}
+
+    bool run() { return false; }
+
+    std::string getDescription() { return "test task"; }
+};
+
+class ShardTask : public TestTask {
+public:
+    ShardTask(const Priority &p, int s) : TestTask(p), shard(s) {}
+
+    int getShardAffinity() { return shard; }
+
+private:
+    int shard;
+};
+
+/**
+ * Drives the scheduling decisions of an ExecutorPool, its TaskQueues and
+ * ExecutorThreads directly, without starting any thread.
+ */
+class ExecutorPoolTest {
+public:
+    static ExecutorPool *createPool(bool workStealing) {
+        return new ExecutorPool(0, NUM_TASK_GROUPS, 4, 4, 2, 2,
+                                workStealing, false, false);
+    }
+
+    /**
+     * Create a pool whose threads are spread over two NUMA nodes, without
+     * binding any thread to the CPUs of a node.
+     */
+    static ExecutorPool *createNumaPool(bool workStealing) {
+        ExecutorPool *pool = createPool(workStealing);
+        pool->numaNodes.resize(2);
+        return pool;
+    }
+
+    static void testRunQueuePriorityOrder() {
+        ExecutorPool *pool = createPool(true);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread t(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        pool->threadQ.push_back(&t);
+
+        ExTask low = new TestTask(Priority::ItemPagerPriority);
+        ExTask high = new TestTask(Priority::BgFetcherPriority);
+        ExTask mid = new TestTask(Priority::FlusherPriority);
+        pool->runNext(t, low, q);
+        pool->runNext(t, high, q);
+        pool->runNext(t, mid, q);
+        cb_assert(t.getRunQueueSize() == 3);
+        cb_assert(pool->getNumReadyTasks() == 3);
+
+        ExTask expected[] = { high, mid, low };
+        for (int i = 0; i < 3; ++i) {
+            cb_assert(pool->_nextRunQueueTask(t) == q);
+            cb_assert(t.currentTask.get() == expected[i].get());
+            cb_assert(t.curTaskType == NONIO_TASK_IDX);
+            pool->doneWork(t.curTaskType);
+        }
+        cb_assert(pool->_nextRunQueueTask(t) == NULL);
+        cb_assert(pool->getNumReadyTasks() == 0);
+
+        delete q;
+        delete pool;
+    }
+
+    static void testStealing() {
+        ExecutorPool *pool = createPool(true);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread busy(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        ExecutorThread idle(pool, NONIO_TASK_IDX, "nonio_worker_1");
+        ExecutorThread other(pool, AUXIO_TASK_IDX, "auxio_worker_2");
+        pool->threadQ.push_back(&busy);
+        pool->threadQ.push_back(&idle);
+        pool->threadQ.push_back(&other);
+
+        ExTask low = new TestTask(Priority::ItemPagerPriority);
+        ExTask high = new TestTask(Priority::BgFetcherPriority);
+        pool->runNext(busy, low, q);
+        pool->runNext(busy, high, q);
+
+        // Threads only steal the tasks of their own type
+        cb_assert(pool->_nextRunQueueTask(other) == NULL);
+        cb_assert(other.getNumStolen() == 0);
+
+        // and take the task the victim would have run next
+        cb_assert(pool->_nextRunQueueTask(idle) == q);
+        cb_assert(idle.currentTask.get() == high.get());
+        cb_assert(idle.getNumStolen() == 1);
+        cb_assert(busy.getRunQueueSize() == 1);
+        pool->doneWork(idle.curTaskType);
+
+        cb_assert(pool->_nextRunQueueTask(busy) == q);
+        cb_assert(busy.currentTask.get() == low.get());
+        cb_assert(busy.getNumStolen() == 0);
+        pool->doneWork(busy.curTaskType);
+
+        // Nothing is left to steal
+        cb_assert(pool->_nextRunQueueTask(idle) == NULL);
+        cb_assert(idle.getNumStolen() == 1);
+        cb_assert(pool->getNumReadyTasks() == 0);
+
+        delete q;
+        delete pool;
+    }
+
+    static void testDeadTaskCleanup() {
+        ExecutorPool *pool = createPool(false);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread t(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        pool->threadQ.push_back(&t);
+
+        ExTask dead = new TestTask(Priority::ItemPagerPriority);
+        ExTask live = new TestTask(Priority::ItemPagerPriority);
+        q->_pushReadyTask(dead);
+        q->_pushReadyTask(live);
+        pool->addWork(2, NONIO_TASK_IDX);
+        dead->cancel();
+
+        // A dead task is cleaned out of the TaskQueue first, even when no
+        // thread capacity is left for its type
+        pool->setMaxNonIO(0);
+        cb_assert(q->fetchNextTask(t, false));
+        cb_assert(t.currentTask.get() == dead.get());
+        cb_assert(t.curTaskType == NO_TASK_TYPE);
+        cb_assert(pool->getNumReadyTasks() == 1);
+
+        pool->setMaxNonIO(2);
+        t.currentTask.reset();
+        cb_assert(q->fetchNextTask(t, false));
+        cb_assert(t.currentTask.get() == live.get());
+        cb_assert(t.curTaskType == NONIO_TASK_IDX);
+        pool->doneWork(t.curTaskType);
+        cb_assert(pool->getNumReadyTasks() == 0);
+
+        delete q;
+        delete pool;
+    }
+
+    static void testDeadTaskCleanupFromRunQueue() {
+        ExecutorPool *pool = createPool(true);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread t(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        pool->threadQ.push_back(&t);
+
+        ExTask dead = new TestTask(Priority::ItemPagerPriority);
+        pool->runNext(t, dead, q);
+        dead->cancel();
+
+        pool->setMaxNonIO(0);
+        cb_assert(pool->_nextRunQueueTask(t) == q);
+        cb_assert(t.currentTask.get() == dead.get());
+        cb_assert(t.curTaskType == NO_TASK_TYPE);
+        cb_assert(t.getRunQueueSize() == 0);
+        cb_assert(pool->getNumReadyTasks() == 0);
+        cb_assert(q->getPendingQueueSize() == 0);
+
+        delete q;
+        delete pool;
+    }
+
+    static void testMoveToRunQueueBatch() {
+        ExecutorPool *pool = createPool(true);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread t(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        pool->threadQ.push_back(&t);
+
+        const size_t numTasks = 3 * TASK_RUN_QUEUE_BATCH;
+        for (size_t i = 0; i < numTasks; ++i) {
+            ExTask task = new TestTask(i <= TASK_RUN_QUEUE_BATCH ?
+                                       Priority::BgFetcherPriority :
+                                       Priority::ItemPagerPriority);
+            q->_pushReadyTask(task);
+        }
+        pool->addWork(numTasks, NONIO_TASK_IDX);
+
+        // The thread runs the top task and queues only a batch of the next
+        // ones, which are still counted as ready tasks
+        cb_assert(q->fetchNextTask(t, false));
+        cb_assert(t.curTaskType == NONIO_TASK_IDX);
+        cb_assert(t.getRunQueueSize() == TASK_RUN_QUEUE_BATCH);
+        cb_assert(q->getReadyQueueSize() ==
+                  numTasks - 1 - TASK_RUN_QUEUE_BATCH);
+        cb_assert(pool->getNumReadyTasks() == numTasks - 1);
+
+        while (!t.runQueue.empty()) {
+            cb_assert(t.runQueue.top().first->getTypeId() ==
+                      Priority::BgFetcherPriority.getTypeId());
+            t.runQueue.pop();
+        }
+        pool->doneWork(t.curTaskType);
+
+        delete q;
+        delete pool;
+    }
+
+    static void testNumaNodeSelection() {
+        ExecutorPool *pool = createNumaPool(false);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread t0(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        ExecutorThread t1(pool, NONIO_TASK_IDX, "nonio_worker_1");
+        ExecutorThread unbound(pool, NONIO_TASK_IDX, "nonio_worker_2");
+        t0.numaNode = 0;
+        t1.numaNode = 1;
+
+        ExTask shared = new TestTask(Priority::ItemPagerPriority);
+        ExTask node0 = new ShardTask(Priority::BgFetcherPriority, 2);
+        ExTask node1 = new ShardTask(Priority::FlusherPriority, 3);
+        q->_pushReadyTask(shared);
+        q->_pushReadyTask(node0);
+        q->_pushReadyTask(node1);
+        pool->addWork(3, NONIO_TASK_IDX);
+        cb_assert(q->readyQueue.size() == 1);
+        cb_assert(q->numNodeReadyTasks == 2);
+
+        // A local task of a higher priority goes before a shared one
+        cb_assert(q->_nextReadyQueue(t0) == &q->nodeReadyQueues[0]);
+        cb_assert(q->_nextReadyQueue(t1) == &q->nodeReadyQueues[1]);
+        // and a thread without a node takes the shared tasks first
+        cb_assert(q->_nextReadyQueue(unbound) == &q->readyQueue);
+        cb_assert(q->_popReadyTask(unbound).get() == shared.get());
+
+        // A shared task of a higher priority goes before a local one
+        ExTask high = new TestTask(Priority::BgFetcherPriority);
+        q->_pushReadyTask(high);
+        pool->addWork(1, NONIO_TASK_IDX);
+        cb_assert(q->_popReadyTask(t1).get() == high.get());
+        cb_assert(q->_popReadyTask(t1).get() == node1.get());
+
+        // With nothing else ready a thread runs a task of another node
+        cb_assert(q->_nextReadyQueue(t1) == &q->nodeReadyQueues[0]);
+        cb_assert(q->_popReadyTask(t1).get() == node0.get());
+        cb_assert(q->numNodeReadyTasks == 0);
+        cb_assert(q->_nextReadyQueue(t0) == NULL);
+        cb_assert(pool->getNumReadyTasks() == 0);
+
+        delete q;
+        delete pool;
+    }
+
+    static void testStealingPrefersNode() {
+        ExecutorPool *pool = createNumaPool(true);
+        TaskQueue *q = new TaskQueue(pool, NONIO_TASK_IDX, "test");
+        ExecutorThread thief(pool, NONIO_TASK_IDX, "nonio_worker_0");
+        ExecutorThread remote(pool, NONIO_TASK_IDX, "nonio_worker_1");
+        ExecutorThread local(pool, NONIO_TASK_IDX, "nonio_worker_2");
+        thief.numaNode = 0;
+        remote.numaNode = 1;
+        local.numaNode = 0;
+        pool->threadQ.push_back(&thief);
+        pool->threadQ.push_back(&remote);
+        pool->threadQ.push_back(&local);
+
+        ExTask remoteTask = new TestTask(Priority::BgFetcherPriority);
+        ExTask localTask = new TestTask(Priority::ItemPagerPriority);
+        pool->runNext(remote, remoteTask, q);
+        pool->runNext(local, localTask, q);
+
+        // A victim on the thread's own node is picked over a remote one,
+        // even one with a task of a higher priority
+        cb_assert(pool->_nextRunQueueTask(thief) == q);
+        cb_assert(thief.currentTask.get() == localTask.get());
+        pool->doneWork(thief.curTaskType);
+
+        // and a remote one is only picked once the node has nothing left
+        cb_assert(pool->_nextRunQueueTask(thief) == q);
+        cb_assert(thief.currentTask.get() == remoteTask.get());
+        pool->doneWork(thief.curTaskType);
+        cb_assert(thief.getNumStolen() == 2);
+        cb_assert(pool->getNumReadyTasks() == 0);
+
+        delete q;
+        delete pool;
+    }
+};
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    ExecutorPoolTest::testRunQueuePriorityOrder();
+    ExecutorPoolTest::testStealing();
+    ExecutorPoolTest::testDeadTaskCleanup();
+    ExecutorPoolTest::testDeadTaskCleanupFromRunQueue();
+    ExecutorPoolTest::testMoveToRunQueueBatch();
+    ExecutorPoolTest::testNumaNodeSelection();
+    ExecutorPoolTest::testStealingPrefersNode();
+
+    return 0;
+}
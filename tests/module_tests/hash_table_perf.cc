@@ -0,0 +1,239 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "item.h"
+#include "stats.h"
+#include "stored-value.h"
+#include "threadtests.h"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+static EPStats global_stats;
+
+static std::string makeKey(size_t i) {
+    std::stringstream ss;
+    ss << "key" << i;
+    return ss.str();
+}
+
+/* Records the longest time the table was locked for by a resize. */
+class StallRecorder : public PauseResumeHashTableResizer {
+public:
+    StallRecorder() : chunks(0), maxStall(0) {}
+
+    bool migrated(hrtime_t stall) {
+        ++chunks;
+        maxStall = std::max(maxStall, stall);
+        return true;
+    }
+
+    size_t chunks;
+    hrtime_t maxStall;
+};
+
+/* Fill the hash table with the given number of small items and let it
+ * settle to its natural size.
+ */
+static void populate(HashTable &ht, size_t ndocs) {
+    StallRecorder recorder;
+    for (size_t i = 0; i < ndocs; i++) {
+        const std::string key = makeKey(i);
+        Item item(key.c_str(), key.length(), 0, 0, "v", 1);
+        cb_assert(ht.set(item) == WAS_CLEAN);
+        if (i % 65536 == 0) {
+            // Grow as we go (like the resizer task would), rather than
+            // filling very long chains.
+            ht.resize();
+            cb_assert(ht.pauseResumeResize(recorder));
+        }
+    }
+    ht.resize();
+    cb_assert(ht.pauseResumeResize(recorder));
+}
+
+/* Time ngets random lookups, returning the latencies in ns sorted
+ * ascending.
+ */
+static std::vector<hrtime_t> timeGets(HashTable &ht, size_t ndocs,
+                                      size_t ngets) {
+    std::vector<hrtime_t> latencies;
+    latencies.reserve(ngets);
+    for (size_t i = 0; i < ngets; i++) {
+        std::string key = makeKey((i * 7919) % ndocs);
+        hrtime_t start = gethrtime();
+        StoredValue *v = ht.find(key, false);
+        latencies.push_back(gethrtime() - start);
+        cb_assert(v != NULL);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+static void printResult(const std::string label, size_t value,
+                        const std::string units) {
+    std::cout.imbue(std::locale(""));
+
+    std::cout << std::setw(28) << label << ": "
+              << std::right << std::setw(11) << value << " " << units << std::endl;
+}
+
+static void benchmarkLayout(const char *layout, size_t ndocs, size_t ngets) {
+    HashTable::setDefaultLayout(layout);
+    HashTable ht(global_stats);
+    populate(ht, ndocs);
+
+    std::vector<hrtime_t> lat = timeGets(ht, ndocs, ngets);
+    hrtime_t total = 0;
+    for (size_t i = 0; i < lat.size(); ++i) {
+        total += lat[i];
+    }
+
+    std::string prefix(layout);
+    printResult(prefix + " overhead", ht.memorySize(), "bytes");
+    printResult(prefix + " overhead/item",
+                ht.memorySize() / ht.getNumInMemoryItems(), "bytes");
+    printResult(prefix + " get avg", total / lat.size(), "ns");
+    printResult(prefix + " get p99", lat[(lat.size() * 99) / 100], "ns");
+}
+
+static void benchmarkResize(size_t chunkSize, size_t ndocs) {
+    HashTable::setDefaultLayout("chained");
+    HashTable::setDefaultResizeChunkSize(chunkSize);
+    HashTable ht(global_stats);
+    HashTable::setDefaultResizeChunkSize(0);
+    populate(ht, ndocs);
+
+    // Starting the resize locks the table too (for all of it if the
+    // resize isn't incremental).
+    StallRecorder recorder;
+    hrtime_t start = gethrtime();
+    ht.resize(ht.getSize() * 2 + 1);
+    recorder.maxStall = (gethrtime() - start) / 1000;
+    cb_assert(ht.pauseResumeResize(recorder));
+
+    std::stringstream label;
+    label << "resize chunk " << chunkSize << " max stall";
+    printResult(label.str(), recorder.maxStall, "us");
+}
+
+/* Each thread does a 90/10 mix of gets and sets, returning how long it
+ * took in ns. Gets either always lock the bucket (as getInternal used
+ * to) or try the optimistic path first.
+ */
+class MixedAccessGenerator : public Generator<hrtime_t> {
+public:
+    MixedAccessGenerator(HashTable &h, size_t n, size_t o, bool opt)
+        : ht(h), ndocs(n), ops(o), optimistic(opt), thread(0) {}
+
+    hrtime_t operator()() {
+        size_t i = (++thread) * 104729;
+        hrtime_t start = gethrtime();
+        for (size_t op = 0; op < ops; ++op, i += 7919) {
+            std::string key = makeKey(i % ndocs);
+            if (op % 10 == 0) {
+                Item item(key.c_str(), key.length(), 0, 0, "v", 1);
+                ht.set(item);
+            } else {
+                delete get(key);
+            }
+        }
+        return gethrtime() - start;
+    }
+
+private:
+    Item *get(const std::string &key) {
+        if (optimistic) {
+            Item *itm = ht.optimisticGet(key, 0);
+            if (itm) {
+                return itm;
+            }
+        }
+        int bucket_num(0);
+        LockHolder lh = ht.getLockedBucket(key, &bucket_num);
+        StoredValue *v = ht.unlocked_find(key, bucket_num);
+        cb_assert(v != NULL);
+        return v->toItem(false, 0);
+    }
+
+    HashTable &ht;
+    const size_t ndocs;
+    const size_t ops;
+    const bool optimistic;
+    AtomicValue<size_t> thread;
+};
+
+static void benchmarkConcurrentGets(bool optimistic, size_t nthreads,
+                                    size_t ndocs, size_t ops) {
+    HashTable::setDefaultLayout("chained");
+    HashTable ht(global_stats);
+    populate(ht, ndocs);
+    // Reference everything until it's as hot as a frequently read item.
+    for (size_t i = 0; i < ndocs; ++i) {
+        std::string key = makeKey(i);
+        while (ht.find(key)->getNRUValue() > MIN_NRU_VALUE) {
+        }
+    }
+
+    MixedAccessGenerator gen(ht, ndocs, ops, optimistic);
+    std::vector<hrtime_t> times = getCompletedThreads(nthreads, &gen);
+    hrtime_t elapsed = *std::max_element(times.begin(), times.end());
+
+    std::stringstream label;
+    label << (optimistic ? "optimistic" : "locked") << " get/set "
+          << nthreads << " threads";
+    printResult(label.str(), (nthreads * ops * 1000000000ULL) / elapsed,
+                "ops/s");
+}
+
+int main(void) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=1"));
+    global_stats.setMaxDataSize(std::numeric_limits<size_t>::max());
+
+    const size_t ndocs = 1000000;
+    const size_t ngets = 1000000;
+
+    benchmarkLayout("chained", ndocs, ngets);
+    benchmarkLayout("bucketized", ndocs, ngets);
+    benchmarkResize(0, ndocs);
+    benchmarkResize(1024, ndocs);
+
+    const size_t threads[] = { 1, 4, 16 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+        benchmarkConcurrentGets(false, threads[i], ndocs, ngets);
+        benchmarkConcurrentGets(true, threads[i], ndocs, ngets);
+    }
+}
@@ -343,8 +343,271 @@ static void testAutoResize() {
     verifyFound(h, keys);
 
     h.resize();
+    if (h.getLayout() == HT_LAYOUT_BUCKETIZED) {
+        // Several values share each bucket.
+        cb_assert(h.getSize() == 1531);
+    } else {
+        cb_assert(h.getSize() == 6143);
+    }
+    verifyFound(h, keys);
+}
+
+/**
+ * Pauses an incremental resize after every chunk.
+ */
+class ChunkCounter : public PauseResumeHashTableResizer {
+public:
+    ChunkCounter() : chunks(0) {}
+
+    bool migrated(hrtime_t stall) {
+        (void)stall;
+        ++chunks;
+        return false;
+    }
+
+    size_t chunks;
+};
+
+static void testIncrementalResize() {
+    HashTable::setDefaultResizeChunkSize(10);
+    HashTable h(global_stats, 97, 3);
+    HashTable::setDefaultResizeChunkSize(0);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+    size_t stalls = global_stats.htResizeStallHisto.total();
+
+    h.resize(6143);
+    cb_assert(h.getSize() == 6143);
+    cb_assert(h.isResizing());
+    verifyFound(h, keys);
+
+    // A second resize has to wait for the first to be migrated.
+    h.resize(769);
     cb_assert(h.getSize() == 6143);
+
+    // Everything keeps working between chunks.
+    ChunkCounter counter;
+    std::vector<std::string> added;
+    while (!h.pauseResumeResize(counter)) {
+        cb_assert(h.isResizing());
+        std::string k = keys[counter.chunks * 97];
+        cb_assert(h.del(k));
+        cb_assert(h.find(k) == NULL);
+        store(h, k);
+
+        std::vector<std::string> more = generateKeys(5000 + counter.chunks,
+                                                     4999 + counter.chunks);
+        storeMany(h, more);
+        added.insert(added.end(), more.begin(), more.end());
+
+        verifyFound(h, keys);
+        verifyFound(h, added);
+        cb_assert(count(h) == static_cast<int>(keys.size() + added.size()));
+    }
+
+    // 97 buckets, 10 at a time.
+    cb_assert(counter.chunks == 10);
+    cb_assert(!h.isResizing());
+    cb_assert(h.getSize() == 6143);
+    verifyFound(h, keys);
+    verifyFound(h, added);
+    cb_assert(count(h) == static_cast<int>(keys.size() + added.size()));
+    cb_assert(global_stats.htResizeStallHisto.total() ==
+              stalls + 1 + counter.chunks);
+
+    // Nothing left to migrate.
+    cb_assert(h.pauseResumeResize(counter));
+    cb_assert(counter.chunks == 10);
+}
+
+class MigratingAccessGenerator : public Generator<bool> {
+public:
+
+    MigratingAccessGenerator(const std::vector<std::string> &k,
+                             HashTable &h) : keys(k), ht(h), size(10000) {
+        std::random_shuffle(keys.begin(), keys.end());
+    }
+
+    bool operator()() {
+        std::vector<std::string>::iterator it;
+        for (it = keys.begin(); it != keys.end(); ++it) {
+            if (rand() % 111 == 0) {
+                ht.resize(size);
+                size = size == 10000 ? 30000 : 10000;
+            }
+            if (rand() % 7 == 0) {
+                ChunkCounter counter;
+                ht.pauseResumeResize(counter);
+            }
+            ht.del(*it);
+        }
+        return true;
+    }
+
+private:
+    std::vector<std::string>  keys;
+    HashTable                &ht;
+    size_t                    size;
+};
+
+static void testConcurrentAccessIncrementalResize() {
+    HashTable::setDefaultResizeChunkSize(100);
+    HashTable h(global_stats, 5, 3);
+    HashTable::setDefaultResizeChunkSize(0);
+
+    std::vector<std::string> keys = generateKeys(20000);
+    storeMany(h, keys);
     verifyFound(h, keys);
+
+    srand(918475);
+    MigratingAccessGenerator gen(keys, h);
+    getCompletedThreads(16, &gen);
+    cb_assert(count(h) == 0);
+}
+
+static void testOptimisticGet() {
+    HashTable h(global_stats, 5, 1);
+
+    std::string k("key");
+    std::string missing("missing");
+    cb_assert(h.optimisticGet(missing, 0) == NULL);
+    store(h, k);
+
+    // Fresh values aren't recently referenced yet.
+    cb_assert(h.optimisticGet(k, 0) == NULL);
+    Item *itm = h.optimisticGet(k, 3, false);
+    cb_assert(itm);
+    cb_assert(itm->getKey() == k);
+    cb_assert(itm->getValue()->to_s() == k);
+    cb_assert(itm->getVBucketId() == 3);
+    delete itm;
+
+    while (h.find(k)->getNRUValue() > MIN_NRU_VALUE) {
+    }
+    itm = h.optimisticGet(k, 0);
+    cb_assert(itm);
+    cb_assert(itm->getNRUValue() == MIN_NRU_VALUE);
+    delete itm;
+
+    // Locked values are left to the locked path.
+    StoredValue *v = h.find(k);
+    v->lock(ep_current_time() + 1);
+    cb_assert(h.optimisticGet(k, 0, false) == NULL);
+    cb_assert(v->isLockedNoUpdate(ep_current_time()));
+    v->unlock();
+
+    // As are non-resident and deleted values.
+    v->markClean();
+    cb_assert(h.unlocked_ejectItem(v, VALUE_ONLY));
+    cb_assert(h.optimisticGet(k, 0, false) == NULL);
+    store(h, k);
+    cb_assert(h.del(k));
+    cb_assert(h.optimisticGet(k, 0, false) == NULL);
+
+    h.reclaimRetired();
+}
+
+/**
+ * Half the threads read values without locks while the other half
+ * keep replacing, deleting and moving them.
+ */
+class OptimisticAccessGenerator : public Generator<bool> {
+public:
+
+    OptimisticAccessGenerator(const std::vector<std::string> &k,
+                              HashTable &h) : keys(k), ht(h), thread(0) {}
+
+    bool operator()() {
+        if (++thread % 2) {
+            write();
+        } else {
+            read();
+        }
+        return true;
+    }
+
+private:
+
+    void read() {
+        for (int i = 0; i < 20; ++i) {
+            std::vector<std::string>::iterator it;
+            for (it = keys.begin(); it != keys.end(); ++it) {
+                Item *itm = ht.optimisticGet(*it, 0, false);
+                if (itm) {
+                    cb_assert(itm->getKey() == *it);
+                    std::string val(itm->getValue()->to_s());
+                    cb_assert(val == *it || val == *it + *it);
+                    delete itm;
+                }
+            }
+        }
+    }
+
+    void write() {
+        size_t size = 10000;
+        std::vector<std::string>::iterator it;
+        for (it = keys.begin(); it != keys.end(); ++it) {
+            std::string val(*it + *it);
+            Item i(it->data(), it->length(), 0, 0, val.c_str(), val.length());
+            ht.set(i);
+            if (rand() % 3 == 0) {
+                ht.del(*it);
+            }
+            if (rand() % 1111 == 0) {
+                ht.resize(size);
+                size = size == 10000 ? 30000 : 10000;
+                ChunkCounter counter;
+                while (!ht.pauseResumeResize(counter)) {
+                }
+            }
+        }
+    }
+
+    std::vector<std::string>  keys;
+    HashTable                &ht;
+    AtomicValue<int>          thread;
+};
+
+static void testConcurrentOptimisticGet() {
+    HashTable::setDefaultResizeChunkSize(100);
+    HashTable h(global_stats, 5, 3);
+    HashTable::setDefaultResizeChunkSize(0);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    srand(918475);
+    OptimisticAccessGenerator gen(keys, h);
+    getCompletedThreads(8, &gen);
+}
+
+static void testRetiredBytes() {
+    HashTable h(global_stats, 5, 1);
+    size_t overhead = global_stats.memOverhead.load();
+
+    const std::string k("somekey");
+    const size_t itemSize(64 * 1024);
+    char *someval(static_cast<char*>(calloc(1, itemSize)));
+    cb_assert(someval);
+    Item i(k.data(), k.length(), 0, 0, someval, itemSize);
+    h.set(i);
+
+    // A value replaced under optimistic readers is charged until reclaimed
+    h.set(i);
+    cb_assert(global_stats.memOverhead.load() >= overhead + itemSize);
+    h.reclaimRetired();
+    cb_assert(global_stats.memOverhead.load() == overhead);
+
+    // and writers reclaim it themselves once enough has been retired
+    for (int j = 0; j < 64; ++j) {
+        h.set(i);
+    }
+    cb_assert(global_stats.memOverhead.load() < overhead + 8 * itemSize);
+
+    h.reclaimRetired();
+    cb_assert(global_stats.memOverhead.load() == overhead);
+    free(someval);
 }
 
 static void testAdd() {
@@ -394,6 +657,35 @@ static void testDepthCounting() {
     cb_assert(depthCounter.max > 1000);
 }
 
+static void depthForHashFunction(const char *func, size_t nbuckets, int nkeys,
+                                 HashTableDepthStatVisitor &depthCounter) {
+    HashTable::setDefaultHashFunction(func);
+    HashTable h(global_stats, nbuckets, 1);
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    h.visitDepth(depthCounter);
+    cb_assert(depthCounter.size == static_cast<size_t>(nkeys));
+}
+
+static void testHashFunctionDistribution() {
+    const size_t nbuckets = 1531;
+    const int nkeys = 50000;
+
+    HashTableDepthStatVisitor djb2;
+    depthForHashFunction("djb2", nbuckets, nkeys, djb2);
+    HashTableDepthStatVisitor murmur;
+    depthForHashFunction("murmur3", nbuckets, nkeys, murmur);
+
+    // Sequential-suffix keys must spread over every bucket, and no
+    // function may build up much longer chains than djb2, the default.
+    cb_assert(djb2.min > 0);
+    cb_assert(murmur.min > 0);
+    cb_assert(murmur.max <= djb2.max + djb2.max / 2);
+
+    HashTable::setDefaultHashFunction("djb2");
+}
+
 static void testPoisonKey() {
     std::string k("A\\NROBs_oc)$zqJ1C.9?XU}Vn^(LW\"`+K/4lykF[ue0{ram;fvId6h=p&Zb3T~SQ]82'ixDP");
 
@@ -570,10 +862,11 @@ static void testSizeStatsEjectFlush() {
 }
 
 static void testItemAge() {
-    // Setup
+    // Setup; values small enough to be held inline have no age.
     HashTable ht(global_stats, 5, 1);
     std::string key("key");
-    Item item(key.data(), key.length(), 0, 0, "value", strlen("value"));
+    std::string value(StoredValue::maxInlineValueSize, 'x');
+    Item item(key.data(), key.length(), 0, 0, value.data(), value.length());
     cb_assert(ht.set(item) == WAS_CLEAN);
 
     // Test
@@ -593,17 +886,108 @@ static void testItemAge() {
     cb_assert(v->getValue()->getAge() == 0);
 
     // Check changing age when new value is used.
-    Item item2(key.data(), key.length(), 0, 0, "value2", strlen("value2"));
+    value.append("2");
+    Item item2(key.data(), key.length(), 0, 0, value.data(), value.length());
     item2.getValue()->incrementAge();
     v->setValue(item2, ht, false);
     cb_assert(v->getValue()->getAge() == 1);
 }
 
-int main() {
-    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
-    global_stats.setMaxDataSize(64*1024*1024);
-    HashTable::setDefaultNumBuckets(3);
-    alarm(60);
+static void testInlineValues() {
+    global_stats.reset();
+    HashTable ht(global_stats, 5, 1);
+    size_t initialSize = global_stats.currentSize.load();
+    size_t initialInline = global_stats.numInlineValue.load();
+
+    std::string k("counter");
+    uint8_t ext_meta[] = { PROTOCOL_BINARY_DATATYPE_JSON };
+    Item small(k.data(), k.length(), 0, 0, "42", 2, ext_meta, 1);
+    cb_assert(ht.set(small) == WAS_CLEAN);
+
+    StoredValue *v = ht.find(k);
+    cb_assert(v->hasInlineValue());
+    cb_assert(ht.numInlineValues.load() == 1);
+    cb_assert(global_stats.numInlineValue.load() == initialInline + 1);
+    cb_assert(v->valuelen() == small.getValue()->length());
+    // The inline area is part of the object; don't count the value twice.
+    cb_assert(v->size() == v->getObjectSize());
+    cb_assert(ht.cacheSize.load() == v->size());
+    cb_assert(v->getValue()->to_s() == "42");
+    cb_assert(memcmp(v->getValueData(), "42", 2) == 0);
+    Item *itm = v->toItem(false, 0);
+    cb_assert(itm->getValue()->to_s() == "42");
+    cb_assert(itm->getDataType() == PROTOCOL_BINARY_DATATYPE_JSON);
+    delete itm;
+
+    // A counter can grow a little and stay inline...
+    Item grown(k.data(), k.length(), 0, 0, "4242", 4);
+    v->setValue(grown, ht, false);
+    cb_assert(v->hasInlineValue());
+    cb_assert(v->getValue()->to_s() == "4242");
+    cb_assert(v->getValue()->getDataType() == PROTOCOL_BINARY_RAW_BYTES);
+
+    // ...but a large value needs a Blob.
+    std::string big(StoredValue::maxInlineValueSize + 1, 'x');
+    Item large(k.data(), k.length(), 0, 0, big.data(), big.length());
+    v->setValue(large, ht, false);
+    cb_assert(!v->hasInlineValue());
+    cb_assert(v->getValue().get() == large.getValue().get());
+    cb_assert(v->getValueData() == large.getValue()->getData());
+    cb_assert(ht.numInlineValues.load() == 0);
+
+    v->setValue(small, ht, false);
+    cb_assert(v->hasInlineValue());
+
+    // Ejecting and restoring the value.
+    v->markClean();
+    cb_assert(ht.unlocked_ejectItem(v, VALUE_ONLY));
+    cb_assert(!v->isResident());
+    cb_assert(ht.numInlineValues.load() == 0);
+    cb_assert(v->unlocked_restoreValue(&small, ht));
+    cb_assert(v->hasInlineValue());
+    cb_assert(v->getValue()->to_s() == "42");
+
+    cb_assert(ht.del(k));
+    cb_assert(ht.numInlineValues.load() == 0);
+    cb_assert(global_stats.numInlineValue.load() == initialInline);
+    cb_assert(ht.memSize.load() == 0);
+    cb_assert(ht.cacheSize.load() == 0);
+    cb_assert(initialSize == global_stats.currentSize.load());
+}
+
+static void testLayoutOverhead() {
+    const size_t nbuckets = 1531;
+    HashTable::setDefaultLayout("chained");
+    HashTable chained(global_stats, nbuckets, 1);
+    HashTable::setDefaultLayout("bucketized");
+    HashTable bucketized(global_stats, nbuckets, 1);
+
+    cb_assert(chained.getLayout() == HT_LAYOUT_CHAINED);
+    cb_assert(bucketized.getLayout() == HT_LAYOUT_BUCKETIZED);
+    cb_assert(sizeof(HashBucket) == 64);
+    cb_assert(bucketized.memorySize() - chained.memorySize() ==
+              nbuckets * (sizeof(HashBucket) - sizeof(StoredValue*)));
+
+    // Both layouts must find the same items, including ones which had
+    // to go into a bucket's overflow chain.
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(chained, keys);
+    storeMany(bucketized, keys);
+    cb_assert(count(chained) == 5000);
+    cb_assert(count(bucketized) == 5000);
+    std::vector<std::string> deleted;
+    for (size_t i = 0; i < keys.size(); i += 7) {
+        cb_assert(bucketized.find(keys[i]) != NULL);
+        cb_assert(bucketized.del(keys[i]));
+        cb_assert(bucketized.find(keys[i]) == NULL);
+        deleted.push_back(keys[i]);
+    }
+    cb_assert(count(bucketized) == static_cast<int>(5000 - deleted.size()));
+    storeMany(bucketized, deleted);
+    cb_assert(count(bucketized) == 5000);
+}
+
+static void runTests() {
     testHashSize();
     testHashSizeTwo();
     testReverseDeletions();
@@ -612,10 +996,16 @@ int main() {
     testAdd();
     testAddExpiry();
     testDepthCounting();
+    testHashFunctionDistribution();
     testPoisonKey();
     testResize();
     testConcurrentAccessResize();
     testAutoResize();
+    testIncrementalResize();
+    testConcurrentAccessIncrementalResize();
+    testOptimisticGet();
+    testConcurrentOptimisticGet();
+    testRetiredBytes();
     testSizeStats();
     testSizeStatsFlush();
     testSizeStatsSoftDel();
@@ -623,5 +1013,17 @@ int main() {
     testSizeStatsEject();
     testSizeStatsEjectFlush();
     testItemAge();
+    testInlineValues();
+}
+
+int main() {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    global_stats.setMaxDataSize(64*1024*1024);
+    HashTable::setDefaultNumBuckets(3);
+    alarm(60);
+    runTests();
+    testLayoutOverhead();
+    HashTable::setDefaultLayout("bucketized");
+    runTests();
     exit(0);
 }
@@ -0,0 +1,195 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <map>
+#include <vector>
+
+#include "timerwheel.h"
+
+static const uint64_t TICK = 1000; // 1ms
+
+static struct timeval usecToTv(uint64_t usec) {
+    struct timeval tv;
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+    return tv;
+}
+
+static const uint64_t START = 1400000000ULL * 1000000;
+
+static void testEmpty() {
+    TimerWheel<int> wheel(TICK, usecToTv(START));
+    std::vector<int> out;
+    struct timeval tv;
+    cb_assert(wheel.size() == 0);
+    cb_assert(!wheel.nextExpiry(tv));
+    cb_assert(wheel.expire(usecToTv(START + 3600000000ULL), out) == 0);
+    cb_assert(out.empty());
+}
+
+static void testDueNow() {
+    TimerWheel<int> wheel(TICK, usecToTv(START));
+    std::vector<int> out;
+    wheel.add(1, 1, usecToTv(START), usecToTv(START));
+    wheel.add(2, 2, usecToTv(START - 5000), usecToTv(START));
+    cb_assert(wheel.size() == 2);
+
+    struct timeval tv;
+    cb_assert(wheel.nextExpiry(tv));
+    cb_assert(less_eq_tv(tv, usecToTv(START)));
+
+    cb_assert(wheel.expire(usecToTv(START), out) == 2);
+    cb_assert(out.size() == 2);
+    cb_assert(wheel.size() == 0);
+}
+
+static void testNotEarly() {
+    TimerWheel<int> wheel(TICK, usecToTv(START));
+    std::vector<int> out;
+    wheel.add(1, 1, usecToTv(START + 1500), usecToTv(START));
+
+    cb_assert(wheel.expire(usecToTv(START + 1000), out) == 0);
+    cb_assert(wheel.expire(usecToTv(START + 1499), out) == 0);
+    cb_assert(wheel.expire(usecToTv(START + 2000), out) == 1);
+    cb_assert(out.size() == 1 && out[0] == 1);
+}
+
+static void testRemove() {
+    TimerWheel<int> wheel(TICK, usecToTv(START));
+    std::vector<int> out;
+    wheel.add(1, 1, usecToTv(START + 10000), usecToTv(START));
+    wheel.add(2, 2, usecToTv(START + 10000000), usecToTv(START));
+    cb_assert(wheel.contains(1) && wheel.contains(2));
+
+    cb_assert(wheel.remove(1));
+    cb_assert(!wheel.remove(1));
+    cb_assert(!wheel.contains(1));
+    cb_assert(wheel.size() == 1);
+
+    // re-adding an id replaces its entry
+    wheel.add(2, 3, usecToTv(START + 20000), usecToTv(START));
+    cb_assert(wheel.size() == 1);
+
+    cb_assert(wheel.expire(usecToTv(START + 60000000), out) == 1);
+    cb_assert(out.size() == 1 && out[0] == 3);
+}
+
+static void testForever() {
+    TimerWheel<int> wheel(TICK, usecToTv(START));
+    std::vector<int> out;
+    struct timeval forever;
+    set_max_tv(forever);
+    wheel.add(1, 1, forever, usecToTv(START));
+
+    cb_assert(wheel.expire(usecToTv(START + 86400000000ULL), out) == 0);
+    cb_assert(wheel.size() == 1);
+    cb_assert(wheel.remove(1));
+}
+
+/**
+ * Walk the clock forward in random steps over a wheel holding elements
+ * spread over every level, and check that each one comes out with the
+ * first expire() call past its due tick.
+ */
+static void testRandom() {
+    TimerWheel<int> wheel(TICK, usecToTv(START));
+    std::map<int, uint64_t> due;
+    srand(42);
+
+    uint64_t now = START;
+    int nextId = 0;
+    for (int round = 0; round < 20000; ++round) {
+        for (int n = rand() % 4; n > 0; --n) {
+            uint64_t delay;
+            switch (rand() % 4) {
+            case 0:
+                delay = rand() % 100000; // level 0 and 1
+                break;
+            case 1:
+                delay = uint64_t(rand() % 600) * 1000000; // level 2
+                break;
+            case 2:
+                delay = uint64_t(rand() % 20000) * 1000000; // level 3
+                break;
+            default:
+                delay = uint64_t(rand() % 40000) * 1000000; // overflow
+            }
+            int id = nextId++;
+            due[id] = now + delay;
+            wheel.add(id, id, usecToTv(now + delay), usecToTv(now));
+        }
+
+        if (!due.empty() && rand() % 5 == 0) {
+            std::map<int, uint64_t>::iterator it = due.begin();
+            std::advance(it, rand() % due.size());
+            cb_assert(wheel.remove(it->first));
+            due.erase(it);
+        }
+        cb_assert(wheel.size() == due.size());
+
+        struct timeval next;
+        if (wheel.nextExpiry(next)) {
+            uint64_t earliest = ~uint64_t(0);
+            std::map<int, uint64_t>::iterator it;
+            for (it = due.begin(); it != due.end(); ++it) {
+                earliest = std::min(earliest, it->second);
+            }
+            cb_assert(!less_tv(usecToTv((earliest + TICK - 1) / TICK * TICK),
+                               next));
+        }
+
+        switch (rand() % 3) {
+        case 0:
+            now += rand() % 3000;
+            break;
+        case 1:
+            now += uint64_t(rand() % 1000) * 1000;
+            break;
+        default:
+            now += uint64_t(rand() % 10000) * 1000000;
+        }
+
+        std::vector<int> out;
+        wheel.expire(usecToTv(now), out);
+        for (size_t i = 0; i < out.size(); ++i) {
+            std::map<int, uint64_t>::iterator it = due.find(out[i]);
+            cb_assert(it != due.end());
+            cb_assert(it->second <= now);
+            due.erase(it);
+        }
+        std::map<int, uint64_t>::iterator it;
+        for (it = due.begin(); it != due.end(); ++it) {
+            cb_assert((it->second + TICK - 1) / TICK > now / TICK);
+        }
+    }
+}
+
+int main() {
+
+    testEmpty();
+    testDueNow();
+    testNotEarly();
+    testRemove();
+    testForever();
+    testRandom();
+
+    return 0;
+}